@@ -0,0 +1,25 @@
+//登录/注册的认证后端接口
+//HttpRequest::authBackend为空时使用MySQL(SqlConnPool/AsyncSql)，不为空时登录/注册只调用这里
+//实现必须允许多个工作线程同时调用
+#ifndef AUTH_BACKEND_H
+#define AUTH_BACKEND_H
+
+#include<string>
+
+class AuthBackend{
+public:
+    enum RESULT{
+        OK,
+        WRONG_PASSWORD,
+        NO_USER,
+        USER_EXISTS,
+        FAILED,//存储出错或已满
+    };
+
+    virtual ~AuthBackend() = default;
+
+    virtual int Login(const std::string& name, const std::string& pwd) = 0;
+    virtual int Register(const std::string& name, const std::string& pwd) = 0;
+};
+
+#endif
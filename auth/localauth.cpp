@@ -0,0 +1,254 @@
+#include"localauth.h"
+#include<fcntl.h>
+#include<unistd.h>
+#include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<random>
+#include<assert.h>
+#include"../log/log.h"
+
+using namespace std;
+
+const char LocalAuth::FILE_MAGIC[8] = {'T', 'W', 'S', 'A', 'U', 'T', 'H', '1'};
+
+LocalAuth::LocalAuth():fd_(-1), base_(nullptr), mapSize_(0), maxUsers_(0), syncWrites_(false),
+    mask_(0), end_(0), saltState_(0), count_(0){}
+
+LocalAuth::~LocalAuth(){
+    Close();
+}
+
+bool LocalAuth::Open(const char* path, size_t maxUsers, bool syncWrites){
+    assert(path && maxUsers > 0);
+    Close();
+    fd_ = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd_ < 0){
+        LOG_ERROR("LocalAuth: open %s error", path);
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd_, &st) < 0){
+        Close();
+        return false;
+    }
+    size_t fileSize = st.st_size;
+    if(fileSize == 0){
+        char header[FILE_HEADER] = {0};
+        memcpy(header, FILE_MAGIC, sizeof(FILE_MAGIC));
+        if(pwrite(fd_, header, FILE_HEADER, 0) != (ssize_t)FILE_HEADER){
+            LOG_ERROR("LocalAuth: write header error");
+            Close();
+            return false;
+        }
+        fileSize = FILE_HEADER;
+    }
+    maxUsers_ = maxUsers;
+    syncWrites_ = syncWrites;
+    //一次预留全部用户所需的地址空间，文件增长后映射地址不变，查找方持有的指针一直有效
+    mapSize_ = max(fileSize, FILE_HEADER + maxUsers * MAX_RECORD);
+    void* addr = mmap(nullptr, mapSize_, PROT_READ, MAP_SHARED, fd_, 0);
+    if(addr == MAP_FAILED){
+        LOG_ERROR("LocalAuth: mmap %s error", path);
+        Close();
+        return false;
+    }
+    base_ = static_cast<char*>(addr);
+    if(memcmp(base_, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0){
+        LOG_ERROR("LocalAuth: %s is not an auth store", path);
+        Close();
+        return false;
+    }
+
+    size_t cap = 2;
+    while(cap < maxUsers * 2){
+        cap <<= 1;//负载不超过一半，探测链保持很短
+    }
+    table_.reset(new atomic<uint64_t>[cap]);
+    for(size_t i = 0; i < cap; i++){
+        table_[i].store(0, memory_order_relaxed);
+    }
+    mask_ = cap - 1;
+    random_device rd;
+    saltState_ = ((uint64_t)rd() << 32) | rd();
+    if(!Load_(fileSize)){
+        Close();
+        return false;
+    }
+    LOG_INFO("LocalAuth: %s, %d users", path, (int)Size());
+    return true;
+}
+
+//逐条校验记录并建立索引，遇到第一条不完整或校验失败的记录就截断文件
+bool LocalAuth::Load_(size_t fileSize){
+    size_t off = FILE_HEADER;
+    size_t cnt = 0;
+    while(off + sizeof(Record) <= fileSize){
+        const Record* rec = reinterpret_cast<const Record*>(base_ + off);
+        size_t size = RecordSize_(rec->nameLen);
+        if(rec->magic != RECORD_MAGIC || rec->nameLen == 0 || rec->nameLen > NAME_MAX_LEN ||
+           off + size > fileSize){
+            break;
+        }
+        const char* name = base_ + off + sizeof(Record);
+        if(Check_(*rec, name) != rec->check){
+            break;
+        }
+        if(cnt >= maxUsers_){
+            LOG_ERROR("LocalAuth: more than %d users in store", (int)maxUsers_);
+            return false;
+        }
+        Publish_(HashName_(name, rec->nameLen), off);
+        cnt++;
+        off += size;
+    }
+    if(off < fileSize){
+        LOG_WARN("LocalAuth: truncate %d bytes of incomplete records", (int)(fileSize - off));
+        if(ftruncate(fd_, off) < 0){
+            return false;
+        }
+    }
+    end_ = off;
+    count_.store(cnt, memory_order_relaxed);
+    return true;
+}
+
+void LocalAuth::Close(){
+    if(base_){
+        munmap(base_, mapSize_);
+        base_ = nullptr;
+    }
+    if(fd_ >= 0){
+        close(fd_);
+        fd_ = -1;
+    }
+    table_.reset();
+    count_.store(0, memory_order_relaxed);
+}
+
+int LocalAuth::Login(const string& name, const string& pwd){
+    if(!base_){
+        return FAILED;
+    }
+    const Record* rec = Find_(name);
+    if(!rec){
+        return NO_USER;
+    }
+    return Digest_(rec->salt, pwd) == rec->digest ? OK : WRONG_PASSWORD;
+}
+
+int LocalAuth::Register(const string& name, const string& pwd){
+    if(!base_ || name.empty() || name.size() > NAME_MAX_LEN){
+        return FAILED;
+    }
+    lock_guard<mutex> locker(mtx_);
+    if(Find_(name)){
+        return USER_EXISTS;
+    }
+    if(Size() >= maxUsers_){
+        LOG_WARN("LocalAuth: store is full");
+        return FAILED;
+    }
+    char buf[MAX_RECORD];
+    size_t size = RecordSize_(name.size());
+    memset(buf, 0, size);
+    Record* rec = reinterpret_cast<Record*>(buf);
+    rec->magic = RECORD_MAGIC;
+    rec->nameLen = name.size();
+    //xorshift生成盐，只在持锁时更新
+    saltState_ ^= saltState_ << 13;
+    saltState_ ^= saltState_ >> 7;
+    saltState_ ^= saltState_ << 17;
+    rec->salt = saltState_;
+    rec->digest = Digest_(rec->salt, pwd);
+    memcpy(buf + sizeof(Record), name.data(), name.size());
+    rec->check = Check_(*rec, name.data());
+    //写进文件后共享映射立即可见，再发布到索引
+    if(pwrite(fd_, buf, size, end_) != (ssize_t)size || (syncWrites_ && fdatasync(fd_) < 0)){
+        LOG_ERROR("LocalAuth: append error");
+        if(ftruncate(fd_, end_) < 0){
+            LOG_ERROR("LocalAuth: truncate error");
+        }
+        return FAILED;
+    }
+    Publish_(HashName_(name.data(), name.size()), end_);
+    end_ += size;
+    count_.fetch_add(1, memory_order_relaxed);
+    return OK;
+}
+
+const LocalAuth::Record* LocalAuth::Find_(const string& name) const{
+    if(name.empty() || name.size() > NAME_MAX_LEN){
+        return nullptr;
+    }
+    uint64_t hash = HashName_(name.data(), name.size());
+    uint64_t tag = hash >> 40;
+    for(size_t i = hash & mask_;; i = (i + 1) & mask_){
+        uint64_t slot = table_[i].load(memory_order_acquire);
+        if(slot == 0){
+            return nullptr;
+        }
+        if((slot >> 40) != tag){
+            continue;
+        }
+        const Record* rec = reinterpret_cast<const Record*>(base_ + (slot & OFFSET_MASK));
+        if(rec->nameLen == name.size() &&
+           memcmp(base_ + (slot & OFFSET_MASK) + sizeof(Record), name.data(), name.size()) == 0){
+            return rec;
+        }
+    }
+}
+
+//只有持锁的注册和启动加载调用，槽位从0变为非0后不再改变
+void LocalAuth::Publish_(uint64_t hash, uint64_t offset){
+    uint64_t slot = (hash >> 40 << 40) | offset;
+    for(size_t i = hash & mask_;; i = (i + 1) & mask_){
+        if(table_[i].load(memory_order_relaxed) == 0){
+            table_[i].store(slot, memory_order_release);
+            return;
+        }
+    }
+}
+
+static inline uint64_t Mix64(uint64_t x){
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t LocalAuth::HashName_(const char* name, size_t len){
+    uint64_t h = 0xcbf29ce484222325ULL;//FNV-1a
+    for(size_t i = 0; i < len; i++){
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    //最高位置1，标签不为0，发布后的槽位也就不会是0
+    return Mix64(h) | (1ULL << 63);
+}
+
+uint64_t LocalAuth::Digest_(uint64_t salt, const string& pwd){
+    uint64_t h = Mix64(salt ^ pwd.size());
+    for(size_t i = 0; i < pwd.size(); i += 8){
+        uint64_t word = 0;
+        memcpy(&word, pwd.data() + i, min((size_t)8, pwd.size() - i));
+        h = Mix64(h ^ word) + salt;
+    }
+    return Mix64(h);
+}
+
+uint32_t LocalAuth::Check_(const Record& rec, const char* name){
+    Record copy = rec;
+    copy.check = 0;
+    uint32_t h = 2166136261u;//FNV-1a
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(&copy);
+    for(size_t i = 0; i < sizeof(copy); i++){
+        h = (h ^ p[i]) * 16777619u;
+    }
+    for(size_t i = 0; i < copy.nameLen; i++){
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
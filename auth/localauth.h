@@ -0,0 +1,76 @@
+//本地认证存储：不依赖数据库的AuthBackend实现
+//用户记录追加写入一个日志文件，整个文件只读mmap到固定地址；启动时扫描文件在内存中建立开放寻址哈希索引，
+//文件末尾写了一半的记录(崩溃)会被截掉
+//登录查找不加锁：索引槽位是原子变量，记录写入文件后才发布到索引，发布后不再修改；注册由互斥锁串行
+//不保存密码原文，每条记录保存随机盐和加盐后的64位摘要
+//注意：摘要只是快速的64位混合哈希，不是PBKDF2/scrypt这样的密码KDF，文件泄露后可以离线暴力破解，
+//只是占位实现，用于边缘节点和压测；保存真实用户的密码前要换成真正的KDF(记录格式需要加版本)
+#ifndef LOCAL_AUTH_H
+#define LOCAL_AUTH_H
+
+#include<string>
+#include<mutex>
+#include<atomic>
+#include<memory>
+#include<stdint.h>
+#include"authbackend.h"
+
+class LocalAuth : public AuthBackend{
+public:
+    LocalAuth();
+    ~LocalAuth();
+
+    //maxUsers为用户数上限，决定索引大小和预留的映射空间；syncWrites为true时每次注册都fdatasync
+    bool Open(const char* path, size_t maxUsers, bool syncWrites);
+    void Close();
+
+    int Login(const std::string& name, const std::string& pwd) override;
+    int Register(const std::string& name, const std::string& pwd) override;
+
+    size_t Size() const {return count_.load(std::memory_order_relaxed);}
+
+private:
+    //文件中的记录头，后面紧跟用户名，整条记录按8字节对齐
+    struct Record{
+        uint32_t magic;
+        uint16_t nameLen;
+        uint16_t reserved;
+        uint64_t salt;
+        uint64_t digest;
+        uint32_t check;//记录头(check置0)和用户名的校验和
+        uint32_t pad;
+    };
+
+    static const char FILE_MAGIC[8];
+    static const size_t FILE_HEADER = 16;
+    static const uint32_t RECORD_MAGIC = 0x52545541;//"AUTR"
+    static const size_t NAME_MAX_LEN = 255;
+    static const size_t MAX_RECORD = (sizeof(Record) + NAME_MAX_LEN + 7) & ~(size_t)7;
+    //槽位：低40位是记录在文件中的偏移(0表示空)，高24位是用户名哈希的标签
+    static const uint64_t OFFSET_MASK = (1ULL << 40) - 1;
+
+    static size_t RecordSize_(size_t nameLen) {return (sizeof(Record) + nameLen + 7) & ~(size_t)7;}
+    static uint64_t HashName_(const char* name, size_t len);
+    static uint64_t Digest_(uint64_t salt, const std::string& pwd);//非安全的占位摘要，见文件头
+    static uint32_t Check_(const Record& rec, const char* name);
+
+    const Record* Find_(const std::string& name) const;
+    void Publish_(uint64_t hash, uint64_t offset);
+    bool Load_(size_t fileSize);
+
+    int fd_;
+    char* base_;
+    size_t mapSize_;
+    size_t maxUsers_;
+    bool syncWrites_;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> table_;
+    size_t mask_;
+
+    std::mutex mtx_;//注册之间互斥
+    size_t end_;//下一条记录的写入位置
+    uint64_t saltState_;
+    std::atomic<size_t> count_;
+};
+
+#endif
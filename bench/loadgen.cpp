@@ -0,0 +1,518 @@
+//HTTP/1.1压测客户端：多线程，每个线程一个epoll，管理自己的一组非阻塞连接
+//闭环(rate=0)：每个连接保持pipeline个请求在途，收到一个响应就补发一个
+//开环(rate>0)：按总速率为每个连接排好发送时刻，延迟从计划发送时刻算起，
+//服务器变慢时排队的时间也计入延迟，不会出现协调遗漏(coordinated omission)；
+//闭环的延迟另外按HdrHistogram的方式用中位数作为期望间隔补齐被遗漏的样本
+//延迟直方图复用metrics/metrics.h的Histogram(按线程分片，相对误差不超过12.5%)
+//编译：g++ -O2 -std=c++14 -pthread bench/loadgen.cpp metrics/metrics.cpp -o loadgen
+//用法：loadgen 场景文件 [key=value ...]，命令行的key=value覆盖场景文件中的设置，场景文件见bench/scenarios
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<errno.h>
+#include<time.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<netdb.h>
+#include<sys/epoll.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<arpa/inet.h>
+#include<string>
+#include<vector>
+#include<deque>
+#include<thread>
+#include<atomic>
+#include<fstream>
+#include<memory>
+
+#include"../metrics/metrics.h"
+
+struct Config{
+    std::string host = "127.0.0.1";
+    int port = 1316;
+    int connections = 16;
+    int threads = 2;
+    double duration = 10;//秒，不含预热
+    double warmup = 1;//预热秒数，期间的请求不计入结果
+    int pipeline = 1;//每个连接的在途请求数
+    bool keepAlive = true;
+    double rate = 0;//开环的总请求速率，0为闭环
+    int churn = 0;//每个连接完成这么多请求后断开重连，0为不主动断开
+    int timeoutMS = 5000;//在途请求超过这么久没有响应就断开重连
+    std::string method = "GET";
+    std::vector<std::string> paths;//多个路径轮流请求
+    std::string body;
+    std::string contentType = "application/x-www-form-urlencoded";
+};
+
+//每个线程的统计，线程结束后合并
+struct Stats{
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    uint64_t connects = 0;
+    uint64_t connectErrors = 0;
+    uint64_t errors = 0;//连接断开或超时丢掉的在途请求
+    uint64_t status[6] = {0};//按1xx~5xx分类，0为无法解析
+};
+
+static Histogram latency;//微秒
+static Config config;
+static std::vector<std::string> requests;//预先拼好的请求报文
+static struct sockaddr_in serverAddr;
+static uint64_t measureStart;//预热结束的时刻
+static uint64_t measureEnd;
+
+static uint64_t NowUs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static std::string Trim(const std::string& s){
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if(b == std::string::npos){
+        return "";
+    }
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+static bool SetOption(const std::string& line){
+    std::string kv = line.substr(0, line.find('#'));
+    size_t eq = kv.find('=');
+    if(eq == std::string::npos){
+        return Trim(kv).empty();
+    }
+    std::string key = Trim(kv.substr(0, eq));
+    std::string value = Trim(kv.substr(eq + 1));
+    if(key == "host") config.host = value;
+    else if(key == "port") config.port = atoi(value.c_str());
+    else if(key == "connections") config.connections = atoi(value.c_str());
+    else if(key == "threads") config.threads = atoi(value.c_str());
+    else if(key == "duration") config.duration = atof(value.c_str());
+    else if(key == "warmup") config.warmup = atof(value.c_str());
+    else if(key == "pipeline") config.pipeline = atoi(value.c_str());
+    else if(key == "keepalive") config.keepAlive = atoi(value.c_str()) != 0;
+    else if(key == "rate") config.rate = atof(value.c_str());
+    else if(key == "churn") config.churn = atoi(value.c_str());
+    else if(key == "timeout") config.timeoutMS = atoi(value.c_str());
+    else if(key == "method") config.method = value;
+    else if(key == "path") config.paths.push_back(value);
+    else if(key == "body") config.body = value;
+    else if(key == "content_type") config.contentType = value;
+    else{
+        fprintf(stderr, "unknown option: %s\n", key.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool LoadScenario(const char* file){
+    std::ifstream in(file);
+    if(!in){
+        fprintf(stderr, "cannot open %s\n", file);
+        return false;
+    }
+    std::string line;
+    while(std::getline(in, line)){
+        if(!SetOption(line)){
+            return false;
+        }
+    }
+    return true;
+}
+
+static void BuildRequests(){
+    if(config.paths.empty()){
+        config.paths.push_back("/");
+    }
+    for(auto& path : config.paths){
+        std::string req = config.method + " " + path + " HTTP/1.1\r\nHost: " + config.host + "\r\n";
+        req += config.keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+        if(!config.body.empty()){
+            req += "Content-Type: " + config.contentType + "\r\n";
+            req += "Content-Length: " + std::to_string(config.body.size()) + "\r\n";
+        }
+        req += "\r\n" + config.body;
+        requests.push_back(req);
+    }
+}
+
+class Worker{
+public:
+    Worker(int conns, double rate):conns_(conns), interval_(rate > 0 ? 1e6 / rate : 0){
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    }
+    ~Worker(){
+        for(auto& c : conns_){
+            Close_(&c);
+        }
+        close(epollFd_);
+    }
+
+    void Run(){
+        uint64_t now = NowUs();
+        //各连接的第一次发送错开，开环时总速率从一开始就均匀
+        for(size_t i = 0; i < conns_.size(); i++){
+            conns_[i].nextDue = now + (uint64_t)(interval_ * i);
+            conns_[i].pathIdx = i;
+        }
+        struct epoll_event events[256];
+        while((now = NowUs()) < measureEnd){
+            for(auto& c : conns_){
+                Drive_(&c, now);
+            }
+            int n = epoll_wait(epollFd_, events, 256, interval_ > 0 ? 1 : 100);
+            now = NowUs();
+            for(int i = 0; i < n; i++){
+                Conn* c = &conns_[events[i].data.u32];
+                if(c->fd < 0){
+                    continue;//同一批事件中已经关闭
+                }
+                if(c->connecting && (events[i].events & EPOLLOUT)){
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                    if(err){
+                        ConnectFailed_(c);
+                        continue;
+                    }
+                    c->connecting = false;
+                }
+                if(events[i].events & EPOLLIN){
+                    Read_(c, now);
+                }
+                if(c->fd >= 0 && (events[i].events & (EPOLLERR | EPOLLHUP))){
+                    Fail_(c);
+                }
+            }
+        }
+    }
+
+    Stats stats;
+
+private:
+    //一个在途请求
+    struct Pending{
+        uint64_t intended;//计划发送时刻，闭环时等于实际发送时刻
+        uint64_t sent;
+    };
+
+    struct Conn{
+        int fd = -1;
+        bool connecting = false;
+        std::string out;
+        size_t outOff = 0;
+        std::string in;
+        std::deque<Pending> inflight;
+        uint64_t nextDue = 0;//开环时下一个请求的计划发送时刻
+        int issued = 0;//这个连接上已经发出的请求数，用于churn
+        size_t pathIdx = 0;
+        uint64_t retryAt = 0;//建连失败后等到这个时刻再重试
+    };
+
+    static const uint64_t RETRY_US = 100000;
+
+    void ConnectFailed_(Conn* c){
+        stats.connectErrors++;
+        Close_(c);
+        c->retryAt = NowUs() + RETRY_US;
+    }
+
+    void Connect_(Conn* c){
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(c->fd < 0){
+            ConnectFailed_(c);
+            return;
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        stats.connects++;
+        int ret = connect(c->fd, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
+        if(ret < 0 && errno != EINPROGRESS){
+            ConnectFailed_(c);
+            return;
+        }
+        c->connecting = ret < 0;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+        ev.data.u32 = c - &conns_[0];
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, c->fd, &ev);
+        c->issued = 0;
+    }
+
+    void Close_(Conn* c){
+        if(c->fd >= 0){
+            close(c->fd);
+            c->fd = -1;
+        }
+        c->connecting = false;
+        c->out.clear();
+        c->outOff = 0;
+        c->in.clear();
+        c->inflight.clear();
+    }
+
+    //连接异常：在途请求记为错误，下一轮重连
+    void Fail_(Conn* c){
+        stats.errors += c->inflight.size();
+        Close_(c);
+    }
+
+    //按模式补发请求并尽量写出
+    void Drive_(Conn* c, uint64_t now){
+        if(c->fd < 0){
+            if(now < c->retryAt){
+                return;
+            }
+            Connect_(c);
+            if(c->fd < 0){
+                return;
+            }
+        }
+        if(!c->inflight.empty() && now - c->inflight.front().sent > (uint64_t)config.timeoutMS * 1000){
+            Fail_(c);
+            return;
+        }
+        int depth = config.keepAlive ? config.pipeline : 1;
+        while((int)c->inflight.size() < depth && (config.churn <= 0 || c->issued < config.churn)
+              && (config.keepAlive || c->issued == 0)){
+            uint64_t intended = now;
+            if(interval_ > 0){
+                if(c->nextDue > now){
+                    break;
+                }
+                //发不出去的计划时刻保留下来，排队的时间计入延迟
+                intended = c->nextDue;
+                c->nextDue += (uint64_t)(interval_ * conns_.size());
+            }
+            c->out += requests[c->pathIdx++ % requests.size()];
+            c->inflight.push_back({intended, now});
+            c->issued++;
+        }
+        if(c->connecting || c->outOff == c->out.size()){
+            return;
+        }
+        while(c->outOff < c->out.size()){
+            ssize_t n = send(c->fd, c->out.data() + c->outOff, c->out.size() - c->outOff, MSG_NOSIGNAL);
+            if(n < 0){
+                if(errno != EAGAIN && errno != EWOULDBLOCK){
+                    Fail_(c);
+                }
+                return;
+            }
+            c->outOff += n;
+        }
+        c->out.clear();
+        c->outOff = 0;
+    }
+
+    void Read_(Conn* c, uint64_t now){
+        char buf[65536];
+        while(c->fd >= 0){
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if(n > 0){
+                c->in.append(buf, n);
+                stats.bytes += n;
+                if(!Parse_(c, now)){
+                    return;
+                }
+                continue;
+            }
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                return;
+            }
+            Fail_(c);//对端关闭或出错
+            return;
+        }
+    }
+
+    //取出所有完整的响应，按Content-length跳过消息体；返回false表示连接已关闭
+    bool Parse_(Conn* c, uint64_t now){
+        while(true){
+            size_t headEnd = c->in.find("\r\n\r\n");
+            if(headEnd == std::string::npos){
+                return true;
+            }
+            size_t bodyLen = 0;
+            bool close = !config.keepAlive;
+            size_t pos = c->in.find("\r\n") + 2;
+            while(pos < headEnd){
+                size_t eol = c->in.find("\r\n", pos);
+                std::string line = c->in.substr(pos, eol - pos);
+                if(strncasecmp(line.c_str(), "Content-length:", 15) == 0){
+                    bodyLen = strtoul(line.c_str() + 15, nullptr, 10);
+                }else if(strncasecmp(line.c_str(), "Connection:", 11) == 0 && strcasestr(line.c_str(), "close")){
+                    close = true;
+                }
+                pos = eol + 2;
+            }
+            size_t total = headEnd + 4 + bodyLen;
+            if(c->in.size() < total){
+                return true;
+            }
+            int code = 0;
+            if(c->in.compare(0, 5, "HTTP/") == 0){
+                size_t sp = c->in.find(' ');
+                code = sp == std::string::npos ? 0 : atoi(c->in.c_str() + sp + 1);
+            }
+            c->in.erase(0, total);
+            if(c->inflight.empty()){
+                Fail_(c);//多出来的响应
+                return false;
+            }
+            Pending p = c->inflight.front();
+            c->inflight.pop_front();
+            if(p.intended >= measureStart && now <= measureEnd){
+                stats.requests++;
+                stats.status[code >= 100 && code < 600 ? code / 100 : 0]++;
+                latency.Record(now - p.intended);
+            }
+            if(close || (config.churn > 0 && c->issued >= config.churn && c->inflight.empty())){
+                stats.errors += c->inflight.size();
+                Close_(c);
+                return false;
+            }
+        }
+    }
+
+    std::vector<Conn> conns_;
+    double interval_;//开环时本线程两次发送的平均间隔，微秒；每个连接的间隔是它乘以连接数
+    int epollFd_;
+};
+
+//counts中第q分位所在桶的上界
+static uint64_t Percentile(const std::vector<uint64_t>& counts, uint64_t count, double q){
+    if(count == 0){
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * count);
+    if(rank >= count){
+        rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for(size_t i = 0; i < counts.size(); i++){
+        seen += counts[i];
+        if(seen > rank){
+            return Histogram::UpperBound(i);
+        }
+    }
+    return Histogram::UpperBound(counts.size() - 1);
+}
+
+static void PrintLatency(const char* title, const std::vector<uint64_t>& counts){
+    uint64_t count = 0;
+    for(auto n : counts){
+        count += n;
+    }
+    static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999, 0.9999, 1.0};
+    printf("%s\n", title);
+    for(double q : QUANTILES){
+        printf("  p%-8g %10.3f ms\n", q * 100, Percentile(counts, count, q) / 1000.0);
+    }
+}
+
+//HdrHistogram的copyCorrectedForCoordinatedOmission：大于期望间隔的样本，
+//按间隔递减补上被它阻塞而没有发出的请求本该测到的延迟
+static std::vector<uint64_t> CorrectOmission(const std::vector<uint64_t>& counts, uint64_t expected){
+    std::vector<uint64_t> corrected(counts);
+    if(expected == 0){
+        return corrected;
+    }
+    for(size_t i = 0; i < counts.size(); i++){
+        if(counts[i] == 0){
+            continue;
+        }
+        uint64_t value = Histogram::UpperBound(i) - 1;
+        for(uint64_t missing = value > expected ? value - expected : 0; missing >= expected; missing -= expected){
+            corrected[Histogram::BucketOf(missing)] += counts[i];
+        }
+    }
+    return corrected;
+}
+
+int main(int argc, char* argv[]){
+    if(argc < 2){
+        fprintf(stderr, "usage: %s scenario [key=value ...]\n", argv[0]);
+        return 1;
+    }
+    if(!LoadScenario(argv[1])){
+        return 1;
+    }
+    for(int i = 2; i < argc; i++){
+        if(!SetOption(argv[i])){
+            return 1;
+        }
+    }
+    if(config.threads < 1) config.threads = 1;
+    if(config.connections < config.threads) config.connections = config.threads;
+    if(config.pipeline < 1) config.pipeline = 1;
+    BuildRequests();
+
+    struct hostent* host = gethostbyname(config.host.c_str());
+    if(!host){
+        fprintf(stderr, "cannot resolve %s\n", config.host.c_str());
+        return 1;
+    }
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(config.port);
+    memcpy(&serverAddr.sin_addr, host->h_addr_list[0], sizeof(serverAddr.sin_addr));
+
+    printf("%s:%d %s, %d threads, %d connections, pipeline %d, keep-alive %d, churn %d, %s\n",
+           config.host.c_str(), config.port, config.paths[0].c_str(), config.threads, config.connections,
+           config.pipeline, (int)config.keepAlive, config.churn,
+           config.rate > 0 ? ("open loop " + std::to_string((int)config.rate) + " req/s").c_str() : "closed loop");
+
+    uint64_t start = NowUs();
+    measureStart = start + (uint64_t)(config.warmup * 1e6);
+    measureEnd = measureStart + (uint64_t)(config.duration * 1e6);
+    std::vector<std::unique_ptr<Worker>> workers;
+    for(int i = 0; i < config.threads; i++){
+        int conns = config.connections / config.threads + (i < config.connections % config.threads ? 1 : 0);
+        workers.emplace_back(new Worker(conns, config.rate * conns / config.connections));
+    }
+    std::vector<std::thread> threads;
+    for(auto& w : workers){
+        threads.emplace_back(&Worker::Run, w.get());
+    }
+    for(auto& t : threads){
+        t.join();
+    }
+
+    Stats total;
+    for(auto& w : workers){
+        total.requests += w->stats.requests;
+        total.bytes += w->stats.bytes;
+        total.connects += w->stats.connects;
+        total.connectErrors += w->stats.connectErrors;
+        total.errors += w->stats.errors;
+        for(int i = 0; i < 6; i++){
+            total.status[i] += w->stats.status[i];
+        }
+    }
+    double sec = config.duration;
+    printf("requests %llu in %.1fs, %.0f req/s, %.2f MB/s\n", (unsigned long long)total.requests, sec,
+           total.requests / sec, total.bytes / sec / 1e6);
+    printf("connects %llu, connect errors %llu, request errors %llu\n", (unsigned long long)total.connects,
+           (unsigned long long)total.connectErrors, (unsigned long long)total.errors);
+    printf("status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+           (unsigned long long)total.status[2], (unsigned long long)total.status[3],
+           (unsigned long long)total.status[4], (unsigned long long)total.status[5],
+           (unsigned long long)(total.status[0] + total.status[1]));
+
+    std::vector<uint64_t> counts;
+    uint64_t sum, count;
+    latency.Collect(&counts, &sum, &count);
+    if(config.rate > 0){
+        PrintLatency("latency (from intended send time)", counts);
+    }else{
+        PrintLatency("latency (measured)", counts);
+        uint64_t expected = Percentile(counts, count, 0.5);
+        PrintLatency("latency (corrected for coordinated omission)", CorrectOmission(counts, expected));
+    }
+    return 0;
+}
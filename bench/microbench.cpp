@@ -0,0 +1,539 @@
+//基础组件的微基准测试：Buffer、HttpRequest::parse、HeapTimer、ThreadPool、BlockQueue、Log::write
+//自带一个很小的测试框架：每个用例从1次迭代开始按10倍增加，直到单次运行超过min_time秒，
+//报告每次迭代的耗时和吞吐；--json输出与Google Benchmark相同的JSON格式，可以直接用它的compare.py比较两次构建
+//编译：g++ -O2 -std=c++14 -pthread -I/usr/include/mysql bench/microbench.cpp buffer/buffer.cpp timer/heaptimer.cpp
+//      http/httprequest.cpp pool/*.cpp auth/localauth.cpp log/log.cpp log/logformat.cpp log/accesslog.cpp
+//      metrics/metrics.cpp trace/phasetrace.cpp server/epoller.cpp -lmysqlclient -lz -o microbench
+//用法：microbench [--filter=子串] [--min_time=秒] [--json=文件(-为标准输出)] [--corpus=bench/corpus]
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<unistd.h>
+#include<dirent.h>
+#include<sys/stat.h>
+#include<sys/socket.h>
+#include<string>
+#include<vector>
+#include<map>
+#include<thread>
+#include<atomic>
+#include<fstream>
+#include<sstream>
+#include<functional>
+#include<memory>
+
+#include"../buffer/buffer.h"
+#include"../http/httprequest.h"
+#include"../timer/heaptimer.h"
+#include"../pool/threadpool.h"
+#include"../log/blockqueue.h"
+#include"../log/log.h"
+#include"../metrics/metrics.h"
+
+//一次运行的计时与计数，用例只在循环里跑iterations次
+class State{
+public:
+    explicit State(uint64_t iterations):iterations(iterations), items_(0), bytes_(0), paused_(0){}
+
+    const uint64_t iterations;
+
+    void Start(){
+        realStart_ = Now_(CLOCK_MONOTONIC);
+        cpuStart_ = Now_(CLOCK_THREAD_CPUTIME_ID);
+    }
+    void Stop(){
+        real_ = Now_(CLOCK_MONOTONIC) - realStart_ - paused_;
+        cpu_ = Now_(CLOCK_THREAD_CPUTIME_ID) - cpuStart_;
+    }
+    //准备数据的时间不计入
+    void Pause(){pauseStart_ = Now_(CLOCK_MONOTONIC);}
+    void Resume(){paused_ += Now_(CLOCK_MONOTONIC) - pauseStart_;}
+
+    void SetItems(uint64_t items){items_ = items;}
+    void SetBytes(uint64_t bytes){bytes_ = bytes;}
+    void SetCounter(const std::string& name, double value){counters_[name] = value;}
+
+    double RealNs() const {return real_;}
+    double CpuNs() const {return cpu_;}
+    uint64_t Items() const {return items_;}
+    uint64_t Bytes() const {return bytes_;}
+    const std::map<std::string, double>& Counters() const {return counters_;}
+
+private:
+    static double Now_(clockid_t clock){
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+    }
+
+    uint64_t items_;
+    uint64_t bytes_;
+    double realStart_, cpuStart_, pauseStart_;
+    double paused_;
+    double real_, cpu_;
+    std::map<std::string, double> counters_;
+};
+
+typedef std::function<void(State&)> BenchFunc;
+
+struct Benchmark{
+    std::string name;
+    BenchFunc fn;
+    uint64_t fixedIterations;//大于0时只跑这么多次，用于本身就很慢的用例
+};
+
+static std::vector<Benchmark>& Registry(){
+    static std::vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+
+static void Register(const std::string& name, BenchFunc fn, uint64_t fixedIterations = 0){
+    Registry().push_back({name, fn, fixedIterations});
+}
+
+static std::string corpusDir = "bench/corpus";
+
+//---------------- Buffer ----------------
+
+static void BufferAppend(State& st, size_t len){
+    std::string data(len, 'x');
+    Buffer buff;
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        buff.Append(data);
+        if(buff.ReadableBytes() >= 64 * 1024){
+            buff.RetrieveAll();
+        }
+    }
+    st.Stop();
+    st.SetBytes(st.iterations * len);
+}
+
+//从很小的缓冲区开始追加到1MB，每次都要经过MakeSpace_扩容或挪动
+static void BufferGrowth(State& st){
+    std::string chunk(4096, 'x');
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        Buffer buff(64);
+        for(int n = 0; n < 256; n++){
+            buff.Append(chunk);
+            if(n % 4 == 3){
+                buff.Retrieve(chunk.size());//读走一部分，让MakeSpace_有时挪动有时扩容
+            }
+        }
+    }
+    st.Stop();
+    st.SetBytes(st.iterations * 256 * chunk.size());
+}
+
+static void BufferReadFd(State& st, size_t len){
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0){
+        return;
+    }
+    int size = 1 << 20;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    std::string data(len, 'x');
+    Buffer buff;
+    int err = 0;
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        st.Pause();
+        if(write(fds[0], data.data(), len) != (ssize_t)len){
+            break;
+        }
+        st.Resume();
+        size_t got = 0;
+        while(got < len){
+            ssize_t n = buff.ReadFd(fds[1], &err);
+            if(n <= 0){
+                break;
+            }
+            got += n;
+        }
+        buff.RetrieveAll();
+    }
+    st.Stop();
+    st.SetBytes(st.iterations * len);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+//---------------- HttpRequest::parse ----------------
+
+//语料是抓下来的原始请求，每个文件一个；文件里只有\n时换成\r\n
+static std::vector<std::string> LoadCorpus(){
+    std::vector<std::string> corpus;
+    DIR* dir = opendir(corpusDir.c_str());
+    if(!dir){
+        return corpus;
+    }
+    while(struct dirent* ent = readdir(dir)){
+        std::string name = ent->d_name;
+        if(name.size() < 5 || name.compare(name.size() - 5, 5, ".http") != 0){
+            continue;
+        }
+        std::ifstream in(corpusDir + "/" + name, std::ios::binary);
+        std::stringstream ss;
+        ss << in.rdbuf();
+        std::string raw = ss.str();
+        if(raw.find('\r') == std::string::npos){
+            std::string fixed;
+            for(char c : raw){
+                if(c == '\n'){
+                    fixed += '\r';
+                }
+                fixed += c;
+            }
+            raw.swap(fixed);
+        }
+        corpus.push_back(raw);
+    }
+    closedir(dir);
+    return corpus;
+}
+
+static void RequestParse(State& st){
+    static const std::vector<std::string> corpus = LoadCorpus();
+    if(corpus.empty()){
+        st.SetCounter("corpus_missing", 1);
+        st.Start();
+        st.Stop();
+        return;
+    }
+    HttpRequest request;
+    Buffer buff;
+    uint64_t bytes = 0;
+    uint64_t failed = 0;
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        const std::string& raw = corpus[i % corpus.size()];
+        buff.Append(raw);
+        request.Init();
+        if(!request.parse(buff)){
+            failed++;
+        }
+        buff.RetrieveAll();
+        bytes += raw.size();
+    }
+    st.Stop();
+    st.SetItems(st.iterations);
+    st.SetBytes(bytes);
+    st.SetCounter("corpus", corpus.size());
+    st.SetCounter("failed", failed);
+}
+
+//---------------- HeapTimer ----------------
+
+static const int TIMER_CNT = 100000;
+
+static void TimerAdd(State& st){
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        st.Pause();
+        HeapTimer timer;
+        st.Resume();
+        for(int id = 0; id < TIMER_CNT; id++){
+            timer.add(id, 60000 + (id * 7919) % 60000, []{});
+        }
+        st.Pause();
+        timer.clear();
+        st.Resume();
+    }
+    st.Stop();
+    st.SetItems(st.iterations * TIMER_CNT);
+}
+
+//已有TIMER_CNT个定时器时延长随机一个，和每次读写事件ExtentTime_的用法一样
+static void TimerAdjust(State& st){
+    HeapTimer timer;
+    for(int id = 0; id < TIMER_CNT; id++){
+        timer.add(id, 60000 + id % 1000, []{});
+    }
+    uint32_t x = 2463534242u;
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        timer.adjust(x % TIMER_CNT, 60000 + x % 60000);
+    }
+    st.Stop();
+    st.SetItems(st.iterations);
+}
+
+//TIMER_CNT个定时器全部到期，一次tick全部处理
+static void TimerTick(State& st){
+    int fired = 0;
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        st.Pause();
+        HeapTimer timer;
+        for(int id = 0; id < TIMER_CNT; id++){
+            timer.add(id, 0, [&fired]{ fired++; });
+        }
+        st.Resume();
+        timer.tick();
+    }
+    st.Stop();
+    st.SetItems(fired);
+}
+
+//---------------- ThreadPool ----------------
+
+static void PoolThroughput(State& st, int threads){
+    ThreadPool pool(threads);
+    std::atomic<uint64_t> done(0);
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        pool.AddTask([&done]{ done.fetch_add(1, std::memory_order_relaxed); });
+    }
+    while(done.load(std::memory_order_acquire) < st.iterations){
+        std::this_thread::yield();
+    }
+    st.Stop();
+    st.SetItems(st.iterations);
+}
+
+//一次只有一个任务在途，测空闲线程池从AddTask到任务开始执行的延迟(唤醒延迟)
+static void PoolLatency(State& st, int threads){
+    ThreadPool pool(threads);
+    std::unique_ptr<Histogram> wakeup(new Histogram());//微秒
+    Histogram* hist = wakeup.get();
+    std::atomic<bool> ran(false);
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        ran.store(false, std::memory_order_relaxed);
+        auto queued = std::chrono::steady_clock::now();
+        pool.AddTask([&ran, hist, queued]{
+            hist->RecordSince(queued);
+            ran.store(true, std::memory_order_release);
+        });
+        while(!ran.load(std::memory_order_acquire)){
+            std::this_thread::yield();
+        }
+    }
+    st.Stop();
+    st.SetItems(st.iterations);
+    st.SetCounter("p50_us", hist->Percentile(0.5));
+    st.SetCounter("p99_us", hist->Percentile(0.99));
+}
+
+//---------------- BlockQueue ----------------
+
+//producers个生产者、1个消费者，与日志和访问日志的用法相同
+static void QueueContention(State& st, int producers){
+    BlockQueue<std::string> queue(4096);
+    std::string msg(100, 'x');
+    uint64_t perThread = st.iterations / producers + 1;
+    uint64_t total = perThread * producers;
+    std::atomic<bool> start(false);
+    std::vector<std::thread> threads;
+    for(int p = 0; p < producers; p++){
+        threads.emplace_back([&]{
+            while(!start.load(std::memory_order_acquire)){
+                std::this_thread::yield();
+            }
+            for(uint64_t n = 0; n < perThread; n++){
+                queue.push_back(msg);
+            }
+        });
+    }
+    st.Start();
+    start.store(true, std::memory_order_release);
+    std::string item;
+    for(uint64_t n = 0; n < total; n++){
+        queue.pop(item);
+    }
+    st.Stop();
+    for(auto& t : threads){
+        t.join();
+    }
+    st.SetItems(total);
+}
+
+//---------------- Log::write ----------------
+
+static const char* LOG_DIR = "./microbench_log";
+
+//maxQueue为0是同步写；BLOCK策略下写线程跟不上时调用方等待，测到的是持续吞吐
+static void LogWrite(State& st, int maxQueue, int mode){
+    mkdir(LOG_DIR, 0755);
+    Log* log = Log::Instance();
+    log->init(1, LOG_DIR, ".log", maxQueue, mode);
+    log->SetSaturationPolicy(Log::BLOCK);
+    st.Start();
+    for(uint64_t i = 0; i < st.iterations; i++){
+        LOG_INFO("microbench request %d from %s took %dus", (int)i, "127.0.0.1", (int)(i & 1023));
+    }
+    log->flush();
+    st.Stop();
+    st.SetItems(st.iterations);
+}
+
+static void RegisterAll(){
+    for(size_t len : {16, 256, 4096}){
+        Register("Buffer/Append/" + std::to_string(len), [len](State& st){ BufferAppend(st, len); });
+    }
+    Register("Buffer/MakeSpaceGrowth", BufferGrowth);
+    for(size_t len : {512, 16384, 262144}){
+        Register("Buffer/ReadFd/" + std::to_string(len), [len](State& st){ BufferReadFd(st, len); });
+    }
+    Register("HttpRequest/parse", RequestParse);
+    Register("HeapTimer/add/100000", TimerAdd);
+    Register("HeapTimer/adjust/100000", TimerAdjust);
+    Register("HeapTimer/tick/100000", TimerTick);
+    for(int threads : {1, 4, 8}){
+        Register("ThreadPool/throughput/threads:" + std::to_string(threads),
+                 [threads](State& st){ PoolThroughput(st, threads); });
+        Register("ThreadPool/latency/threads:" + std::to_string(threads),
+                 [threads](State& st){ PoolLatency(st, threads); });
+    }
+    for(int producers : {1, 4, 16}){
+        Register("BlockQueue/contention/producers:" + std::to_string(producers),
+                 [producers](State& st){ QueueContention(st, producers); });
+    }
+    //同步写在前：Log切到异步后写线程一直存在
+    Register("Log/write/sync", [](State& st){ LogWrite(st, 0, Log::TEXT); });
+    Register("Log/write/async", [](State& st){ LogWrite(st, 1024, Log::TEXT); });
+    Register("Log/write/async_deferred", [](State& st){ LogWrite(st, 1024, Log::DEFERRED); });
+}
+
+//---------------- 运行与输出 ----------------
+
+struct Result{
+    std::string name;
+    uint64_t iterations;
+    double realNs;//每次迭代
+    double cpuNs;
+    double itemsPerSec;
+    double bytesPerSec;
+    std::map<std::string, double> counters;
+};
+
+static Result Run(const Benchmark& bench, double minTime){
+    uint64_t iterations = bench.fixedIterations ? bench.fixedIterations : 1;
+    while(true){
+        State st(iterations);
+        bench.fn(st);
+        double sec = st.RealNs() / 1e9;
+        if(bench.fixedIterations || sec >= minTime || iterations >= (1ULL << 40)){
+            Result r;
+            r.name = bench.name;
+            r.iterations = iterations;
+            r.realNs = st.RealNs() / iterations;
+            r.cpuNs = st.CpuNs() / iterations;
+            r.itemsPerSec = sec > 0 ? st.Items() / sec : 0;
+            r.bytesPerSec = sec > 0 ? st.Bytes() / sec : 0;
+            r.counters = st.Counters();
+            return r;
+        }
+        //按已测得的速度估计够用的次数，最多放大10倍
+        double scale = sec > 0 ? minTime * 1.4 / sec : 10;
+        iterations = (uint64_t)(iterations * (scale > 10 ? 10 : (scale < 2 ? 2 : scale)));
+    }
+}
+
+static void PrintJsonString(FILE* fp, const std::string& s){
+    fputc('"', fp);
+    for(char c : s){
+        if(c == '"' || c == '\\'){
+            fputc('\\', fp);
+        }
+        fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void WriteJson(FILE* fp, const std::vector<Result>& results){
+    char host[256] = {0};
+    gethostname(host, sizeof(host) - 1);
+    char date[64];
+    time_t now = time(nullptr);
+    struct tm t;
+    localtime_r(&now, &t);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &t);
+    fprintf(fp, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"host_name\": ", date);
+    PrintJsonString(fp, host);
+    fprintf(fp, ",\n    \"executable\": \"microbench\",\n    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+#ifdef NDEBUG
+    fprintf(fp, "    \"library_build_type\": \"release\"\n  },\n");
+#else
+    fprintf(fp, "    \"library_build_type\": \"debug\"\n  },\n");
+#endif
+    fprintf(fp, "  \"benchmarks\": [\n");
+    for(size_t i = 0; i < results.size(); i++){
+        const Result& r = results[i];
+        fprintf(fp, "    {\n      \"name\": ");
+        PrintJsonString(fp, r.name);
+        fprintf(fp, ",\n      \"run_name\": ");
+        PrintJsonString(fp, r.name);
+        fprintf(fp, ",\n      \"run_type\": \"iteration\",\n      \"repetitions\": 1,\n      \"iterations\": %llu,\n"
+                    "      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\"",
+                (unsigned long long)r.iterations, r.realNs, r.cpuNs);
+        if(r.itemsPerSec > 0){
+            fprintf(fp, ",\n      \"items_per_second\": %.3f", r.itemsPerSec);
+        }
+        if(r.bytesPerSec > 0){
+            fprintf(fp, ",\n      \"bytes_per_second\": %.3f", r.bytesPerSec);
+        }
+        for(auto& c : r.counters){
+            fprintf(fp, ",\n      ");
+            PrintJsonString(fp, c.first);
+            fprintf(fp, ": %.3f", c.second);
+        }
+        fprintf(fp, "\n    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[]){
+    std::string filter, jsonPath;
+    double minTime = 0.5;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg.compare(0, 9, "--filter=") == 0){
+            filter = arg.substr(9);
+        }else if(arg.compare(0, 11, "--min_time=") == 0){
+            minTime = atof(arg.c_str() + 11);
+        }else if(arg.compare(0, 7, "--json=") == 0){
+            jsonPath = arg.substr(7);
+        }else if(arg.compare(0, 9, "--corpus=") == 0){
+            corpusDir = arg.substr(9);
+        }else{
+            fprintf(stderr, "usage: %s [--filter=substr] [--min_time=sec] [--json=file|-] [--corpus=dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    RegisterAll();
+    //JSON写到标准输出时表格改到标准错误，方便重定向
+    FILE* table = jsonPath == "-" ? stderr : stdout;
+    fprintf(table, "%-42s %14s %14s %12s %14s %12s\n", "Benchmark", "Time(ns)", "CPU(ns)", "Iterations",
+            "Items/s", "MB/s");
+    std::vector<Result> results;
+    for(auto& bench : Registry()){
+        if(!filter.empty() && bench.name.find(filter) == std::string::npos){
+            continue;
+        }
+        Result r = Run(bench, minTime);
+        fprintf(table, "%-42s %14.1f %14.1f %12llu %14.0f %12.1f", r.name.c_str(), r.realNs, r.cpuNs,
+                (unsigned long long)r.iterations, r.itemsPerSec, r.bytesPerSec / 1e6);
+        for(auto& c : r.counters){
+            fprintf(table, " %s=%g", c.first.c_str(), c.second);
+        }
+        fprintf(table, "\n");
+        results.push_back(r);
+    }
+    if(!jsonPath.empty()){
+        FILE* fp = jsonPath == "-" ? stdout : fopen(jsonPath.c_str(), "w");
+        if(!fp){
+            fprintf(stderr, "cannot open %s\n", jsonPath.c_str());
+            return 1;
+        }
+        WriteJson(fp, results);
+        if(fp != stdout){
+            fclose(fp);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+//队列竞争测试：1~32个生产者、1个消费者(与日志写线程的用法相同)，
+//比较BlockQueue和LockFreeQueue的吞吐量，每条消息是一个约100字节的字符串
+//编译：g++ -O2 -std=c++14 -pthread bench/queuebench.cpp -o queuebench
+//用法：queuebench [每轮消息总数] [队列容量]
+#include<stdio.h>
+#include<stdlib.h>
+#include<string>
+#include<vector>
+#include<thread>
+#include<atomic>
+#include<chrono>
+#include<assert.h>
+
+#include"../log/blockqueue.h"
+#include"../log/lockfreequeue.h"
+
+static const std::string MESSAGE(100, 'x');
+
+struct Result{
+    double seconds;
+    size_t received;
+};
+
+//BlockQueue只能拷贝入队、逐条出队
+static Result RunBlockQueue(int producers, size_t total, size_t capacity){
+    BlockQueue<std::string> queue(capacity);
+    std::atomic<bool> start(false);
+    size_t perThread = total / producers;
+    std::vector<std::thread> threads;
+    for(int i = 0; i < producers; i++){
+        threads.emplace_back([&]{
+            while(!start.load(std::memory_order_acquire)){
+                std::this_thread::yield();
+            }
+            for(size_t n = 0; n < perThread; n++){
+                std::string msg = MESSAGE;
+                queue.push_back(msg);
+            }
+        });
+    }
+    size_t expect = perThread * producers;
+    size_t received = 0;
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    std::string item;
+    while(received < expect && queue.pop(item)){
+        received++;
+    }
+    auto end = std::chrono::steady_clock::now();
+    for(auto& t : threads){
+        t.join();
+    }
+    return {std::chrono::duration<double>(end - begin).count(), received};
+}
+
+//LockFreeQueue移动入队，消费者醒来后批量取走
+static Result RunLockFreeQueue(int producers, size_t total, size_t capacity){
+    LockFreeQueue<std::string> queue(capacity);
+    std::atomic<bool> start(false);
+    size_t perThread = total / producers;
+    std::vector<std::thread> threads;
+    for(int i = 0; i < producers; i++){
+        threads.emplace_back([&]{
+            while(!start.load(std::memory_order_acquire)){
+                std::this_thread::yield();
+            }
+            for(size_t n = 0; n < perThread; n++){
+                std::string msg = MESSAGE;
+                queue.push_back(std::move(msg));
+            }
+        });
+    }
+    size_t expect = perThread * producers;
+    size_t received = 0;
+    std::vector<std::string> batch;
+    batch.reserve(256);
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    std::string item;
+    while(received < expect && queue.pop(item)){
+        received++;
+        batch.clear();
+        received += queue.pop_bulk(batch, 256);
+    }
+    auto end = std::chrono::steady_clock::now();
+    for(auto& t : threads){
+        t.join();
+    }
+    return {std::chrono::duration<double>(end - begin).count(), received};
+}
+
+int main(int argc, char* argv[]){
+    size_t total = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000000;
+    size_t capacity = argc > 2 ? strtoull(argv[2], nullptr, 10) : 4096;
+    printf("messages/round: %zu, capacity: %zu, hardware threads: %u\n",
+           total, capacity, std::thread::hardware_concurrency());
+    printf("%-10s %16s %16s %8s\n", "producers", "BlockQueue(M/s)", "LockFree(M/s)", "speedup");
+    for(int producers = 1; producers <= 32; producers *= 2){
+        Result block = RunBlockQueue(producers, total, capacity);
+        Result lockFree = RunLockFreeQueue(producers, total, capacity);
+        double blockRate = block.received / block.seconds / 1e6;
+        double lockFreeRate = lockFree.received / lockFree.seconds / 1e6;
+        printf("%-10d %16.2f %16.2f %7.2fx\n", producers, blockRate, lockFreeRate, lockFreeRate / blockRate);
+    }
+    return 0;
+}
@@ -0,0 +1,455 @@
+//回放TrafficCapture抓到的流量：按原来的连接、每次read的字节和时间间隔重新发给本机的服务器
+//每个抓到的连接对应一个回放连接，在原来的时刻(按speed压缩)建立，每段数据在原来的时刻发出；
+//wait=1时(默认)前面的请求还没收到响应就先不发下一段，和真实客户端等响应再发下一个请求一致，
+//这时服务器变慢会让回放落后于原来的节奏，落后的时间单独统计
+//copies=N把每个连接复制N份同时回放，用来放大并发；speed=N把时间间隔压缩为1/N，用来放大速率
+//编译：g++ -O2 -std=c++14 -pthread bench/replay.cpp metrics/metrics.cpp -o replay
+//用法：replay 抓包文件 [host=127.0.0.1] [port=1316] [speed=1] [copies=1] [threads=2] [wait=1] [timeout=5000]
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<errno.h>
+#include<time.h>
+#include<unistd.h>
+#include<netdb.h>
+#include<sys/epoll.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<arpa/inet.h>
+#include<string>
+#include<vector>
+#include<deque>
+#include<map>
+#include<thread>
+#include<memory>
+#include<algorithm>
+#include<fstream>
+
+#include"../trace/capture.h"
+#include"../metrics/metrics.h"
+
+//抓到的一个连接
+struct Session{
+    uint64_t openUs = 0;
+    uint64_t closeUs = UINT64_MAX;//没有CLOSE记录时收完响应就关闭
+    struct Chunk{
+        uint64_t offsetUs;
+        std::string data;
+    };
+    std::vector<Chunk> chunks;
+    bool truncated = false;//抓取时丢过记录，不回放
+};
+
+struct Options{
+    std::string host = "127.0.0.1";
+    int port = 1316;
+    double speed = 1;
+    int copies = 1;
+    int threads = 2;
+    bool wait = true;
+    int timeoutMS = 5000;
+};
+
+struct Stats{
+    uint64_t sessions = 0;
+    uint64_t requests = 0;
+    uint64_t responses = 0;
+    uint64_t connectErrors = 0;
+    uint64_t aborted = 0;//还有数据没发完或响应没收完就断开的连接
+    uint64_t status[6] = {0};
+};
+
+static Options options;
+static std::vector<Session> sessions;
+static struct sockaddr_in serverAddr;
+static Histogram latency;//请求最后一个字节发出到响应收完，微秒
+static Histogram lag;//每段数据实际发出比计划晚了多少，微秒
+
+static uint64_t NowUs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool LoadCapture(const char* path){
+    std::ifstream in(path, std::ios::binary);
+    CaptureFileHeader fileHeader;
+    if(!in.read((char*)&fileHeader, sizeof(fileHeader)) || memcmp(fileHeader.magic, CAPTURE_MAGIC, 8) != 0){
+        fprintf(stderr, "%s is not a capture file\n", path);
+        return false;
+    }
+    std::map<uint32_t, size_t> index;//连接编号 -> sessions下标
+    CaptureRecordHeader header;
+    while(in.read((char*)&header, sizeof(header))){
+        std::string data(header.Len(), '\0');
+        if(header.Len() > 0 && !in.read(&data[0], header.Len())){
+            break;//文件尾部写了一半
+        }
+        auto it = index.find(header.conn);
+        if(header.Type() == CAPTURE_OPEN){
+            index[header.conn] = sessions.size();
+            sessions.emplace_back();
+            sessions.back().openUs = header.offsetUs;
+            continue;
+        }
+        if(it == index.end()){
+            continue;//抓取开始前建立的连接
+        }
+        Session& s = sessions[it->second];
+        if(header.Type() == CAPTURE_DATA){
+            s.chunks.push_back({header.offsetUs, std::move(data)});
+        }else if(header.Type() == CAPTURE_CLOSE){
+            s.closeUs = header.offsetUs;
+            index.erase(it);
+        }else if(header.Type() == CAPTURE_TRUNCATED){
+            s.truncated = true;
+            index.erase(it);
+        }
+    }
+    size_t total = sessions.size();
+    sessions.erase(std::remove_if(sessions.begin(), sessions.end(),
+                                  [](const Session& s){ return s.truncated; }), sessions.end());
+    if(sessions.size() < total){
+        fprintf(stderr, "skipped %zu truncated connections\n", total - sessions.size());
+    }
+    return true;
+}
+
+//从字节流中数出完整的HTTP报文：头部加Content-length长的消息体
+//请求和响应共用，status不为空时解析状态码
+class MessageCounter{
+public:
+    //返回新完成的报文数
+    int Feed(const char* data, size_t len, std::vector<int>* status = nullptr){
+        buf_.append(data, len);
+        int done = 0;
+        while(true){
+            size_t headEnd = buf_.find("\r\n\r\n");
+            if(headEnd == std::string::npos){
+                break;
+            }
+            size_t bodyLen = 0;
+            size_t pos = buf_.find("\r\n") + 2;
+            while(pos < headEnd){
+                size_t eol = buf_.find("\r\n", pos);
+                if(strncasecmp(buf_.c_str() + pos, "Content-length:", 15) == 0){
+                    bodyLen = strtoul(buf_.c_str() + pos + 15, nullptr, 10);
+                }
+                pos = eol + 2;
+            }
+            if(buf_.size() < headEnd + 4 + bodyLen){
+                break;
+            }
+            if(status){
+                size_t sp = buf_.find(' ');
+                status->push_back(sp < headEnd ? atoi(buf_.c_str() + sp + 1) : 0);
+            }
+            buf_.erase(0, headEnd + 4 + bodyLen);
+            done++;
+        }
+        return done;
+    }
+
+private:
+    std::string buf_;
+};
+
+class Worker{
+public:
+    explicit Worker(uint64_t start):start_(start){
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    }
+    ~Worker(){
+        close(epollFd_);
+    }
+
+    void Add(const Session* session){
+        conns_.emplace_back();
+        conns_.back().session = session;
+    }
+
+    void Run(){
+        //按建立时间排序，依次到点建立连接
+        std::sort(conns_.begin(), conns_.end(), [](const Conn& a, const Conn& b){
+            return a.session->openUs < b.session->openUs;
+        });
+        size_t nextOpen = 0;
+        size_t finished = 0;
+        struct epoll_event events[256];
+        while(finished < conns_.size()){
+            uint64_t now = NowUs();
+            while(nextOpen < conns_.size() && Due_(conns_[nextOpen].session->openUs) <= now){
+                Open_(&conns_[nextOpen++]);
+            }
+            for(size_t i = 0; i < nextOpen; i++){
+                Drive_(&conns_[i], now);
+            }
+            int n = epoll_wait(epollFd_, events, 256, 1);
+            now = NowUs();
+            for(int i = 0; i < n; i++){
+                Conn* c = &conns_[events[i].data.u32];
+                if(c->fd < 0){
+                    continue;
+                }
+                if(c->connecting && (events[i].events & EPOLLOUT)){
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                    if(err){
+                        stats.connectErrors++;
+                        Finish_(c);
+                        continue;
+                    }
+                    c->connecting = false;
+                }
+                if(events[i].events & EPOLLIN){
+                    Read_(c, now);
+                }
+                if(c->fd >= 0 && (events[i].events & (EPOLLERR | EPOLLHUP))){
+                    Finish_(c);
+                }
+            }
+            finished = 0;
+            for(size_t i = 0; i < nextOpen; i++){
+                finished += conns_[i].done;
+            }
+        }
+    }
+
+    Stats stats;
+
+private:
+    struct Conn{
+        const Session* session = nullptr;
+        int fd = -1;
+        bool connecting = false;
+        bool done = false;
+        size_t next = 0;//下一段要发的数据
+        std::string out;
+        size_t outOff = 0;
+        MessageCounter requests;
+        MessageCounter responses;
+        std::deque<uint64_t> pending;//已发出的完整请求的发送时刻
+        uint64_t lastActive = 0;
+    };
+
+    uint64_t Due_(uint64_t offsetUs) const{
+        return start_ + (uint64_t)(offsetUs / options.speed);
+    }
+
+    void Open_(Conn* c){
+        stats.sessions++;
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(c->fd < 0){
+            stats.connectErrors++;
+            c->done = true;
+            return;
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        int ret = connect(c->fd, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
+        if(ret < 0 && errno != EINPROGRESS){
+            stats.connectErrors++;
+            close(c->fd);
+            c->fd = -1;
+            c->done = true;
+            return;
+        }
+        c->connecting = ret < 0;
+        c->lastActive = NowUs();
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+        ev.data.u32 = c - &conns_[0];
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    void Finish_(Conn* c){
+        if(c->fd >= 0){
+            if(c->next < c->session->chunks.size() || !c->pending.empty()){
+                stats.aborted++;
+            }
+            close(c->fd);
+            c->fd = -1;
+        }
+        c->done = true;
+    }
+
+    void Drive_(Conn* c, uint64_t now){
+        if(c->fd < 0 || c->connecting){
+            return;
+        }
+        const Session* s = c->session;
+        //到点的数据依次放入发送缓冲；wait时要等前面的响应都收到
+        while(c->next < s->chunks.size() && Due_(s->chunks[c->next].offsetUs) <= now
+              && (!options.wait || c->pending.empty())){
+            const Session::Chunk& chunk = s->chunks[c->next++];
+            lag.Record(now - Due_(chunk.offsetUs));
+            c->out += chunk.data;
+            int complete = c->requests.Feed(chunk.data.data(), chunk.data.size());
+            for(int i = 0; i < complete; i++){
+                c->pending.push_back(now);
+                stats.requests++;
+            }
+        }
+        while(c->outOff < c->out.size()){
+            ssize_t n = send(c->fd, c->out.data() + c->outOff, c->out.size() - c->outOff, MSG_NOSIGNAL);
+            if(n < 0){
+                if(errno != EAGAIN && errno != EWOULDBLOCK){
+                    Finish_(c);
+                }
+                return;
+            }
+            c->outOff += n;
+            c->lastActive = now;
+        }
+        c->out.clear();
+        c->outOff = 0;
+        if(!c->pending.empty() && now - c->lastActive > (uint64_t)options.timeoutMS * 1000){
+            Finish_(c);//响应超时
+            return;
+        }
+        //数据发完、响应收齐，到了原来关闭的时刻(没有记录关闭时刻就立即)关闭
+        if(c->next == s->chunks.size() && c->pending.empty()
+           && (s->closeUs == UINT64_MAX || Due_(s->closeUs) <= now)){
+            Finish_(c);
+        }
+    }
+
+    void Read_(Conn* c, uint64_t now){
+        char buf[65536];
+        std::vector<int> status;
+        while(c->fd >= 0){
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                return;
+            }
+            if(n <= 0){
+                Finish_(c);//服务器关闭连接
+                return;
+            }
+            c->lastActive = now;
+            status.clear();
+            int done = c->responses.Feed(buf, n, &status);
+            for(int i = 0; i < done && !c->pending.empty(); i++){
+                latency.Record(now - c->pending.front());
+                c->pending.pop_front();
+                stats.responses++;
+                int code = status[i];
+                stats.status[code >= 100 && code < 600 ? code / 100 : 0]++;
+            }
+        }
+    }
+
+    uint64_t start_;
+    int epollFd_;
+    std::vector<Conn> conns_;
+};
+
+static void PrintHistogram(const char* title, const Histogram& hist){
+    printf("%s p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n", title,
+           hist.Percentile(0.5) / 1000.0, hist.Percentile(0.9) / 1000.0, hist.Percentile(0.99) / 1000.0,
+           hist.Percentile(0.999) / 1000.0, hist.Percentile(1.0) / 1000.0);
+}
+
+int main(int argc, char* argv[]){
+    if(argc < 2){
+        fprintf(stderr, "usage: %s capture [host=] [port=] [speed=] [copies=] [threads=] [wait=] [timeout=]\n", argv[0]);
+        return 1;
+    }
+    for(int i = 2; i < argc; i++){
+        const char* eq = strchr(argv[i], '=');
+        if(!eq){
+            fprintf(stderr, "bad option: %s\n", argv[i]);
+            return 1;
+        }
+        std::string key(argv[i], eq - argv[i]);
+        const char* value = eq + 1;
+        if(key == "host") options.host = value;
+        else if(key == "port") options.port = atoi(value);
+        else if(key == "speed") options.speed = atof(value);
+        else if(key == "copies") options.copies = atoi(value);
+        else if(key == "threads") options.threads = atoi(value);
+        else if(key == "wait") options.wait = atoi(value) != 0;
+        else if(key == "timeout") options.timeoutMS = atoi(value);
+        else{
+            fprintf(stderr, "unknown option: %s\n", key.c_str());
+            return 1;
+        }
+    }
+    if(options.speed <= 0) options.speed = 1;
+    if(options.copies < 1) options.copies = 1;
+    if(options.threads < 1) options.threads = 1;
+    if(!LoadCapture(argv[1])){
+        return 1;
+    }
+    if(sessions.empty()){
+        fprintf(stderr, "no connections in %s\n", argv[1]);
+        return 1;
+    }
+    struct hostent* host = gethostbyname(options.host.c_str());
+    if(!host){
+        fprintf(stderr, "cannot resolve %s\n", options.host.c_str());
+        return 1;
+    }
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(options.port);
+    memcpy(&serverAddr.sin_addr, host->h_addr_list[0], sizeof(serverAddr.sin_addr));
+
+    uint64_t span = 0;
+    size_t chunks = 0;
+    for(auto& s : sessions){
+        chunks += s.chunks.size();
+        if(!s.chunks.empty()){
+            span = std::max(span, s.chunks.back().offsetUs);
+        }
+    }
+    printf("%zu connections, %zu chunks over %.1fs, replaying x%d at speed %g against %s:%d\n",
+           sessions.size(), chunks, span / 1e6, options.copies, options.speed, options.host.c_str(), options.port);
+
+    uint64_t start = NowUs() + 100000;//留出建立线程的时间
+    std::vector<std::unique_ptr<Worker>> workers;
+    for(int i = 0; i < options.threads; i++){
+        workers.emplace_back(new Worker(start));
+    }
+    size_t n = 0;
+    for(auto& s : sessions){
+        for(int k = 0; k < options.copies; k++){
+            workers[n++ % workers.size()]->Add(&s);
+        }
+    }
+    std::vector<std::thread> threads;
+    for(auto& w : workers){
+        threads.emplace_back(&Worker::Run, w.get());
+    }
+    for(auto& t : threads){
+        t.join();
+    }
+    double sec = (NowUs() - start) / 1e6;
+
+    Stats total;
+    for(auto& w : workers){
+        total.sessions += w->stats.sessions;
+        total.requests += w->stats.requests;
+        total.responses += w->stats.responses;
+        total.connectErrors += w->stats.connectErrors;
+        total.aborted += w->stats.aborted;
+        for(int i = 0; i < 6; i++){
+            total.status[i] += w->stats.status[i];
+        }
+    }
+    printf("replayed in %.1fs (captured %.1fs at speed %g): %llu connections, %llu requests, %llu responses, %.0f req/s\n",
+           sec, span / 1e6, options.speed, (unsigned long long)total.sessions, (unsigned long long)total.requests,
+           (unsigned long long)total.responses, total.responses / sec);
+    printf("connect errors %llu, aborted connections %llu\n",
+           (unsigned long long)total.connectErrors, (unsigned long long)total.aborted);
+    printf("status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+           (unsigned long long)total.status[2], (unsigned long long)total.status[3],
+           (unsigned long long)total.status[4], (unsigned long long)total.status[5],
+           (unsigned long long)(total.status[0] + total.status[1]));
+    PrintHistogram("latency", latency);
+    PrintHistogram("schedule lag", lag);
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include "buffer.h"
+#include<errno.h>
+#include<algorithm>
 //读写下标初始化，vector<char>初始化
-Buffer::Buffer(int initBuffSize) : buffer_(initBuffSize),readPos_(0),writePos_(0) {}
+Buffer::Buffer(int initBuffSize) : buffer_(initBuffSize),readPos_(0),writePos_(0),maxSize_(0) {}
 
 //可写的数量=buffer大小 - 写下标
 size_t Buffer::WritableBytes() const{
@@ -95,19 +97,30 @@ ssize_t Buffer::ReadFd(int fd, int* Errno){
     char buff[65535];//栈区
     struct iovec iov[2];
     size_t writeable = WritableBytes();//记录下能写多少
+    size_t extra = sizeof(buff);
+    //有上限时两块加起来不超过剩余的额度，剩下的数据留在内核里
+    if(maxSize_ > 0){
+        size_t readable = ReadableBytes();
+        if(readable >= maxSize_){
+            *Errno = ENOBUFS;
+            return -1;
+        }
+        writeable = std::min(writeable, maxSize_ - readable);
+        extra = std::min(extra, maxSize_ - readable - writeable);
+    }
     // 分散读， 保证数据全部读完
     iov[0].iov_base = BeginWrite();
     iov[0].iov_len = writeable;
     iov[1].iov_base = buff;
-    iov[1].iov_len = sizeof(buff);
+    iov[1].iov_len = extra;
 
-    ssize_t len = readv(fd,iov,2);
+    ssize_t len = readv(fd,iov,extra > 0 ? 2 : 1);
     if(len<0){
         *Errno = errno;
     }else if(static_cast<size_t>(len) <= writeable){//若len小于writable,说明写区可以容纳len
         writePos_+=len;
     }else{
-        writePos_=buffer_.size();// 写区写满了,下标移到最后
+        writePos_+=writeable;// 写区写满了
         Append(buff,static_cast<size_t>(len-writeable));//剩余长度
     }
     return len;
@@ -39,6 +39,10 @@ public:
     void Append(const void* data, size_t len);
     void Append(const Buffer& buffer);
 
+    //ReadFd读入后可读数据最多maxSize字节，已满时返回-1、Errno为ENOBUFS；0表示不限制
+    void SetMaxSize(size_t maxSize){
+        maxSize_ = maxSize;
+    }
     ssize_t ReadFd(int fd, int* Errno);
     ssize_t WriteFd(int fd, int* Errno);
 
@@ -50,6 +54,7 @@ private:
     std::vector<char> buffer_;
     std::atomic<std::size_t> readPos_;//读的下标
     std::atomic<std::size_t> writePos_;//写的下标
+    size_t maxSize_;
 
 };
 
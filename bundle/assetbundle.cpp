@@ -0,0 +1,160 @@
+#include"assetbundle.h"
+
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<assert.h>
+
+#include"../log/log.h"
+
+const char AssetBundle::MAGIC[8] = {'T','W','S','P','A','C','K','1'};
+
+AssetBundle::AssetBundle(){
+    base_ = nullptr;
+    size_ = 0;
+    header_ = nullptr;
+    buckets_ = nullptr;
+    entries_ = nullptr;
+}
+
+AssetBundle::~AssetBundle(){
+    Close();
+}
+
+//FNV-1a 64位哈希，打包器和服务器必须使用同一个
+uint64_t AssetBundle::Hash(const char* data, size_t len){
+    uint64_t h = 1469598103934665603ULL;
+    for(size_t i = 0; i < len; i++){
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool AssetBundle::Open(const char* path, bool populate, bool hugePage){
+    assert(path);
+    Close();
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        LOG_ERROR("Bundle %s open error!", path);
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(BundleHeader)){
+        LOG_ERROR("Bundle %s is too small!", path);
+        close(fd);
+        return false;
+    }
+    int flags = MAP_PRIVATE;
+    if(populate){
+        flags |= MAP_POPULATE;//启动时就把整个包读进页缓存
+    }
+    //整个服务期间只有这一次mmap
+    void* ret = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if(ret == MAP_FAILED){
+        LOG_ERROR("Bundle %s mmap error!", path);
+        return false;
+    }
+    base_ = (char*)ret;
+    size_ = st.st_size;
+    if(hugePage){
+        //文件映射不能用MAP_HUGETLB，只能建议内核合并成透明大页
+        madvise(base_, size_, MADV_HUGEPAGE);
+    }
+
+    header_ = (const BundleHeader*)base_;
+    bool valid = memcmp(header_->magic, MAGIC, sizeof(MAGIC)) == 0
+              && header_->version == VERSION
+              && header_->totalSize == size_
+              && header_->bucketCount > 0
+              && (header_->bucketCount & (header_->bucketCount - 1)) == 0
+              && InRange_(header_->indexOff, (uint64_t)header_->bucketCount * sizeof(uint32_t))
+              && InRange_(header_->entryOff, (uint64_t)header_->entryCount * sizeof(BundleEntry));
+    if(valid){
+        buckets_ = (const uint32_t*)(base_ + header_->indexOff);
+        entries_ = (const BundleEntry*)(base_ + header_->entryOff);
+        valid = CheckEntries_();
+    }
+    if(!valid){
+        LOG_ERROR("Bundle %s format error!", path);
+        Close();
+        return false;
+    }
+    LOG_INFO("Bundle %s loaded, entries:%d, size:%d", path, (int)header_->entryCount, (int)size_);
+    return true;
+}
+
+//截断或损坏的包在这里拒绝，否则Lookup_/Find会读到映射之外
+bool AssetBundle::CheckEntries_() const{
+    for(uint32_t i = 0; i < header_->bucketCount; i++){
+        if(buckets_[i] > header_->entryCount){
+            return false;
+        }
+    }
+    for(uint32_t i = 0; i < header_->entryCount; i++){
+        const BundleEntry& e = entries_[i];
+        if(!InRange_(e.pathOff, e.pathLen)
+            || !InRange_(e.headerOff, e.headerLen)
+            || !InRange_(e.dataOff, e.dataLen)){
+            return false;
+        }
+        if(e.gzLen > 0 && (!InRange_(e.gzHeaderOff, e.gzHeaderLen) || !InRange_(e.gzOff, e.gzLen))){
+            return false;
+        }
+    }
+    return true;
+}
+
+void AssetBundle::Close(){
+    if(base_){
+        munmap(base_, size_);
+    }
+    base_ = nullptr;
+    size_ = 0;
+    header_ = nullptr;
+    buckets_ = nullptr;
+    entries_ = nullptr;
+}
+
+//线性探测查找，只访问映射的内存
+const BundleEntry* AssetBundle::Lookup_(const std::string& path) const{
+    if(!base_){
+        return nullptr;
+    }
+    uint64_t h = Hash(path.data(), path.size());
+    uint32_t mask = header_->bucketCount - 1;
+    for(uint32_t i = 0; i <= mask; i++){
+        uint32_t slot = buckets_[(h + i) & mask];
+        if(slot == 0){
+            return nullptr;
+        }
+        const BundleEntry* entry = &entries_[slot - 1];
+        if(entry->hash == h && entry->pathLen == path.size()
+            && memcmp(base_ + entry->pathOff, path.data(), path.size()) == 0){
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+bool AssetBundle::Find(const std::string& path, bool acceptGzip, Asset* asset) const{
+    assert(asset);
+    const BundleEntry* entry = Lookup_(path);
+    if(!entry){
+        return false;
+    }
+    if(acceptGzip && entry->gzLen > 0){
+        asset->header = base_ + entry->gzHeaderOff;
+        asset->headerLen = entry->gzHeaderLen;
+        asset->data = base_ + entry->gzOff;
+        asset->dataLen = entry->gzLen;
+    }else{
+        asset->header = base_ + entry->headerOff;
+        asset->headerLen = entry->headerLen;
+        asset->data = base_ + entry->dataOff;
+        asset->dataLen = entry->dataLen;
+    }
+    return true;
+}
@@ -0,0 +1,83 @@
+//静态资源包
+//由bundle/packer把resources/目录打包成一个文件，服务器启动时一次mmap整个文件，
+//请求时通过哈希索引查找路径，不再经过文件系统
+#ifndef ASSET_BUNDLE_H
+#define ASSET_BUNDLE_H
+
+#include<stdint.h>
+#include<string.h>
+#include<string>
+
+/*
+文件布局（主机字节序）：
+    BundleHeader
+    uint32_t buckets[bucketCount]   开放寻址的哈希桶，存entry下标+1，0表示空
+    BundleEntry entries[entryCount]
+    字符串区（路径、预先生成的响应头）
+    数据区（原始内容和可选的gzip内容，按64字节对齐）
+*/
+struct BundleHeader{
+    char magic[8];//"TWSPACK1"
+    uint32_t version;
+    uint32_t entryCount;
+    uint32_t bucketCount;//2的幂
+    uint32_t reserved;
+    uint64_t indexOff;
+    uint64_t entryOff;
+    uint64_t totalSize;
+};
+
+struct BundleEntry{
+    uint64_t hash;
+    uint32_t pathOff, pathLen;
+    //"Content-type: ...\r\nETag: ...\r\n"
+    uint32_t headerOff, headerLen;
+    //gzip版本的响应头，多了Content-Encoding和Vary
+    uint32_t gzHeaderOff, gzHeaderLen;
+    uint64_t dataOff, dataLen;
+    uint64_t gzOff, gzLen;//gzLen为0表示没有压缩版本
+};
+
+class AssetBundle{
+public:
+    static const char MAGIC[8];
+    static const uint32_t VERSION = 1;
+
+    //查找结果，指针都指向映射的区域
+    struct Asset{
+        const char* header;//Content-type和ETag等响应头
+        size_t headerLen;
+        const char* data;
+        size_t dataLen;
+    };
+
+    AssetBundle();
+    ~AssetBundle();
+
+    //populate:MAP_POPULATE预先读入所有页，hugePage:建议内核使用透明大页
+    bool Open(const char* path, bool populate = false, bool hugePage = false);
+    void Close();
+    bool IsOpen() const {return base_ != nullptr;}
+
+    //按请求路径查找，acceptGzip为true且有压缩版本时返回压缩内容
+    bool Find(const std::string& path, bool acceptGzip, Asset* asset) const;
+    size_t EntryCount() const {return header_ ? header_->entryCount : 0;}
+
+    static uint64_t Hash(const char* data, size_t len);
+
+private:
+    const BundleEntry* Lookup_(const std::string& path) const;
+    //[off, off+len)在映射范围内，写成减法避免相加溢出
+    bool InRange_(uint64_t off, uint64_t len) const{
+        return off <= size_ && len <= size_ - off;
+    }
+    bool CheckEntries_() const;//打开时检查每个桶和每个entry的偏移，之后查找不再检查
+
+    char* base_;
+    size_t size_;
+    const BundleHeader* header_;
+    const uint32_t* buckets_;
+    const BundleEntry* entries_;
+};
+
+#endif
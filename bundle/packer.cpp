@@ -0,0 +1,247 @@
+//构建期打包工具：把资源目录打成一个资源包文件
+//用法：packer [-z] <资源目录> <输出文件>
+//  -z  用zlib为每个文件生成gzip版本，比原文件小时才保留
+//编译：g++ -O2 -std=c++14 bundle/packer.cpp bundle/assetbundle.cpp log/log.cpp log/logformat.cpp buffer/buffer.cpp -lz -lpthread -o packer
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<dirent.h>
+#include<sys/stat.h>
+#include<string>
+#include<vector>
+#include<algorithm>
+#include<zlib.h>
+
+#include"assetbundle.h"
+
+using namespace std;
+
+struct PackFile{
+    string path;//以/开头的请求路径
+    string content;
+    string gz;
+    string header;
+    string gzHeader;
+};
+
+static const char* MimeType(const string& path){
+    static const char* SUFFIX_TYPE[][2] = {
+        { ".html",  "text/html" },
+        { ".xml",   "text/xml" },
+        { ".xhtml", "application/xhtml+xml" },
+        { ".txt",   "text/plain" },
+        { ".rtf",   "application/rtf" },
+        { ".pdf",   "application/pdf" },
+        { ".word",  "application/nsword" },
+        { ".png",   "image/png" },
+        { ".gif",   "image/gif" },
+        { ".jpg",   "image/jpeg" },
+        { ".jpeg",  "image/jpeg" },
+        { ".au",    "audio/basic" },
+        { ".mpeg",  "video/mpeg" },
+        { ".mpg",   "video/mpeg" },
+        { ".avi",   "video/x-msvideo" },
+        { ".gz",    "application/x-gzip" },
+        { ".tar",   "application/x-tar" },
+        { ".css",   "text/css" },
+        { ".js",    "text/javascript" },
+    };
+    string::size_type idx = path.find_last_of('.');
+    if(idx != string::npos){
+        for(auto& type : SUFFIX_TYPE){
+            if(path.compare(idx, string::npos, type[0]) == 0){
+                return type[1];
+            }
+        }
+    }
+    return "text/plain";
+}
+
+static bool ReadFile(const string& file, string* content){
+    FILE* fp = fopen(file.c_str(), "rb");
+    if(!fp){
+        return false;
+    }
+    char buff[65536];
+    size_t n;
+    content->clear();
+    while((n = fread(buff, 1, sizeof(buff), fp)) > 0){
+        content->append(buff, n);
+    }
+    fclose(fp);
+    return true;
+}
+
+//递归收集目录下的普通文件
+static void Walk(const string& root, const string& rel, vector<PackFile>* files){
+    DIR* dir = opendir((root + rel).c_str());
+    if(!dir){
+        fprintf(stderr, "opendir %s failed\n", (root + rel).c_str());
+        return;
+    }
+    while(struct dirent* ent = readdir(dir)){
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0){
+            continue;
+        }
+        string path = rel + "/" + ent->d_name;
+        struct stat st;
+        if(stat((root + path).c_str(), &st) < 0){
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)){
+            Walk(root, path, files);
+        }else if(S_ISREG(st.st_mode)){
+            PackFile file;
+            file.path = path;
+            if(ReadFile(root + path, &file.content)){
+                files->push_back(std::move(file));
+            }
+        }
+    }
+    closedir(dir);
+}
+
+static bool Gzip(const string& in, string* out){
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    //windowBits 15+16 生成gzip格式
+    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK){
+        return false;
+    }
+    out->resize(deflateBound(&zs, in.size()) + 32);
+    zs.next_in = (Bytef*)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef*)&(*out)[0];
+    zs.avail_out = out->size();
+    int ret = deflate(&zs, Z_FINISH);
+    out->resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+static uint64_t Align(uint64_t off){
+    return (off + 63) & ~(uint64_t)63;
+}
+
+int main(int argc, char* argv[]){
+    bool compress = false;
+    int argi = 1;
+    if(argi < argc && strcmp(argv[argi], "-z") == 0){
+        compress = true;
+        argi++;
+    }
+    if(argc - argi != 2){
+        fprintf(stderr, "usage: %s [-z] <resources dir> <bundle file>\n", argv[0]);
+        return 1;
+    }
+    string root = argv[argi];
+    while(!root.empty() && root.back() == '/'){
+        root.pop_back();
+    }
+
+    vector<PackFile> files;
+    Walk(root, "", &files);
+    //按路径排序，相同输入得到相同的包
+    sort(files.begin(), files.end(), [](const PackFile& a, const PackFile& b){
+        return a.path < b.path;
+    });
+
+    for(auto& file : files){
+        char etag[32];
+        snprintf(etag, sizeof(etag), "%016llx",
+                 (unsigned long long)AssetBundle::Hash(file.content.data(), file.content.size()));
+        file.header = string("Content-type: ") + MimeType(file.path) + "\r\n"
+                    + "ETag: \"" + etag + "\"\r\n";
+        if(compress && Gzip(file.content, &file.gz) && file.gz.size() < file.content.size()){
+            file.gzHeader = file.header + "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+        }else{
+            file.gz.clear();
+        }
+    }
+
+    //哈希桶数为不小于2倍条目数的2的幂，保证探测链短
+    uint32_t bucketCount = 16;
+    while(bucketCount < files.size() * 2){
+        bucketCount <<= 1;
+    }
+
+    BundleHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AssetBundle::MAGIC, sizeof(header.magic));
+    header.version = AssetBundle::VERSION;
+    header.entryCount = files.size();
+    header.bucketCount = bucketCount;
+    header.indexOff = sizeof(BundleHeader);
+    header.entryOff = Align(header.indexOff + bucketCount * sizeof(uint32_t));
+
+    vector<uint32_t> buckets(bucketCount, 0);
+    vector<BundleEntry> entries(files.size());
+    string strs;
+    uint64_t strOff = header.entryOff + files.size() * sizeof(BundleEntry);
+    for(size_t i = 0; i < files.size(); i++){
+        BundleEntry& entry = entries[i];
+        memset(&entry, 0, sizeof(entry));
+        entry.hash = AssetBundle::Hash(files[i].path.data(), files[i].path.size());
+        entry.pathOff = strOff + strs.size();
+        entry.pathLen = files[i].path.size();
+        strs += files[i].path;
+        entry.headerOff = strOff + strs.size();
+        entry.headerLen = files[i].header.size();
+        strs += files[i].header;
+        entry.gzHeaderOff = strOff + strs.size();
+        entry.gzHeaderLen = files[i].gzHeader.size();
+        strs += files[i].gzHeader;
+
+        uint32_t mask = bucketCount - 1;
+        uint32_t slot = entry.hash & mask;
+        while(buckets[slot]){
+            slot = (slot + 1) & mask;
+        }
+        buckets[slot] = i + 1;
+    }
+
+    uint64_t dataOff = Align(strOff + strs.size());
+    for(size_t i = 0; i < files.size(); i++){
+        entries[i].dataOff = dataOff;
+        entries[i].dataLen = files[i].content.size();
+        dataOff = Align(dataOff + files[i].content.size());
+        if(!files[i].gz.empty()){
+            entries[i].gzOff = dataOff;
+            entries[i].gzLen = files[i].gz.size();
+            dataOff = Align(dataOff + files[i].gz.size());
+        }
+    }
+    header.totalSize = dataOff;
+
+    FILE* fp = fopen(argv[argi + 1], "wb");
+    if(!fp){
+        fprintf(stderr, "open %s failed\n", argv[argi + 1]);
+        return 1;
+    }
+    //按偏移顺序写出，中间的空隙补0
+    string out(header.totalSize, '\0');
+    memcpy(&out[0], &header, sizeof(header));
+    memcpy(&out[header.indexOff], buckets.data(), buckets.size() * sizeof(uint32_t));
+    if(!entries.empty()){
+        memcpy(&out[header.entryOff], entries.data(), entries.size() * sizeof(BundleEntry));
+    }
+    if(!strs.empty()){
+        memcpy(&out[strOff], strs.data(), strs.size());
+    }
+    for(size_t i = 0; i < files.size(); i++){
+        if(!files[i].content.empty()){
+            memcpy(&out[entries[i].dataOff], files[i].content.data(), files[i].content.size());
+        }
+        if(!files[i].gz.empty()){
+            memcpy(&out[entries[i].gzOff], files[i].gz.data(), files[i].gz.size());
+        }
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok){
+        fprintf(stderr, "write %s failed\n", argv[argi + 1]);
+        return 1;
+    }
+    printf("packed %zu files, %llu bytes\n", files.size(), (unsigned long long)header.totalSize);
+    return 0;
+}
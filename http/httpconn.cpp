@@ -1,14 +1,53 @@
 #include"httpconn.h"
+#include<netinet/in.h>
+#include<linux/errqueue.h>
 using namespace std;
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
 const char*HttpConn::srcDir;
+const char* HttpConn::metricsPath = nullptr;
 std::atomic<int> HttpConn::userCount;
-bool HttpConn:isET;//是否是边沿触发
+std::atomic<uint32_t> HttpConn::nextConnId_;
+bool HttpConn::isET;//是否是边沿触发
+size_t HttpConn::writeQuantum = 256 * 1024;
+size_t HttpConn::zeroCopyThreshold = 0;
+std::atomic<uint64_t> HttpConn::zcSendCnt;
+std::atomic<uint64_t> HttpConn::zcDoneCnt;
+std::atomic<uint64_t> HttpConn::zcCopiedCnt;
+std::atomic<uint64_t> HttpConn::zcNoBufsCnt;
+std::mutex HttpConn::lingerMtx_;
+std::vector<HttpConn::ZeroCopyLinger> HttpConn::lingering_;
+std::atomic<int> HttpConn::lingerCnt_;
 
 HttpConn::HttpConn(){
     fd_ = -1;
     addr_={0};
     isClose_ = true;
+    gen_ = 0;
+    connId_ = 0;
+    capturing_ = false;
+    rejected_ = draining_ = false;
+    idleSince_ = 0;
+    dispatchSeq_ = returnedSeq_ = 0;
+    limitSlot_ = -1;
+    readPhase_ = PHASE_NONE;
+    phaseStartMS_ = 0;
+    iovCnt_ = iovIdx_ = 0;
+    bytesWritten_ = 0;
+    zcEnabled_ = zcResponse_ = false;
+    zcSeq_ = 0;
 }
 
 HttpConn::~HttpConn(){
@@ -18,11 +57,35 @@ HttpConn::~HttpConn(){
 void HttpConn::init(int fd,const sockaddr_in& addr){
     assert(fd>0);
     userCount++;
+    gen_++;
     addr_ = addr;
     fd_ = fd;
-    writeBuff_.RetrieveAll();
     readBuff_.RetrieveAll();
-    isClose_ = fasle;
+    iovCnt_ = iovIdx_ = 0;
+    bytesWritten_ = 0;
+    zcResponse_ = false;
+    zcSeq_ = 0;//新连接的内核序号从0开始
+    zcEnabled_ = false;
+    if(zeroCopyThreshold > 0){
+        int one = 1;
+        zcEnabled_ = setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+    trace_.Accept();
+    rejected_ = draining_ = false;
+    idleSince_ = 0;
+    //序号不清零，上一个客户端的工作线程迟到的MarkReturned不会把新连接标成已交回
+    MarkReturned(dispatchSeq_.load(std::memory_order_acquire));
+    limitSlot_ = -1;
+    readPhase_ = PHASE_NONE;
+    //读缓冲最多容纳一个最大的请求，慢速或恶意客户端不能让它无限增长
+    readBuff_.SetMaxSize(HttpRequest::maxRequestBytes);
+    connId_ = nextConnId_.fetch_add(1, std::memory_order_relaxed);
+    capturing_ = TrafficCapture::Instance()->Sampled(connId_);
+    if(capturing_){
+        //OPEN没记下来，回放时这个连接的其他记录也用不上
+        capturing_ = TrafficCapture::Instance()->Record(connId_, CAPTURE_OPEN, &addr_.sin_addr, sizeof(addr_.sin_addr));
+    }
+    isClose_ = false;
     //日志记录信息
     LOG_INFO("Client[%d](%s:%d) in, userCount:%d", fd_, GetIP(), GetPort(), (int)userCount);
 }
@@ -31,13 +94,61 @@ void HttpConn::Close(){
     response_.UnmapFile();
     if(isClose_==false){
         isClose_ = true;
+        //关闭前把已经到达的完成通知读掉，还有没完成的发送时映射要保留到内核释放
+        if(HasZeroCopyPending()){
+            ReapZeroCopy();
+        }
+        zcBody_.reset();
+        if(capturing_){
+            TrafficCapture::Instance()->Record(connId_, CAPTURE_CLOSE, nullptr, 0);
+            capturing_ = false;
+        }
         userCount--;
-        close(fd_);
+        if(zcHolds_.empty()){
+            close(fd_);
+        }else{
+            //套接字不close，错误队列才能继续收到完成通知；fd也因此不会被新连接复用
+            shutdown(fd_, SHUT_RDWR);
+            std::lock_guard<std::mutex> locker(lingerMtx_);
+            lingering_.push_back({fd_, std::move(zcHolds_),
+                std::chrono::steady_clock::now() + std::chrono::milliseconds(ZC_LINGER_MS)});
+            zcHolds_.clear();
+            lingerCnt_++;
+        }
         //日志记录信息
         LOG_INFO("Client[%d](%s:%d) quit, UserCount:%d", fd_, GetIP(), GetPort(), (int)userCount);
     }
 }
 
+void HttpConn::SetReadPhase_(int phase){
+    if(phase == readPhase_.load(std::memory_order_relaxed)){
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if(phase == PHASE_HEADER){
+        start = reqStart_;
+    }
+    phaseStartMS_.store(std::chrono::duration_cast<std::chrono::milliseconds>(
+        start.time_since_epoch()).count(), std::memory_order_relaxed);
+    readPhase_.store(phase, std::memory_order_relaxed);
+}
+
+bool HttpConn::Drain(){
+    if(!rejected_){
+        return false;
+    }
+    shutdown(fd_, SHUT_WR);
+    draining_ = true;
+    return true;
+}
+
+//只增不减：交回后连接可能马上被再次交出，甚至关闭后给了新客户端，旧的序号不能覆盖新的
+void HttpConn::MarkReturned(uint64_t seq){
+    uint64_t cur = returnedSeq_.load(std::memory_order_acquire);
+    while(cur < seq && !returnedSeq_.compare_exchange_weak(cur, seq, std::memory_order_acq_rel)){
+    }
+}
+
 int HttpConn::GetFd() const{
     return fd_;
 }
@@ -56,67 +167,302 @@ int HttpConn::GetPort() const{
 
 ssize_t HttpConn::read(int* saveErrno){
     ssize_t len = -1;
+    if(readBuff_.ReadableBytes()==0){
+        reqStart_ = std::chrono::steady_clock::now();//新请求开始
+        trace_.Begin();
+    }
     do{
         len = readBuff_.ReadFd(fd_, saveErrno);
         if(len<=0){
             break;
         }
+        Metrics::Instance()->bytesIn.Add(len);
+        //新读到的字节在读缓冲的末尾；中间丢了一段的字节流回放出来是错的，标记后停止抓这个连接
+        if(capturing_ && !TrafficCapture::Instance()->Record(connId_, CAPTURE_DATA, readBuff_.BeginWriteConst() - len, len)){
+            TrafficCapture::Instance()->Truncate(connId_);
+            capturing_ = false;
+        }
     }while(isET);//边沿触发要一次性全部读出
+    TWS_PROBE2(read_done, fd_, readBuff_.ReadableBytes());
     return len;
 }
 
 //主要使用writev连续写函数
+//大文件每次最多写writeQuantum字节就返回，让出工作线程，剩下的等EPOLLOUT再写，
+//这样几个慢速的大文件下载不会占满线程池，小响应不用排在它们后面
 ssize_t HttpConn::write(int* saveErrno){
     ssize_t len = -1;
+    size_t budget = TurnBudget_();
     do{
-        len = writev(fd_,iov_,iovCnt_);//将iov的内容写到fd中
+        if(zcResponse_ && iovIdx_ == iovCnt_ - 1){
+            len = SendZeroCopy_(budget);//只剩消息体
+        }else{
+            //零拷贝时响应头仍按普通方式写，避免内核引用会被下个请求改写的头部缓冲
+            int cnt = zcResponse_ ? iovCnt_ - 1 - iovIdx_ : iovCnt_ - iovIdx_;
+            len = writev(fd_,iov_ + iovIdx_,cnt);//将iov的内容写到fd中
+        }
         if(len<=0){
             *saveErrno = errno;
             break;
         }
-        //buffer中iov的两个区都为0，说明传输结束
-        if(iov[0].iov_len + iov[1].iov_len==0){break;}
-        else if(static_cast<size_t>(len) > iov_[0].iov_len){
-            iov_[1].iov_base = (uint8_t*)iov_[1].iov_base + (len-iov[0].iov_len);
-            iov_[1].iov_len -= (len-iov[0].iov_len);
-            if(iov_[0].iov_len){
-                writeBuff_.RetrieveAll();
-                iov_[0].iov_len = 0;
+        AdvanceIov_(len);
+        bytesWritten_ += len;
+        Metrics* metrics = Metrics::Instance();
+        metrics->bytesOut.Add(len);
+        //iov的所有片段都写完，说明传输结束
+        if(ToWriteBytes()==0){
+            LOG_DEBUG("Client[%d] write %d bytes, %.0f B/s", fd_, (int)bytesWritten_, WriteThroughput());
+            metrics->CountStatus(response_.Code());
+            metrics->requestLatency.RecordSince(reqStart_);
+            TWS_PROBE3(write_done, fd_, response_.Code(), bytesWritten_);
+            trace_.Done();
+            if(trace_.Active()){
+                char ip[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &addr_.sin_addr, ip, sizeof(ip));
+                //没有解析就拒绝的请求没有方法和路径，记为"-"
+                static const std::string NONE = "-";
+                PhaseTracer::Instance()->Submit(trace_, ip, rejected_ ? NONE : request_.method(),
+                                                rejected_ ? NONE : request_.uri(),
+                                                response_.Code(), bytesWritten_);
             }
+            LogAccess_();
+            break;
         }
-        else{
-            iov_[0].iov_base = (unit8*)iov_[0].iov_base + len;
-            iov_[0].iov_len -= len;
-            writeBuff_.Retrieve(len);
+        if(budget > 0){
+            if(static_cast<size_t>(len) >= budget){
+                break;//本轮配额用完
+            }
+            budget -= len;
         }
     }while(isET||ToWriteBytes()>10240);
     return len;
 }
 
+ssize_t HttpConn::SendZeroCopy_(size_t budget){
+    struct iovec iov = iov_[iovIdx_];
+    if(budget > 0 && iov.iov_len > budget){
+        iov.iov_len = budget;
+    }
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    ssize_t len = sendmsg(fd_, &msg, MSG_ZEROCOPY);
+    if(len < 0 && errno == ENOBUFS){
+        //锁定的页超过了optmem限制，这次退回普通发送
+        zcNoBufsCnt++;
+        return send(fd_, iov.iov_base, iov.iov_len, 0);
+    }
+    if(len > 0){
+        //第一次零拷贝发送时接管映射，直到完成通知到达才释放
+        if(!zcBody_){
+            zcBody_ = response_.PinFile();
+        }
+        if(!zcHolds_.empty() && zcHolds_.back().body == zcBody_){
+            zcHolds_.back().lastSeq = zcSeq_;
+        }else{
+            zcHolds_.push_back({zcBody_, zcSeq_});
+        }
+        zcSeq_++;
+        zcSendCnt++;
+    }
+    return len;
+}
+
+bool HttpConn::ReapZeroCopy(){
+    return ReapZeroCopy_(fd_, zcHolds_);
+}
+
+bool HttpConn::ReapZeroCopy_(int fd, std::deque<ZeroCopyHold>& holds){
+    char control[128];
+    while(true){
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE) < 0){
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)){
+            if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)){
+                continue;
+            }
+            struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY){
+                if(serr->ee_errno){
+                    return false;
+                }
+                continue;
+            }
+            //[ee_info, ee_data]区间内的发送都已完成
+            uint32_t lo = serr->ee_info;
+            uint32_t hi = serr->ee_data;
+            zcDoneCnt += hi - lo + 1;
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+                zcCopiedCnt += hi - lo + 1;
+            }
+            while(!holds.empty() && static_cast<int32_t>(holds.front().lastSeq - hi) <= 0){
+                holds.pop_front();
+            }
+        }
+    }
+}
+
+void HttpConn::ReapLingering(){
+    if(lingerCnt_.load(std::memory_order_relaxed) == 0){
+        return;
+    }
+    std::lock_guard<std::mutex> locker(lingerMtx_);
+    auto now = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < lingering_.size();){
+        ZeroCopyLinger& linger = lingering_[i];
+        //对端复位时错误队列里先是真正的错误，后面的完成通知下一轮接着读
+        ReapZeroCopy_(linger.fd, linger.holds);
+        if(!linger.holds.empty() && now < linger.deadline){
+            i++;
+            continue;
+        }
+        if(!linger.holds.empty()){
+            LOG_WARN("fd %d: %d zerocopy sends not completed, release anyway", linger.fd, (int)linger.holds.size());
+        }
+        close(linger.fd);
+        if(i + 1 < lingering_.size()){
+            linger = std::move(lingering_.back());
+        }
+        lingering_.pop_back();
+        lingerCnt_--;
+    }
+}
+
+//响应的第一轮给完整的配额，小响应一轮就写完；已经写过一轮的大传输按实测速率
+//把每轮限制在约WRITE_SLICE_US内，越慢的客户端每轮写得越少、越早让出线程
+size_t HttpConn::TurnBudget_() const{
+    if(writeQuantum == 0 || bytesWritten_ < writeQuantum){
+        return writeQuantum;
+    }
+    size_t bytes = static_cast<size_t>(WriteThroughput() * WRITE_SLICE_US / 1000000);
+    if(bytes < MIN_TURN_BYTES){
+        return MIN_TURN_BYTES;
+    }
+    return bytes < writeQuantum ? bytes : writeQuantum;
+}
+
+double HttpConn::WriteThroughput() const{
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - writeStart_).count();
+    return sec > 0 ? bytesWritten_ / sec : 0;
+}
+
+void HttpConn::LogAccess_(){
+    AccessLog* log = AccessLog::Instance();
+    if(!log->IsOpen()){
+        return;
+    }
+    //inet_ntoa返回静态缓冲区，多个工作线程同时记录时不安全
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr_.sin_addr, ip, sizeof(ip));
+    std::string method = request_.method();
+    std::string version = request_.version();
+    std::string referer = request_.GetHeader("Referer");
+    std::string userAgent = request_.GetHeader("User-Agent");
+    AccessRecord record;
+    record.peer = ip;
+    record.port = ntohs(addr_.sin_port);
+    record.method = method.c_str();
+    record.path = request_.uri().c_str();
+    record.version = version.c_str();
+    record.referer = referer.c_str();
+    record.userAgent = userAgent.c_str();
+    record.status = response_.Code();
+    record.bytes = bytesWritten_;
+    record.latencyUs = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - reqStart_).count();
+    log->write(record);
+}
+
+//跳过已经写完的片段，并调整当前片段的起始位置
+void HttpConn::AdvanceIov_(size_t len){
+    while(len > 0 && iovIdx_ < iovCnt_){
+        if(len >= iov_[iovIdx_].iov_len){
+            len -= iov_[iovIdx_].iov_len;
+            iov_[iovIdx_].iov_len = 0;
+            iovIdx_++;
+        }else{
+            iov_[iovIdx_].iov_base = (uint8_t*)iov_[iovIdx_].iov_base + len;
+            iov_[iovIdx_].iov_len -= len;
+            len = 0;
+        }
+    }
+}
+
 bool HttpConn::process(){
     request_.Init();
+    rejected_ = false;
     if(readBuff_.ReadableBytes()<=0){
-        return fasle;
+        return false;
+    }
+    //请求没收全时等下一次读，超过大小限制或Content-length不对时不解析，直接回复431/413/400并关闭
+    //预检算在解析阶段里，被拒绝的请求也有完整的阶段边界
+    trace_.ParseStart();
+    HttpRequest::PRECHECK check = HttpRequest::Precheck(readBuff_);
+    if(check == HttpRequest::NEED_HEADER || check == HttpRequest::NEED_BODY){
+        SetReadPhase_(check == HttpRequest::NEED_HEADER ? PHASE_HEADER : PHASE_BODY);
+        return false;
+    }
+    SetReadPhase_(PHASE_NONE);
+    if(check != HttpRequest::COMPLETE){
+        int code = check == HttpRequest::HEADER_TOO_LARGE ? 431 : check == HttpRequest::REQUEST_TOO_LARGE ? 413 : 400;
+        if(code == 400){
+            Metrics::Instance()->parseErrors.Add();
+            LOG_WARN("Client[%d] bad Content-length", fd_);
+        }else{
+            LOG_WARN("Client[%d] request too large, %d bytes buffered", fd_, (int)readBuff_.ReadableBytes());
+        }
+        readBuff_.RetrieveAll();
+        trace_.ParseEnd(0);
+        rejected_ = true;
+        response_.Init(srcDir, request_.path(), false, -1);
+        response_.SetError(code);
+        MakeResponse_();
+        return true;
     }
+    bool parsed = request_.parse(readBuff_);
+    trace_.ParseEnd(request_.VerifyTicks());
+    TWS_PROBE3(parse_done, fd_, parsed, request_.path().c_str());
     //解析成功
-    else if(request_.parse(readBuff_)){
+    if(parsed){
         LOG_DEBUG("%s", request_.path().c_str());
-        response_.Init(srcDir, request_.path(), request_.IsKeepAlive(), 200);
+        if(request_.VerifyPending()){
+            return false;//等数据库结果，由Resume继续
+        }
+        response_.Init(srcDir, request_.path(), request_.IsKeepAlive(), 200, request_.AcceptGzip());
+        if(metricsPath && request_.path() == metricsPath){
+            response_.SetBody(Metrics::Instance()->Render(), HttpResponse::METRICS_TYPE);
+        }
     }else{
-        response_.Init(srcDir,request_.path(),fasle,400);
+        Metrics::Instance()->parseErrors.Add();
+        response_.Init(srcDir,request_.path(),false,400);
     }
+    MakeResponse_();
+    return true;
+}
 
-    response_MakeResponse(writeBuff_);//生成响应报文放入writeBuff_中
-    //响应头
-    iov_[0].iov_base = const_cast<char*>(writeBuff_.Peek());
-    iov_[0].iov_len = writeBuff_.ReadableBytes();
-    iovCnt_ = 1;
-    //文件
-    if(response_.FileLen() > 0 && response_.File()){
-        iov_[1].iov_base = response_.File();
-        iov_[1].iov_len = reasponse_.Filelen();
-        iovCnt_ = 2;
-    }
+void HttpConn::Resume(bool verified){
+    trace_.Resume();
+    request_.FinishVerify(verified);
+    response_.Init(srcDir, request_.path(), request_.IsKeepAlive(), 200, request_.AcceptGzip());
+    MakeResponse_();
+}
+
+void HttpConn::MakeResponse_(){
+    //响应报文的各片段（状态行、响应头、文件）直接放入iov_
+    iovCnt_ = response_.MakeResponse(iov_);
+    trace_.Built();
+    TWS_PROBE3(response_built, fd_, response_.Code(), ToWriteBytes());
+    iovIdx_ = 0;
+    bytesWritten_ = 0;
+    writeStart_ = std::chrono::steady_clock::now();
+    //消息体足够大且是映射的文件/资源包时走零拷贝，其他消息体可能在完成通知前被释放
+    zcBody_.reset();
+    zcResponse_ = zcEnabled_ && response_.BodyPinnable() && iovCnt_ == HttpResponse::IOV_MAX_CNT
+               && iov_[iovCnt_ - 1].iov_len >= zeroCopyThreshold;
     LOG_DEBUG("filesize:%d, %d  to %d", response_.FileLen() , iovCnt_, ToWriteBytes());
-    return true;
-}
\ No newline at end of file
+}
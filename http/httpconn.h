@@ -6,9 +6,20 @@
 #include<arpa/inet.h> //sockaddr_in
 #include<stdlib.h> //atoi()
 #include<errno.h>
+#include<chrono>
+#include<deque>
+#include<memory>
+#include<mutex>
+#include<vector>
+#include<sys/socket.h>
 
 #include"../log/log.h"
+#include"../log/accesslog.h"
 #include"../buffer/buffer.h"
+#include"../metrics/metrics.h"
+#include"../trace/phasetrace.h"
+#include"../trace/capture.h"
+#include"../trace/probes.h"
 #include"httprequest.h"
 #include"httpresponse.h"
 /*
@@ -29,17 +40,111 @@ public:
     sockaddr_in GetAddr() const;
     bool process();
 
+    //登录/注册在等待AsyncSql的结果，这期间连接不在epoll中
+    bool IsWaitingDb() const{
+        return request_.VerifyPending();
+    }
+    void VerifyAsync(std::function<void(bool)> done) const{
+        request_.VerifyAsync(done);
+    }
+    void Resume(bool verified);//查询结果到达后生成响应
+    //事件循环把读/写任务交给线程池时调用，用于计算排队时间，同时把交出序号加一
+    void MarkDispatch(){
+        trace_.Dispatch();
+        dispatchSeq_.fetch_add(1, std::memory_order_acq_rel);
+    }
+    uint64_t DispatchSeq() const{
+        return dispatchSeq_.load(std::memory_order_acquire);
+    }
+    //工作线程重新注册epoll事件之后调用，seq是注册之前读到的DispatchSeq，之后不再访问连接
+    void MarkReturned(uint64_t seq);
+    //连接交给了工作线程还没交回(包括等待数据库)，事件循环不能关闭它
+    bool IsBusy() const{
+        return returnedSeq_.load(std::memory_order_acquire) != dispatchSeq_.load(std::memory_order_acquire);
+    }
+    //每次init加一，异步回调用它判断连接是否已经换成了别的客户端
+    uint64_t Generation() const{
+        return gen_;
+    }
+    bool IsClosed() const{
+        return isClose_;
+    }
+    //响应写完、交回事件循环等待下一个请求的长连接是空闲的，连接数接近上限时先关闭空闲最久的
+    //since为开始空闲的时刻(单调时钟毫秒)，0表示不空闲；只在事件循环中读写
+    void SetIdle(int64_t since){
+        idleSince_ = since;
+    }
+    int64_t IdleSince() const{
+        return idleSince_;
+    }
+    //RateLimiter::Acquire返回的表项编号，连接关闭时归还，-1表示没有
+    void SetLimitSlot(int slot){
+        limitSlot_ = slot;
+    }
+    int LimitSlot() const{
+        return limitSlot_;
+    }
+    //请求收了一部分时所处的阶段，事件循环据此设置请求头/消息体的截止时刻
+    enum READ_PHASE{
+        PHASE_NONE,//没有收了一半的请求
+        PHASE_HEADER,
+        PHASE_BODY,
+    };
+    int ReadPhase() const{
+        return readPhase_.load(std::memory_order_relaxed);
+    }
+    //进入当前阶段的时刻(单调时钟毫秒)：请求头阶段从请求的第一个字节算起，消息体阶段从请求头收完算起
+    int64_t PhaseStartMS() const{
+        return phaseStartMS_.load(std::memory_order_relaxed);
+    }
+    //没解析就回复了错误(431/413/400)的请求，客户端可能还在发送，响应写完后调用：
+    //关闭写方向、返回true，之后由事件循环读掉剩下的数据，等客户端关闭或者超时再Close
+    //直接close时接收缓冲里还有数据，内核会发RST，客户端可能收不到错误响应
+    bool Drain();
+    bool IsDraining() const{
+        return draining_;
+    }
+    //读缓冲中还有没处理完的请求数据
+    bool HasPendingInput() const{
+        return readBuff_.ReadableBytes() > 0;
+    }
+
     //写的总长度
-    int ToWriteBytes(){
-        return iov_[0].iov.len + iov_[1].iov_len;
+    size_t ToWriteBytes() const{
+        size_t bytes = 0;
+        for(int i = iovIdx_; i < iovCnt_; i++){
+            bytes += iov_[i].iov_len;
+        }
+        return bytes;
     }
 
     bool IsKeepAlive() const{
         return request_.IsKeepAlive();
     }
 
+    //当前响应的写出速率，字节/秒，用来决定大传输每轮写多少
+    double WriteThroughput() const;
+
+    //还有零拷贝发送没有收到内核的完成通知
+    bool HasZeroCopyPending() const{
+        return !zcHolds_.empty();
+    }
+    //读取错误队列中的零拷贝完成通知，释放已完成的映射
+    //返回false表示错误队列中有真正的套接字错误
+    bool ReapZeroCopy();
+    //Close时还有零拷贝发送没完成的套接字先shutdown，等完成通知读完(最多ZC_LINGER_MS)再close，
+    //这期间消息体的映射一直保留。事件循环每轮调用
+    static void ReapLingering();
+
     static bool isET;
+    static size_t writeQuantum;//每次写事件最多写出的字节数，0表示不限制
+    static size_t zeroCopyThreshold;//消息体不小于该值时用MSG_ZEROCOPY发送，0表示关闭
+    static std::atomic<uint64_t> zcSendCnt;//零拷贝sendmsg次数
+    static std::atomic<uint64_t> zcDoneCnt;//收到完成通知的次数
+    static std::atomic<uint64_t> zcCopiedCnt;//内核退回拷贝发送的次数
+    static std::atomic<uint64_t> zcNoBufsCnt;//ENOBUFS后改用普通发送的次数
     static const char* srcDir;
+    static const char* metricsPath;//请求该路径时返回指标，nullptr表示不提供
     static std::atomic<int> userCount;//原子操作，支持锁
 
 private:
@@ -47,12 +152,61 @@ private:
     struct  sockaddr_in addr_;
 
     bool isClose_;
+    std::atomic<uint64_t> gen_;//工作线程也会读
+    uint32_t connId_;//进程内唯一的连接编号，抓包记录用
+    bool capturing_;//这个连接的请求字节写入TrafficCapture
+    bool rejected_;//当前请求没有解析就回复了错误
+    bool draining_;
+    int64_t idleSince_;
+    std::atomic<uint64_t> dispatchSeq_;//事件循环交给工作线程的次数
+    std::atomic<uint64_t> returnedSeq_;//工作线程最近一次交回时的dispatchSeq_
+    int limitSlot_;
+    std::atomic<int> readPhase_;
+    std::atomic<int64_t> phaseStartMS_;
+    void SetReadPhase_(int phase);
+    static std::atomic<uint32_t> nextConnId_;
+
+    static const int WRITE_SLICE_US = 2000;//大传输每轮写出的目标时长
+    static const size_t MIN_TURN_BYTES = 16 * 1024;
+    size_t TurnBudget_() const;//本轮最多写出的字节数，0表示不限
+    void AdvanceIov_(size_t len);//已写出len字节，移动iov
+    void MakeResponse_();//根据request_生成响应并填好iov_
+    ssize_t SendZeroCopy_(size_t budget);//零拷贝发送消息体
+    void LogAccess_();//响应写完后记一条访问日志
 
     int iovCnt_;
-    struct iovec iov_[2];
+    int iovIdx_;//当前写到的iovec下标
+    struct iovec iov_[HttpResponse::IOV_MAX_CNT];//响应报文的各个片段
+
+    size_t bytesWritten_;//当前响应已写出的字节数
+    std::chrono::steady_clock::time_point writeStart_;//当前响应开始发送的时间
+    std::chrono::steady_clock::time_point reqStart_;//收到当前请求第一个字节的时间
+    PhaseTrace trace_;//当前请求各阶段的时间戳
+
+    //零拷贝发送过的消息体，在内核的完成通知到达前保持映射
+    struct ZeroCopyHold{
+        std::shared_ptr<const void> body;
+        uint32_t lastSeq;//该消息体最后一次sendmsg的序号
+    };
+    bool zcEnabled_;//套接字已开启SO_ZEROCOPY
+    bool zcResponse_;//当前响应的消息体走零拷贝
+    uint32_t zcSeq_;//下一次零拷贝sendmsg的序号，与内核的计数一致
+    std::shared_ptr<const void> zcBody_;
+    std::deque<ZeroCopyHold> zcHolds_;
+    static bool ReapZeroCopy_(int fd, std::deque<ZeroCopyHold>& holds);
+
+    //已经Close、还在等零拷贝完成通知的套接字
+    struct ZeroCopyLinger{
+        int fd;
+        std::deque<ZeroCopyHold> holds;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    static const int ZC_LINGER_MS = 30000;
+    static std::mutex lingerMtx_;
+    static std::vector<ZeroCopyLinger> lingering_;
+    static std::atomic<int> lingerCnt_;
 
     Buffer readBuff_;//读缓冲
-    Buffer writeBuff_; //写缓冲
 
     HttpRequest request_;
     HttpResponse response_;
@@ -0,0 +1,30 @@
+#include"httpdate.h"
+
+char HttpDate::lines_[2][LINE_LEN + 1];
+std::atomic<int> HttpDate::cur_(0);
+std::atomic<time_t> HttpDate::sec_(0);
+
+void HttpDate::Update(){
+    time_t now = time(nullptr);
+    //同一秒内不用重复格式化
+    if(now == sec_.load(std::memory_order_relaxed)){
+        return;
+    }
+    struct tm t;
+    gmtime_r(&now,&t);
+    int next = cur_.load(std::memory_order_relaxed) ^ 1;
+    strftime(lines_[next],sizeof(lines_[next]),"Date: %a, %d %b %Y %H:%M:%S GMT\r\n",&t);
+    //先写好内容再发布下标，读者看到新下标时内容已经完整
+    cur_.store(next,std::memory_order_release);
+    sec_.store(now,std::memory_order_relaxed);
+}
+
+size_t HttpDate::Copy(char* dst){
+    //还没有被定时器更新过时先格式化一次
+    if(sec_.load(std::memory_order_relaxed) == 0){
+        Update();
+    }
+    const char* line = lines_[cur_.load(std::memory_order_acquire)];
+    memcpy(dst,line,LINE_LEN);
+    return LINE_LEN;
+}
@@ -0,0 +1,27 @@
+//缓存的Date响应头
+//主循环每秒格式化一次，所有工作线程共享，生成响应时只需拷贝
+#ifndef HTTP_DATE_H
+#define HTTP_DATE_H
+
+#include<atomic>
+#include<time.h>
+#include<string.h>
+
+class HttpDate{
+public:
+    //"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" 共37字节
+    static const size_t LINE_LEN = 37;
+
+    //秒数变化时重新格式化，由主循环的定时器驱动
+    static void Update();
+    //拷贝当前的Date行到dst，dst至少LINE_LEN字节，返回拷贝的长度
+    static size_t Copy(char* dst);
+
+private:
+    //双缓冲：写者格式化到另一块，再切换下标，读者不用加锁
+    static char lines_[2][LINE_LEN + 1];
+    static std::atomic<int> cur_;
+    static std::atomic<time_t> sec_;
+};
+
+#endif
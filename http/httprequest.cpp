@@ -1,8 +1,11 @@
 #include "httprequest.h"
+#include<strings.h>
+#include<stdlib.h>
+#include<stdint.h>
 using namespace std;
 
 //放置请求信息到后端验证再上传
-const unorderd_set<string>HttpRequest::DEFAULT_HTML{
+const unordered_set<string>HttpRequest::DEFAULT_HTML{
     "/index", "/register", "/login", "/welcome", "/video", "/picture",
 };
 
@@ -11,12 +14,84 @@ const unordered_map<string,int>HttpRequest::DEFAULT_HTML_TAG{
     {"/login.html", 1}, {"/register.html", 0}
 };
 
+AuthBackend* HttpRequest::authBackend = nullptr;
+size_t HttpRequest::maxHeaderBytes = 0;
+size_t HttpRequest::maxRequestBytes = 0;
+
 //初始化操作
 void HttpRequest::Init(){
     state_ = REQUEST_LINE;//初始状态
-    method_ = path_ = version_ = body_ ="";
+    method_ = path_ = version_ = body_ = uri_ ="";
     header_.clear();
     post_.clear();
+    verifyPending_ = verifyLogin_ = false;
+    verifyTicks_ = 0;
+}
+
+HttpRequest::PRECHECK HttpRequest::Precheck(const Buffer& buff){
+    static const char CRLF2[] = "\r\n\r\n";
+    const char* begin = buff.Peek();
+    const char* end = buff.BeginWriteConst();
+    size_t readable = buff.ReadableBytes();
+    const char* headEnd = search(begin, end, CRLF2, CRLF2 + 4);
+    if(headEnd == end){
+        //请求头还没结束就已经超过上限，或者把整个请求的额度占满了
+        if((maxHeaderBytes > 0 && readable > maxHeaderBytes) ||
+           (maxRequestBytes > 0 && readable >= maxRequestBytes)){
+            return HEADER_TOO_LARGE;
+        }
+        return NEED_HEADER;
+    }
+    size_t headLen = headEnd + 4 - begin;
+    if(maxHeaderBytes > 0 && headLen > maxHeaderBytes){
+        return HEADER_TOO_LARGE;
+    }
+    size_t bodyLen = 0;
+    bool hasLen = false;
+    for(const char* line = begin; line < headEnd; ){
+        const char* eol = search(line, headEnd, CRLF2, CRLF2 + 2);
+        if(eol - line > 15 && strncasecmp(line, "Content-length:", 15) == 0){
+            size_t len;
+            if(!ParseLength_(line + 15, eol, &len) || (hasLen && len != bodyLen)){
+                return BAD_LENGTH;
+            }
+            bodyLen = len;
+            hasLen = true;
+        }
+        line = eol + 2;
+    }
+    //用减法比较，很大的Content-length和headLen相加会回绕
+    if(maxRequestBytes > 0 && (headLen > maxRequestBytes || bodyLen > maxRequestBytes - headLen)){
+        return REQUEST_TOO_LARGE;
+    }
+    return readable - headLen < bodyLen ? NEED_BODY : COMPLETE;
+}
+
+//Content-length的值：前后可以有空格/制表符，中间只能是十进制数字，超过size_t算错误
+//strtoull会接受负号(-1变成2^64-1)、前导空白以外的垃圾和溢出，这里不用它
+bool HttpRequest::ParseLength_(const char* begin, const char* end, size_t* len){
+    while(begin < end && (*begin == ' ' || *begin == '\t')){
+        begin++;
+    }
+    while(end > begin && (end[-1] == ' ' || end[-1] == '\t')){
+        end--;
+    }
+    if(begin == end){
+        return false;
+    }
+    size_t value = 0;
+    for(; begin < end; begin++){
+        if(*begin < '0' || *begin > '9'){
+            return false;
+        }
+        size_t digit = *begin - '0';
+        if(value > (SIZE_MAX - digit) / 10){
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+    *len = value;
+    return true;
 }
 
 //解析请求
@@ -61,12 +136,13 @@ bool HttpRequest::parse(Buffer& buff){
 }
 
 bool HttpRequest::ParseRequestLine_(const string& line){
-    regex patteh("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$");//正则表达式
+    regex patten("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$");//正则表达式
     smatch Match;//用于匹配patten得到结果
     // 在匹配规则中，以括号()的方式来划分组别 一共三个括号 [0]表示整体
     if(regex_match(line, Match, patten)) {  // 匹配指定字符串整体是否符合
         method_ = Match[1];
         path_ = Match[2];
+        uri_ = path_;
         version_ = Match[3];
         state_ = HEADERS;
         return true;
@@ -123,7 +199,16 @@ void HttpRequest::ParsePost_(){
             LOG_DEBUG("Tag:%d", tag);
             if(tag == 0 || tag == 1) {
                 bool isLogin = (tag == 1);  // 为1则是登录
-                if(UserVerify(post_["username"], post_["password"], isLogin)) {
+                if(!authBackend && AsyncSql::Instance()->IsOpen()) {
+                    //查询交给事件循环，结果到达后由FinishVerify设置页面
+                    verifyPending_ = true;
+                    verifyLogin_ = isLogin;
+                    return;
+                }
+                uint64_t start = PhaseTrace::enabled ? PhaseTrace::Now() : 0;
+                bool verified = UserVerify(post_["username"], post_["password"], isLogin);
+                verifyTicks_ = start ? PhaseTrace::Now() - start : 0;
+                if(verified) {
                     path_ = "/welcome.html";
                 } 
                 else {
@@ -153,9 +238,9 @@ void HttpRequest::ParseFromUrlenconded_(){
                 body_[i] = ' ';
                 break;
             case '%':
-                num = ConverHex(body[i+1])*16 + ConverHex(body_[i+2]);
-                body[i+2] = num% 10 + '0';
-                body[i+1] = num/ 10 + '0';
+                num = ConverHex(body_[i+1])*16 + ConverHex(body_[i+2]);
+                body_[i+2] = num% 10 + '0';
+                body_[i+1] = num/ 10 + '0';
                 i += 2 ;
                 break;
             case '&':
@@ -175,65 +260,183 @@ void HttpRequest::ParseFromUrlenconded_(){
     }
 }
 
+//先查凭据缓存，能确定结果时返回true并通过result带回
+//注册时缓存确认用户名不存在，insertOnly置为true，跳过查重的SELECT
+static bool VerifyFromCache(const string& name, const string& pwd, bool isLogin,
+                            bool* result, bool* insertOnly) {
+    *insertOnly = false;
+    CredCache::RESULT cached = CredCache::Instance()->Lookup(name, pwd);
+    if(cached == CredCache::MISS) {
+        return false;
+    }
+    if(isLogin) {
+        *result = cached == CredCache::MATCH;
+        if(!*result) { LOG_INFO("pwd error!"); }
+        return true;
+    }
+    if(cached == CredCache::ABSENT) {
+        *insertOnly = true;
+        return false;
+    }
+    LOG_INFO("user used!");
+    *result = false;
+    return true;
+}
+
+//组提交的注册结果：更新凭据缓存，返回注册是否成功
+static bool FinishRegister(const string& name, const string& pwd, int result) {
+    if(result == RegBatch::INSERTED) {
+        CredCache::Instance()->PutUser(name, pwd);//写穿
+        LOG_DEBUG("UserVerify success!!");
+        return true;
+    }
+    CredCache::Instance()->Invalidate(name);
+    if(result == RegBatch::DUPLICATE) {
+        LOG_INFO("user used!");
+    } else {
+        LOG_DEBUG("Insert error!");
+    }
+    return false;
+}
+
 bool HttpRequest::UserVerify(const string &name, const string &pwd, bool isLogin) {
     if(name == "" || pwd == "") { return false; }
-    LOG_INFO("Verify name:%s pwd:%s", name.c_str(), pwd.c_str());
-    MYSQL* sql;
-    SqlConnRAII(&sql, SqlConnPool::Instance());
-    assert(sql);
-    
-    bool flag = false;
-    unsigned int j = 0;
-    char order[256] = { 0 };
-    MYSQL_FIELD *fields = nullptr;
-    MYSQL_RES *res = nullptr;
-    
-    if(!isLogin) { flag = true; }
-    /* 查询用户及密码 */
-    snprintf(order, 256, "SELECT username, password FROM user WHERE username='%s' LIMIT 1", name.c_str());
-    LOG_DEBUG("%s", order);
-
-    if(mysql_query(sql, order)) { 
-        mysql_free_result(res);
-        return false; 
+    LOG_INFO("Verify name:%s", name.c_str());
+    if(authBackend) {
+        int ret = isLogin ? authBackend->Login(name, pwd) : authBackend->Register(name, pwd);
+        if(ret == AuthBackend::WRONG_PASSWORD || ret == AuthBackend::NO_USER) {
+            LOG_INFO("pwd error!");
+        } else if(ret == AuthBackend::USER_EXISTS) {
+            LOG_INFO("user used!");
+        }
+        return ret == AuthBackend::OK;
     }
-    res = mysql_store_result(sql);
-    j = mysql_num_fields(res);
-    fields = mysql_fetch_fields(res);
+    bool result, insertOnly;
+    if(VerifyFromCache(name, pwd, isLogin, &result, &insertOnly)) {
+        return result;
+    }
+    if(!isLogin && RegBatch::Instance()->Enabled()) {
+        /* 注册交给组提交，查重在批内的事务里完成 */
+        return FinishRegister(name, pwd, RegBatch::Instance()->Insert(name, pwd));
+    }
+    MYSQL* sql;
+    SqlConnRAII raii(&sql, SqlConnPool::Instance());
+    if(!sql) { return false; }
 
-    while(MYSQL_ROW row = mysql_fetch_row(res)) {
-        LOG_DEBUG("MYSQL ROW: %s %s", row[0], row[1]);
-        string password(row[1]);
-        /* 注册行为 且 用户名未被使用*/
+    if(!insertOnly) {
+        /* 查询用户及密码，语句在连接上只prepare一次，参数按类型绑定 */
+        uint64_t version = CredCache::Instance()->Version(name);
+        SqlStmt query(sql, "SELECT username, password FROM user WHERE username=? LIMIT 1");
+        if(!query.Exec(name)) {
+            return false;
+        }
+        bool found = query.Next();
+        if(found) {
+            CredCache::Instance()->FillUser(name, query.GetString(1), version);
+        } else {
+            CredCache::Instance()->FillAbsent(name, version);
+        }
         if(isLogin) {
-            if(pwd == password) { flag = true; }
-            else {
-                flag = false;
-                LOG_INFO("pwd error!");
+            if(found && pwd == query.GetString(1)) {
+                LOG_DEBUG("UserVerify success!!");
+                return true;
             }
-        } 
-        else { 
-            flag = false; 
+            LOG_INFO("pwd error!");
+            return false;
+        }
+        /* 注册行为 且 用户名已被使用 */
+        if(found) {
             LOG_INFO("user used!");
+            return false;
         }
     }
-    mysql_free_result(res);
+    LOG_DEBUG("regirster!");
+    SqlStmt insert(sql, "INSERT INTO user(username, password) VALUES(?, ?)");
+    if(!insert.Exec(name, pwd)) {
+        LOG_DEBUG("Insert error!");
+        CredCache::Instance()->Invalidate(name);
+        return false;
+    }
+    CredCache::Instance()->PutUser(name, pwd);//写穿
+    LOG_DEBUG("UserVerify success!!");
+    return true;
+}
 
-    /* 注册行为 且 用户名未被使用*/
-    if(!isLogin && flag == true) {
+//与UserVerify的逻辑相同：登录比较密码，注册时用户名未被使用才插入
+//参数由AsyncSql转义，回调在事件循环线程中执行
+void HttpRequest::UserVerifyAsync(const string& name, const string& pwd, bool isLogin,
+                                  std::function<void(bool)> done) {
+    if(name == "" || pwd == "") {
+        done(false);
+        return;
+    }
+    LOG_INFO("Verify name:%s (async)", name.c_str());
+    bool result, insertOnly;
+    if(VerifyFromCache(name, pwd, isLogin, &result, &insertOnly)) {
+        done(result);
+        return;
+    }
+    if(!isLogin && RegBatch::Instance()->Enabled()) {
+        //结果在批处理线程中得到，交回事件循环线程再回调
+        RegBatch::Instance()->Submit(name, pwd, [name, pwd, done](int ret) {
+            AsyncSql::Instance()->Post([name, pwd, done, ret]() {
+                done(FinishRegister(name, pwd, ret));
+            });
+        });
+        return;
+    }
+    auto insert = [name, pwd, done]() {
         LOG_DEBUG("regirster!");
-        bzero(order, 256);
-        snprintf(order, 256,"INSERT INTO user(username, password) VALUES('%s','%s')", name.c_str(), pwd.c_str());
-        LOG_DEBUG( "%s", order);
-        if(mysql_query(sql, order)) { 
-            LOG_DEBUG( "Insert error!");
-            flag = false; 
-        }
-        flag = true;
+        AsyncSql::Instance()->Query("INSERT INTO user(username, password) VALUES(?, ?)", {name, pwd},
+            [name, pwd, done](MYSQL_RES*, bool ok) {
+                if(ok) {
+                    CredCache::Instance()->PutUser(name, pwd);//写穿
+                } else {
+                    LOG_DEBUG("Insert error!");
+                    CredCache::Instance()->Invalidate(name);
+                }
+                done(ok);
+            });
+    };
+    if(insertOnly) {
+        insert();
+        return;
     }
-    // SqlConnPool::Instance()->FreeConn(sql);
-    LOG_DEBUG( "UserVerify success!!");
-    return flag;
+    uint64_t version = CredCache::Instance()->Version(name);
+    AsyncSql::Instance()->Query("SELECT username, password FROM user WHERE username=? LIMIT 1", {name},
+        [name, pwd, isLogin, done, insert, version](MYSQL_RES* res, bool ok) {
+            if(!ok) {
+                done(false);
+                return;
+            }
+            MYSQL_ROW row = res ? mysql_fetch_row(res) : nullptr;
+            if(row && row[1]) {
+                CredCache::Instance()->FillUser(name, row[1], version);
+            } else {
+                CredCache::Instance()->FillAbsent(name, version);
+            }
+            if(isLogin) {
+                bool flag = row && row[1] && pwd == row[1];
+                if(!flag) { LOG_INFO("pwd error!"); }
+                done(flag);
+                return;
+            }
+            if(row) {
+                LOG_INFO("user used!");
+                done(false);
+                return;
+            }
+            insert();
+        });
+}
+
+void HttpRequest::VerifyAsync(std::function<void(bool)> done) const {
+    UserVerifyAsync(GetPost("username"), GetPost("password"), verifyLogin_, done);
+}
+
+void HttpRequest::FinishVerify(bool ok) {
+    verifyPending_ = false;
+    path_ = ok ? "/welcome.html" : "/error.html";
 }
 
 std::string HttpRequest::path() const{
@@ -267,9 +470,22 @@ std::string HttpRequest::GetPost(const char* key) const {
     return "";
 }
 
+std::string HttpRequest::GetHeader(const std::string& key) const {
+    auto it = header_.find(key);
+    if(it != header_.end()) {
+        return it->second;
+    }
+    return "";
+}
+
 bool HttpRequest::IsKeepAlive() const {
     if(header_.count("Connection") == 1) {
         return header_.find("Connection")->second == "keep-alive" && version_ == "1.1";
     }
     return false;
-}
\ No newline at end of file
+}
+
+bool HttpRequest::AcceptGzip() const {
+    auto it = header_.find("Accept-Encoding");
+    return it != header_.end() && it->second.find("gzip") != std::string::npos;
+}
@@ -11,6 +11,11 @@
 #include"../buffer/buffer.h"
 #include"../log/log.h"
 #include"../pool/sqlconnpool.h"
+#include"../pool/asyncsql.h"
+#include"../pool/credcache.h"
+#include"../pool/regbatch.h"
+#include"../auth/authbackend.h"
+#include"../trace/phasetrace.h"
 
 class HttpRequest{
 public:
@@ -21,20 +26,48 @@ public:
         FINISH,
     };
 
+    //Precheck的结果
+    enum PRECHECK{
+        COMPLETE,//缓冲中已有完整的请求
+        NEED_HEADER,//请求头还没收完
+        NEED_BODY,//请求头收完，消息体还没收完
+        HEADER_TOO_LARGE,//请求行加请求头超过maxHeaderBytes，回复431
+        REQUEST_TOO_LARGE,//整个请求超过maxRequestBytes，回复413
+        BAD_LENGTH,//Content-length不是十进制数、溢出或者多个值不一致，回复400
+    };
+
     HttpRequest(){Init();}
     ~HttpRequest() = default;
 
     void Init();
+    //解析前检查缓冲中是否已经有一个完整的请求以及大小是否超限，不取走数据
+    //只找请求头结尾和Content-length，收全之后才交给parse
+    static PRECHECK Precheck(const Buffer& buff);
     bool parse(Buffer& buff);
 
     std::string path() const;
     std::string& path();
     std::string method() const;
     std::string version() const;
+    const std::string& uri() const {return uri_;}//请求行中的原始路径
+    std::string GetHeader(const std::string& key) const;
     std::string GetPost(const std::string& key) const;
     std::string GetPost(const char* key) const;
 
     bool IsKeepAlive() const;
+    bool AcceptGzip() const;//Accept-Encoding中是否包含gzip
+
+    //认证后端，为空时登录/注册查询MySQL
+    static AuthBackend* authBackend;
+    static size_t maxHeaderBytes;//请求行加请求头的最大字节数，0不限制
+    static size_t maxRequestBytes;//请求头加消息体的最大字节数，0不限制
+
+    //开启AsyncSql时登录/注册不在解析中查询数据库，而是挂起等待VerifyAsync的结果
+    bool VerifyPending() const {return verifyPending_;}
+    void VerifyAsync(std::function<void(bool)> done) const;
+    void FinishVerify(bool ok);//根据验证结果设置跳转的页面
+    //解析中同步登录/注册用掉的TSC周期，未开启请求跟踪时为0
+    uint64_t VerifyTicks() const {return verifyTicks_;}
 
 private:
     bool ParseRequestLine_(const std::string& line);//处理请求行
@@ -44,12 +77,19 @@ private:
     void ParsePath_();//处理请求路径
     void ParsePost_();//处理Post事件
     void ParseFromUrlenconded_();//从url解析编码
+    static bool ParseLength_(const char* begin, const char* end, size_t* len);//解析Content-length的值
 
     //用户验证
     static bool UserVerify(const std::string& name, const std::string& pwd, bool isLogin);
+    static void UserVerifyAsync(const std::string& name, const std::string& pwd, bool isLogin,
+                                std::function<void(bool)> done);
+
+    bool verifyPending_;
+    bool verifyLogin_;
+    uint64_t verifyTicks_;
 
-    PARSE_STAET state_;
-    std::string method_,path_,version_,body_;
+    PARSE_STATE state_;
+    std::string method_,path_,version_,body_,uri_;
     std::unordered_map<std::string,std::string> header_;
     std::unordered_map<std::string,std::string> post_;
 
@@ -2,33 +2,77 @@
 
 using namespace std;
 
-const unordered_map<string,string> HttpResponse::SUFFIX_TYPE = {
-    { ".html",  "text/html" },
-    { ".xml",   "text/xml" },
-    { ".xhtml", "application/xhtml+xml" },
-    { ".txt",   "text/plain" },
-    { ".rtf",   "application/rtf" },
-    { ".pdf",   "application/pdf" },
-    { ".word",  "application/nsword" },
-    { ".png",   "image/png" },
-    { ".gif",   "image/gif" },
-    { ".jpg",   "image/jpeg" },
-    { ".jpeg",  "image/jpeg" },
-    { ".au",    "audio/basic" },
-    { ".mpeg",  "video/mpeg" },
-    { ".mpg",   "video/mpeg" },
-    { ".avi",   "video/x-msvideo" },
-    { ".gz",    "application/x-gzip" },
-    { ".tar",   "application/x-tar" },
-    { ".css",   "text/css "},
-    { ".js",    "text/javascript "},
+//字面量连同长度一起保存，避免运行时strlen
+#define FRAGMENT(str) { str, sizeof(str) - 1 }
+
+const HttpResponse::SuffixType HttpResponse::SUFFIX_TYPE[] = {
+    { ".html",  FRAGMENT("Content-type: text/html\r\n") },
+    { ".xml",   FRAGMENT("Content-type: text/xml\r\n") },
+    { ".xhtml", FRAGMENT("Content-type: application/xhtml+xml\r\n") },
+    { ".txt",   FRAGMENT("Content-type: text/plain\r\n") },
+    { ".rtf",   FRAGMENT("Content-type: application/rtf\r\n") },
+    { ".pdf",   FRAGMENT("Content-type: application/pdf\r\n") },
+    { ".word",  FRAGMENT("Content-type: application/nsword\r\n") },
+    { ".png",   FRAGMENT("Content-type: image/png\r\n") },
+    { ".gif",   FRAGMENT("Content-type: image/gif\r\n") },
+    { ".jpg",   FRAGMENT("Content-type: image/jpeg\r\n") },
+    { ".jpeg",  FRAGMENT("Content-type: image/jpeg\r\n") },
+    { ".au",    FRAGMENT("Content-type: audio/basic\r\n") },
+    { ".mpeg",  FRAGMENT("Content-type: video/mpeg\r\n") },
+    { ".mpg",   FRAGMENT("Content-type: video/mpeg\r\n") },
+    { ".avi",   FRAGMENT("Content-type: video/x-msvideo\r\n") },
+    { ".gz",    FRAGMENT("Content-type: application/x-gzip\r\n") },
+    { ".tar",   FRAGMENT("Content-type: application/x-tar\r\n") },
+    { ".css",   FRAGMENT("Content-type: text/css\r\n") },
+    { ".js",    FRAGMENT("Content-type: text/javascript\r\n") },
+    { nullptr,  { nullptr, 0 } },
+};
+
+const HttpResponse::Fragment HttpResponse::DEFAULT_TYPE = FRAGMENT("Content-type: text/plain\r\n");
+const HttpResponse::Fragment HttpResponse::METRICS_TYPE =
+    FRAGMENT("Content-type: text/plain; version=0.0.4\r\n");
+
+const HttpResponse::StatusLine HttpResponse::STATUS_LINE[] = {
+    { 200, FRAGMENT("HTTP/1.1 200 OK\r\n") },
+    { 400, FRAGMENT("HTTP/1.1 400 Bad Request\r\n") },
+    { 403, FRAGMENT("HTTP/1.1 403 Forbidden\r\n") },
+    { 404, FRAGMENT("HTTP/1.1 404 Not Found\r\n") },
+    { 408, FRAGMENT("HTTP/1.1 408 Request Timeout\r\n") },
+    { 413, FRAGMENT("HTTP/1.1 413 Payload Too Large\r\n") },
+    { 431, FRAGMENT("HTTP/1.1 431 Request Header Fields Too Large\r\n") },
+    { -1,  { nullptr, 0 } },
 };
 
+const HttpResponse::Fragment HttpResponse::KEEP_ALIVE_HEADER =
+    FRAGMENT("Connection: keep-alive\r\nkeep-alive: max=6, timeout=120\r\n");
+const HttpResponse::Fragment HttpResponse::CLOSE_HEADER = FRAGMENT("Connection: close\r\n");
+
 const unordered_map<int,string> HttpResponse::CODE_STATUS = {
     { 200, "OK" },
     { 400, "Bad Request" },
     { 403, "Forbidden" },
     { 404, "Not Found" },
+    { 408, "Request Timeout" },
+    { 413, "Payload Too Large" },
+    { 431, "Request Header Fields Too Large" },
+};
+
+//ErrorContent的消息体，每个状态码启动时生成一次，不在请求里拼接字符串
+const unordered_map<int,string> HttpResponse::ERROR_BODY = []{
+    unordered_map<int,string> bodies;
+    for(const auto& it : CODE_STATUS){
+        bodies[it.first] = "<html><title>Error</title><body bgcolor=\"ffffff\">" +
+                           to_string(it.first) + " : " + it.second + "\n" +
+                           "<p>File NotFound!</p><hr><em>TinyWebServer</em></body></html>";
+    }
+    return bodies;
+}();
+
+const AssetBundle* HttpResponse::bundle = nullptr;
+
+//登录/注册后跳转的页面，内容固定且请求频繁
+const unordered_set<string> HttpResponse::CACHE_PATH = {
+    "/welcome.html", "/error.html",
 };
 
 const unordered_map<int,string> HttpResponse::CODE_PATH = {
@@ -41,26 +85,87 @@ HttpResponse::HttpResponse(){
     code_ = -1;
     path_ = srcDir_ = "";
     isKeepAlive_ = false;
+    acceptGzip_ = false;
     mmFile_ = nullptr;
     mmFileStat_ = {0};
+    lenLineLen_ = 0;
+    errBody_ = {nullptr, 0};
+    bodyType_ = nullptr;
+    hasBody_ = false;
+    pinnable_ = false;
 };
 
 HttpResponse::~HttpResponse(){
     UnmapFile();
 }
 
-void HttpResponse::Init(const string& srcDir, string& path,bool isKeepAlive,int code){
+void HttpResponse::Init(const string& srcDir, string& path,bool isKeepAlive,int code,bool acceptGzip){
     assert(srcDir != "");
     if(mmFile_){UnmapFile();}
     code_ = code;
     isKeepAlive_ = isKeepAlive;
+    acceptGzip_ = acceptGzip;
     path_ = path;
-    srcDir_ = srcDir_;
+    srcDir_ = srcDir;
     mmFile_ = nullptr;
     mmFileStat_ = {0};
+    errBody_ = {nullptr, 0};
+    cached_.reset();
+    lenLineLen_ = 0;
+    body_.clear();
+    bodyType_ = nullptr;
+    hasBody_ = false;
+    pinnable_ = false;
+}
+
+void HttpResponse::SetBody(string body, const Fragment& type){
+    body_ = move(body);
+    bodyType_ = &type;
+    hasBody_ = true;
+}
+
+//消息体是状态码和描述的纯文本
+static string ErrorText(int code, const string& status){
+    return to_string(code) + " " + status + "\n";
+}
+
+void HttpResponse::SetError(int code){
+    assert(CODE_STATUS.count(code));
+    code_ = code;
+    isKeepAlive_ = false;
+    SetBody(ErrorText(code, CODE_STATUS.find(code)->second), DEFAULT_TYPE);
+}
+
+string HttpResponse::CloseResponse(int code){
+    assert(CODE_STATUS.count(code));
+    const string& status = CODE_STATUS.find(code)->second;
+    string body = ErrorText(code, status);
+    return "HTTP/1.1 " + to_string(code) + " " + status + "\r\n" +
+           string(DEFAULT_TYPE.data, DEFAULT_TYPE.len) +
+           "Content-length: " + to_string(body.size()) + "\r\n" +
+           string(CLOSE_HEADER.data, CLOSE_HEADER.len) + "\r\n" + body;
 }
 
-void HttpResponse::MakeResponse(Buffer& buff){
+int HttpResponse::MakeResponse(struct iovec* iov){
+    if(hasBody_){
+        if(code_ == -1){
+            code_ = 200;
+        }
+        SetContentLength_(body_.size());
+        return AssembleIov_(iov, StateLine_(), *bodyType_, body_.data(), body_.size());
+    }
+    if(bundle){
+        return MakeBundleResponse_(iov);
+    }
+    ResponseCache* cache = ResponseCache::Instance();
+    //固定页面先查缓存，命中时连stat都不用做
+    if(cache->Enabled() && (code_ == -1 || code_ == 200) && CACHE_PATH.count(path_)){
+        code_ = 200;
+        ResponseCache::Entry resp = cache->Get(CacheKey_());
+        if(resp){
+            return ServeCached_(iov, resp);
+        }
+    }
     /*判断请求的资源文件*/
     if(stat((srcDir_ + path_).data(),&mmFileStat_) < 0|| S_ISDIR(mmFileStat_.st_mode)){
         code_ = 404;
@@ -68,13 +173,133 @@ void HttpResponse::MakeResponse(Buffer& buff){
     else if(!(mmFileStat_.st_mode & S_IROTH)){
         code_ = 403;
     }
-    else if(code == -1){
+    else if(code_ == -1){
         code_ = 200;
     }
     ErrorHtml_();
-    AddStateLine_(buff);
-    AddHeader_(buff);
-    AddContent_(buff);
+    const Fragment& state = StateLine_();//未知状态码在这里归为400
+    bool cacheable = cache->Enabled() && (code_ != 200 || CACHE_PATH.count(path_));
+    if(cacheable && code_ != 200){
+        //错误页面按状态码缓存，不用再打开文件或拼接错误信息
+        ResponseCache::Entry resp = cache->Get(CacheKey_());
+        if(resp){
+            return ServeCached_(iov, resp);
+        }
+    }
+    AddContent_();
+    //消息体：映射的文件或错误页面
+    int cnt;
+    if(mmFile_ && FileLen() > 0){
+        cnt = AssembleIov_(iov, state, GetFileType_(), mmFile_, FileLen());
+        pinnable_ = true;
+    }else{
+        cnt = AssembleIov_(iov, state, GetFileType_(), errBody_.data, errBody_.len);
+    }
+    if(cacheable){
+        cnt = StoreCached_(iov, cnt);
+    }
+    return cnt;
+}
+
+//缓存的key：状态码、连接方式、是否接受gzip和路径
+string HttpResponse::CacheKey_() const{
+    string key = to_string(code_);
+    key += isKeepAlive_ ? "|k|" : "|c|";
+    key += acceptGzip_ ? "g|" : "-|";
+    key += path_;
+    return key;
+}
+
+//缓存的报文分成Date行前后两段，中间放当前的Date行
+int HttpResponse::ServeCached_(struct iovec* iov, const ResponseCache::Entry& resp){
+    cached_ = resp;
+    pinnable_ = false;
+    const char* data = cached_->data.data();
+    iov[0].iov_base = const_cast<char*>(data);
+    iov[0].iov_len = cached_->dateAt;
+    iov[1].iov_base = dateLine_;
+    iov[1].iov_len = HttpDate::Copy(dateLine_);
+    iov[2].iov_base = const_cast<char*>(data + cached_->dateAt);
+    iov[2].iov_len = cached_->data.size() - cached_->dateAt;
+    return 3;
+}
+
+//把刚生成的各片段除Date行外拼成报文放入缓存，之后同样从缓存发送
+int HttpResponse::StoreCached_(struct iovec* iov, int cnt){
+    assert(cnt > DATE_IOV && iov[DATE_IOV].iov_base == dateLine_);
+    size_t total = 0;
+    for(int i = 0; i < cnt; i++){
+        if(i != DATE_IOV){
+            total += iov[i].iov_len;
+        }
+    }
+    if(total > ResponseCache::MAX_ENTRY_SIZE){
+        return cnt;
+    }
+    std::shared_ptr<ResponseCache::Response> resp = std::make_shared<ResponseCache::Response>();
+    resp->data.reserve(total);
+    for(int i = 0; i < cnt; i++){
+        if(i == DATE_IOV){
+            resp->dateAt = resp->data.size();
+        }else{
+            resp->data.append((const char*)iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    ResponseCache::Instance()->Put(CacheKey_(), resp);
+    UnmapFile();
+    errBody_ = {nullptr, 0};
+    return ServeCached_(iov, resp);
+}
+
+//资源包模式：查找只访问映射的内存，响应头和消息体都直接指向资源包
+int HttpResponse::MakeBundleResponse_(struct iovec* iov){
+    AssetBundle::Asset asset;
+    bool found = bundle->Find(path_, acceptGzip_, &asset);
+    if(!found){
+        code_ = 404;
+    }else if(code_ == -1){
+        code_ = 200;
+    }
+    if(CODE_PATH.count(code_) == 1){
+        path_ = CODE_PATH.find(code_)->second;
+        found = bundle->Find(path_, acceptGzip_, &asset);
+    }
+    const Fragment& state = StateLine_();
+    if(!found){
+        ErrorContent();
+        return AssembleIov_(iov, state, GetFileType_(), errBody_.data, errBody_.len);
+    }
+    SetContentLength_(asset.dataLen);
+    Fragment type = { asset.header, asset.headerLen };
+    pinnable_ = true;//资源包在服务器退出前一直映射
+    return AssembleIov_(iov, state, type, asset.data, asset.dataLen);
+}
+
+//各片段按顺序排列，writev一次写出，不再拷贝到写缓冲区
+int HttpResponse::AssembleIov_(struct iovec* iov, const Fragment& state, const Fragment& type,
+                               const char* body, size_t bodyLen){
+    const Fragment& header = Header_();
+    int cnt = 0;
+    iov[cnt].iov_base = const_cast<char*>(state.data);
+    iov[cnt++].iov_len = state.len;
+    iov[cnt].iov_base = const_cast<char*>(header.data);
+    iov[cnt++].iov_len = header.len;
+    iov[cnt].iov_base = const_cast<char*>(type.data);
+    iov[cnt++].iov_len = type.len;
+    iov[cnt].iov_base = dateLine_;
+    iov[cnt++].iov_len = HttpDate::Copy(dateLine_);
+    iov[cnt].iov_base = lenLine_;
+    iov[cnt++].iov_len = lenLineLen_;
+    if(body && bodyLen > 0){
+        iov[cnt].iov_base = const_cast<char*>(body);
+        iov[cnt++].iov_len = bodyLen;
+    }
+    assert(cnt <= IOV_MAX_CNT);
+    return cnt;
+}
+
+void HttpResponse::SetContentLength_(size_t len){
+    lenLineLen_ = snprintf(lenLine_, sizeof(lenLine_), "Content-length: %zu\r\n\r\n", len);
 }
 
 char* HttpResponse::File(){
@@ -87,51 +312,54 @@ size_t HttpResponse::FileLen() const{
 
 void HttpResponse::ErrorHtml_(){
     if(CODE_PATH.count(code_)==1){
-        path_ = CODE_PATH.fide(code_)->second;
+        path_ = CODE_PATH.find(code_)->second;
         stat((srcDir_ + path_).data(),&mmFileStat_);
     }
 }
 
-void HttpResponse::AddStateLine_(Buffer& buff) {
-    string status;
-    if(CODE_STATUS.count(code_) == 1) {
-        status = CODE_STATUS.find(code_)->second;
-    }
-    else {
-        code_ = 400;
-        status = CODE_STATUS.find(400)->second;
+const HttpResponse::Fragment& HttpResponse::StateLine_() {
+    for(const StatusLine* it = STATUS_LINE; it->code != -1; it++){
+        if(it->code == code_){
+            return it->line;
+        }
     }
-    buff.Append("HTTP/1.1 " + to_string(code_) + " " + status + "\r\n");
+    code_ = 400;
+    return StateLine_();
 }
 
-void HttpResponse::AddHeader_(Buffer& buff) {
-    buff.Append("Connection: ");
-    if(isKeepAlive_) {
-        buff.Append("keep-alive\r\n");
-        buff.Append("keep-alive: max=6, timeout=120\r\n");
-    } else{
-        buff.Append("close\r\n");
-    }
-    buff.Append("Content-type: " + GetFileType_() + "\r\n");
+const HttpResponse::Fragment& HttpResponse::Header_() const {
+    return isKeepAlive_ ? KEEP_ALIVE_HEADER : CLOSE_HEADER;
 }
 
-void HttpResponse::AddContent_(Buffer& buff) {
+void HttpResponse::AddContent_() {
     int srcFd = open((srcDir_ + path_).data(), O_RDONLY);
     if(srcFd < 0) { 
-        ErrorContent(buff, "File NotFound!");
+        ErrorContent();
         return; 
     }
 
     //将文件映射到内存提高文件的访问速度  MAP_PRIVATE 建立一个写入时拷贝的私有映射
     LOG_DEBUG("file path %s", (srcDir_ + path_).data());
-    int* mmRet = (int*)mmap(0, mmFileStat_.st_size, PROT_READ, MAP_PRIVATE, srcFd, 0);
-    if(*mmRet == -1) {
-        ErrorContent(buff, "File NotFound!");
+    void* mmRet = mmap(0, mmFileStat_.st_size, PROT_READ, MAP_PRIVATE, srcFd, 0);
+    close(srcFd);
+    if(mmRet == MAP_FAILED) {
+        ErrorContent();
         return; 
     }
     mmFile_ = (char*)mmRet;
-    close(srcFd);
-    buff.Append("Content-length: " + to_string(mmFileStat_.st_size) + "\r\n\r\n");
+    SetContentLength_(mmFileStat_.st_size);
+}
+
+std::shared_ptr<const void> HttpResponse::PinFile(){
+    if(!mmFile_){
+        return nullptr;
+    }
+    size_t len = mmFileStat_.st_size;
+    std::shared_ptr<const void> pin(mmFile_, [len](const void* addr){
+        munmap(const_cast<void*>(addr), len);
+    });
+    mmFile_ = nullptr;//之后由pin负责释放
+    return pin;
 }
 
 void HttpResponse::UnmapFile(){
@@ -141,34 +369,27 @@ void HttpResponse::UnmapFile(){
     }
 }
 
-//判断文件类型
-string HttpResponse::GetFileType_(){
-    string::size_type idx = path_.find_lastof('.');
+//判断文件类型，直接在path_上比较后缀，不产生临时字符串
+const HttpResponse::Fragment& HttpResponse::GetFileType_() const{
+    string::size_type idx = path_.find_last_of('.');
     //最大值find函数找不到指定值的情况下会返回stirng::npos
     if(idx == string::npos){
-        return"text/plian";
+        return DEFAULT_TYPE;
     }
-    string suffix = path_.substr(idx);
-    if(SUFFIX_TYPE.count(suffix)==1){
-        return SUFFIX_TYPE.find(suffix)->second;
+    for(const SuffixType* it = SUFFIX_TYPE; it->suffix; it++){
+        if(path_.compare(idx, string::npos, it->suffix) == 0){
+            return it->line;
+        }
     }
-    return "text/plain";
+    return DEFAULT_TYPE;
 }
 
-void HttpResponse::ErrorContent(BUffer& buff,string message){
-    string body;
-    string status;
-    body += "<html><title>Error</title>";
-    body += "<body bgcolor=\"ffffff\">";
-    if(CODE_STATUS.count(code_)==1){
-        status = CODE_STATUS.find(code_)->second;
-    }else{
-        status = "Bad Request";
+void HttpResponse::ErrorContent(){
+    auto it = ERROR_BODY.find(code_);
+    if(it == ERROR_BODY.end()){
+        it = ERROR_BODY.find(400);//状态行已经把未知状态码归为400，这里只是兜底
     }
-    body += to_string(code_) + " : " + status  + "\n";
-    body += "<p>" + message + "</p>";
-    body += "<hr><em>TinyWebServer</em></body></html>";
-
-    buff.Append("Content-length: " + to_string(body.size()) + "\r\n\r\n");
-    buff.Append(body);
-}
\ No newline at end of file
+    errBody_ = {it->second.data(), it->second.size()};
+    mmFileStat_.st_size = 0;
+    SetContentLength_(errBody_.len);
+}
@@ -2,37 +2,79 @@
 #define HTTP_RESPONSE_H
 
 #include<unordered_map>
+#include<unordered_set>
 #include<fcntl.h>//open
 #include<unistd.h>//close
 #include<sys/stat.h>//stat
 #include<sys/mman.h>//mmap,mumap
+#include<sys/uio.h>//iovec
+#include<memory>
 
 #include"../buffer/buffer.h"
 #include"../log/log.h"
+#include"httpdate.h"
+#include"../bundle/assetbundle.h"
+#include"responsecache.h"
 
 class HttpResponse{
 public:
+    //响应报文的片段数：状态行、Connection、Content-type、Date、Content-length、消息体
+    static const int IOV_MAX_CNT = 6;
+    static const int DATE_IOV = 3;//Date行所在的片段
+
     HttpResponse();
     ~HttpResponse();
 
-    void Init(const std::string& srcDir, std::string& path, bool isKeepAlive = false,int code = -1);
-    void MakeResponse(Buffer& buff);
+    void Init(const std::string& srcDir, std::string& path, bool isKeepAlive = false,int code = -1,
+              bool acceptGzip = false);
+    //生成响应报文，各片段直接填入iov，返回使用的iovec个数
+    int MakeResponse(struct iovec* iov);
     void UnmapFile();
+    //把映射文件的所有权交给返回值，最后一个持有者释放时才munmap
+    //零拷贝发送期间内核还在引用这些页，用它来保证映射不被提前释放
+    std::shared_ptr<const void> PinFile();
+    //消息体是映射的文件或资源包时为true：只有这两种内存能在零拷贝发送完成前保持有效，
+    //SetBody的字符串、错误页面和缓存的报文可能在通知到达前被释放或复用
+    bool BodyPinnable() const {return pinnable_;}
     char* File();
     size_t FileLen() const;
-    void ErrorContent(Buffer& buff,std::string message);
+    void ErrorContent();//文件打不开时的错误页面，消息体按状态码预先生成
     int Code() const {return code_;}
 
+    //不为空时从资源包中取文件，不再访问srcDir
+    static const AssetBundle* bundle;
+
+    //预先生成好的报文片段
+    struct Fragment{
+        const char* data;
+        size_t len;
+    };
+    //不读文件，直接以body作为消息体(状态码取Init的code，未指定时为200)，在Init之后、MakeResponse之前调用
+    void SetBody(std::string body, const Fragment& type);
+    //不读文件的错误响应(408/413/431等)，消息体是状态码和描述，发完后关闭连接
+    void SetError(int code);
+    //同样内容的完整报文，给不经过HttpConn发送的地方(比如事件循环里的超时)预先生成
+    static std::string CloseResponse(int code);
+    static const Fragment METRICS_TYPE;//Prometheus文本格式
+
 private:
-    void AddStateLine_(Buffer& buff);
-    void AddHeader_(Buffer& buff);
-    void AddContent_(Buffer& buff);
+    int MakeBundleResponse_(struct iovec* iov);
+    int AssembleIov_(struct iovec* iov, const Fragment& state, const Fragment& type,
+                     const char* body, size_t bodyLen);
+    void SetContentLength_(size_t len);
+    std::string CacheKey_() const;
+    int ServeCached_(struct iovec* iov, const ResponseCache::Entry& resp);
+    int StoreCached_(struct iovec* iov, int cnt);
+    const Fragment& StateLine_();
+    const Fragment& Header_() const;
+    void AddContent_();
 
     void ErrorHtml_();
-    std::string GetFileType_();
+    const Fragment& GetFileType_() const;
 
     int code_;
     bool isKeepAlive_;
+    bool acceptGzip_;
 
     std::string path_;
     std::string srcDir_;
@@ -40,9 +82,34 @@ private:
     char* mmFile_;
     struct stat mmFileStat_;
 
-    static const std::unordered_map<std::string, std::string> SUFFIX_TYPE;//后缀类型
+    Fragment errBody_;//错误页面的消息体，指向ERROR_BODY
+    std::string body_;//SetBody设置的消息体
+    const Fragment* bodyType_;
+    bool hasBody_;
+    bool pinnable_;//消息体可以交给零拷贝发送
+    ResponseCache::Entry cached_;//正在发送的缓存响应，发送期间保持引用
+    char dateLine_[HttpDate::LINE_LEN];
+    char lenLine_[48];//Content-length行和空行
+    size_t lenLineLen_;
+
+    struct StatusLine{
+        int code;
+        Fragment line;
+    };
+    struct SuffixType{
+        const char* suffix;
+        Fragment line;
+    };
+
+    static const SuffixType SUFFIX_TYPE[];//后缀类型及对应的Content-type行
+    static const Fragment DEFAULT_TYPE;
+    static const StatusLine STATUS_LINE[];//状态码及对应的状态行
+    static const Fragment KEEP_ALIVE_HEADER;
+    static const Fragment CLOSE_HEADER;
     static const std::unordered_map<int, std::string> CODE_STATUS;//编码类型
-    static const std::unordered_map<int, std::string> CODE_PATH;//编码路径    
+    static const std::unordered_map<int, std::string> CODE_PATH;//编码路径
+    static const std::unordered_map<int, std::string> ERROR_BODY;//各状态码的错误页面
+    static const std::unordered_set<std::string> CACHE_PATH;//可以缓存整个响应的页面
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,69 @@
+#include"responsecache.h"
+
+ResponseCache::ResponseCache():ttlMS_(1000),hits_(0),misses_(0){}
+
+ResponseCache* ResponseCache::Instance(){
+    static ResponseCache cache;
+    return &cache;
+}
+
+ResponseCache::Shard& ResponseCache::GetShard_(const std::string& key){
+    return shards_[std::hash<std::string>()(key) % SHARD_NUM];
+}
+
+ResponseCache::Entry ResponseCache::Get(const std::string& key){
+    Shard& shard = GetShard_(key);
+    {
+        std::lock_guard<std::mutex> locker(shard.mtx);
+        auto it = shard.map.find(key);
+        if(it != shard.map.end()){
+            if(it->second.expires > Clock::now()){
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return it->second.resp;
+            }
+            shard.map.erase(it);//过期
+        }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+void ResponseCache::Put(const std::string& key, const Entry& resp){
+    int ttl = ttlMS_.load(std::memory_order_relaxed);
+    if(ttl <= 0 || !resp || resp->data.size() > MAX_ENTRY_SIZE){
+        return;
+    }
+    Clock::time_point now = Clock::now();
+    Shard& shard = GetShard_(key);
+    std::lock_guard<std::mutex> locker(shard.mtx);
+    //段满了先清理过期的，仍然满就随便淘汰一个
+    if(shard.map.size() >= SHARD_CAPACITY && shard.map.count(key) == 0){
+        for(auto it = shard.map.begin(); it != shard.map.end();){
+            if(it->second.expires <= now){
+                it = shard.map.erase(it);
+            }else{
+                ++it;
+            }
+        }
+        if(shard.map.size() >= SHARD_CAPACITY){
+            shard.map.erase(shard.map.begin());
+        }
+    }
+    Node& node = shard.map[key];
+    node.resp = resp;
+    node.expires = now + std::chrono::milliseconds(ttl);
+}
+
+void ResponseCache::Clear(){
+    for(int i = 0; i < SHARD_NUM; i++){
+        std::lock_guard<std::mutex> locker(shards_[i].mtx);
+        shards_[i].map.clear();
+    }
+}
+
+void ResponseCache::SetTtl(int ttlMS){
+    ttlMS_.store(ttlMS, std::memory_order_relaxed);
+    if(ttlMS <= 0){
+        Clear();
+    }
+}
@@ -0,0 +1,66 @@
+//小型响应缓存
+//缓存完整的响应报文（响应头+消息体），key由状态码、连接方式和路径组成，
+//只用于登录后的welcome/error页面和错误页面这类小而频繁的响应，过期时间很短
+//报文里不含Date行，发送时在dateAt处插入当前的Date
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include<string>
+#include<memory>
+#include<mutex>
+#include<atomic>
+#include<chrono>
+#include<unordered_map>
+
+class ResponseCache{
+public:
+    struct Response{
+        std::string data;//去掉Date行的报文
+        size_t dateAt;//Date行在报文中的位置
+    };
+    typedef std::shared_ptr<const Response> Entry;
+
+    static ResponseCache* Instance();
+
+    //未命中返回空指针
+    Entry Get(const std::string& key);
+    void Put(const std::string& key, const Entry& resp);
+    void Clear();
+
+    //ttlMS为0时关闭缓存
+    void SetTtl(int ttlMS);
+    bool Enabled() const {return ttlMS_.load(std::memory_order_relaxed) > 0;}
+
+    uint64_t Hits() const {return hits_.load(std::memory_order_relaxed);}
+    uint64_t Misses() const {return misses_.load(std::memory_order_relaxed);}
+
+    static const size_t MAX_ENTRY_SIZE = 64 * 1024;//超过这个大小的响应不缓存
+
+private:
+    ResponseCache();
+    ~ResponseCache() = default;
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Node{
+        Entry resp;
+        Clock::time_point expires;
+    };
+    //分段加锁，不同key落在不同的段上互不影响
+    struct Shard{
+        std::mutex mtx;
+        std::unordered_map<std::string, Node> map;
+    };
+
+    static const int SHARD_NUM = 16;
+    static const size_t SHARD_CAPACITY = 64;
+
+    Shard& GetShard_(const std::string& key);
+
+    Shard shards_[SHARD_NUM];
+    std::atomic<int> ttlMS_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+};
+
+#endif
@@ -0,0 +1,315 @@
+#include"accesslog.h"
+#include<fcntl.h>
+#include<unistd.h>
+#include<stdio.h>
+#include<string.h>
+#include<sys/stat.h>
+#include<zlib.h>
+
+AccessLog::AccessLog(){
+    format_ = COMBINED;
+    maxBytes_ = 0;
+    rotateSec_ = 0;
+    gzip_ = false;
+    isOpen_ = false;
+    fd_ = -1;
+    fileSize_ = 0;
+    nextRotate_ = 0;
+    dropped_ = 0;
+    isRunning_ = false;
+}
+
+AccessLog::~AccessLog(){
+    Close();
+}
+
+AccessLog* AccessLog::Instance(){
+    static AccessLog log;
+    return &log;
+}
+
+bool AccessLog::init(const char* path, int format, size_t maxBytes,
+                     int rotateSec, bool gzip, int maxQueueCapacity){
+    assert(path && maxQueueCapacity > 0);
+    Close();
+    path_ = path;
+    format_ = format;
+    maxBytes_ = maxBytes;
+    rotateSec_ = rotateSec;
+    gzip_ = gzip;
+    OpenFile_();
+    if(fd_ < 0){
+        return false;
+    }
+    queue_.reset(new LockFreeQueue<std::string>(maxQueueCapacity));
+    isRunning_ = true;
+    writeThread_.reset(new std::thread(&AccessLog::AsyncWrite_, this));
+    if(gzip_){
+        gzipQueue_.reset(new LockFreeQueue<std::string>(64));
+        gzipThread_.reset(new std::thread(&AccessLog::GzipWorker_, this));
+    }
+    isOpen_ = true;
+    return true;
+}
+
+//先让写线程把队列写完再退出
+void AccessLog::Close(){
+    if(!isOpen_){
+        return;
+    }
+    isOpen_ = false;
+    isRunning_ = false;
+    if(writeThread_ && writeThread_->joinable()){
+        queue_->flush();
+        writeThread_->join();
+    }
+    if(gzipThread_ && gzipThread_->joinable()){
+        gzipQueue_->flush();
+        gzipThread_->join();
+    }
+    if(fd_ >= 0){
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+void AccessLog::write(const AccessRecord& record){
+    if(!isOpen_){
+        return;
+    }
+    std::string line;
+    line.reserve(256);
+    if(format_ == JSON){
+        FormatJson_(record, &line);
+    }else{
+        FormatCommon_(record, format_ == COMBINED, &line);
+    }
+    //队列满时丢弃，请求线程不为访问日志等待
+    if(!queue_->try_push(std::move(line))){
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+//时间字段每个线程每秒只格式化一次
+static const char* CachedTime(bool iso){
+    thread_local time_t cachedSec[2] = {0, 0};
+    thread_local char cached[2][40];
+    time_t now = time(nullptr);
+    int idx = iso ? 1 : 0;
+    if(now != cachedSec[idx]){
+        struct tm t;
+        localtime_r(&now, &t);
+        strftime(cached[idx], sizeof(cached[idx]), iso ? "%Y-%m-%dT%H:%M:%S%z" : "%d/%b/%Y:%H:%M:%S %z", &t);
+        cachedSec[idx] = now;
+    }
+    return cached[idx];
+}
+
+//127.0.0.1 - - [19/Oct/2026:07:13:30 +0800] "GET /index.html HTTP/1.1" 200 1234 "-" "curl/8.0" 356
+void AccessLog::FormatCommon_(const AccessRecord& r, bool combined, std::string* line){
+    char buff[128];
+    *line += r.peer ? r.peer : "-";
+    *line += " - - [";
+    *line += CachedTime(false);
+    *line += "] \"";
+    AppendText_(r.method, "-", line);
+    line->push_back(' ');
+    AppendText_(r.path, "-", line);
+    *line += " HTTP/";
+    AppendText_(r.version, "1.1", line);
+    snprintf(buff, sizeof(buff), "\" %d %zu", r.status, r.bytes);
+    *line += buff;
+    if(combined){
+        *line += " \"";
+        AppendText_(r.referer, "-", line);
+        *line += "\" \"";
+        AppendText_(r.userAgent, "-", line);
+        line->push_back('"');
+    }
+    snprintf(buff, sizeof(buff), " %lld\n", (long long)r.latencyUs);
+    *line += buff;
+}
+
+//和Apache一样转义：\"和\\，控制字符写成\xHH，客户端不能用引号或换行伪造日志行
+void AccessLog::AppendText_(const char* s, const char* dflt, std::string* out){
+    if(!s || !*s){
+        *out += dflt;
+        return;
+    }
+    for(; *s; s++){
+        unsigned char ch = *s;
+        if(ch == '"' || ch == '\\'){
+            out->push_back('\\');
+            out->push_back(ch);
+        }else if(ch < 0x20 || ch == 0x7f){
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\x%02x", ch);
+            *out += esc;
+        }else{
+            out->push_back(ch);
+        }
+    }
+}
+
+void AccessLog::AppendJsonString_(const char* s, std::string* out){
+    out->push_back('"');
+    for(; s && *s; s++){
+        unsigned char ch = *s;
+        if(ch == '"' || ch == '\\'){
+            out->push_back('\\');
+            out->push_back(ch);
+        }else if(ch < 0x20){
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", ch);
+            *out += esc;
+        }else{
+            out->push_back(ch);
+        }
+    }
+    out->push_back('"');
+}
+
+void AccessLog::FormatJson_(const AccessRecord& r, std::string* line){
+    char buff[128];
+    *line += "{\"time\":\"";
+    *line += CachedTime(true);
+    *line += "\",\"peer\":";
+    AppendJsonString_(r.peer, line);
+    snprintf(buff, sizeof(buff), ",\"port\":%d,\"method\":", r.port);
+    *line += buff;
+    AppendJsonString_(r.method, line);
+    *line += ",\"path\":";
+    AppendJsonString_(r.path, line);
+    *line += ",\"version\":";
+    AppendJsonString_(r.version, line);
+    snprintf(buff, sizeof(buff), ",\"status\":%d,\"bytes\":%zu,\"latency_us\":%lld",
+             r.status, r.bytes, (long long)r.latencyUs);
+    *line += buff;
+    if(r.referer && *r.referer){
+        *line += ",\"referer\":";
+        AppendJsonString_(r.referer, line);
+    }
+    if(r.userAgent && *r.userAgent){
+        *line += ",\"user_agent\":";
+        AppendJsonString_(r.userAgent, line);
+    }
+    *line += "}\n";
+}
+
+//写线程：攒够FLUSH_BYTES或者队列空闲1秒就写一次
+void AccessLog::AsyncWrite_(){
+    std::string line;
+    std::vector<std::string> lines;
+    lines.reserve(POP_BATCH);
+    while(isRunning_ || !queue_->empty()){
+        if(queue_->pop(line, 1)){
+            batch_ += line;
+            //醒来后把已经到达的行一次取走
+            lines.clear();
+            queue_->pop_bulk(lines, POP_BATCH);
+            for(auto& l : lines){
+                batch_ += l;
+            }
+            if(batch_.size() < FLUSH_BYTES){
+                continue;
+            }
+        }
+        Flush_();
+    }
+    Flush_();
+}
+
+void AccessLog::Flush_(){
+    RotateIfNeeded_(time(nullptr), batch_.size());
+    if(batch_.empty() || fd_ < 0){
+        return;
+    }
+    const char* p = batch_.data();
+    size_t left = batch_.size();
+    while(left > 0){
+        ssize_t len = ::write(fd_, p, left);
+        if(len < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        p += len;
+        left -= len;
+    }
+    fileSize_ += batch_.size() - left;
+    batch_.clear();
+}
+
+void AccessLog::OpenFile_(){
+    //O_APPEND：多个进程或logrotate同时操作时也只追加
+    fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd_ < 0){
+        return;
+    }
+    struct stat st;
+    fileSize_ = fstat(fd_, &st) == 0 ? st.st_size : 0;
+    if(rotateSec_ > 0){
+        time_t now = time(nullptr);
+        nextRotate_ = now - now % rotateSec_ + rotateSec_;
+    }
+}
+
+//只在写线程调用，请求线程不会等待文件切换
+void AccessLog::RotateIfNeeded_(time_t now, size_t incoming){
+    bool bySize = maxBytes_ > 0 && fileSize_ > 0 && fileSize_ + incoming > maxBytes_;
+    bool byTime = rotateSec_ > 0 && now >= nextRotate_;
+    if(!bySize && !byTime){
+        return;
+    }
+    if(byTime && fileSize_ == 0){
+        nextRotate_ = now - now % rotateSec_ + rotateSec_;//空文件不切换
+        return;
+    }
+    struct tm t;
+    localtime_r(&now, &t);
+    char suffix[64];
+    strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &t);
+    std::string rotated = path_ + suffix;
+    //同一秒内切了多次时加序号
+    for(int i = 1; access(rotated.c_str(), F_OK) == 0; i++){
+        rotated = path_ + suffix + "." + std::to_string(i);
+    }
+    close(fd_);
+    fd_ = -1;
+    if(rename(path_.c_str(), rotated.c_str()) == 0 && gzip_ && gzipQueue_){
+        gzipQueue_->try_push(std::move(rotated));
+    }
+    OpenFile_();
+}
+
+//后台压缩切出的文件，压缩成功后删除原文件
+void AccessLog::GzipWorker_(){
+    std::string file;
+    while(isRunning_ || !gzipQueue_->empty()){
+        if(!gzipQueue_->pop(file, 1)){
+            continue;
+        }
+        FILE* in = fopen(file.c_str(), "rb");
+        if(!in){
+            continue;
+        }
+        std::string gzName = file + ".gz";
+        gzFile out = gzopen(gzName.c_str(), "wb6");
+        bool ok = out != nullptr;
+        char buff[65536];
+        size_t n;
+        while(ok && (n = fread(buff, 1, sizeof(buff), in)) > 0){
+            ok = gzwrite(out, buff, n) == (int)n;
+        }
+        fclose(in);
+        if(out && gzclose(out) != Z_OK){
+            ok = false;
+        }
+        if(ok){
+            unlink(file.c_str());
+        }else{
+            unlink(gzName.c_str());
+        }
+    }
+}
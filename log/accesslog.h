@@ -0,0 +1,90 @@
+//访问日志：每个响应一条记录，与运行日志分开
+//请求线程只负责格式化一行并放入队列，写线程批量写入文件，
+//按大小或时间切换文件也在写线程完成，切出的旧文件可以交给后台线程gzip压缩
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include<string>
+#include<thread>
+#include<memory>
+#include<atomic>
+#include<stdint.h>
+#include<time.h>
+#include<vector>
+#include<assert.h>
+#include"lockfreequeue.h"
+
+//一条访问记录
+struct AccessRecord{
+    const char* peer;//客户端ip
+    int port;
+    const char* method;
+    const char* path;
+    const char* version;
+    const char* referer;
+    const char* userAgent;
+    int status;
+    size_t bytes;//发送的字节数，包括响应头
+    int64_t latencyUs;//从收到请求到最后一个字节写完，微秒
+};
+
+class AccessLog{
+public:
+    enum FORMAT{
+        COMMON,//NCSA通用格式，末尾追加耗时(微秒)
+        COMBINED,//通用格式加Referer和User-Agent，末尾追加耗时(微秒)
+        JSON,//每行一个JSON对象
+    };
+
+    static AccessLog* Instance();
+
+    //path:日志文件，maxBytes:超过该大小切换文件(0不限制)，
+    //rotateSec:每隔多少秒切换文件(0不限制)，gzip:切出的文件在后台压缩
+    bool init(const char* path, int format = COMBINED, size_t maxBytes = 0,
+              int rotateSec = 0, bool gzip = false, int maxQueueCapacity = 4096);
+    void Close();
+    bool IsOpen() const {return isOpen_;}
+
+    void write(const AccessRecord& record);
+
+    uint64_t Dropped() const {return dropped_.load(std::memory_order_relaxed);}
+
+private:
+    AccessLog();
+    ~AccessLog();
+
+    void FormatCommon_(const AccessRecord& r, bool combined, std::string* line);
+    void FormatJson_(const AccessRecord& r, std::string* line);
+    static void AppendText_(const char* s, const char* dflt, std::string* out);//文本格式中转义后追加，空串写dflt
+    static void AppendJsonString_(const char* s, std::string* out);
+
+    void AsyncWrite_();//写线程
+    void Flush_();//写出当前批次，调用者是写线程
+    void RotateIfNeeded_(time_t now, size_t incoming);
+    void OpenFile_();
+    void GzipWorker_();//后台压缩线程
+
+    static const size_t FLUSH_BYTES = 64 * 1024;//批次积累到这么多就写
+    static const size_t POP_BATCH = 256;//写线程每次最多批量取出的行数
+
+    std::string path_;
+    int format_;
+    size_t maxBytes_;
+    int rotateSec_;
+    bool gzip_;
+    bool isOpen_;
+
+    int fd_;
+    size_t fileSize_;
+    time_t nextRotate_;
+    std::string batch_;
+
+    std::atomic<uint64_t> dropped_;//队列满时丢弃的记录数
+    std::unique_ptr<LockFreeQueue<std::string>> queue_;
+    std::unique_ptr<LockFreeQueue<std::string>> gzipQueue_;//待压缩的文件名
+    std::unique_ptr<std::thread> writeThread_;
+    std::unique_ptr<std::thread> gzipThread_;
+    std::atomic<bool> isRunning_;
+};
+
+#endif
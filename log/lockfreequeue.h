@@ -0,0 +1,339 @@
+//有界多生产者多消费者无锁队列(Dmitry Vyukov的环形队列)
+//每个槽位带一个序号，生产者和消费者各自用CAS抢占位置，不需要互斥锁；
+//只有队列空(消费者)或满(生产者)时才用futex睡眠，正常收发不进内核
+//接口与BlockQueue保持一致，另外提供移动入队、emplace、try_push/try_pop和批量出队
+//不支持push_front/front/back：环形队列只能从尾部入、头部出
+#ifndef LOCK_FREE_QUEUE_H
+#define LOCK_FREE_QUEUE_H
+
+#include<atomic>
+#include<vector>
+#include<new>
+#include<utility>
+#include<type_traits>
+#include<assert.h>
+#include<limits.h>
+#include<stdint.h>
+#include<time.h>
+#include<unistd.h>
+#include<sched.h>
+#include<sys/syscall.h>
+#include<linux/futex.h>
+
+template<typename T>
+class LockFreeQueue{
+public:
+    //容量向上取整到2的幂
+    explicit LockFreeQueue(size_t maxsize = 1024);
+    ~LockFreeQueue();
+
+    LockFreeQueue(const LockFreeQueue&) = delete;
+    LockFreeQueue& operator=(const LockFreeQueue&) = delete;
+
+    bool empty() const;
+    bool full() const;
+
+    //队列满时阻塞，关闭后直接丢弃
+    void push_back(const T& item);
+    void push_back(T&& item);
+    template<typename... Args>
+    void emplace_back(Args&&... args);
+    //不阻塞，队列满或已关闭返回false
+    bool try_push(const T& item);
+    bool try_push(T&& item);
+
+    bool pop(T& item);//队列空时阻塞，关闭后返回false
+    bool pop(T& item, int timeout);//最多等待timeout秒
+    bool try_pop(T& item);
+    //不阻塞，最多取出max个追加到out，返回取出的个数
+    size_t pop_bulk(std::vector<T>& out, size_t max);
+
+    void clear();
+    size_t capacity() const {return mask_ + 1;}
+    size_t size() const;//并发修改时只是近似值
+
+    void flush();//唤醒所有等待的消费者
+    void Close();
+
+private:
+    struct Cell{
+        std::atomic<size_t> seq;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
+    };
+
+    template<typename... Args>
+    bool TryEmplace_(Args&&... args);
+    template<typename... Args>
+    void EmplaceWait_(Args&&... args);
+    bool Wait_(std::atomic<uint32_t>& futexWord, std::atomic<int>& waiters, bool producer, const struct timespec* deadline);
+    void Notify_(std::atomic<uint32_t>& futexWord, std::atomic<int>& waiters, int count);
+
+    static int Futex_(std::atomic<uint32_t>* addr, int op, uint32_t val, const struct timespec* ts){
+        return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val, ts, nullptr, 0);
+    }
+
+    static const size_t CACHE_LINE = 64;
+
+    Cell* cells_;
+    size_t mask_;
+    std::atomic<bool> isClose_;
+    //入队和出队位置放在不同的缓存行，避免生产者和消费者互相使缓存行失效
+    char pad0_[CACHE_LINE];
+    std::atomic<size_t> enqueuePos_;
+    char pad1_[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> dequeuePos_;
+    char pad2_[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    //futex等待字：有等待者时才递增并唤醒
+    std::atomic<uint32_t> notEmpty_;
+    std::atomic<int> consumerWaiters_;
+    char pad3_[CACHE_LINE];
+    std::atomic<uint32_t> notFull_;
+    std::atomic<int> producerWaiters_;
+};
+
+template<typename T>
+LockFreeQueue<T>::LockFreeQueue(size_t maxsize){
+    assert(maxsize > 0);
+    size_t cap = 2;
+    while(cap < maxsize){
+        cap <<= 1;
+    }
+    mask_ = cap - 1;
+    cells_ = static_cast<Cell*>(::operator new(sizeof(Cell) * cap));
+    for(size_t i = 0; i < cap; i++){
+        new (&cells_[i].seq) std::atomic<size_t>(i);
+    }
+    isClose_ = false;
+    enqueuePos_ = 0;
+    dequeuePos_ = 0;
+    notEmpty_ = 0;
+    notFull_ = 0;
+    consumerWaiters_ = 0;
+    producerWaiters_ = 0;
+}
+
+template<typename T>
+LockFreeQueue<T>::~LockFreeQueue(){
+    Close();
+    ::operator delete(cells_);
+}
+
+template<typename T>
+bool LockFreeQueue<T>::empty() const{
+    return size() == 0;
+}
+
+template<typename T>
+bool LockFreeQueue<T>::full() const{
+    return size() >= capacity();
+}
+
+template<typename T>
+size_t LockFreeQueue<T>::size() const{
+    size_t deq = dequeuePos_.load(std::memory_order_relaxed);
+    size_t enq = enqueuePos_.load(std::memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
+}
+
+//槽位序号等于pos表示可写，等于pos+1表示可读
+template<typename T>
+template<typename... Args>
+bool LockFreeQueue<T>::TryEmplace_(Args&&... args){
+    if(isClose_.load(std::memory_order_relaxed)){
+        return false;
+    }
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for(;;){
+        cell = &cells_[pos & mask_];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0){
+            if(enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                break;
+            }
+        }else if(diff < 0){
+            return false;//队列满
+        }else{
+            pos = enqueuePos_.load(std::memory_order_relaxed);
+        }
+    }
+    new (&cell->data) T(std::forward<Args>(args)...);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    Notify_(notEmpty_, consumerWaiters_, 1);
+    return true;
+}
+
+template<typename T>
+bool LockFreeQueue<T>::try_pop(T& item){
+    size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for(;;){
+        cell = &cells_[pos & mask_];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(diff == 0){
+            if(dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                break;
+            }
+        }else if(diff < 0){
+            return false;//队列空
+        }else{
+            pos = dequeuePos_.load(std::memory_order_relaxed);
+        }
+    }
+    T* data = reinterpret_cast<T*>(&cell->data);
+    item = std::move(*data);
+    data->~T();
+    cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+    //生产者等到队列空出一半再一起唤醒，避免每取一条就进一次内核
+    if(size() <= (mask_ + 1) / 2){
+        Notify_(notFull_, producerWaiters_, INT_MAX);
+    }
+    return true;
+}
+
+template<typename T>
+size_t LockFreeQueue<T>::pop_bulk(std::vector<T>& out, size_t max){
+    size_t cnt = 0;
+    T item;
+    //逐个出队，批量场景下省掉的是每条的等待和唤醒
+    while(cnt < max && try_pop(item)){
+        out.push_back(std::move(item));
+        cnt++;
+    }
+    return cnt;
+}
+
+//生产者等待队列不满，消费者等待队列非空
+//先登记等待者再检查一次队列，与Notify_中的检查构成Dekker式配对，不会漏掉唤醒
+template<typename T>
+bool LockFreeQueue<T>::Wait_(std::atomic<uint32_t>& futexWord, std::atomic<int>& waiters,
+                             bool producer, const struct timespec* deadline){
+    uint32_t word = futexWord.load(std::memory_order_acquire);
+    waiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool ready = producer ? !full() : !empty();
+    if(!ready && !isClose_.load(std::memory_order_relaxed)){
+        struct timespec rel, *ts = nullptr;
+        if(deadline){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rel.tv_sec = deadline->tv_sec - now.tv_sec;
+            rel.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+            if(rel.tv_nsec < 0){
+                rel.tv_sec--;
+                rel.tv_nsec += 1000000000;
+            }
+            if(rel.tv_sec < 0){
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+                return false;//超时
+            }
+            ts = &rel;
+        }
+        Futex_(&futexWord, FUTEX_WAIT_PRIVATE, word, ts);
+    }else if(ready){
+        //位置已被对方占用但槽位还没写完，让出CPU等它完成
+        sched_yield();
+    }
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+template<typename T>
+void LockFreeQueue<T>::Notify_(std::atomic<uint32_t>& futexWord, std::atomic<int>& waiters, int count){
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(waiters.load(std::memory_order_relaxed) > 0){
+        futexWord.fetch_add(1, std::memory_order_release);
+        Futex_(&futexWord, FUTEX_WAKE_PRIVATE, count, nullptr);
+    }
+}
+
+template<typename T>
+template<typename... Args>
+void LockFreeQueue<T>::EmplaceWait_(Args&&... args){
+    while(!TryEmplace_(std::forward<Args>(args)...)){
+        if(isClose_.load(std::memory_order_relaxed)){
+            return;
+        }
+        Wait_(notFull_, producerWaiters_, true, nullptr);
+    }
+}
+
+template<typename T>
+void LockFreeQueue<T>::push_back(const T& item){
+    EmplaceWait_(item);
+}
+
+template<typename T>
+void LockFreeQueue<T>::push_back(T&& item){
+    EmplaceWait_(std::move(item));
+}
+
+template<typename T>
+template<typename... Args>
+void LockFreeQueue<T>::emplace_back(Args&&... args){
+    EmplaceWait_(std::forward<Args>(args)...);
+}
+
+template<typename T>
+bool LockFreeQueue<T>::try_push(const T& item){
+    return TryEmplace_(item);
+}
+
+template<typename T>
+bool LockFreeQueue<T>::try_push(T&& item){
+    return TryEmplace_(std::move(item));
+}
+
+template<typename T>
+bool LockFreeQueue<T>::pop(T& item){
+    while(!try_pop(item)){
+        if(isClose_.load(std::memory_order_relaxed)){
+            return false;
+        }
+        Wait_(notEmpty_, consumerWaiters_, false, nullptr);
+    }
+    return true;
+}
+
+template<typename T>
+bool LockFreeQueue<T>::pop(T& item, int timeout){
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout;
+    while(!try_pop(item)){
+        if(isClose_.load(std::memory_order_relaxed)){
+            return false;
+        }
+        if(!Wait_(notEmpty_, consumerWaiters_, false, &deadline)){
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename T>
+void LockFreeQueue<T>::clear(){
+    T item;
+    while(try_pop(item)){
+    }
+}
+
+template<typename T>
+void LockFreeQueue<T>::flush(){
+    notEmpty_.fetch_add(1, std::memory_order_release);
+    Futex_(&notEmpty_, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr);
+}
+
+template<typename T>
+void LockFreeQueue<T>::Close(){
+    isClose_ = true;
+    clear();
+    notEmpty_.fetch_add(1, std::memory_order_release);
+    Futex_(&notEmpty_, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr);
+    notFull_.fetch_add(1, std::memory_order_release);
+    Futex_(&notFull_, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr);
+}
+
+#endif
@@ -1,36 +1,86 @@
 #include "log.h"
+#include<fcntl.h>
+#include<unistd.h>
+#include<algorithm>
+#include"../trace/probes.h"
+
+Log::FormatInfo Log::formats_[Log::MAX_FORMATS];
+std::atomic<int> Log::formatCount_(0);
+std::mutex Log::formatMtx_;
+LogSite* Log::sites_[Log::MAX_SITES];
+std::atomic<int> Log::siteCount_(0);
+std::mutex Log::siteMtx_;
+const int Log::FLUSH_INTERVAL_MS;
+
+static const char* DROP_SUMMARY = "dropped %llu messages (%s)";
+
+LogSite::LogSite(const char* file, int line):file(file),line(line),tat(0),dropped(0){
+    Log::RegisterSite(this);
+}
 
 //构造函数
 Log::Log(){
-    fp_ = nullptr;//打开log的文件指针
-    deque_ = nullptr;//阻塞队列
+    fd_ = -1;//打开log的文件描述符
     writeThread_ = nullptr;//写线程的指针
     lineCount_ = 0;//日志行数记录
     toDay_ = 0;//按当天日期区分文件
+    nextDay_ = 0;
+    fileIndex_ = 0;
     isAsync_ = false;//是否开启异步日志
+    mode_ = TEXT;
+    formatWritten_ = 0;
+    isOpen_ = false;
+    level_ = 1;
+    MAX_LINES_ = MAX_LINES;
+    ringSize_ = 0;
+    flushBytes_ = 0;
+    isRunning_ = false;
+    wakePending_ = false;
+    summaryFmtId_ = -1;
+    limited_ = false;
+    rateInterval_ = 0;
+    rateTolerance_ = 0;
+    sampleKeep_ = SAMPLE_ALL;
+    saturation_ = DROP;
+    saturationDropped_ = 0;
+    droppedTotal_ = 0;
+    nextReport_ = 0;
+    nextSyncReport_ = 0;
 }
 
 //析构函数
 Log::~Log(){
-    //当阻塞队列非空时，唤醒消费者处理剩余任务，直至清空队列
-    while(!deque_->empty()){
-        deque_->flush();//唤醒消费者
+    //通知写线程退出，写线程退出前会把所有缓冲区写完
+    if(writeThread_ && writeThread_->joinable()){
+        {
+            lock_guard<mutex> locker(condMtx_);
+            isRunning_ = false;
+        }
+        cond_.notify_one();
+        spaceCond_.notify_all();
+        writeThread_->join();
     }
-    deque_->Close();//关闭队列
-    writeThread_->join();//等待当前线程完成手中任务
-    if(fp_){ //清洗文件缓冲区，关闭文件描述符
+    if(fd_ >= 0){ //关闭文件描述符
         lock_guard<mutex> locker(mtx_);
-        flush();//清空缓冲区数据
-        fclose(fp_);//关闭日志文件
+        close(fd_);
+        fd_ = -1;
     }
 }
 
-//唤醒阻塞队列消费者，开始写日志
+//唤醒写线程，把缓冲区中的日志写入文件
+//同步方式每条日志直接write，不需要再刷新
 void Log::flush(){
-    if(isAsync_){//只有异步日志用deque
-        deque_->flush();
+    if(isAsync_){
+        Wake_();
+    }
+}
+
+//先置标志再通知：写线程在condMtx_下检查标志，通知不会在它检查之后、等待之前丢掉
+void Log::Wake_(){
+    if(!wakePending_.exchange(true, std::memory_order_acq_rel)){
+        { lock_guard<mutex> locker(condMtx_); }
+        cond_.notify_one();
     }
-    fflush(fp_);//清空输入缓存区
 }
 
 //单例模式的懒汉模式（用到才唤醒），局部静态变量法（无需加锁解锁）
@@ -44,29 +94,483 @@ void Log::FlushLogThread(){
     Log::Instance()->AsncWrite_();
 }
 
-//写线程真正的执行函数
+//写线程真正的执行函数：缓冲区积累到一定大小或每隔FLUSH_INTERVAL_MS毫秒批量写一次
 void Log::AsncWrite_(){
-    string str = "";
-    while (deque_->pop(str)){
-        lock_guard<mutex> locker(mtx_);
-        fputs(str.c_str(),fp_);
-    }   
+    while(true){
+        {
+            unique_lock<mutex> locker(condMtx_);
+            cond_.wait_for(locker, std::chrono::milliseconds(FLUSH_INTERVAL_MS), [this]{
+                return wakePending_.load(std::memory_order_acquire) || !isRunning_;
+            });
+            wakePending_.store(false, std::memory_order_release);
+        }
+        bool running = isRunning_;
+        DrainRings_();
+        spaceCond_.notify_all();
+        ReportDropped_(!running);
+        if(!running){
+            break;
+        }
+    }
+}
+
+//当前线程第一次写日志时注册自己的缓冲区
+LogRing* Log::GetRing_(){
+    thread_local shared_ptr<LogRing> ring;
+    if(!ring){
+        ring = make_shared<LogRing>(ringSize_);
+        lock_guard<mutex> locker(ringMtx_);
+        rings_.push_back(ring);
+    }
+    return ring.get();
+}
+
+//依次取出各线程缓冲区的内容，凑成一批iovec一次writev
+void Log::DrainRings_(){
+    vector<LogRing*> rings;
+    {
+        lock_guard<mutex> locker(ringMtx_);
+        for(auto& ring : rings_){
+            rings.push_back(ring.get());
+        }
+    }
+    DrainRings_(rings);
+    //线程退出后只剩rings_持有它的缓冲区，写空了就释放；只有写线程会删除，上面用的裸指针仍然有效
+    lock_guard<mutex> locker(ringMtx_);
+    for(size_t i = 0; i < rings_.size();){
+        if(rings_[i].use_count() == 1 && rings_[i]->Size() == 0){
+            rings_[i] = move(rings_.back());
+            rings_.pop_back();
+        }else{
+            i++;
+        }
+    }
+}
+
+void Log::DrainRings_(const vector<LogRing*>& rings){
+    struct iovec iov[IOV_BATCH];
+    LogRing* owners[IOV_BATCH / 2];
+    size_t bytes[IOV_BATCH / 2];
+    int iovCnt = 0;
+    int ringCnt = 0;
+
+    lock_guard<mutex> locker(mtx_);
+    RotateIfNeeded_(time(nullptr));
+    if(mode_ != TEXT){
+        //延迟格式化的记录可能跨过环形缓冲区的末尾，先拼成连续的一段再处理
+        for(LogRing* ring : rings){
+            size_t len = 0;
+            int n = ring->Peek(iov, &len);
+            if(n == 0){
+                continue;
+            }
+            scratch_.clear();
+            for(int j = 0; j < n; j++){
+                scratch_.append((const char*)iov[j].iov_base, iov[j].iov_len);
+            }
+            ring->Consume(len);
+            WriteRecords_(scratch_.data(), scratch_.size());
+        }
+        return;
+    }
+    for(size_t i = 0; i <= rings.size(); i++){
+        //一批凑满或者所有缓冲区都看过了，写出去并释放空间；每个缓冲区最多两段，也可能只有一段
+        if(i == rings.size() || iovCnt + 2 > IOV_BATCH || ringCnt == IOV_BATCH / 2){
+            if(iovCnt > 0){
+                for(int j = 0; j < iovCnt; j++){
+                    const char* p = (const char*)iov[j].iov_base;
+                    lineCount_ += std::count(p, p + iov[j].iov_len, '\n');
+                }
+                WriteAll_(iov, iovCnt);
+                for(int j = 0; j < ringCnt; j++){
+                    owners[j]->Consume(bytes[j]);
+                }
+                iovCnt = ringCnt = 0;
+            }
+            if(i == rings.size()){
+                break;
+            }
+        }
+        size_t len = 0;
+        int n = rings[i]->Peek(iov + iovCnt, &len);
+        if(n > 0){
+            iovCnt += n;
+            owners[ringCnt] = rings[i];
+            bytes[ringCnt++] = len;
+        }
+    }
+}
+
+//writev写普通文件一般一次写完，被信号打断等情况下继续写剩下的
+void Log::WriteAll_(struct iovec* iov, int cnt){
+    while(cnt > 0){
+        ssize_t len = writev(fd_, iov, cnt);
+        if(len < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        while(cnt > 0 && static_cast<size_t>(len) >= iov->iov_len){
+            len -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if(cnt > 0){
+            iov->iov_base = (char*)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+}
+
+void Log::OpenFile_(const char* fileName){
+    if(fd_ >= 0){
+        close(fd_);
+    }
+    //O_APPEND保证多次写入都追加在末尾
+    fd_ = open(fileName, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd_ < 0){
+        mkdir(path_,0777);//生成目录文件（最大权限）
+        fd_ = open(fileName, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+    assert(fd_ >= 0);
+    if(mode_ == BINARY){
+        //每次打开都写一个文件头，解码时从这里重新读取格式串定义
+        char head[sizeof(LogRecordHeader) + sizeof(LOG_BINARY_MAGIC)];
+        LogRecordHeader header;
+        memset(&header, 0, sizeof(header));
+        header.len = sizeof(head);
+        header.kind = LOG_RECORD_SESSION;
+        memcpy(head, &header, sizeof(header));
+        memcpy(head + sizeof(header), LOG_BINARY_MAGIC, sizeof(LOG_BINARY_MAGIC));
+        ::write(fd_, head, sizeof(head));
+        formatWritten_ = 0;
+    }
+}
+
+int Log::RegisterFormat(int level, const char* format, const char* file, int line){
+    lock_guard<mutex> locker(formatMtx_);
+    int id = formatCount_.load(std::memory_order_relaxed);
+    if(id >= MAX_FORMATS){
+        return -1;
+    }
+    formats_[id].level = level;
+    formats_[id].format = format;//格式串都是字面量，一直有效
+    formats_[id].file = file;
+    formats_[id].line = line;
+    formatCount_.store(id + 1, std::memory_order_release);
+    return id;
+}
+
+bool Log::PutScalar_(char* rec, size_t* n, char tag, uint64_t v){
+    if(*n + 1 + sizeof(v) > LINE_MAX_LEN){
+        return false;//放不下的参数丢掉，格式化时输出<?>
+    }
+    rec[(*n)++] = tag;
+    memcpy(rec + *n, &v, sizeof(v));
+    *n += sizeof(v);
+    return true;
+}
+
+//字符串在调用时就复制，调用返回后原来的内存可能已经释放
+bool Log::EncodeArg_(char* rec, size_t* n, const char* s){
+    if(!s){
+        s = "(null)";
+    }
+    if(*n + 1 + sizeof(uint32_t) > LINE_MAX_LEN){
+        return false;
+    }
+    uint32_t len = std::min(strlen(s), LINE_MAX_LEN - *n - 1 - sizeof(uint32_t));
+    rec[(*n)++] = LOG_ARG_STR;
+    memcpy(rec + *n, &len, sizeof(len));
+    *n += sizeof(len);
+    memcpy(rec + *n, s, len);
+    *n += len;
+    return true;
+}
+
+//缓冲区满时不再退回同步写文件：那样会让所有线程排队等磁盘，过载时更慢
+bool Log::Push_(int level, const char* data, size_t len){
+    //文本和延迟格式化的记录都从这里进缓冲区
+    TWS_PROBE2(log_enqueue, level, len);
+    LogRing* ring = GetRing_();
+    int policy = saturation_.load(std::memory_order_relaxed);
+    if(policy == SAMPLE && level < 2 && ring->Size() >= ring->Capacity() / 2
+       && !Sample_(SAMPLE_ALL / SATURATION_SAMPLE)){
+        saturationDropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    while(!ring->Push(data, len)){
+        Wake_();
+        if(policy != BLOCK || !isRunning_){
+            saturationDropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        WaitForSpace_();
+    }
+    if(ring->Size() >= flushBytes_){
+        Wake_();
+    }
+    return true;
+}
+
+//写线程每写完一轮就唤醒一次，超时后再看一次，不会一直等下去
+void Log::WaitForSpace_(){
+    unique_lock<mutex> locker(condMtx_);
+    spaceCond_.wait_for(locker, std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+}
+
+void Log::RegisterSite(LogSite* site){
+    lock_guard<mutex> locker(siteMtx_);
+    int id = siteCount_.load(std::memory_order_relaxed);
+    if(id >= MAX_SITES){
+        return;
+    }
+    sites_[id] = site;
+    siteCount_.store(id + 1, std::memory_order_release);
+}
+
+void Log::SetRateLimit(int perSec, int burst){
+    if(perSec > 0){
+        int64_t interval = 1000000 / perSec;
+        rateInterval_ = interval > 0 ? interval : 1;
+        rateTolerance_ = rateInterval_ * (std::max(burst, 1) - 1);
+    }else{
+        rateInterval_ = 0;
+    }
+    limited_ = rateInterval_ > 0 || sampleKeep_ < SAMPLE_ALL;
+}
+
+void Log::SetSampling(double keep){
+    if(keep >= 1 || keep <= 0){
+        sampleKeep_ = SAMPLE_ALL;
+    }else{
+        sampleKeep_ = static_cast<uint64_t>(keep * SAMPLE_ALL);
+    }
+    limited_ = rateInterval_ > 0 || sampleKeep_ < SAMPLE_ALL;
+}
+
+void Log::SetSaturationPolicy(int policy){
+    saturation_ = policy;
+}
+
+//每个线程一个xorshift随机数发生器，不需要同步
+bool Log::Sample_(uint64_t keep){
+    thread_local uint64_t state = 0;
+    if(state == 0){
+        state = reinterpret_cast<uintptr_t>(&state) ^ static_cast<uint64_t>(time(nullptr)) ^ 0x9E3779B97F4A7C15ull;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (state & 0xFFFFFFFFull) < keep;
+}
+
+//采样只针对DEBUG和INFO；限流用GCRA，等价于每秒perSec个令牌、容量burst的令牌桶，
+//只需要对调用处的一个原子变量做CAS
+bool Log::AdmitSlow_(int level, LogSite* site){
+    uint64_t keep = sampleKeep_.load(std::memory_order_relaxed);
+    if(level < 2 && keep < SAMPLE_ALL && !Sample_(keep)){
+        site->dropped.fetch_add(1, std::memory_order_relaxed);
+        if(!isAsync_){
+            ReportDroppedSync_();
+        }
+        return false;
+    }
+    int64_t interval = rateInterval_.load(std::memory_order_relaxed);
+    if(interval <= 0){
+        return true;
+    }
+    int64_t tolerance = rateTolerance_.load(std::memory_order_relaxed);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t now = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    int64_t tat = site->tat.load(std::memory_order_relaxed);
+    for(;;){
+        int64_t base = std::max(tat, now);
+        if(base - now > tolerance){
+            site->dropped.fetch_add(1, std::memory_order_relaxed);
+            if(!isAsync_){
+                ReportDroppedSync_();
+            }
+            return false;
+        }
+        if(site->tat.compare_exchange_weak(tat, base + interval, std::memory_order_relaxed)){
+            return true;
+        }
+    }
+}
+
+uint64_t Log::DroppedCount(){
+    return droppedTotal_.load(std::memory_order_relaxed) + saturationDropped_.load(std::memory_order_relaxed);
+}
+
+size_t Log::BufferedBytes(){
+    lock_guard<mutex> locker(ringMtx_);
+    size_t bytes = 0;
+    for(auto& ring : rings_){
+        bytes += ring->Size();
+    }
+    return bytes;
+}
+
+//每秒最多汇总一次，每个有丢弃的调用处一行
+void Log::ReportDropped_(bool force){
+    time_t now = time(nullptr);
+    lock_guard<mutex> locker(mtx_);
+    if(!force && now < nextReport_){
+        return;
+    }
+    nextReport_ = now + 1;
+    int count = siteCount_.load(std::memory_order_acquire);
+    for(int i = 0; i < count; i++){
+        uint64_t n = sites_[i]->dropped.exchange(0, std::memory_order_relaxed);
+        if(n > 0){
+            char reason[LOG_PATH_LEN];
+            snprintf(reason, sizeof(reason), "rate limited or sampled at %s:%d", sites_[i]->file, sites_[i]->line);
+            WriteSummary_(n, reason);
+        }
+    }
+    uint64_t n = saturationDropped_.exchange(0, std::memory_order_relaxed);
+    if(n > 0){
+        droppedTotal_.fetch_add(n, std::memory_order_relaxed);
+        WriteSummary_(n, "log buffer full");
+    }
+}
+
+//同步方式没有写线程，由写日志或者被丢弃的线程顺带汇总，最多每FLUSH_INTERVAL_MS抢到一次
+void Log::ReportDroppedSync_(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    int64_t next = nextSyncReport_.load(std::memory_order_relaxed);
+    if(now < next || !nextSyncReport_.compare_exchange_strong(next, now + FLUSH_INTERVAL_MS,
+                                                              std::memory_order_relaxed)){
+        return;
+    }
+    ReportDropped_(true);
+}
+
+//汇总行和普通日志一样按当前的写入方式输出，调用者持有mtx_
+void Log::WriteSummary_(uint64_t count, const char* reason){
+    struct timeval now{0,0};
+    gettimeofday(&now,nullptr);
+    if(mode_ != TEXT && summaryFmtId_ >= 0){
+        char rec[LINE_MAX_LEN];
+        size_t n = sizeof(LogRecordHeader);
+        int argc = 0;
+        EncodeArgs_(rec, &n, &argc, (unsigned long long)count, reason);
+        LogRecordHeader header;
+        memset(&header, 0, sizeof(header));
+        header.len = n;
+        header.kind = LOG_RECORD_ENTRY;
+        header.level = 2;
+        header.argc = argc;
+        header.fmtId = summaryFmtId_;
+        header.usec = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+        memcpy(rec, &header, sizeof(header));
+        WriteRecords_(rec, n);
+        return;
+    }
+    char line[LINE_MAX_LEN];
+    int n = AppendTime_(now, line);
+    n += AppendLogLevelTitle_(2, line + n);
+    int m = snprintf(line + n, LINE_MAX_LEN - n - 1, DROP_SUMMARY, (unsigned long long)count, reason);
+    n = std::min(n + std::max(m, 0), LINE_MAX_LEN - 2);
+    line[n++] = '\n';
+    struct iovec iov = { line, (size_t)n };
+    WriteAll_(&iov, 1);
+    lineCount_++;
+}
+
+void Log::WriteFormats_(){
+    int count = formatCount_.load(std::memory_order_acquire);
+    string defs;
+    for(; formatWritten_ < count; formatWritten_++){
+        const FormatInfo& info = formats_[formatWritten_];
+        string payload = string(info.file) + ":" + to_string(info.line);
+        payload.push_back('\0');
+        payload += info.format;
+        payload.push_back('\0');
+        LogRecordHeader header;
+        memset(&header, 0, sizeof(header));
+        header.len = sizeof(header) + payload.size();
+        header.kind = LOG_RECORD_FORMAT;
+        header.level = info.level;
+        header.fmtId = formatWritten_;
+        defs.append((const char*)&header, sizeof(header));
+        defs += payload;
+    }
+    if(!defs.empty()){
+        ::write(fd_, defs.data(), defs.size());
+    }
+}
+
+void Log::WriteRecords_(const char* data, size_t len){
+    if(mode_ == BINARY){
+        //二进制文件：先补上新登记的格式串定义，再原样写出记录
+        WriteFormats_();
+        size_t pos = 0;
+        while(pos + sizeof(LogRecordHeader) <= len){
+            LogRecordHeader header;
+            memcpy(&header, data + pos, sizeof(header));
+            pos += header.len;
+            lineCount_++;
+        }
+        struct iovec iov = { const_cast<char*>(data), len };
+        WriteAll_(&iov, 1);
+        return;
+    }
+    //写线程格式化成文本
+    string text;
+    size_t pos = 0;
+    int count = formatCount_.load(std::memory_order_acquire);
+    while(pos + sizeof(LogRecordHeader) <= len){
+        LogRecordHeader header;
+        memcpy(&header, data + pos, sizeof(header));
+        if(header.len < sizeof(header) || pos + header.len > len){
+            break;
+        }
+        if(header.kind == LOG_RECORD_ENTRY && (int)header.fmtId < count){
+            char prefix[64];
+            struct timeval now;
+            now.tv_sec = header.usec / 1000000;
+            now.tv_usec = header.usec % 1000000;
+            int n = AppendTime_(now, prefix);
+            n += AppendLogLevelTitle_(header.level, prefix + n);
+            text.append(prefix, n);
+            LogFormatRecord(formats_[header.fmtId].format, data + pos + sizeof(header),
+                            header.len - sizeof(header), header.argc, &text);
+            text.push_back('\n');
+            lineCount_++;
+        }
+        pos += header.len;
+    }
+    struct iovec iov = { &text[0], text.size() };
+    WriteAll_(&iov, 1);
 }
 
 //初始化日志实例
-void Log::init(int level,const char* path, const char* suffix, int maxQueCapacity){
+void Log::init(int level,const char* path, const char* suffix, int maxQueCapacity, int mode){
     isOpen_ = true;
     level_ =level;
+    //延迟格式化需要写线程，同步方式下退回文本
+    mode_ = maxQueCapacity ? mode : TEXT;
+    if(mode_ != TEXT && summaryFmtId_ < 0){
+        summaryFmtId_ = RegisterFormat(2, DROP_SUMMARY, __FILE__, __LINE__);
+    }
     path_ = path;
     suffix_ = suffix;
     if(maxQueCapacity){//异步方式
         isAsync_ = true;
-        if(!deque_){ //如果没有deque，则new一个
-            unique_ptr<BlockQueue<std::string>> newQue(new BlockQueue<std::string>);
-            //因为unique_ptr不支持普通的拷贝或赋值操作,所以采用move
-            //将动态申请的内存权给deque，newDeque被释放
-            deque_ = move(newQue);  // 左值变右值,掏空newDeque
-
+        if(!writeThread_){ //如果没有写线程，则创建一个
+            //原来按条数计的队列容量换算成字节，每个线程的缓冲区取2的幂
+            ringSize_ = 64 * 1024;
+            while(ringSize_ < static_cast<size_t>(maxQueCapacity) * 256){
+                ringSize_ <<= 1;
+            }
+            flushBytes_ = ringSize_ / 4;
+            isRunning_ = true;
             unique_ptr<thread> newThread(new thread(FlushLogThread));
             writeThread_ = move(newThread);
         }
@@ -77,119 +581,124 @@ void Log::init(int level,const char* path, const char* suffix, int maxQueCapacit
 
     lineCount_ = 0;
     time_t timer = time(nullptr);
-    struct tm* sysTime = localtime(&timer);
-    struct tm t = *sysTime;
-    path_ = path;
-    suffix_ = suffix;
+    struct tm t;
+    localtime_r(&timer, &t);
     char fileName[LOG_NAME_LEN] = {0};
     snprintf(fileName,LOG_NAME_LEN - 1, "%s/%04d_%02d_%02d%s",
             path_,t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,suffix_);
-    toDay_ = t.tm_mday; 
+    toDay_ = t.tm_mday;
+    t.tm_hour = t.tm_min = t.tm_sec = 0;
+    t.tm_mday++;
+    nextDay_ = mktime(&t);
     //锁的范围
     {
         lock_guard<mutex> locker(mtx_);
-        buff_.RetrieveAll();
-        if(fp_){
-            flush();
-            fclose(fp_);
-        }
-        fp_ = fopen(fileName,"a");//打开文件读取并附加写入
-        if(fp_ == nullptr){
-            mkdir(path_,0777);//生成目录文件（最大权限）
-            fp_ = fopen(fileName,"a")
-        }
-        assert(fp_!=nullptr);
+        OpenFile_(fileName);
+    }
+}
+
+//日志日期 日志行数 如果不是今天或者行数超了，切换到新的文件，调用者持有mtx_
+void Log::RotateIfNeeded_(time_t now){
+    bool newDay = now >= nextDay_;
+    if(!newDay && !(lineCount_ && lineCount_ >= MAX_LINES_)){
+        return;
+    }
+    struct tm t;
+    localtime_r(&now, &t);
+    char newFile[LOG_NAME_LEN];
+    char tail[36] = {0};
+    snprintf(tail, 36, "%04d_%02d_%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday);
+
+    //如果时间不匹配，则替换为最新的日志文件名
+    if(newDay){
+        snprintf(newFile, LOG_NAME_LEN - 72, "%s/%s%s", path_, tail, suffix_);
+        toDay_ = t.tm_mday;
+        lineCount_ = 0;
+        fileIndex_ = 0;
+        t.tm_hour = t.tm_min = t.tm_sec = 0;
+        t.tm_mday++;
+        nextDay_ = mktime(&t);
+    }
+    else{
+        snprintf(newFile, LOG_NAME_LEN - 72, "%s/%s-%d%s", path_, tail, ++fileIndex_, suffix_);
+        lineCount_ = 0;
+    }
+    OpenFile_(newFile);
+}
+
+//时间前缀：年月日时分秒每个线程每秒只格式化一次，之后只补微秒
+int Log::AppendTime_(const struct timeval& now, char* dst){
+    thread_local time_t cachedSec = 0;
+    thread_local char cached[32];
+    thread_local int cachedLen = 0;
+    if(now.tv_sec != cachedSec){
+        struct tm t;
+        localtime_r(&now.tv_sec, &t);
+        cachedLen = snprintf(cached, sizeof(cached), "%d-%02d-%02d %02d:%02d:%02d.",
+                    t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+                    t.tm_hour, t.tm_min, t.tm_sec);
+        cachedSec = now.tv_sec;
     }
+    memcpy(dst, cached, cachedLen);
+    return cachedLen + snprintf(dst + cachedLen, 16, "%06ld ", (long)now.tv_usec);
 }
 
 void Log::write(int level, const char* format,...){
     struct timeval now{0,0};
     gettimeofday(&now,nullptr);
-    time_t tSec = now.tv_sec;
-    struct tm* sysTime = localtime(&tSec);
-    struct tm t = *sysTime;
     va_list vaList;
 
-    //日志日期 日志行数 如果不是今天或者行数超了
-    if(toDay_!=t.tm_mday||(lineCount_&&(lineCount_ % MAX_LINES_ == 0))){
-        unique_lock<mutex> locker(mtx_);
-        locker.unlock();
-
-        char newFile[LOG_NAME_LEN];
-        char tail[36] = {0};
-        snprintf(tail, 36, "%04d_%02d_%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday);
+    //在线程自己的栈外缓冲中生成一条完整的日志，不需要加锁
+    thread_local char line[LINE_MAX_LEN];
+    int n = AppendTime_(now, line);
+    n += AppendLogLevelTitle_(level, line + n);
 
-        //如果时间不匹配，则替换为最新的日志文件名
-        if(toDay_ != t.tm_mday){
-            snprintf(newFile, LOG_NAME_LEN - 72, "%s/%s%s", path_, tail, suffix_);
-            toDay_ = t.tm_mday;
-            lineCount_ = 0;
-        }
-        else{
-            snprintf(newFile, LOG_NAME_LEN - 72, "%s/%s-%d%s", path_, tail, (lineCount_  / MAX_LINES), suffix_);
-        }
-
-        locker.lock();
-        flush();
-        fclose(fp_);
-        fp_ = fopen(newFile,"a");
-        assert(fp_!=nullptr;)
+    va_start(vaList,format);//stdarg.h
+    int m = vsnprintf(line + n, LINE_MAX_LEN - n - 1, format, vaList);
+    va_end(vaList);
+    if(m < 0){
+        m = 0;
     }
+    //超长的日志截断
+    n = std::min(n + m, LINE_MAX_LEN - 2);
+    line[n++] = '\n';
 
-    //锁的内容，在buffer中生成一条对应的日志信息
-    {
-        unique_lock<mutex> locker(mtx_);
-        lineCount_ ++;
-        int n = snprintf(buff_.BeginWrite(), 128, "%d-%02d-%02d %02d:%02d:%02d.%06ld ",
-                    t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
-                    t.tm_hour, t.tm_min, t.tm_sec, now.tv_usec);
-        buff_.HasWritten(n);
-        AppendLogLevelTitle_(level);
-
-        va_start(va_list,format);//stdarg.h
-        int m = vsnprintf(buff_.BeginWrite(), buff_.WritableBytes(), format, vaList);
-        va_end(vaList);
-
-        buff_.HasWritten(m);
-        buff_.Append("\n\0",2);
-        //如果阻塞队列大小不为0则使用异步写入，等于0则使用同步写入
-        if(isAsync_ && deque_ && !deque_->full()) { // 异步方式（加入阻塞队列中，等待写线程读取日志信息）
-            deque_->push_back(buff_.RetrieveAllToStr());
-        } else {    // 同步方式（直接向文件中写入日志信息）
-            fputs(buff_.Peek(), fp_);   // 同步就直接写入文件
-        }
-        buff_.RetrieveAll();    // 清空buff
+    //异步方式：放入本线程的缓冲区，积累到一定量再唤醒写线程
+    if(isAsync_){
+        Push_(level, line, n);
+        return;
+    }
+    //同步方式直接写入文件
+    if(limited_.load(std::memory_order_relaxed)){
+        ReportDroppedSync_();
     }
+    lock_guard<mutex> locker(mtx_);
+    RotateIfNeeded_(now.tv_sec);
+    lineCount_++;
+    ::write(fd_, line, n);
 }
 
 //添加日志等级
-void Log::AppendLogLevelTitle_(int level){
+int Log::AppendLogLevelTitle_(int level, char* dst){
+    const char* title;
     switch (level)
     {
     case 0://调试代码时的输出
-        buff_.Append("[debug]: ",9);
+        title = "[debug]: ";
         break;
     case 1://系统当前状态
-        buff_.Append("[info]: ",9);
+        title = "[info] : ";
         break;
     case 2://调试代码的警告
-        buff_.Append("[warn]: ",9);
+        title = "[warn] : ";
         break;
     case 3://系统的错误信息
-        buff_.Append("[error]: ",9);
+        title = "[error]: ";
         break;
     default:
-        buff_.Append("[info]: ", 9)
+        title = "[info] : ";
         break;
     }
+    memcpy(dst, title, 9);
+    return 9;
 }
-
-int Log::GetLevel() {
-    lock_guard<mutex> locker(mtx_);
-    return level_;
-}
-
-void Log::SetLevel(int level) {
-    lock_guard<mutex> locker(mtx_);
-    level_ = level;
-}
\ No newline at end of file
@@ -4,39 +4,198 @@
 #include<mutex>
 #include<string>
 #include<thread>
+#include<vector>
+#include<memory>
+#include<atomic>
+#include<condition_variable>
 #include<sys/time.h>
 #include<string.h>
 #include<stdarg.h>
 #include<assert.h>
 #include<sys/stat.h>
+#include<type_traits>
 #include"blockqueue.h"
+#include"logring.h"
+#include"logformat.h"
 #include"../buffer/buffer.h"
 
+//编译期日志等级，低于该等级的日志宏展开为空，例如-DLOG_MIN_LEVEL=1去掉所有DEBUG日志
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+//每个日志调用处一个静态对象，记录限流状态和被丢弃的条数
+struct LogSite{
+    LogSite(const char* file, int line);
+    const char* file;
+    int line;
+    std::atomic<int64_t> tat;//令牌桶(GCRA)的理论到达时间，微秒
+    std::atomic<uint64_t> dropped;//上次汇报后被限流或采样丢掉的条数
+};
+
 class Log{
 public:
-    //初始化日志示例（阻塞队列最大容量，日志保存路径，文件后缀）
+    //日志的写入方式
+    enum MODE{
+        TEXT,//调用处格式化，写文本文件
+        DEFERRED,//调用处只记录参数，写线程格式化后写文本文件
+        BINARY,//调用处只记录参数，写线程直接写二进制文件，用logdecode离线解码
+    };
+
+    //初始化日志示例（异步缓冲容量，日志保存路径，文件后缀，写入方式）
+    //maxQueueCapacity为0时同步写，否则每个线程有自己的环形缓冲区，由写线程批量写入
+    //DEFERRED和BINARY只在异步方式下生效
     void init(int level,const char* path = "./log",
                 const char* suffix = ".log",
-                int maxQueueCapacity = 1024);
-    
+                int maxQueueCapacity = 1024,
+                int mode = TEXT);
+
+    //写线程跟不上、线程缓冲区满时的处理方式
+    enum SATURATION{
+        DROP,//直接丢弃，计数后汇总输出
+        SAMPLE,//缓冲区过半后DEBUG/INFO按比例保留，满了再丢弃
+        BLOCK,//等写线程腾出空间
+    };
+
     static Log* Instance();
     static void FlushLogThread();//异步写日志公有方法，调用私有方法asyncWrite
 
     void write(int level, const char* format,...);//将输出内容按照标准格式整理
     void flush();
 
-    int GetLevel();
-    void SetLevel(int level);
-    bool IsOpen(){return IsOpen_;}
+    //每个调用处每秒最多perSec条，允许burst条突发，perSec为0时不限流
+    void SetRateLimit(int perSec, int burst);
+    //DEBUG和INFO日志按keep(0~1]的概率保留，1表示全部保留
+    void SetSampling(double keep);
+    void SetSaturationPolicy(int policy);
+
+    //限流和采样的判断，未开启时只是一次relaxed读
+    bool Admit(int level, LogSite* site){
+        if(!limited_.load(std::memory_order_relaxed)){
+            return true;
+        }
+        return AdmitSlow_(level, site);
+    }
+    static void RegisterSite(LogSite* site);
+
+    //每个调用处第一次执行时登记格式串，返回编号；满了返回-1
+    static int RegisterFormat(int level, const char* format, const char* file, int line);
+
+    //延迟格式化：记录格式串编号和参数的原始字节，不调用vsnprintf
+    template<typename... Args>
+    void writeDeferred(int level, int fmtId, const char* format, const Args&... args){
+        if(fmtId < 0){
+            write(level, format, args...);
+            return;
+        }
+        thread_local char rec[LINE_MAX_LEN];
+        size_t n = sizeof(LogRecordHeader);
+        int argc = 0;
+        EncodeArgs_(rec, &n, &argc, args...);
+        LogRecordHeader header;
+        memset(&header, 0, sizeof(header));
+        header.len = n;
+        header.kind = LOG_RECORD_ENTRY;
+        header.level = level;
+        header.argc = argc;
+        header.fmtId = fmtId;
+        struct timeval now{0,0};
+        gettimeofday(&now,nullptr);
+        header.usec = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+        memcpy(rec, &header, sizeof(header));
+        Push_(level, rec, n);
+    }
+
+    //等级用原子变量，宏里每次判断只是一次relaxed读
+    int GetLevel(){return level_.load(std::memory_order_relaxed);}
+    void SetLevel(int level){level_.store(level, std::memory_order_relaxed);}
+    bool IsOpen(){return isOpen_;}
+    bool IsDeferred(){return mode_ != TEXT;}
+
+    //缓冲区满丢弃的累计条数(不含限流和采样)，以及各线程缓冲区中还没写出的字节数
+    uint64_t DroppedCount();
+    size_t BufferedBytes();
 private:
+    static void EncodeArgs_(char*, size_t*, int*){}
+    template<typename T, typename... Rest>
+    static void EncodeArgs_(char* rec, size_t* n, int* argc, const T& arg, const Rest&... rest){
+        if(EncodeArg_(rec, n, arg)){
+            (*argc)++;
+        }
+        EncodeArgs_(rec, n, argc, rest...);
+    }
+    template<typename T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, bool>::type
+    EncodeArg_(char* rec, size_t* n, const T& v){
+        bool isSigned = std::is_signed<T>::value;
+        return PutScalar_(rec, n, isSigned ? LOG_ARG_INT : LOG_ARG_UINT,
+                          isSigned ? (uint64_t)(int64_t)v : (uint64_t)v);
+    }
+    template<typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value, bool>::type
+    EncodeArg_(char* rec, size_t* n, const T& v){
+        double d = v;
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return PutScalar_(rec, n, LOG_ARG_DOUBLE, bits);
+    }
+    static bool EncodeArg_(char* rec, size_t* n, const void* p){
+        return PutScalar_(rec, n, LOG_ARG_PTR, (uint64_t)(uintptr_t)p);
+    }
+    static bool EncodeArg_(char* rec, size_t* n, const char* s);
+    static bool EncodeArg_(char* rec, size_t* n, char* s){
+        return EncodeArg_(rec, n, (const char*)s);
+    }
+    static bool PutScalar_(char* rec, size_t* n, char tag, uint64_t v);
+
     Log();
-    void AppendLogLevelTitle_(int level);
+    int AppendLogLevelTitle_(int level, char* dst);
+    int AppendTime_(const struct timeval& now, char* dst);
     virtual ~Log();
     void AsncWrite_();//异步写日志方法
+    void DrainRings_();//把所有线程的缓冲区批量写入文件，释放已退出线程的空缓冲区
+    void DrainRings_(const std::vector<LogRing*>& rings);
+    LogRing* GetRing_();//当前线程的环形缓冲区
+    void Wake_();//唤醒写线程，已经有未处理的唤醒时不再通知
+    bool Push_(int level, const char* data, size_t len);//放入本线程缓冲区，满时按饱和策略处理
+    void WaitForSpace_();
+    bool AdmitSlow_(int level, LogSite* site);
+    static bool Sample_(uint64_t keep);
+    void ReportDropped_(bool force);//输出"dropped N messages"汇总，异步方式由写线程调用
+    void ReportDroppedSync_();//同步方式下按FLUSH_INTERVAL_MS限频调用ReportDropped_
+    void WriteSummary_(uint64_t count, const char* reason);
+    void WriteRecords_(const char* data, size_t len);//写出一批延迟格式化的记录，调用者持有mtx_
+    void WriteFormats_();//二进制文件中补上还没写过的格式串定义
+    void RotateIfNeeded_(time_t now);//按日期和行数切换日志文件
+    void OpenFile_(const char* fileName);
+    void WriteAll_(struct iovec* iov, int cnt);
 private:
     static const int LOG_PATH_LEN = 256;//日志文件最长文件名
     static const int LOG_NAME_LEN = 256;//日志最长名字
     static const int MAX_LINES = 50000;//日志文件内的最长日志条数
+    static const int LINE_MAX_LEN = 4096;//单条日志最大长度
+    static const int FLUSH_INTERVAL_MS = 100;//写线程最长多久写一次文件
+    static const int IOV_BATCH = 64;//一次writev最多的片段数
+    static const int MAX_FORMATS = 4096;//最多登记的格式串（调用处）数量
+    static const int MAX_SITES = 4096;//最多登记的调用处数量，超出的调用处仍会限流但不汇总
+    static const int SATURATION_SAMPLE = 8;//SAMPLE策略下缓冲区过半后每8条保留1条
+    static const uint64_t SAMPLE_ALL = 1ull << 32;//采样阈值，随机数低32位小于它就保留
+
+    //登记的格式串，固定大小的数组加原子计数，写线程读取不用加锁
+    struct FormatInfo{
+        int level;
+        const char* format;
+        const char* file;
+        int line;
+    };
+    static FormatInfo formats_[MAX_FORMATS];
+    static std::atomic<int> formatCount_;
+    static std::mutex formatMtx_;
+    static LogSite* sites_[MAX_SITES];
+    static std::atomic<int> siteCount_;
+    static std::mutex siteMtx_;
+    int summaryFmtId_;//延迟格式化时汇总行的格式串编号
+    int formatWritten_;//当前二进制文件中已经写过定义的格式串数量
 
     const char* path_;//路径名
     const char* suffix_;//后缀名
@@ -45,34 +204,83 @@ private:
 
     int lineCount_;//日志行数记录
     int toDay_;//按当天日期区分文件
+    time_t nextDay_;//下一天0点，到了就切换文件
+    int fileIndex_;//当天按行数切分出的文件序号
+
+    bool isOpen_;
 
-    bool isOpen_;               
- 
-    Buffer buff_;//输出的内容，缓冲区
-    int level_;//日志等级
+    std::atomic<int> level_;//日志等级
     bool isAsync_;//是否开启异步日志
+    int mode_;//写入方式
+
+    std::atomic<bool> limited_;//是否开启了限流或采样
+    std::atomic<int64_t> rateInterval_;//限流时两条之间的间隔，微秒
+    std::atomic<int64_t> rateTolerance_;//允许的突发对应的时间，微秒
+    std::atomic<uint64_t> sampleKeep_;//采样阈值，SAMPLE_ALL表示全部保留
+    std::atomic<int> saturation_;//饱和策略
+    std::atomic<uint64_t> saturationDropped_;//缓冲区满丢弃的条数，汇总输出后清零
+    std::atomic<uint64_t> droppedTotal_;//已汇总输出的丢弃条数
+    time_t nextReport_;//下一次汇总丢弃条数的时间，mtx_保护
+    std::atomic<int64_t> nextSyncReport_;//同步方式下一次尝试汇总的时刻，单调时钟毫秒
+    std::condition_variable spaceCond_;//BLOCK策略下等待缓冲区腾出空间
 
-    FILE* fp_;//打开log的文件指针
-    std::unique_ptr<BlockQueue<std::string>> deque_;//阻塞队列
+    int fd_;//打开log的文件描述符
+    size_t ringSize_;//每个线程缓冲区的大小
+    size_t flushBytes_;//缓冲区积累到这么多就唤醒写线程
+    //所有线程的缓冲区，线程自己也持有一份，线程退出后写线程把它写空再释放
+    std::vector<std::shared_ptr<LogRing>> rings_;
+    std::mutex ringMtx_;//保护rings_的注册和释放
     std::unique_ptr<std::thread> writeThread_;//写线程的指针
-    std::mutex mtx_;//同步日志必需的互斥量
+    std::atomic<bool> isRunning_;
+    std::mutex condMtx_;
+    std::condition_variable cond_;//唤醒写线程
+    std::atomic<bool> wakePending_;//有唤醒还没被写线程处理，写线程在condMtx_下检查
+    std::mutex mtx_;//保护日志文件和行数
+    std::string scratch_;//写线程拼接记录和格式化文本用
 };
 
+//日志不再逐行flush，由写线程按大小或时间批量写入
+//延迟格式化时每个调用处用局部静态变量保存格式串编号，只登记一次
+//每个调用处的LogSite记录自己的限流状态，被限流或采样丢掉的条数由写线程每秒汇总一次
 #define LOG_BASE(level,format,...)\
     do{\
         Log* log = Log::Instance();\
-        if(log->Isopen()&&log->GetLevel()<=level){\
-            log->write(level,format,##__VA_ARGS__);\
-            log->flush();\
+        if(log->IsOpen()&&log->GetLevel()<=level){\
+            static LogSite logSite(__FILE__, __LINE__);\
+            if(log->Admit(level, &logSite)){\
+                if(log->IsDeferred()){\
+                    static const int logFmtId = Log::RegisterFormat(level, format, __FILE__, __LINE__);\
+                    log->writeDeferred(level, logFmtId, format, ##__VA_ARGS__);\
+                }else{\
+                    log->write(level,format,##__VA_ARGS__);\
+                }\
+            }\
         }\
     }while(0);
 
 // 四个宏定义，主要用于不同类型的日志输出，也是外部使用日志的接口
 // ...表示可变参数，__VA_ARGS__就是将...的值复制到这里
 // 前面加上##的作用是：当可变参数的个数为0时，这里的##可以把把前面多余的","去掉,否则会编译出错。
-#define LOG_DEBUG(format, ...) do {LOG_BASE(0, format, ##__VA_ARGS__)} while(0);    
+// 低于LOG_MIN_LEVEL的等级在编译期就去掉，参数也不会被求值
+#if LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(format, ...) do {LOG_BASE(0, format, ##__VA_ARGS__)} while(0);
+#else
+#define LOG_DEBUG(format, ...) do {} while(0);
+#endif
+#if LOG_MIN_LEVEL <= 1
 #define LOG_INFO(format, ...) do {LOG_BASE(1, format, ##__VA_ARGS__)} while(0);
+#else
+#define LOG_INFO(format, ...) do {} while(0);
+#endif
+#if LOG_MIN_LEVEL <= 2
 #define LOG_WARN(format, ...) do {LOG_BASE(2, format, ##__VA_ARGS__)} while(0);
+#else
+#define LOG_WARN(format, ...) do {} while(0);
+#endif
+#if LOG_MIN_LEVEL <= 3
 #define LOG_ERROR(format, ...) do {LOG_BASE(3, format, ##__VA_ARGS__)} while(0);
+#else
+#define LOG_ERROR(format, ...) do {} while(0);
+#endif
 
-#endif //LOG_H
\ No newline at end of file
+#endif //LOG_H
@@ -0,0 +1,101 @@
+//二进制日志解码工具：把Log::BINARY方式写出的文件还原成文本
+//用法：logdecode <二进制日志文件>
+//编译：g++ -O2 -std=c++14 log/logdecode.cpp log/logformat.cpp -o logdecode
+#include<stdio.h>
+#include<time.h>
+#include<string>
+#include<vector>
+
+#include"logformat.h"
+
+using namespace std;
+
+struct FormatDef{
+    int level;
+    string site;//file:line
+    string format;
+};
+
+static const char* LevelTitle(int level){
+    switch(level){
+    case 0: return "[debug]: ";
+    case 1: return "[info] : ";
+    case 2: return "[warn] : ";
+    case 3: return "[error]: ";
+    default: return "[info] : ";
+    }
+}
+
+int main(int argc, char* argv[]){
+    if(argc != 2){
+        fprintf(stderr, "usage: %s <binary log file>\n", argv[0]);
+        return 1;
+    }
+    FILE* fp = fopen(argv[1], "rb");
+    if(!fp){
+        fprintf(stderr, "open %s failed\n", argv[1]);
+        return 1;
+    }
+    string data;
+    char buff[65536];
+    size_t n;
+    while((n = fread(buff, 1, sizeof(buff), fp)) > 0){
+        data.append(buff, n);
+    }
+    fclose(fp);
+
+    vector<FormatDef> formats;
+    size_t pos = 0;
+    size_t entries = 0, unknown = 0;
+    string line;
+    while(pos + sizeof(LogRecordHeader) <= data.size()){
+        LogRecordHeader header;
+        memcpy(&header, data.data() + pos, sizeof(header));
+        if(header.len < sizeof(header) || pos + header.len > data.size()){
+            fprintf(stderr, "truncated record at offset %zu\n", pos);
+            break;
+        }
+        const char* payload = data.data() + pos + sizeof(header);
+        size_t payloadLen = header.len - sizeof(header);
+        pos += header.len;
+
+        if(header.kind == LOG_RECORD_SESSION){
+            //新的一段，之前的格式串编号失效
+            formats.clear();
+        }else if(header.kind == LOG_RECORD_FORMAT){
+            string text(payload, payloadLen);
+            size_t split = text.find('\0');
+            if(split == string::npos){
+                continue;
+            }
+            if(formats.size() <= header.fmtId){
+                formats.resize(header.fmtId + 1);
+            }
+            FormatDef& def = formats[header.fmtId];
+            def.level = header.level;
+            def.site = text.substr(0, split);
+            def.format = text.c_str() + split + 1;
+        }else if(header.kind == LOG_RECORD_ENTRY){
+            entries++;
+            time_t sec = header.usec / 1000000;
+            struct tm t;
+            localtime_r(&sec, &t);
+            char prefix[64];
+            snprintf(prefix, sizeof(prefix), "%d-%02d-%02d %02d:%02d:%02d.%06ld ",
+                     t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+                     t.tm_hour, t.tm_min, t.tm_sec, (long)(header.usec % 1000000));
+            line = prefix;
+            line += LevelTitle(header.level);
+            if(header.fmtId < formats.size() && !formats[header.fmtId].format.empty()){
+                LogFormatRecord(formats[header.fmtId].format.c_str(), payload, payloadLen, header.argc, &line);
+            }else{
+                unknown++;
+                line += "<unknown format " + to_string(header.fmtId) + ">";
+            }
+            line.push_back('\n');
+            fwrite(line.data(), 1, line.size(), stdout);
+        }
+    }
+    fprintf(stderr, "%zu entries, %zu with unknown format\n", entries, unknown);
+    return 0;
+}
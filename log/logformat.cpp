@@ -0,0 +1,135 @@
+#include"logformat.h"
+#include<stdio.h>
+#include<algorithm>
+
+//从参数区取出下一个参数，成功返回true
+static bool NextArg(const char*& p, const char* end, int& argc, char* tag,
+                    uint64_t* value, const char** str, uint32_t* strLen){
+    if(argc <= 0 || p >= end){
+        return false;
+    }
+    *tag = *p++;
+    if(*tag == LOG_ARG_STR){
+        if(end - p < 4){
+            return false;
+        }
+        memcpy(strLen, p, 4);
+        p += 4;
+        if((size_t)(end - p) < *strLen){
+            return false;
+        }
+        *str = p;
+        p += *strLen;
+    }else{
+        if(end - p < 8){
+            return false;
+        }
+        memcpy(value, p, 8);
+        p += 8;
+    }
+    argc--;
+    return true;
+}
+
+void LogFormatRecord(const char* fmt, const char* args, size_t argLen, int argc, std::string* out){
+    const char* p = args;
+    const char* end = args + argLen;
+    char buff[512];
+    while(*fmt){
+        if(*fmt != '%'){
+            const char* next = strchr(fmt, '%');
+            size_t n = next ? (size_t)(next - fmt) : strlen(fmt);
+            out->append(fmt, n);
+            fmt += n;
+            continue;
+        }
+        if(fmt[1] == '%'){
+            out->push_back('%');
+            fmt += 2;
+            continue;
+        }
+        //拆出一个转换说明符：标志、宽度、精度、长度修饰、转换字符
+        std::string spec = "%";
+        const char* s = fmt + 1;
+        while(*s && strchr("-+ #0", *s)){
+            spec.push_back(*s++);
+        }
+        //宽度和精度的*也各占一个参数
+        for(int part = 0; part < 2; part++){
+            if(part == 1){
+                if(*s != '.'){
+                    break;
+                }
+                spec.push_back(*s++);
+            }
+            if(*s == '*'){
+                char tag; uint64_t v = 0; const char* str; uint32_t len;
+                if(NextArg(p, end, argc, &tag, &v, &str, &len) && tag != LOG_ARG_STR){
+                    spec += std::to_string((long long)(int64_t)v);
+                }
+                s++;
+            }
+            while(*s >= '0' && *s <= '9'){
+                spec.push_back(*s++);
+            }
+        }
+        while(*s && strchr("hlLqjzt", *s)){
+            s++;//长度修饰统一换成记录时的64位类型
+        }
+        char conv = *s;
+        if(!conv){
+            break;
+        }
+        fmt = s + 1;
+
+        char tag; uint64_t v = 0; const char* str = nullptr; uint32_t len = 0;
+        if(!NextArg(p, end, argc, &tag, &v, &str, &len)){
+            out->append("<?>");
+            continue;
+        }
+        int n = -1;
+        switch(conv){
+        case 'd': case 'i':
+            if(tag == LOG_ARG_INT || tag == LOG_ARG_UINT){
+                n = snprintf(buff, sizeof(buff), (spec + "ll" + conv).c_str(), (long long)(int64_t)v);
+            }
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            if(tag == LOG_ARG_INT || tag == LOG_ARG_UINT){
+                n = snprintf(buff, sizeof(buff), (spec + "ll" + conv).c_str(), (unsigned long long)v);
+            }
+            break;
+        case 'c':
+            if(tag == LOG_ARG_INT || tag == LOG_ARG_UINT){
+                n = snprintf(buff, sizeof(buff), (spec + conv).c_str(), (int)v);
+            }
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if(tag == LOG_ARG_DOUBLE){
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                n = snprintf(buff, sizeof(buff), (spec + conv).c_str(), d);
+            }
+            break;
+        case 's':
+            if(tag == LOG_ARG_STR){
+                //记录的字符串不带结束符，复制出来再交给snprintf处理宽度和精度
+                std::string tmp(str, len);
+                n = snprintf(buff, sizeof(buff), (spec + conv).c_str(), tmp.c_str());
+            }
+            break;
+        case 'p':
+            if(tag == LOG_ARG_PTR || tag == LOG_ARG_UINT){
+                n = snprintf(buff, sizeof(buff), "%p", (void*)(uintptr_t)v);
+            }
+            break;
+        default:
+            break;
+        }
+        if(n < 0){
+            out->append("<?>");
+        }else{
+            out->append(buff, std::min((size_t)n, sizeof(buff) - 1));
+        }
+    }
+}
@@ -0,0 +1,42 @@
+//延迟格式化日志的记录格式
+//调用处只记录格式串编号和参数的原始字节，由写线程或离线解码工具(logdecode)再格式化
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+#include<stdint.h>
+#include<string.h>
+#include<string>
+
+//每条记录的头部，记录在内存缓冲区和二进制日志文件中的布局相同（主机字节序）
+struct LogRecordHeader{
+    uint32_t len;//整条记录的长度，包括头部
+    uint8_t kind;//记录类型，见下面的LOG_RECORD_*
+    uint8_t level;
+    uint8_t argc;
+    uint8_t reserved;
+    uint32_t fmtId;
+    int64_t usec;//时间戳，微秒
+};
+
+enum{
+    LOG_RECORD_SESSION = 'H',//文件头，之后的格式串编号重新定义
+    LOG_RECORD_FORMAT = 'F',//格式串定义，负载为"file:line\0format\0"
+    LOG_RECORD_ENTRY = 'E',//一条日志，负载为参数
+};
+
+//参数的类型标记，后面跟8字节的值，字符串为4字节长度加内容
+enum{
+    LOG_ARG_INT = 'i',
+    LOG_ARG_UINT = 'u',
+    LOG_ARG_DOUBLE = 'f',
+    LOG_ARG_STR = 's',
+    LOG_ARG_PTR = 'p',
+};
+
+static const char LOG_BINARY_MAGIC[8] = {'T','W','S','L','O','G','B','1'};
+
+//按格式串逐个转换说明符格式化已记录的参数，结果追加到out
+//参数类型与说明符不匹配时输出<?>，不会越界读取
+void LogFormatRecord(const char* fmt, const char* args, size_t argLen, int argc, std::string* out);
+
+#endif
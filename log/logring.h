@@ -0,0 +1,79 @@
+//单生产者单消费者的无锁环形缓冲区
+//每个写日志的线程各有一个，生产者是该线程，消费者是日志的写线程
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include<atomic>
+#include<vector>
+#include<string.h>
+#include<assert.h>
+#include<sys/uio.h>
+#include<algorithm>
+
+class LogRing{
+public:
+    //capacity必须是2的幂
+    explicit LogRing(size_t capacity):buf_(capacity),mask_(capacity - 1),head_(0),tail_(0){
+        assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    }
+
+    //生产者写入一整条日志，空间不够时返回false，不会写入半条
+    bool Push(const char* data, size_t len){
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        if(len > buf_.size() - (head - tail)){
+            return false;
+        }
+        size_t pos = head & mask_;
+        size_t first = std::min(len, buf_.size() - pos);
+        memcpy(&buf_[pos], data, first);
+        memcpy(&buf_[0], data + first, len - first);
+        head_.store(head + len, std::memory_order_release);//发布给消费者
+        return true;
+    }
+
+    //消费者取出可读区域，回绕时分成两段，返回使用的iovec个数
+    int Peek(struct iovec* iov, size_t* bytes){
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t len = head - tail;
+        *bytes = len;
+        if(len == 0){
+            return 0;
+        }
+        size_t pos = tail & mask_;
+        size_t first = std::min(len, buf_.size() - pos);
+        iov[0].iov_base = &buf_[pos];
+        iov[0].iov_len = first;
+        if(first == len){
+            return 1;
+        }
+        iov[1].iov_base = &buf_[0];
+        iov[1].iov_len = len - first;
+        return 2;
+    }
+
+    //消费者写完后释放空间
+    void Consume(size_t len){
+        tail_.store(tail_.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    }
+
+    size_t Size() const{
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    size_t Capacity() const{
+        return buf_.size();
+    }
+
+private:
+    std::vector<char> buf_;
+    size_t mask_;
+    //读写下标用填充隔开放在不同的缓存行，避免伪共享
+    char pad0_[64];
+    std::atomic<size_t> head_;//写下标，只由生产者修改
+    char pad1_[64];
+    std::atomic<size_t> tail_;//读下标，只由消费者修改
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include"adminserver.h"
+#include<unistd.h>
+#include<string.h>
+#include<poll.h>
+#include<sys/uio.h>
+#include<sys/socket.h>
+#include<sys/time.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include"../log/log.h"
+
+using namespace std;
+
+AdminServer::AdminServer():listenFd_(-1), running_(false){}
+
+AdminServer::~AdminServer(){
+    Stop();
+}
+
+AdminServer* AdminServer::Instance(){
+    static AdminServer server;
+    return &server;
+}
+
+bool AdminServer::Start(uint16_t port, const char* bindAddr){
+    if(running_){
+        return true;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, bindAddr && *bindAddr ? bindAddr : "127.0.0.1", &addr.sin_addr) != 1){
+        LOG_ERROR("AdminServer: bad bind address %s", bindAddr);
+        return false;
+    }
+    listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listenFd_ < 0){
+        return false;
+    }
+    int one = 1;
+    setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd_, 16) < 0){
+        LOG_ERROR("AdminServer: bind port %d error", port);
+        close(listenFd_);
+        listenFd_ = -1;
+        return false;
+    }
+    running_ = true;
+    thread_ = thread(&AdminServer::Loop_, this);
+    LOG_INFO("AdminServer port: %d", port);
+    return true;
+}
+
+void AdminServer::Stop(){
+    if(!running_){
+        return;
+    }
+    running_ = false;
+    if(thread_.joinable()){
+        thread_.join();
+    }
+    close(listenFd_);
+    listenFd_ = -1;
+}
+
+void AdminServer::Handle(const string& path, const char* contentType, Handler handler){
+    lock_guard<mutex> locker(mtx_);
+    routes_[path] = Route{contentType, move(handler)};
+}
+
+//accept用poll等待，定期检查停止标志
+void AdminServer::Loop_(){
+    struct pollfd pfd;
+    pfd.fd = listenFd_;
+    pfd.events = POLLIN;
+    while(running_){
+        if(poll(&pfd, 1, POLL_MS) <= 0){
+            continue;
+        }
+        int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if(fd < 0){
+            continue;
+        }
+        //客户端不发请求或不读响应时最多阻塞这么久
+        struct timeval tv = {IO_TIMEOUT_SEC, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        Serve_(fd);
+        close(fd);
+    }
+}
+
+void AdminServer::Serve_(int fd){
+    string req;
+    char buf[1024];
+    while(req.find("\r\n\r\n") == string::npos && req.size() < MAX_REQUEST){
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0){
+            return;
+        }
+        req.append(buf, n);
+    }
+    //请求行：GET /path?query HTTP/1.1
+    size_t sp1 = req.find(' ');
+    size_t sp2 = sp1 == string::npos ? string::npos : req.find(' ', sp1 + 1);
+    int code = 200;
+    string body, type = "text/plain";
+    if(sp2 == string::npos || req.compare(0, sp1, "GET") != 0){
+        code = 400;
+        body = "bad request\n";
+    }else{
+        string target = req.substr(sp1 + 1, sp2 - sp1 - 1);
+        size_t q = target.find('?');
+        string path = target.substr(0, q);
+        string query = q == string::npos ? "" : target.substr(q + 1);
+        Route route;
+        {
+            lock_guard<mutex> locker(mtx_);
+            auto it = routes_.find(path);
+            if(it != routes_.end()){
+                route = it->second;
+            }
+        }
+        if(route.handler){
+            body = route.handler(query);
+            type = route.contentType;
+        }else{
+            code = 404;
+            body = "not found\n";
+        }
+    }
+    char head[256];
+    int len = snprintf(head, sizeof(head),
+                       "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                       code, code == 200 ? "OK" : (code == 404 ? "Not Found" : "Bad Request"),
+                       type.c_str(), body.size());
+    struct iovec iov[2] = {{head, (size_t)len}, {&body[0], body.size()}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    size_t total = len + body.size();
+    size_t sent = 0;
+    while(sent < total){
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(n <= 0){
+            return;
+        }
+        sent += n;
+        //跳过已经发送的部分
+        while(n > 0 && msg.msg_iovlen > 0){
+            if((size_t)n >= msg.msg_iov[0].iov_len){
+                n -= msg.msg_iov[0].iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }else{
+                msg.msg_iov[0].iov_base = (char*)msg.msg_iov[0].iov_base + n;
+                msg.msg_iov[0].iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+}
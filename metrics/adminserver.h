@@ -0,0 +1,52 @@
+//管理端口：独立线程上的极简HTTP服务，只处理GET，每个连接一个请求，响应后关闭
+//与业务端口分开，抓取指标或导出诊断信息不占用工作线程，也不受业务端口的限流影响
+#ifndef ADMIN_SERVER_H
+#define ADMIN_SERVER_H
+
+#include<string>
+#include<unordered_map>
+#include<mutex>
+#include<thread>
+#include<atomic>
+#include<functional>
+#include<stdint.h>
+
+class AdminServer{
+public:
+    //query为'?'之后的部分，返回消息体
+    typedef std::function<std::string(const std::string& query)> Handler;
+
+    static AdminServer* Instance();
+
+    //bindAddr为空时只监听127.0.0.1
+    bool Start(uint16_t port, const char* bindAddr);
+    void Stop();
+    bool IsRunning() const {return running_;}
+
+    //contentType为完整的Content-Type取值
+    void Handle(const std::string& path, const char* contentType, Handler handler);
+
+private:
+    AdminServer();
+    ~AdminServer();
+
+    struct Route{
+        std::string contentType;
+        Handler handler;
+    };
+
+    static const int POLL_MS = 200;//检查停止标志的间隔
+    static const int IO_TIMEOUT_SEC = 2;
+    static const size_t MAX_REQUEST = 8192;
+
+    void Loop_();
+    void Serve_(int fd);
+
+    int listenFd_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+    std::mutex mtx_;//保护routes_
+    std::unordered_map<std::string, Route> routes_;
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include"metrics.h"
+#include<stdio.h>
+
+using namespace std;
+
+size_t MetricShard(){
+    static atomic<size_t> next(0);
+    thread_local size_t shard = next.fetch_add(1, memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+Counter::Counter(){
+    for(auto& cell : cells_){
+        cell.value.store(0, memory_order_relaxed);
+    }
+}
+
+uint64_t Counter::Value() const{
+    uint64_t sum = 0;
+    for(auto& cell : cells_){
+        sum += cell.value.load(memory_order_relaxed);
+    }
+    return sum;
+}
+
+Histogram::Histogram(){
+    for(auto& shard : shards_){
+        for(auto& cnt : shard.counts){
+            cnt.store(0, memory_order_relaxed);
+        }
+        shard.sum.store(0, memory_order_relaxed);
+    }
+}
+
+//最高位决定所在的2的幂区间，其后SUB_BITS位决定区间内的桶
+int Histogram::BucketOf(uint64_t value){
+    if(value < (uint64_t)LINEAR){
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int sub = (int)(value >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+    return LINEAR + (msb - SUB_BITS - 1) * (1 << SUB_BITS) + sub;
+}
+
+uint64_t Histogram::UpperBound(int bucket){
+    if(bucket < LINEAR){
+        return bucket + 1;
+    }
+    int msb = (bucket - LINEAR) / (1 << SUB_BITS) + SUB_BITS + 1;
+    int sub = (bucket - LINEAR) % (1 << SUB_BITS);
+    uint64_t width = 1ULL << (msb - SUB_BITS);
+    uint64_t lower = ((uint64_t)(1 << SUB_BITS) + sub) << (msb - SUB_BITS);
+    return lower + width < lower ? UINT64_MAX : lower + width;
+}
+
+void Histogram::Record(uint64_t value){
+    Shard& shard = shards_[MetricShard()];
+    shard.counts[BucketOf(value)].fetch_add(1, memory_order_relaxed);
+    shard.sum.fetch_add(value, memory_order_relaxed);
+}
+
+//各分片分别读取，抓取期间的并发写入可能让总数和各桶之和相差几个，可以接受
+void Histogram::Collect(vector<uint64_t>* counts, uint64_t* sum, uint64_t* count) const{
+    counts->assign(BUCKETS, 0);
+    *sum = 0;
+    *count = 0;
+    for(auto& shard : shards_){
+        for(int i = 0; i < BUCKETS; i++){
+            uint64_t n = shard.counts[i].load(memory_order_relaxed);
+            (*counts)[i] += n;
+            *count += n;
+        }
+        *sum += shard.sum.load(memory_order_relaxed);
+    }
+}
+
+uint64_t Histogram::Percentile(double q) const{
+    vector<uint64_t> counts;
+    uint64_t sum, count;
+    Collect(&counts, &sum, &count);
+    if(count == 0){
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * count);
+    if(rank >= count){
+        rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKETS; i++){
+        seen += counts[i];
+        if(seen > rank){
+            return UpperBound(i);
+        }
+    }
+    return UpperBound(BUCKETS - 1);
+}
+
+//按状态码分开计数，不在表中的归入最后一个槽位
+const int Metrics::STATUS_CODES[] = {
+    200, 206, 304, 400, 403, 404, 408, 413, 429, 431, 500, 503,
+};
+
+Metrics::Metrics(){}
+
+Metrics* Metrics::Instance(){
+    static Metrics metrics;
+    return &metrics;
+}
+
+void Metrics::CountStatus(int code){
+    int i = 0;
+    while(i < STATUS_CNT - 1 && STATUS_CODES[i] != code){
+        i++;
+    }
+    status_[i].Add();
+}
+
+void Metrics::AddGauge(const char* name, const char* help, function<double()> fn){
+    lock_guard<mutex> locker(mtx_);
+    callbacks_.push_back({name, help, false, move(fn)});
+}
+
+void Metrics::AddCounter(const char* name, const char* help, function<double()> fn){
+    lock_guard<mutex> locker(mtx_);
+    callbacks_.push_back({name, help, true, move(fn)});
+}
+
+void Metrics::ClearCallbacks(){
+    lock_guard<mutex> locker(mtx_);
+    callbacks_.clear();
+}
+
+static void RenderValue(string* out, const char* name, const char* help, const char* type, double value){
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+    *out += line;
+}
+
+//Prometheus的直方图桶是累计的；这里只在2的幂(微秒)处输出，正好落在内部桶的边界上
+void Metrics::RenderHistogram_(string* out, const char* name, const char* help, const Histogram& hist){
+    static const int MIN_POW = Histogram::SUB_BITS + 1;//16us
+    static const int MAX_POW = 26;//约67s
+    vector<uint64_t> counts;
+    uint64_t sum, count;
+    hist.Collect(&counts, &sum, &count);
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    *out += line;
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for(int pow = MIN_POW; pow <= MAX_POW; pow++){
+        int end = Histogram::BucketOf(1ULL << pow);//2^pow所在的桶是第一个不小于它的桶
+        for(; bucket < end; bucket++){
+            cumulative += counts[bucket];
+        }
+        snprintf(line, sizeof(line), "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ULL << pow) / 1e6,
+                 (unsigned long long)cumulative);
+        *out += line;
+    }
+    snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n",
+             name, (unsigned long long)count, name, sum / 1e6, name, (unsigned long long)count);
+    *out += line;
+}
+
+string Metrics::Render(){
+    string out;
+    out.reserve(8192);
+    RenderValue(&out, "tws_accepts_total", "Accepted connections.", "counter", accepts.Value());
+    RenderValue(&out, "tws_bytes_received_total", "Bytes read from clients.", "counter", bytesIn.Value());
+    RenderValue(&out, "tws_bytes_sent_total", "Bytes written to clients.", "counter", bytesOut.Value());
+    RenderValue(&out, "tws_http_parse_errors_total", "Requests that failed to parse.", "counter", parseErrors.Value());
+    RenderValue(&out, "tws_timer_expirations_total", "Connections closed by the idle timer.", "counter",
+                timerExpirations.Value());
+
+    static const char* REJECT_NAMES[REJECT_REASON_CNT] = {"conns", "queue_depth", "queue_wait",
+                                                           "ip_conns", "ip_rate", "ip_auth"};
+    out += "# HELP tws_admission_rejected_total Connections and requests rejected by admission control.\n"
+           "# TYPE tws_admission_rejected_total counter\n";
+    char line[128];
+    for(int i = 0; i < REJECT_REASON_CNT; i++){
+        snprintf(line, sizeof(line), "tws_admission_rejected_total{reason=\"%s\"} %llu\n",
+                 REJECT_NAMES[i], (unsigned long long)rejected[i].Value());
+        out += line;
+    }
+    RenderValue(&out, "tws_idle_connections_shed_total", "Idle keep-alive connections closed near the connection limit.",
+                "counter", idleShed.Value());
+
+    out += "# HELP tws_http_responses_total Responses by status code.\n"
+           "# TYPE tws_http_responses_total counter\n";
+    for(int i = 0; i < STATUS_CNT; i++){
+        if(i < STATUS_CNT - 1){
+            snprintf(line, sizeof(line), "tws_http_responses_total{code=\"%d\"} %llu\n",
+                     STATUS_CODES[i], (unsigned long long)status_[i].Value());
+        }else{
+            snprintf(line, sizeof(line), "tws_http_responses_total{code=\"other\"} %llu\n",
+                     (unsigned long long)status_[i].Value());
+        }
+        out += line;
+    }
+
+    RenderHistogram_(&out, "tws_http_request_duration_seconds",
+                     "From the first request byte to the last response byte.", requestLatency);
+    RenderHistogram_(&out, "tws_threadpool_wait_seconds", "Time tasks spend queued in the thread pool.", poolWait);
+    RenderHistogram_(&out, "tws_sqlpool_wait_seconds", "Time to borrow a connection from SqlConnPool.", sqlWait);
+    RenderHistogram_(&out, "tws_sql_query_seconds", "Database query execution time.", sqlQuery);
+
+    lock_guard<mutex> locker(mtx_);
+    for(auto& cb : callbacks_){
+        RenderValue(&out, cb.name.c_str(), cb.help.c_str(), cb.isCounter ? "counter" : "gauge", cb.fn());
+    }
+    return out;
+}
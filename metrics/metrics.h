@@ -0,0 +1,126 @@
+//运行指标
+//计数器和直方图按线程分片：每个线程固定写一个按缓存行对齐的分片，请求路径上只有一次relaxed原子加，
+//不加锁也没有跨线程的缓存行争用；读取(抓取)时把所有分片加起来
+//直方图按HDR的方式分桶：小于16的值每个值一个桶，之后每个2的幂区间分8个桶，相对误差不超过12.5%
+//Render输出Prometheus文本格式，由HttpConn的指标路径或AdminServer提供
+#ifndef METRICS_H
+#define METRICS_H
+
+#include<string>
+#include<vector>
+#include<mutex>
+#include<atomic>
+#include<functional>
+#include<chrono>
+#include<stdint.h>
+
+static const int METRIC_SHARDS = 16;
+
+//当前线程使用的分片下标，线程第一次使用时按顺序分配
+size_t MetricShard();
+
+class Counter{
+public:
+    Counter();
+    void Add(uint64_t n = 1){
+        cells_[MetricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t Value() const;
+
+private:
+    struct alignas(64) Cell{
+        std::atomic<uint64_t> value;
+    };
+    Cell cells_[METRIC_SHARDS];
+};
+
+class Histogram{
+public:
+    static const int SUB_BITS = 3;//每个2的幂区间分成2^SUB_BITS个桶
+    static const int LINEAR = 2 << SUB_BITS;//小于它的值每个值一个桶
+    static const int BUCKETS = LINEAR + (64 - SUB_BITS - 1) * (1 << SUB_BITS);
+
+    Histogram();
+    void Record(uint64_t value);
+    //常用的记录方式：从begin到现在经过的微秒数
+    void RecordSince(std::chrono::steady_clock::time_point begin){
+        Record(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - begin).count());
+    }
+
+    //所有分片合并后的各桶计数、总和与总数
+    void Collect(std::vector<uint64_t>* counts, uint64_t* sum, uint64_t* count) const;
+    //合并后的第q(0~1)分位数，返回所在桶的上界
+    uint64_t Percentile(double q) const;
+
+    static int BucketOf(uint64_t value);
+    static uint64_t UpperBound(int bucket);//桶内值都小于上界
+
+private:
+    struct alignas(64) Shard{
+        std::atomic<uint64_t> counts[BUCKETS];
+        std::atomic<uint64_t> sum;
+    };
+    Shard shards_[METRIC_SHARDS];
+};
+
+class Metrics{
+public:
+    static Metrics* Instance();
+
+    //准入控制拒绝的原因
+    enum REJECT_REASON{
+        REJECT_CONNS,//连接数达到上限
+        REJECT_QUEUE_DEPTH,//线程池排队任务数达到上限
+        REJECT_QUEUE_WAIT,//线程池排队时间超过阈值
+        REJECT_IP_CONNS,//单个IP的连接数达到上限
+        REJECT_IP_RATE,//单个IP的请求速率超限
+        REJECT_IP_AUTH,//单个IP的登录/注册速率超限
+        REJECT_REASON_CNT,
+    };
+
+    //请求路径上直接使用的指标
+    Counter accepts;
+    Counter bytesIn;
+    Counter bytesOut;
+    Counter parseErrors;
+    Counter timerExpirations;
+    Counter rejected[REJECT_REASON_CNT];//准入控制拒绝的连接和请求
+    Counter idleShed;//连接数接近上限时关闭的空闲长连接
+    Histogram requestLatency;//收到请求第一个字节到响应写完，微秒
+    Histogram poolWait;//线程池任务排队时间，微秒
+    Histogram sqlWait;//从连接池借连接的等待时间，微秒
+    Histogram sqlQuery;//一次查询的执行时间，微秒
+
+    void CountStatus(int code);
+
+    //抓取时才取值的指标，启动时登记，fn在抓取线程中调用
+    void AddGauge(const char* name, const char* help, std::function<double()> fn);
+    void AddCounter(const char* name, const char* help, std::function<double()> fn);
+    //回调引用的对象销毁前调用
+    void ClearCallbacks();
+
+    std::string Render();
+
+private:
+    Metrics();
+    ~Metrics() = default;
+
+    struct Callback{
+        std::string name;
+        std::string help;
+        bool isCounter;
+        std::function<double()> fn;
+    };
+
+    static const int STATUS_CODES[];
+    static const int STATUS_CNT = 13;//最后一个槽位统计其他状态码
+
+    void RenderHistogram_(std::string* out, const char* name, const char* help, const Histogram& hist);
+
+    Counter status_[STATUS_CNT];
+    std::mutex mtx_;//保护callbacks_，只在登记和抓取时使用
+    std::vector<Callback> callbacks_;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include"asyncsql.h"
+#include<sys/eventfd.h>
+#include<mysql/errmsg.h>
+
+using namespace std;
+
+AsyncSql::AsyncSql(){
+    isOpen_ = false;
+    epoller_ = nullptr;
+    inboxFd_ = -1;
+    pending_ = 0;
+}
+
+AsyncSql::~AsyncSql(){
+    Close();
+}
+
+AsyncSql* AsyncSql::Instance(){
+    static AsyncSql sql;
+    return &sql;
+}
+
+bool AsyncSql::Init(Epoller* epoller, const char* host, uint16_t port,
+                    const char* user, const char* pwd,
+                    const char* dbName, int connSize){
+    assert(epoller && connSize > 0);
+#ifndef MYSQL_WAIT_READ
+    //MySQL官方客户端库没有*_start/*_cont接口
+    LOG_WARN("AsyncSql: client library has no non-blocking API");
+    return false;
+#else
+    epoller_ = epoller;
+    conns_.reserve(connSize);//fdConn_保存元素地址，之后不能再扩容
+    for(int i = 0; i < connSize; i++){
+        MYSQL* mysql = mysql_init(nullptr);
+        if(!mysql){
+            LOG_ERROR("AsyncSql: mysql init error");
+            break;
+        }
+        mysql_options(mysql, MYSQL_OPT_NONBLOCK, 0);
+        //连接只在启动时建立一次，用阻塞方式即可
+        if(!mysql_real_connect(mysql, host, user, pwd, dbName, port, nullptr, 0)){
+            LOG_ERROR("AsyncSql: mysql connect error: %s", mysql_error(mysql));
+            mysql_close(mysql);
+            continue;
+        }
+        Conn conn;
+        conn.mysql = mysql;
+        conn.fd = mysql_get_socket(mysql);
+        conn.state = IDLE;
+        conn.err = 0;
+        conn.res = nullptr;
+        conns_.push_back(conn);
+    }
+    if(conns_.empty()){
+        return false;
+    }
+    inboxFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(inboxFd_ < 0){
+        LOG_ERROR("AsyncSql: eventfd error");
+        Close();
+        return false;
+    }
+    epoller_->AddFd(inboxFd_, EPOLLIN);
+    for(auto& conn : conns_){
+        //空闲时不关心读写，只会收到EPOLLERR/EPOLLHUP
+        epoller_->AddFd(conn.fd, 0);
+        fdConn_[conn.fd] = &conn;
+    }
+    isOpen_ = true;
+    LOG_INFO("AsyncSql: %d connections", (int)conns_.size());
+    return true;
+#endif
+}
+
+void AsyncSql::Close(){
+    for(auto& conn : conns_){
+        if(epoller_ && conn.state != BROKEN){
+            epoller_->DelFd(conn.fd);
+        }
+        if(conn.res){
+            mysql_free_result(conn.res);
+        }
+        mysql_close(conn.mysql);
+    }
+    conns_.clear();
+    fdConn_.clear();
+    waiting_.clear();
+    {
+        lock_guard<mutex> locker(mtx_);
+        inbox_.clear();
+        posted_.clear();
+    }
+    if(inboxFd_ >= 0){
+        if(epoller_){
+            epoller_->DelFd(inboxFd_);
+        }
+        close(inboxFd_);
+        inboxFd_ = -1;
+    }
+    isOpen_ = false;
+}
+
+void AsyncSql::Query(const char* sql, vector<string> params, Callback done){
+    if(!isOpen_){
+        done(nullptr, false);
+        return;
+    }
+    {
+        lock_guard<mutex> locker(mtx_);
+        pending_++;
+        inbox_.push_back(Task{sql, move(params), move(done)});
+    }
+    uint64_t one = 1;
+    ::write(inboxFd_, &one, sizeof(one));
+}
+
+void AsyncSql::Post(function<void()> fn){
+    if(!isOpen_){
+        fn();
+        return;
+    }
+    {
+        lock_guard<mutex> locker(mtx_);
+        posted_.push_back(move(fn));
+    }
+    uint64_t one = 1;
+    ::write(inboxFd_, &one, sizeof(one));
+}
+
+bool AsyncSql::HandleEvent(int fd, uint32_t events){
+    if(!isOpen_){
+        return false;
+    }
+    if(fd == inboxFd_){
+        vector<function<void()>> posted;
+        DrainInbox_(&posted);
+        Dispatch_();
+        for(auto& fn : posted){
+            fn();
+        }
+        return true;
+    }
+    auto it = fdConn_.find(fd);
+    if(it == fdConn_.end()){
+        return false;
+    }
+#ifdef MYSQL_WAIT_READ
+    Conn* conn = it->second;
+    if(conn->state == QUERY || conn->state == STORE){
+        //出错时也让客户端库去读，由它返回具体的错误
+        int mask = 0;
+        if(events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP)){
+            mask |= MYSQL_WAIT_READ;
+        }
+        if(events & EPOLLOUT){
+            mask |= MYSQL_WAIT_WRITE;
+        }
+        int status = conn->state == QUERY ? mysql_real_query_cont(&conn->err, conn->mysql, mask)
+                                          : mysql_store_result_cont(&conn->res, conn->mysql, mask);
+        Step_(conn, status);
+    }else if(conn->state == IDLE && (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))){
+        //空闲连接被数据库关闭(例如超过wait_timeout)
+        LOG_WARN("AsyncSql: connection fd[%d] closed by server", fd);
+        conn->state = BROKEN;
+        epoller_->DelFd(fd);
+    }
+#endif
+    Dispatch_();
+    return true;
+}
+
+void AsyncSql::DrainInbox_(vector<function<void()>>* posted){
+    uint64_t cnt;
+    while(read(inboxFd_, &cnt, sizeof(cnt)) > 0){
+    }
+    lock_guard<mutex> locker(mtx_);
+    posted->swap(posted_);
+    while(!inbox_.empty()){
+        waiting_.push_back(move(inbox_.front()));
+        inbox_.pop_front();
+    }
+}
+
+void AsyncSql::Dispatch_(){
+    bool alive = false;
+    for(auto& conn : conns_){
+        //查询可能立即完成，连接又变回空闲，继续分配
+        while(conn.state == IDLE && !waiting_.empty()){
+            Task task = move(waiting_.front());
+            waiting_.pop_front();
+            pending_--;
+            Start_(&conn, task);
+        }
+        alive = alive || conn.state != BROKEN;
+    }
+    if(!alive){
+        //所有连接都已失效，等待的查询直接失败，不让请求一直挂起
+        while(!waiting_.empty()){
+            Task task = move(waiting_.front());
+            waiting_.pop_front();
+            pending_--;
+            task.done(nullptr, false);
+        }
+    }
+}
+
+bool AsyncSql::BuildSql_(MYSQL* mysql, const Task& task, string* sql){
+    sql->clear();
+    size_t k = 0;
+    for(const char* p = task.sql.c_str(); *p; p++){
+        if(*p != '?'){
+            sql->push_back(*p);
+            continue;
+        }
+        if(k >= task.params.size()){
+            return false;
+        }
+        const string& value = task.params[k++];
+        string escaped(value.size() * 2 + 1, '\0');
+        unsigned long n = mysql_real_escape_string(mysql, &escaped[0], value.c_str(), value.size());
+        sql->push_back('\'');
+        sql->append(escaped.data(), n);
+        sql->push_back('\'');
+    }
+    return k == task.params.size();
+}
+
+void AsyncSql::Start_(Conn* conn, Task& task){
+#ifdef MYSQL_WAIT_READ
+    if(!BuildSql_(conn->mysql, task, &conn->sql)){
+        LOG_ERROR("AsyncSql: parameter count mismatch: %s", task.sql.c_str());
+        task.done(nullptr, false);
+        return;
+    }
+    conn->done = move(task.done);
+    conn->start = chrono::steady_clock::now();
+    conn->state = QUERY;
+    conn->err = 0;
+    conn->res = nullptr;
+    int status = mysql_real_query_start(&conn->err, conn->mysql, conn->sql.c_str(), conn->sql.size());
+    Step_(conn, status);
+#endif
+}
+
+//status为0表示当前步骤完成，否则是客户端库要等待的事件
+void AsyncSql::Step_(Conn* conn, int status){
+#ifdef MYSQL_WAIT_READ
+    while(status == 0){
+        if(conn->state == QUERY){
+            if(conn->err){
+                LOG_ERROR("AsyncSql: query error: %s", mysql_error(conn->mysql));
+                Finish_(conn, false);
+                return;
+            }
+            conn->state = STORE;
+            status = mysql_store_result_start(&conn->res, conn->mysql);
+        }else{
+            //INSERT等语句没有结果集，res为空但不是错误
+            Finish_(conn, conn->res != nullptr || mysql_field_count(conn->mysql) == 0);
+            return;
+        }
+    }
+    uint32_t events = 0;
+    if(status & MYSQL_WAIT_READ){
+        events |= EPOLLIN;
+    }
+    if(status & MYSQL_WAIT_WRITE){
+        events |= EPOLLOUT;
+    }
+    //只等超时的情况下也等可读，连接出错会收到EPOLLERR
+    epoller_->ModFd(conn->fd, events ? events : EPOLLIN);
+#endif
+}
+
+void AsyncSql::Finish_(Conn* conn, bool ok){
+    Metrics::Instance()->sqlQuery.RecordSince(conn->start);
+    Callback done = move(conn->done);
+    MYSQL_RES* res = conn->res;
+    conn->res = nullptr;
+    conn->done = nullptr;
+    unsigned int errNo = mysql_errno(conn->mysql);
+    if(!ok && (errNo == CR_SERVER_GONE_ERROR || errNo == CR_SERVER_LOST)){
+        LOG_ERROR("AsyncSql: connection fd[%d] lost", conn->fd);
+        conn->state = BROKEN;
+        epoller_->DelFd(conn->fd);
+    }else{
+        conn->state = IDLE;
+        epoller_->ModFd(conn->fd, 0);
+    }
+    if(done){
+        done(res, ok);
+    }
+    if(res){
+        mysql_free_result(res);
+    }
+}
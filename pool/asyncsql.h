@@ -0,0 +1,98 @@
+//事件循环驱动的非阻塞数据库查询
+//使用MariaDB客户端库的非阻塞接口(mysql_*_start/mysql_*_cont)，每个连接的套接字注册到服务器的epoll中，
+//工作线程通过eventfd把查询交给事件循环，查询在等待数据库时不占用任何线程，
+//结果到达后在事件循环线程中回调。客户端库没有非阻塞接口时Init返回false，调用者继续用SqlConnPool
+#ifndef ASYNC_SQL_H
+#define ASYNC_SQL_H
+
+#include<mysql/mysql.h>
+#include<string>
+#include<vector>
+#include<deque>
+#include<mutex>
+#include<functional>
+#include<unordered_map>
+#include<atomic>
+#include<stdint.h>
+#include"../log/log.h"
+#include"../server/epoller.h"
+#include"../metrics/metrics.h"
+
+class AsyncSql{
+public:
+    //res为查询结果，没有结果集(如INSERT)或出错时为nullptr，回调返回后释放
+    typedef std::function<void(MYSQL_RES* res, bool ok)> Callback;
+
+    static AsyncSql* Instance();
+
+    //在事件循环线程调用，连接在这里同步建立
+    bool Init(Epoller* epoller, const char* host, uint16_t port,
+              const char* user, const char* pwd,
+              const char* dbName, int connSize);
+    void Close();
+    bool IsOpen() const {return isOpen_;}
+
+    //任意线程调用：sql中的?依次替换为转义并加上引号的参数，done在事件循环线程中执行，应尽快返回
+    //没有初始化时done在调用线程中立即以失败返回
+    void Query(const char* sql, std::vector<std::string> params, Callback done);
+
+    //任意线程调用：fn交给事件循环线程执行，用于把其他线程得到的结果送回事件循环
+    //没有初始化时在调用线程中立即执行
+    void Post(std::function<void()> fn);
+
+    //事件循环收到事件时先交给这里，fd不属于AsyncSql时返回false
+    bool HandleEvent(int fd, uint32_t events);
+
+    size_t Pending() const {return pending_.load(std::memory_order_relaxed);}//还没有开始执行的查询数
+
+private:
+    AsyncSql();
+    ~AsyncSql();
+
+    struct Task{
+        std::string sql;
+        std::vector<std::string> params;
+        Callback done;
+    };
+
+    enum STATE{
+        IDLE,
+        QUERY,//mysql_real_query进行中
+        STORE,//mysql_store_result进行中
+        BROKEN,//连接出错，不再使用
+    };
+
+    struct Conn{
+        MYSQL* mysql;
+        int fd;
+        int state;
+        int err;
+        MYSQL_RES* res;
+        std::string sql;//执行中的语句，非阻塞接口要求在完成前保持有效
+        Callback done;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    void DrainInbox_(std::vector<std::function<void()>>* posted);
+    void Dispatch_();//把等待的查询分配给空闲连接
+    void Start_(Conn* conn, Task& task);
+    void Step_(Conn* conn, int status);//推进一个连接的状态机
+    void Finish_(Conn* conn, bool ok);
+    bool BuildSql_(MYSQL* mysql, const Task& task, std::string* sql);
+
+    bool isOpen_;
+    Epoller* epoller_;
+    int inboxFd_;//工作线程提交查询后写eventfd唤醒事件循环
+
+    std::mutex mtx_;//保护inbox_和posted_
+    std::deque<Task> inbox_;
+    std::vector<std::function<void()>> posted_;
+    std::atomic<size_t> pending_;
+
+    //以下只在事件循环线程访问
+    std::deque<Task> waiting_;
+    std::vector<Conn> conns_;
+    std::unordered_map<int, Conn*> fdConn_;
+};
+
+#endif
@@ -0,0 +1,303 @@
+#include"credcache.h"
+#include<string.h>
+#include<time.h>
+#include<random>
+
+CredCache::CredCache(){
+    shardSlots_ = 0;
+    ttlMS_ = 0;
+    negativeTtlMS_ = 0;
+    std::random_device rd;
+    seed_ = ((uint64_t)rd() << 32) ^ rd();
+    for(auto& shard : shards_){
+        shard.seq = 0;
+        shard.hits = 0;
+        shard.negativeHits = 0;
+        shard.misses = 0;
+        shard.stale = 0;
+        for(auto& version : shard.versions){
+            version = 0;
+        }
+    }
+}
+
+CredCache* CredCache::Instance(){
+    static CredCache cache;
+    return &cache;
+}
+
+//启动时调用，之后不再改变表的大小
+void CredCache::Init(size_t capacity, int ttlMS, int negativeTtlMS){
+    ttlMS_ = ttlMS;
+    negativeTtlMS_ = negativeTtlMS;
+    if(capacity == 0){
+        shardSlots_ = 0;
+        return;
+    }
+    size_t slots = MAX_PROBE;
+    while(slots * SHARD_CNT < capacity){
+        slots <<= 1;
+    }
+    for(auto& shard : shards_){
+        shard.slots.reset(new Slot[slots]);
+        for(size_t i = 0; i < slots; i++){
+            for(auto& word : shard.slots[i].name){
+                word = 0;
+            }
+            shard.slots[i].pwdHash = 0;
+            shard.slots[i].expireMS = 0;
+            shard.slots[i].kind = EMPTY;
+        }
+    }
+    shardSlots_ = slots;
+}
+
+int64_t CredCache::NowMS_(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//用户名按8字节打包，同时算FNV-1a哈希，高4位选分片，低位选槽位
+bool CredCache::MakeKey_(const std::string& name, Key* key) const{
+    if(name.empty() || name.size() > NAME_MAX_LEN){
+        return false;
+    }
+    memset(key->words, 0, sizeof(key->words));
+    memcpy(key->words, name.data(), name.size());
+    uint64_t hash = 14695981039346656037ull;
+    for(unsigned char ch : name){
+        hash ^= ch;
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 29;//FNV的高位分布较差，混合一下再取分片
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+    key->hash = hash;
+    return true;
+}
+
+//带随机种子的摘要，进程外无法离线构造碰撞
+uint64_t CredCache::PwdHash_(const std::string& pwd) const{
+    uint64_t hash = 14695981039346656037ull ^ seed_;
+    for(unsigned char ch : pwd){
+        hash ^= ch;
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 31;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 29;
+    return hash ^ seed_;
+}
+
+bool CredCache::SameName_(const Slot& slot, const Key& key){
+    for(int i = 0; i < NAME_WORDS; i++){
+        if(slot.name[i].load(std::memory_order_relaxed) != key.words[i]){
+            return false;
+        }
+    }
+    return true;
+}
+
+CredCache::RESULT CredCache::Lookup(const std::string& name, const std::string& pwd){
+    Key key;
+    if(!Enabled() || !MakeKey_(name, &key)){
+        return MISS;
+    }
+    Shard& shard = ShardOf_(key);
+    uint32_t kind;
+    uint64_t pwdHash;
+    int64_t expire;
+    for(;;){
+        uint32_t seq = shard.seq.load(std::memory_order_acquire);
+        if(seq & 1){
+            continue;//写入进行中
+        }
+        kind = EMPTY;
+        pwdHash = 0;
+        expire = 0;
+        size_t mask = shardSlots_ - 1;
+        for(int i = 0; i < MAX_PROBE; i++){
+            const Slot& slot = shard.slots[(key.hash + i) & mask];
+            uint32_t k = slot.kind.load(std::memory_order_relaxed);
+            if(k != EMPTY && SameName_(slot, key)){
+                kind = k;
+                pwdHash = slot.pwdHash.load(std::memory_order_relaxed);
+                expire = slot.expireMS.load(std::memory_order_relaxed);
+                break;
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(shard.seq.load(std::memory_order_relaxed) == seq){
+            break;
+        }
+    }
+    if(kind == EMPTY){
+        shard.misses.fetch_add(1, std::memory_order_relaxed);
+        return MISS;
+    }
+    if(expire <= NowMS_()){
+        shard.stale.fetch_add(1, std::memory_order_relaxed);
+        shard.misses.fetch_add(1, std::memory_order_relaxed);
+        return MISS;
+    }
+    if(kind == NEGATIVE){
+        shard.negativeHits.fetch_add(1, std::memory_order_relaxed);
+        return ABSENT;
+    }
+    shard.hits.fetch_add(1, std::memory_order_relaxed);
+    return pwdHash == PwdHash_(pwd) ? MATCH : MISMATCH;
+}
+
+//写入：同名槽位优先，其次空槽或已过期的槽，都没有就替换最早过期的
+void CredCache::Put_(const Key& key, uint32_t kind, uint64_t pwdHash, int64_t expireMS,
+                     const uint64_t* version){
+    Shard& shard = ShardOf_(key);
+    std::lock_guard<std::mutex> locker(shard.mtx);
+    std::atomic<uint64_t>& current = VersionOf_(shard, key);
+    if(!version){
+        current.fetch_add(1, std::memory_order_release);
+    }else if(current.load(std::memory_order_relaxed) != *version){
+        return;//查询发出后有过写穿或失效，查到的可能是旧数据
+    }
+    size_t mask = shardSlots_ - 1;
+    int64_t now = NowMS_();
+    Slot* target = nullptr;
+    Slot* victim = nullptr;
+    int64_t victimExpire = INT64_MAX;
+    for(int i = 0; i < MAX_PROBE; i++){
+        Slot* slot = &shard.slots[(key.hash + i) & mask];
+        uint32_t k = slot->kind.load(std::memory_order_relaxed);
+        if(k != EMPTY && SameName_(*slot, key)){
+            target = slot;
+            break;
+        }
+        //空槽和已过期的槽当作最早过期
+        int64_t expire = slot->expireMS.load(std::memory_order_relaxed);
+        if(k == EMPTY || expire <= now){
+            expire = INT64_MIN;
+        }
+        if(expire < victimExpire){
+            victim = slot;
+            victimExpire = expire;
+        }
+    }
+    if(!target){
+        target = victim;
+    }else if(kind == NEGATIVE && target->kind.load(std::memory_order_relaxed) == USER
+             && target->expireMS.load(std::memory_order_relaxed) > now){
+        return;//"不存在"不覆盖有效的用户记录
+    }
+    uint32_t seq = shard.seq.load(std::memory_order_relaxed);
+    shard.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for(int i = 0; i < NAME_WORDS; i++){
+        target->name[i].store(key.words[i], std::memory_order_relaxed);
+    }
+    target->pwdHash.store(pwdHash, std::memory_order_relaxed);
+    target->expireMS.store(expireMS, std::memory_order_relaxed);
+    target->kind.store(kind, std::memory_order_relaxed);
+    shard.seq.store(seq + 2, std::memory_order_release);
+}
+
+void CredCache::PutUser(const std::string& name, const std::string& pwd){
+    Key key;
+    if(!Enabled() || !MakeKey_(name, &key)){
+        return;
+    }
+    Put_(key, USER, PwdHash_(pwd), NowMS_() + ttlMS_, nullptr);
+}
+
+uint64_t CredCache::Version(const std::string& name){
+    Key key;
+    if(!Enabled() || !MakeKey_(name, &key)){
+        return 0;
+    }
+    return VersionOf_(ShardOf_(key), key).load(std::memory_order_acquire);
+}
+
+void CredCache::FillUser(const std::string& name, const std::string& pwd, uint64_t version){
+    Key key;
+    if(!Enabled() || !MakeKey_(name, &key)){
+        return;
+    }
+    Put_(key, USER, PwdHash_(pwd), NowMS_() + ttlMS_, &version);
+}
+
+void CredCache::FillAbsent(const std::string& name, uint64_t version){
+    Key key;
+    if(!Enabled() || negativeTtlMS_ <= 0 || !MakeKey_(name, &key)){
+        return;
+    }
+    Put_(key, NEGATIVE, 0, NowMS_() + negativeTtlMS_, &version);
+}
+
+void CredCache::Invalidate(const std::string& name){
+    Key key;
+    if(!Enabled() || !MakeKey_(name, &key)){
+        return;
+    }
+    Shard& shard = ShardOf_(key);
+    std::lock_guard<std::mutex> locker(shard.mtx);
+    VersionOf_(shard, key).fetch_add(1, std::memory_order_release);//槽位不在也要让进行中的回填作废
+    size_t mask = shardSlots_ - 1;
+    for(int i = 0; i < MAX_PROBE; i++){
+        Slot& slot = shard.slots[(key.hash + i) & mask];
+        if(slot.kind.load(std::memory_order_relaxed) != EMPTY && SameName_(slot, key)){
+            uint32_t seq = shard.seq.load(std::memory_order_relaxed);
+            shard.seq.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            slot.kind.store(EMPTY, std::memory_order_relaxed);
+            shard.seq.store(seq + 2, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+void CredCache::Clear(){
+    if(!Enabled()){
+        return;
+    }
+    for(auto& shard : shards_){
+        std::lock_guard<std::mutex> locker(shard.mtx);
+        uint32_t seq = shard.seq.load(std::memory_order_relaxed);
+        shard.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for(size_t i = 0; i < shardSlots_; i++){
+            shard.slots[i].kind.store(EMPTY, std::memory_order_relaxed);
+        }
+        shard.seq.store(seq + 2, std::memory_order_release);
+    }
+}
+
+uint64_t CredCache::Hits() const{
+    uint64_t sum = 0;
+    for(auto& shard : shards_){
+        sum += shard.hits.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+uint64_t CredCache::NegativeHits() const{
+    uint64_t sum = 0;
+    for(auto& shard : shards_){
+        sum += shard.negativeHits.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+uint64_t CredCache::Misses() const{
+    uint64_t sum = 0;
+    for(auto& shard : shards_){
+        sum += shard.misses.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+uint64_t CredCache::Stale() const{
+    uint64_t sum = 0;
+    for(auto& shard : shards_){
+        sum += shard.stale.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
@@ -0,0 +1,107 @@
+//用户名 -> 凭据的进程内缓存，挡在user表前面
+//按用户名哈希分片，每个分片是固定大小的开放寻址表；写入持有分片的锁，
+//读取不加锁，用分片的序号(seqlock)检查读的过程中有没有写入，有就重读
+//不存密码原文，只存带随机种子的64位摘要；用户名超过NAME_MAX_LEN的不缓存
+//也缓存"用户不存在"(负缓存)，注册前的查重和对不存在用户的登录不用查库
+//查库结果的回填带版本：查询前取Version，期间有写穿或失效就放弃回填，旧的SELECT不会覆盖新写入
+#ifndef CRED_CACHE_H
+#define CRED_CACHE_H
+
+#include<string>
+#include<atomic>
+#include<mutex>
+#include<memory>
+#include<stdint.h>
+
+class CredCache{
+public:
+    enum RESULT{
+        MISS,//没有缓存或已过期，需要查库
+        MATCH,//用户存在且密码一致
+        MISMATCH,//用户存在但密码不一致
+        ABSENT,//确认用户不存在
+    };
+
+    static CredCache* Instance();
+
+    //capacity为0表示关闭；ttlMS是用户记录的有效期，negativeTtlMS是"不存在"记录的有效期
+    void Init(size_t capacity, int ttlMS, int negativeTtlMS);
+    bool Enabled() const {return shardSlots_ > 0;}
+
+    RESULT Lookup(const std::string& name, const std::string& pwd);
+    void PutUser(const std::string& name, const std::string& pwd);//注册成功后写穿
+    void Invalidate(const std::string& name);//用户被修改或删除、写入结果不确定时调用
+    //发起查询前取得的版本，PutUser和Invalidate会让它变化
+    uint64_t Version(const std::string& name);
+    //查库结果回填：version之后有过写穿或失效时不写入；"不存在"也不覆盖未过期的用户记录
+    void FillUser(const std::string& name, const std::string& pwd, uint64_t version);
+    void FillAbsent(const std::string& name, uint64_t version);
+    void Clear();
+
+    uint64_t Hits() const;//MATCH或MISMATCH
+    uint64_t NegativeHits() const;//ABSENT
+    uint64_t Misses() const;//包括过期
+    uint64_t Stale() const;//找到了但已经过期的次数
+
+private:
+    CredCache();
+    ~CredCache() = default;
+
+    static const int SHARD_CNT = 16;
+    static const int MAX_PROBE = 8;//每个键最多看8个相邻槽位
+    static const int NAME_WORDS = 8;
+    static const size_t NAME_MAX_LEN = NAME_WORDS * 8 - 1;
+    static const size_t CACHE_LINE = 64;
+    static const int VERSION_STRIPES = 64;//每个分片的版本按用户名哈希分组，同组的写入互相让回填作废
+
+    enum KIND{
+        EMPTY = 0,
+        USER,
+        NEGATIVE,
+    };
+
+    //槽位的每个字段都是原子变量，读者在写入进行中读到的值会被序号检查丢弃
+    struct Slot{
+        std::atomic<uint64_t> name[NAME_WORDS];//用户名，按8字节打包，末尾补0
+        std::atomic<uint64_t> pwdHash;
+        std::atomic<int64_t> expireMS;
+        std::atomic<uint32_t> kind;
+    };
+
+    struct Shard{
+        std::atomic<uint32_t> seq;//奇数表示写入进行中
+        std::mutex mtx;//写者之间互斥
+        std::unique_ptr<Slot[]> slots;
+        std::atomic<uint64_t> versions[VERSION_STRIPES];//写穿和失效时递增
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> negativeHits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> stale;
+        char pad[CACHE_LINE];
+    };
+
+    struct Key{
+        uint64_t words[NAME_WORDS];
+        uint64_t hash;
+    };
+
+    bool MakeKey_(const std::string& name, Key* key) const;
+    uint64_t PwdHash_(const std::string& pwd) const;
+    static int64_t NowMS_();
+    static bool SameName_(const Slot& slot, const Key& key);
+    //version为nullptr是写穿，递增版本；否则是回填，版本不一致时放弃
+    void Put_(const Key& key, uint32_t kind, uint64_t pwdHash, int64_t expireMS,
+              const uint64_t* version);
+    Shard& ShardOf_(const Key& key) {return shards_[key.hash >> 60];}
+    static std::atomic<uint64_t>& VersionOf_(Shard& shard, const Key& key){
+        return shard.versions[key.hash & (VERSION_STRIPES - 1)];
+    }
+
+    Shard shards_[SHARD_CNT];
+    size_t shardSlots_;//每个分片的槽位数，2的幂
+    int ttlMS_;
+    int negativeTtlMS_;
+    uint64_t seed_;//密码摘要的随机种子，每个进程不同
+};
+
+#endif
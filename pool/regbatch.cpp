@@ -0,0 +1,232 @@
+#include"regbatch.h"
+#include<future>
+#include<unordered_set>
+#include<mysql/mysqld_error.h>
+#include"sqlconnpool.h"
+#include"sqlstmt.h"
+
+using namespace std;
+
+RegBatch::RegBatch(){
+    isOpen_ = false;
+    windowMS_ = 0;
+    maxRows_ = 1;
+    batches_ = 0;
+    rows_ = 0;
+    duplicates_ = 0;
+    failures_ = 0;
+}
+
+RegBatch::~RegBatch(){
+    Close();
+}
+
+RegBatch* RegBatch::Instance(){
+    static RegBatch batch;
+    return &batch;
+}
+
+void RegBatch::Init(int windowMS, int maxRows){
+    assert(windowMS >= 0 && maxRows > 0);
+    if(isOpen_){
+        return;
+    }
+    windowMS_ = windowMS;
+    maxRows_ = maxRows < MAX_ROWS ? maxRows : MAX_ROWS;
+    isOpen_ = true;
+    worker_ = thread(&RegBatch::Worker_, this);
+}
+
+void RegBatch::Close(){
+    {
+        lock_guard<mutex> locker(mtx_);
+        if(!isOpen_){
+            return;
+        }
+        isOpen_ = false;
+    }
+    cond_.notify_all();
+    if(worker_.joinable()){
+        worker_.join();
+    }
+}
+
+void RegBatch::Submit(const string& name, const string& pwd, Callback done){
+    {
+        lock_guard<mutex> locker(mtx_);
+        if(isOpen_){
+            queue_.push_back(Row{name, pwd, move(done), FAILED});
+            //只在开始一批或凑满一批时唤醒，窗口期间的其他行不用叫醒批处理线程
+            if(queue_.size() == 1 || queue_.size() >= maxRows_){
+                cond_.notify_one();
+            }
+            return;
+        }
+    }
+    done(FAILED);
+}
+
+int RegBatch::Insert(const string& name, const string& pwd){
+    promise<int> result;
+    future<int> ready = result.get_future();
+    Submit(name, pwd, [&result](int r){ result.set_value(r); });
+    return ready.get();
+}
+
+void RegBatch::Worker_(){
+    unique_lock<mutex> locker(mtx_);
+    for(;;){
+        cond_.wait(locker, [this]{ return !isOpen_ || !queue_.empty(); });
+        if(queue_.empty()){
+            break;//已关闭且没有剩余
+        }
+        //第一行到达后等一个窗口，凑够maxRows_行提前提交；关闭时不再等待
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(windowMS_);
+        while(isOpen_ && queue_.size() < maxRows_ &&
+              cond_.wait_until(locker, deadline) == cv_status::no_timeout){
+        }
+        vector<Row> rows;
+        size_t n = min(queue_.size(), maxRows_);
+        rows.reserve(n);
+        for(size_t i = 0; i < n; i++){
+            rows.push_back(move(queue_.front()));
+            queue_.pop_front();
+        }
+        locker.unlock();
+        Commit_(rows);
+        locker.lock();
+    }
+    locker.unlock();
+    mysql_thread_end();
+}
+
+void RegBatch::Commit_(vector<Row>& rows){
+    //同一批里同名的行只有第一行参与插入
+    unordered_set<string> names;
+    vector<Row*> pending;
+    for(Row& row : rows){
+        if(names.insert(row.name).second){
+            pending.push_back(&row);
+        }else{
+            row.result = DUPLICATE;
+        }
+    }
+    MYSQL* sql;
+    {
+        SqlConnRAII raii(&sql, SqlConnPool::Instance());
+        if(sql && !CommitBatch_(sql, pending)){
+            mysql_rollback(sql);
+            //多半是批外的写入抢先插入了同名用户，逐行插入区分出是哪一行
+            LOG_WARN("RegBatch: multi-row insert failed, retry row by row: %s", mysql_error(sql));
+            if(!CommitEach_(sql, pending)){
+                LOG_ERROR("RegBatch: commit error: %s", mysql_error(sql));
+                mysql_rollback(sql);
+                for(Row* row : pending){
+                    if(row->result == INSERTED){
+                        row->result = FAILED;
+                    }
+                }
+            }
+        }
+    }
+    batches_++;
+    rows_ += rows.size();
+    for(Row& row : rows){
+        if(row.result == DUPLICATE){
+            duplicates_++;
+        }else if(row.result == FAILED){
+            failures_++;
+        }
+        row.done(row.result);
+    }
+    LOG_DEBUG("RegBatch: committed %d rows", (int)rows.size());
+}
+
+bool RegBatch::CommitBatch_(MYSQL* sql, vector<Row*>& rows){
+    if(mysql_query(sql, "START TRANSACTION")){
+        return false;
+    }
+    vector<string> names;
+    names.reserve(rows.size());
+    for(Row* row : rows){
+        names.push_back(row->name);
+    }
+    //锁住这些用户名(包括不存在时的间隙)，直到提交前都不会被其他事务插入
+    string select = "SELECT username FROM user WHERE username IN (" + Repeat_("?", rows.size()) + ") FOR UPDATE";
+    SqlStmt query(sql, select.c_str());
+    if(!query.ExecList(names)){
+        return false;
+    }
+    unordered_set<string> existing;
+    while(query.Next()){
+        existing.insert(query.GetString(0));
+    }
+
+    vector<string> values;
+    vector<Row*> fresh;
+    for(Row* row : rows){
+        if(existing.count(row->name)){
+            row->result = DUPLICATE;
+            continue;
+        }
+        fresh.push_back(row);
+        values.push_back(row->name);
+        values.push_back(row->pwd);
+    }
+    if(!fresh.empty()){
+        string insertSql = "INSERT INTO user(username, password) VALUES " + Repeat_("(?, ?)", fresh.size());
+        SqlStmt insert(sql, insertSql.c_str());
+        if(!insert.ExecList(values)){
+            return false;
+        }
+    }
+    if(mysql_commit(sql)){
+        return false;
+    }
+    for(Row* row : fresh){
+        row->result = INSERTED;
+    }
+    return true;
+}
+
+bool RegBatch::CommitEach_(MYSQL* sql, vector<Row*>& rows){
+    if(mysql_query(sql, "START TRANSACTION")){
+        return false;
+    }
+    //不假设username上有唯一索引：每行先加锁查一次，能看到本事务前面插入的行和其他事务已提交的行；
+    //有唯一索引时并发插入的冲突再由ER_DUP_ENTRY兜底
+    SqlStmt exists(sql, "SELECT 1 FROM user WHERE username=? LIMIT 1 FOR UPDATE");
+    SqlStmt insert(sql, "INSERT INTO user(username, password) VALUES(?, ?)");
+    for(Row* row : rows){
+        if(row->result == DUPLICATE){
+            continue;//加锁查询时已确认存在
+        }
+        if(!exists.Exec(row->name)){
+            return false;
+        }
+        if(exists.Next()){
+            row->result = DUPLICATE;
+            continue;
+        }
+        if(insert.Exec(row->name, row->pwd)){
+            row->result = INSERTED;
+        }else if(insert.Errno() == ER_DUP_ENTRY){
+            row->result = DUPLICATE;
+        }else{
+            return false;
+        }
+    }
+    return mysql_commit(sql) == 0;
+}
+
+//"?"重复3次得到"?, ?, ?"
+string RegBatch::Repeat_(const char* item, size_t n){
+    string out;
+    for(size_t i = 0; i < n; i++){
+        if(i){
+            out += ", ";
+        }
+        out += item;
+    }
+    return out;
+}
@@ -0,0 +1,80 @@
+//注册写入的组提交
+//各请求的注册先放进队列，批处理线程在第一行到达后再等一个短窗口(或凑够maxRows行)，
+//然后在一个事务里用SELECT ... FOR UPDATE找出已存在的用户名，其余的行用一条多行INSERT写入，
+//一次COMMIT完成，数据库每批只刷一次盘；每个请求拿到自己那一行的结果
+#ifndef REG_BATCH_H
+#define REG_BATCH_H
+
+#include<mysql/mysql.h>
+#include<string>
+#include<vector>
+#include<deque>
+#include<mutex>
+#include<condition_variable>
+#include<thread>
+#include<functional>
+#include<atomic>
+#include<stdint.h>
+#include"../log/log.h"
+
+class RegBatch{
+public:
+    enum RESULT{
+        INSERTED,
+        DUPLICATE,//用户名已存在，或同一批里已有同名的行
+        FAILED,
+    };
+    typedef std::function<void(int result)> Callback;
+
+    static RegBatch* Instance();
+
+    //windowMS：第一行到达后最多再等多久；maxRows：每批最多多少行
+    void Init(int windowMS, int maxRows);
+    void Close();//队列里剩下的行提交完再返回
+    bool Enabled() const {return isOpen_;}
+
+    //done在批处理线程中执行，应尽快返回；没有启用时立即以FAILED回调
+    void Submit(const std::string& name, const std::string& pwd, Callback done);
+    //阻塞到这一行提交完成，在工作线程中使用
+    int Insert(const std::string& name, const std::string& pwd);
+
+    uint64_t Batches() const {return batches_.load(std::memory_order_relaxed);}
+    uint64_t Rows() const {return rows_.load(std::memory_order_relaxed);}
+    uint64_t Duplicates() const {return duplicates_.load(std::memory_order_relaxed);}
+    uint64_t Failures() const {return failures_.load(std::memory_order_relaxed);}
+
+private:
+    RegBatch();
+    ~RegBatch();
+
+    struct Row{
+        std::string name;
+        std::string pwd;
+        Callback done;
+        int result;
+    };
+
+    static const int MAX_ROWS = 256;//多行INSERT的参数个数是行数的两倍
+
+    void Worker_();
+    void Commit_(std::vector<Row>& rows);
+    bool CommitBatch_(MYSQL* sql, std::vector<Row*>& rows);//多行INSERT
+    bool CommitEach_(MYSQL* sql, std::vector<Row*>& rows);//多行INSERT失败时逐行插入，仍然只提交一次
+    static std::string Repeat_(const char* item, size_t n);
+
+    std::atomic<bool> isOpen_;
+    int windowMS_;
+    size_t maxRows_;
+
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    std::deque<Row> queue_;
+    std::thread worker_;
+
+    std::atomic<uint64_t> batches_;
+    std::atomic<uint64_t> rows_;
+    std::atomic<uint64_t> duplicates_;
+    std::atomic<uint64_t> failures_;
+};
+
+#endif
@@ -7,6 +7,19 @@
  * @Description: 这是默认设置,请设置`customMade`, 打开koroFileHeader查看配置 进行设置: https://github.com/OBKoro1/koro1FileHeader/wiki/%E9%85%8D%E7%BD%AE
  */
 #include "sqlconnpool.h"
+#include<mysql/errmsg.h>
+#include"../trace/probes.h"
+
+using namespace std;
+
+const int SqlConnPool::RETRY_MS;
+const int SqlConnPool::MAINTAIN_MS;
+
+SqlConnPool::SqlConnPool():
+    port_(0), MAX_CONN_(0), minConn_(0), acquireTimeoutMS_(3000),
+    validateIdleMS_(30000), idleTimeoutMS_(0), isOpen_(false),
+    total_(0), inUse_(0), acquired_(0), waited_(0), waitUsTotal_(0),
+    waitUsMax_(0), timeouts_(0), connectFailures_(0), pingFailures_(0){}
 
 SqlConnPool* SqlConnPool::Instance(){
     static SqlConnPool pool;
@@ -16,56 +29,324 @@ SqlConnPool* SqlConnPool::Instance(){
 //初始化
 void SqlConnPool::Init(const char* host, uint16_t port,
                        const char* user, const char* pwd,
-                       const cahr* dbName, int connSize = 10){
-    assert(connSize>0);
-    for(int i=0;i<connSize;i++){
-        MYSQL* conn = nullptr;
-        conn = mysql_init(conn);
-        if(!conn){
-            LOG_ERROR("mysql init error");
-            assert(conn);
-        }
-        conn = mysql_real_connect(conn,host,user,pwd,dbName,port,nullptr,0);
-        if(!conn){
-            LOG_ERROR("mysql connect error");
-        }
-        connQue_.emplace(conn);
-    }
-    MAX_CONN_=connSize;
-    sem_init(&semId_,0,MAX_CONN_);
+                       const char* dbName, int maxSize, int minSize){
+    assert(maxSize>0);
+    host_ = host;
+    port_ = port;
+    user_ = user;
+    pwd_ = pwd;
+    dbName_ = dbName;
+    MAX_CONN_ = maxSize;
+    minConn_ = (minSize <= 0 || minSize > maxSize) ? maxSize : minSize;
+    //客户端库的全局初始化不是线程安全的，必须在并行建连之前完成
+    mysql_library_init(0, nullptr, nullptr);
+
+    //并行建立minConn_个连接，启动只等最慢的一次握手
+    vector<MYSQL*> conns(minConn_, nullptr);
+    vector<thread> threads;
+    for(int i=0;i<minConn_;i++){
+        threads.emplace_back([this, &conns, i]{
+            conns[i] = Connect_();
+            mysql_thread_end();
+        });
+    }
+    for(auto& t : threads){
+        t.join();
+    }
+
+    lock_guard<mutex> locker(mtx_);
+    Clock::time_point now = Clock::now();
+    for(MYSQL* conn : conns){
+        if(conn){
+            idle_.push_back({conn, now, now});
+            total_++;
+        }
+    }
+    if(total_ < minConn_){
+        LOG_WARN("SqlConnPool: only %d/%d connections established", total_, minConn_);
+        nextConnect_ = now + chrono::milliseconds(RETRY_MS);
+    }
+    isOpen_ = true;
+    maintainer_ = thread(&SqlConnPool::Maintain_, this);
+}
+
+void SqlConnPool::SetPolicy(int minSize, int acquireTimeoutMS, int validateIdleMS, int idleTimeoutMS){
+    lock_guard<mutex> locker(mtx_);
+    if(minSize > 0){
+        minConn_ = min(minSize, MAX_CONN_);
+    }
+    acquireTimeoutMS_ = acquireTimeoutMS;
+    validateIdleMS_ = validateIdleMS;
+    idleTimeoutMS_ = idleTimeoutMS;
 }
 
-MYSQL* SqlConnPool::GetConn(){
-    MYSQL* conn = nullptr;
-    if(connQue_.empty()){
-        LOG_WARN("SqlConnPool busy");
+MYSQL* SqlConnPool::Connect_(){
+    MYSQL* conn = mysql_init(nullptr);
+    if(!conn){
+        LOG_ERROR("mysql init error");
+        connectFailures_++;
+        return nullptr;
+    }
+    //断线后借出前的mysql_ping重连，语句缓存按线程id变化重新prepare
+    SqlBool reconnect = 1;
+    mysql_options(conn, MYSQL_OPT_RECONNECT, &reconnect);
+    unsigned int timeout = CONNECT_TIMEOUT_SEC;
+    mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    if(!mysql_real_connect(conn, host_.c_str(), user_.c_str(), pwd_.c_str(),
+                           dbName_.c_str(), port_, nullptr, 0)){
+        LOG_ERROR("mysql connect error: %s", mysql_error(conn));
+        mysql_close(conn);
+        connectFailures_++;
         return nullptr;
     }
-    sem_wait(&semId_);//-1
+    unique_ptr<SqlStmtCache> cache(new SqlStmtCache());
     lock_guard<mutex> locker(mtx_);
-    conn = connQue_.front();
-    connQue_.pop();
+    stmtCache_[conn] = move(cache);
     return conn;
 }
 
+void SqlConnPool::Destroy_(MYSQL* conn){
+    unique_ptr<SqlStmtCache> cache;
+    {
+        lock_guard<mutex> locker(mtx_);
+        auto it = stmtCache_.find(conn);
+        if(it != stmtCache_.end()){
+            cache = move(it->second);
+            stmtCache_.erase(it);
+        }
+    }
+    cache.reset();//语句要在连接关闭前释放
+    mysql_close(conn);
+}
+
+bool SqlConnPool::Validate_(MYSQL* conn){
+    if(mysql_ping(conn) == 0){
+        return true;
+    }
+    LOG_WARN("SqlConnPool ping failed: %s", mysql_error(conn));
+    pingFailures_++;
+    return false;
+}
+
+void SqlConnPool::RecordAcquire_(MYSQL* conn, Clock::time_point begin, bool waited){
+    uint64_t us = chrono::duration_cast<chrono::microseconds>(Clock::now() - begin).count();
+    TWS_PROBE3(sql_acquire, conn, us, waited);
+    Metrics::Instance()->sqlWait.Record(us);
+    acquired_.fetch_add(1, memory_order_relaxed);
+    if(waited){
+        waited_.fetch_add(1, memory_order_relaxed);
+    }
+    waitUsTotal_.fetch_add(us, memory_order_relaxed);
+    uint64_t max = waitUsMax_.load(memory_order_relaxed);
+    while(us > max && !waitUsMax_.compare_exchange_weak(max, us, memory_order_relaxed)){
+    }
+}
+
+//优先复用空闲连接，没有空闲且未到上限时当场建立新连接，否则等待归还
+MYSQL* SqlConnPool::GetConn(int timeoutMS){
+    Clock::time_point begin = Clock::now();
+    unique_lock<mutex> locker(mtx_);
+    if(timeoutMS < 0){
+        timeoutMS = acquireTimeoutMS_;
+    }
+    Clock::time_point deadline = begin + chrono::milliseconds(timeoutMS);
+    bool waited = false;
+    while(isOpen_){
+        if(!idle_.empty()){
+            IdleConn idle = idle_.back();
+            idle_.pop_back();
+            inUse_++;
+            bool check = Clock::now() - idle.lastChecked >= chrono::milliseconds(validateIdleMS_);
+            locker.unlock();
+            if(!check || Validate_(idle.conn)){
+                RecordAcquire_(idle.conn, begin, waited);
+                return idle.conn;
+            }
+            //ping失败(自动重连也没成功)，关闭后重新走一遍：取其他空闲连接或者新建
+            Destroy_(idle.conn);
+            locker.lock();
+            total_--;
+            inUse_--;
+            continue;
+        }
+        Clock::time_point now = Clock::now();
+        if(total_ < MAX_CONN_ && now >= nextConnect_){
+            total_++;
+            inUse_++;
+            locker.unlock();
+            MYSQL* conn = Connect_();
+            if(conn){
+                RecordAcquire_(conn, begin, waited);
+                return conn;
+            }
+            locker.lock();
+            total_--;
+            inUse_--;
+            nextConnect_ = Clock::now() + chrono::milliseconds(RETRY_MS);
+            continue;
+        }
+        if(now >= deadline){
+            break;
+        }
+        waited = true;
+        Clock::time_point until = deadline;
+        if(total_ < MAX_CONN_ && nextConnect_ < until){
+            until = nextConnect_;//建连冷却结束后再试一次
+        }
+        cond_.wait_until(locker, until);
+    }
+    timeouts_++;
+    LOG_WARN("SqlConnPool busy, no connection within %dms", timeoutMS);
+    return nullptr;
+}
+
 void SqlConnPool::FreeConn(MYSQL* conn){
     assert(conn);
-    lock_guard<mutex> locker(mtx_);
-    connQue_.push(conn);
-    sem_post(&semId_);//+1
+    //最后一次操作报告断线的连接，下次借出前必须先ping
+    unsigned int err = mysql_errno(conn);
+    bool broken = err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+    TWS_PROBE2(sql_release, conn, broken);
+    unique_lock<mutex> locker(mtx_);
+    inUse_--;
+    if(!isOpen_){
+        total_--;
+        locker.unlock();
+        Destroy_(conn);
+        return;
+    }
+    Clock::time_point now = Clock::now();
+    idle_.push_back({conn, now, broken ? Clock::time_point() : now});
+    cond_.notify_one();
+}
+
+//后台维护：ping空闲过久的连接，回收多余的空闲连接，补足到minConn_
+void SqlConnPool::Maintain_(){
+    unique_lock<mutex> locker(mtx_);
+    while(isOpen_){
+        maintainCond_.wait_for(locker, chrono::milliseconds(MAINTAIN_MS));
+        if(!isOpen_){
+            break;
+        }
+        Clock::time_point now = Clock::now();
+        vector<MYSQL*> expired;
+        while(idleTimeoutMS_ > 0 && !idle_.empty() && total_ > minConn_ &&
+              now - idle_.front().lastUsed >= chrono::milliseconds(idleTimeoutMS_)){
+            expired.push_back(idle_.front().conn);
+            idle_.pop_front();
+            total_--;
+        }
+        //需要校验的连接先取出来，ping期间不会被借走
+        vector<IdleConn> checking;
+        for(auto it = idle_.begin(); it != idle_.end();){
+            if(now - it->lastChecked >= chrono::milliseconds(validateIdleMS_)){
+                checking.push_back(*it);
+                it = idle_.erase(it);
+            }else{
+                ++it;
+            }
+        }
+        int refill = 0;
+        if(total_ < minConn_ && now >= nextConnect_){
+            refill = minConn_ - total_;
+            total_ += refill;
+        }
+        locker.unlock();
+
+        for(MYSQL* conn : expired){
+            Destroy_(conn);
+        }
+        vector<IdleConn> alive;
+        int dead = 0;
+        for(IdleConn& idle : checking){
+            if(Validate_(idle.conn)){
+                idle.lastChecked = Clock::now();
+                alive.push_back(idle);
+            }else{
+                Destroy_(idle.conn);
+                dead++;
+            }
+        }
+        vector<MYSQL*> fresh;
+        for(int i=0;i<refill;i++){
+            MYSQL* conn = Connect_();
+            if(!conn){
+                break;
+            }
+            fresh.push_back(conn);
+        }
+
+        locker.lock();
+        //校验过的连接放回头部，保持按最近使用排序
+        idle_.insert(idle_.begin(), alive.begin(), alive.end());
+        total_ -= dead;
+        total_ -= refill - (int)fresh.size();
+        if((int)fresh.size() < refill){
+            nextConnect_ = Clock::now() + chrono::milliseconds(RETRY_MS);
+        }
+        Clock::time_point done = Clock::now();
+        for(MYSQL* conn : fresh){
+            idle_.push_back({conn, done, done});
+        }
+        if(!alive.empty() || !fresh.empty() || dead > 0){
+            cond_.notify_all();
+        }
+    }
+    locker.unlock();
+    mysql_thread_end();
 }
 
 void SqlConnPool::ClosePool(){
-    lock_guard<mutex> locker(mtx_);
-    while(!connQue_.empty()){
-        auto conn = connQue_.front();
-        connQue_.pop();
-        mysql_close(conn);
+    deque<IdleConn> idle;
+    {
+        lock_guard<mutex> locker(mtx_);
+        if(!isOpen_){
+            return;
+        }
+        isOpen_ = false;
+    }
+    cond_.notify_all();
+    maintainCond_.notify_all();
+    if(maintainer_.joinable()){
+        maintainer_.join();
+    }
+    //维护线程退出后再取空闲连接，它校验或新建的连接也一起关闭
+    {
+        lock_guard<mutex> locker(mtx_);
+        idle.swap(idle_);
+        total_ -= idle.size();
+    }
+    //借出中的连接在归还时关闭
+    for(auto& conn : idle){
+        Destroy_(conn.conn);
     }
     mysql_library_end();
 }
 
+SqlStmtCache* SqlConnPool::GetStmtCache(MYSQL* conn){
+    lock_guard<mutex> locker(mtx_);
+    auto it = stmtCache_.find(conn);
+    return it == stmtCache_.end() ? nullptr : it->second.get();
+}
+
 int SqlConnPool::GetFreeConnCount(){
     lock_guard<mutex> locker(mtx_);
-    return connQue_.size();
-}
\ No newline at end of file
+    return idle_.size();
+}
+
+SqlConnPool::Stats SqlConnPool::GetStats(){
+    Stats stats;
+    {
+        lock_guard<mutex> locker(mtx_);
+        stats.total = total_;
+        stats.idle = idle_.size();
+        stats.inUse = inUse_;
+    }
+    stats.acquired = acquired_.load(memory_order_relaxed);
+    stats.waited = waited_.load(memory_order_relaxed);
+    stats.waitUsTotal = waitUsTotal_.load(memory_order_relaxed);
+    stats.waitUsMax = waitUsMax_.load(memory_order_relaxed);
+    stats.timeouts = timeouts_.load(memory_order_relaxed);
+    stats.connectFailures = connectFailures_.load(memory_order_relaxed);
+    stats.pingFailures = pingFailures_.load(memory_order_relaxed);
+    return stats;
+}
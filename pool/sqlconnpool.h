@@ -1,47 +1,128 @@
 //数据库连接池
+//连接数在[minSize, maxSize]之间伸缩：Init时并行建立minSize个连接，其余在借用时按需建立；
+//空闲过久的连接借出前先ping校验，失败就关闭并重建；后台线程定期ping空闲连接、
+//关闭空闲超时的多余连接，并在断线或建连失败后补足到minSize
+//GetConn最多等待timeoutMS，拿不到连接返回nullptr
 #ifndef SQLCONNPOOL_H
 #define SQLCONNPOOL_H
 
 #include<mysql/mysql.h>
 #include<string>
-#include<queue>
+#include<deque>
+#include<vector>
 #include<mutex>
-#include<semaphore.h>
+#include<condition_variable>
+#include<chrono>
 #include<thread>
+#include<atomic>
+#include<memory>
+#include<unordered_map>
+#include<assert.h>
+#include<stdint.h>
 #include"../log/log.h"
+#include"sqlstmt.h"
+#include"../metrics/metrics.h"
 
 class SqlConnPool{
 public:
+    struct Stats{
+        int total;//已建立和正在建立的连接数
+        int idle;
+        int inUse;
+        uint64_t acquired;//借出次数
+        uint64_t waited;//需要等待的借出次数
+        uint64_t waitUsTotal;//借出的总等待时间(微秒)
+        uint64_t waitUsMax;
+        uint64_t timeouts;
+        uint64_t connectFailures;
+        uint64_t pingFailures;
+    };
+
     //静态实例
     static SqlConnPool* Instance();
 
-    MYSQL* GetConn();
+    //timeoutMS<0使用SetPolicy设置的默认值，0表示不等待；超时或连接池已关闭返回nullptr
+    MYSQL* GetConn(int timeoutMS = -1);
     void FreeConn(MYSQL* conn);
     int GetFreeConnCount();
-    
+    Stats GetStats();
+
+    //conn的预处理语句缓存，不是池中的连接返回nullptr
+    //调用者必须独占conn，归还前缓存不会被移除；一般通过SqlStmt使用
+    SqlStmtCache* GetStmtCache(MYSQL* conn);
+
+    //maxSize为连接数上限，minSize<=0时与maxSize相同
     void Init(const char* host,uint16_t port,
               const char* user,const char* pwd,
-              const char* dbName, int connSize);
+              const char* dbName, int maxSize = 10, int minSize = 0);
+    //minSize<=0保持不变；acquireTimeoutMS为GetConn默认的等待时间；
+    //validateIdleMS：空闲超过该时间的连接借出前先ping；idleTimeoutMS：多于minSize的连接空闲超时后关闭，0表示不回收
+    void SetPolicy(int minSize, int acquireTimeoutMS, int validateIdleMS, int idleTimeoutMS);
     void ClosePool();
 
 private:
-    SqlConnPool() = default;
+    SqlConnPool();
     ~SqlConnPool() {
         ClosePool();
     }
 
+    typedef std::chrono::steady_clock Clock;
+
+    struct IdleConn{
+        MYSQL* conn;
+        Clock::time_point lastUsed;//归还的时间，用于回收多余连接
+        Clock::time_point lastChecked;//最后一次确认连接可用的时间
+    };
+
+    static const int CONNECT_TIMEOUT_SEC = 3;
+    static const int RETRY_MS = 1000;//建连失败后至少隔这么久再试
+    static const int MAINTAIN_MS = 1000;
+
+    MYSQL* Connect_();//不持有锁调用
+    void Destroy_(MYSQL* conn);//不持有锁调用，计数由调用者维护
+    bool Validate_(MYSQL* conn);
+    void RecordAcquire_(MYSQL* conn, Clock::time_point begin, bool waited);
+    void Maintain_();
+
+    std::string host_;
+    uint16_t port_;
+    std::string user_;
+    std::string pwd_;
+    std::string dbName_;
+
     int MAX_CONN_;
-    
-    std::queue<MYSQL*> connQue_;
+    int minConn_;
+    int acquireTimeoutMS_;
+    int validateIdleMS_;
+    int idleTimeoutMS_;
+    bool isOpen_;
+
+    //以下由mtx_保护
+    std::deque<IdleConn> idle_;//尾部是最近归还的，借用从尾部取，头部的连接逐渐空闲超时
+    int total_;
+    int inUse_;
+    Clock::time_point nextConnect_;
+    //每个连接的语句缓存，建立连接时加入，关闭连接时移除
+    std::unordered_map<MYSQL*, std::unique_ptr<SqlStmtCache>> stmtCache_;
     std::mutex mtx_;
-    sem_t semId_;
+    std::condition_variable cond_;//有连接归还或可以建立新连接
+    std::condition_variable maintainCond_;
+    std::thread maintainer_;
+
+    std::atomic<uint64_t> acquired_;
+    std::atomic<uint64_t> waited_;
+    std::atomic<uint64_t> waitUsTotal_;
+    std::atomic<uint64_t> waitUsMax_;
+    std::atomic<uint64_t> timeouts_;
+    std::atomic<uint64_t> connectFailures_;
+    std::atomic<uint64_t> pingFailures_;
 };
 
 class SqlConnRAII{
 public:
-    SqlConnRAII(MYSQL** sql, SqlConnPool* connpool){
+    SqlConnRAII(MYSQL** sql, SqlConnPool* connpool, int timeoutMS = -1){
         assert(connpool);
-        *sql = connpool->GetConn();
+        *sql = connpool->GetConn(timeoutMS);
         sql_ = *sql;
         connpool_ = connpool;
     }
@@ -56,4 +137,4 @@ private:
     MYSQL* sql_;
     SqlConnPool* connpool_;
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,219 @@
+#include"sqlstmt.h"
+#include<string.h>
+#include<stdlib.h>
+#include"sqlconnpool.h"
+
+using namespace std;
+
+MYSQL_STMT* SqlStmtCache::Get(MYSQL* conn, const string& sql){
+    unsigned long threadId = mysql_thread_id(conn);
+    if(threadId != threadId_){
+        //重连后服务端的语句已经不存在，只释放客户端的句柄
+        Clear();
+        threadId_ = threadId;
+    }
+    auto it = stmts_.find(sql);
+    if(it != stmts_.end()){
+        return it->second;
+    }
+    MYSQL_STMT* stmt = mysql_stmt_init(conn);
+    if(!stmt){
+        LOG_ERROR("mysql_stmt_init error");
+        return nullptr;
+    }
+    if(mysql_stmt_prepare(stmt, sql.c_str(), sql.size())){
+        LOG_ERROR("prepare \"%s\" error: %s", sql.c_str(), mysql_stmt_error(stmt));
+        mysql_stmt_close(stmt);
+        return nullptr;
+    }
+    //store_result时计算每列的最大长度，用来分配结果缓冲区
+    SqlBool on = 1;
+    mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &on);
+    stmts_[sql] = stmt;
+    LOG_DEBUG("prepared \"%s\"", sql.c_str());
+    return stmt;
+}
+
+void SqlStmtCache::Clear(){
+    for(auto& item : stmts_){
+        mysql_stmt_close(item.second);
+    }
+    stmts_.clear();
+    epoch_++;
+}
+
+SqlStmt::SqlStmt(MYSQL* conn, const char* sql)
+    :conn_(conn),sql_(sql),cache_(nullptr),stmt_(nullptr),epoch_(0),hasResult_(false){
+    if(conn_){
+        cache_ = SqlConnPool::Instance()->GetStmtCache(conn_);
+    }
+    if(cache_){
+        stmt_ = cache_->Get(conn_, sql_);
+        epoch_ = cache_->Epoch();
+    }
+}
+
+//语句还留在缓存中，这里只释放本次的结果
+SqlStmt::~SqlStmt(){
+    FreeResult_();
+}
+
+//先释放上一次的结果，再从缓存重新取句柄：期间发生过重连时缓存会换成新prepare的语句
+void SqlStmt::ResetParams_(size_t n){
+    FreeResult_();
+    if(cache_){
+        stmt_ = cache_->Get(conn_, sql_);
+        epoch_ = cache_->Epoch();
+    }
+    params_.clear();
+    paramLens_.clear();
+    paramInts_.clear();
+    params_.reserve(n);
+    paramLens_.reserve(n);
+    paramInts_.reserve(n);
+}
+
+void SqlStmt::Bind_(const string& v){
+    MYSQL_BIND bind;
+    memset(&bind, 0, sizeof(bind));
+    paramLens_.push_back(v.size());
+    bind.buffer_type = MYSQL_TYPE_STRING;
+    bind.buffer = const_cast<char*>(v.data());
+    bind.buffer_length = v.size();
+    bind.length = &paramLens_.back();
+    params_.push_back(bind);
+}
+
+void SqlStmt::Bind_(const char* v){
+    MYSQL_BIND bind;
+    memset(&bind, 0, sizeof(bind));
+    if(!v){
+        bind.buffer_type = MYSQL_TYPE_NULL;
+        paramLens_.push_back(0);
+    }else{
+        paramLens_.push_back(strlen(v));
+        bind.buffer_type = MYSQL_TYPE_STRING;
+        bind.buffer = const_cast<char*>(v);
+        bind.buffer_length = paramLens_.back();
+        bind.length = &paramLens_.back();
+    }
+    params_.push_back(bind);
+}
+
+void SqlStmt::BindInt_(long long v, bool isUnsigned){
+    MYSQL_BIND bind;
+    memset(&bind, 0, sizeof(bind));
+    paramInts_.push_back(v);
+    paramLens_.push_back(sizeof(v));
+    bind.buffer_type = MYSQL_TYPE_LONGLONG;
+    bind.buffer = &paramInts_.back();
+    bind.is_unsigned = isUnsigned;
+    params_.push_back(bind);
+}
+
+bool SqlStmt::ExecList(const vector<string>& args){
+    ResetParams_(args.size());
+    for(const string& arg : args){
+        Bind_(arg);
+    }
+    return Execute_();
+}
+
+//断线(CR_SERVER_LOST等)也只报告错误：调用者可能在事务中，静默重连后在新会话里重试会丢掉
+//已经加的锁和事务的原子性；连接归还时连接池按错误码标记，下次借出前ping重连
+bool SqlStmt::Execute_(){
+    if(!stmt_){
+        return false;
+    }
+    auto begin = chrono::steady_clock::now();
+    bool ok = ExecuteOnce_();
+    Metrics::Instance()->sqlQuery.RecordSince(begin);
+    if(!ok){
+        LOG_ERROR("execute \"%s\" error: %s", sql_.c_str(), mysql_stmt_error(stmt_));
+    }
+    return ok;
+}
+
+bool SqlStmt::ExecuteOnce_(){
+    if(mysql_stmt_param_count(stmt_) != params_.size()){
+        LOG_ERROR("\"%s\" needs %d parameters, got %d", sql_.c_str(),
+                  (int)mysql_stmt_param_count(stmt_), (int)params_.size());
+        return false;
+    }
+    if(!params_.empty() && mysql_stmt_bind_param(stmt_, params_.data())){
+        return false;
+    }
+    if(mysql_stmt_execute(stmt_)){
+        return false;
+    }
+    return BindResult_();
+}
+
+//结果集全部取到客户端，按每列的最大长度分配缓冲区，都按字符串取
+bool SqlStmt::BindResult_(){
+    MYSQL_RES* meta = mysql_stmt_result_metadata(stmt_);
+    if(!meta){
+        return true;//INSERT等没有结果集
+    }
+    hasResult_ = true;
+    if(mysql_stmt_store_result(stmt_)){
+        mysql_free_result(meta);
+        return false;
+    }
+    unsigned int cols = mysql_num_fields(meta);
+    MYSQL_FIELD* fields = mysql_fetch_fields(meta);
+    results_.assign(cols, MYSQL_BIND());
+    resultBufs_.resize(cols);
+    resultLens_.assign(cols, 0);
+    resultNulls_.assign(cols, 0);
+    for(unsigned int i = 0; i < cols; i++){
+        resultBufs_[i].assign(fields[i].max_length + 1, '\0');
+        memset(&results_[i], 0, sizeof(MYSQL_BIND));
+        results_[i].buffer_type = MYSQL_TYPE_STRING;
+        results_[i].buffer = &resultBufs_[i][0];
+        results_[i].buffer_length = resultBufs_[i].size();
+        results_[i].length = &resultLens_[i];
+        results_[i].is_null = &resultNulls_[i];
+    }
+    mysql_free_result(meta);
+    return cols == 0 || !mysql_stmt_bind_result(stmt_, results_.data());
+}
+
+void SqlStmt::FreeResult_(){
+    //epoch变了说明句柄已经随Clear关闭，结果也一起释放了
+    if(hasResult_ && stmt_ && cache_->Epoch() == epoch_){
+        mysql_stmt_free_result(stmt_);
+    }
+    hasResult_ = false;
+}
+
+bool SqlStmt::Next(){
+    if(!hasResult_){
+        return false;
+    }
+    int ret = mysql_stmt_fetch(stmt_);
+    return ret == 0 || ret == MYSQL_DATA_TRUNCATED;
+}
+
+bool SqlStmt::IsNull(int col) const{
+    return col < 0 || col >= (int)results_.size() || resultNulls_[col];
+}
+
+string SqlStmt::GetString(int col) const{
+    if(IsNull(col)){
+        return "";
+    }
+    return string(resultBufs_[col].data(), min((size_t)resultLens_[col], resultBufs_[col].size()));
+}
+
+long long SqlStmt::GetInt(int col) const{
+    return IsNull(col) ? 0 : strtoll(resultBufs_[col].c_str(), nullptr, 10);
+}
+
+unsigned long long SqlStmt::AffectedRows() const{
+    return stmt_ ? mysql_stmt_affected_rows(stmt_) : 0;
+}
+
+unsigned int SqlStmt::Errno() const{
+    return stmt_ ? mysql_stmt_errno(stmt_) : mysql_errno(conn_);
+}
@@ -0,0 +1,105 @@
+//预处理语句
+//SqlStmtCache：每个池化连接一份，按SQL文本缓存服务端预处理语句，第一次用到时prepare，
+//连接重连后(mysql_thread_id变化)旧语句全部失效并重新prepare
+//SqlStmt：带类型的查询辅助类，参数按C++类型绑定，调用处不再拼接SQL文本；
+//断线时只报告错误，不自己重连重试(事务中途重连会丢掉锁和原子性)，由调用者放弃、连接池ping后重连
+#ifndef SQL_STMT_H
+#define SQL_STMT_H
+
+#include<mysql/mysql.h>
+#include<string>
+#include<vector>
+#include<unordered_map>
+#include<type_traits>
+#include<stdint.h>
+
+//MariaDB和旧版MySQL用my_bool，MySQL 8用bool，直接取MYSQL_BIND里的类型
+typedef std::remove_pointer<decltype(MYSQL_BIND::is_null)>::type SqlBool;
+
+class SqlStmtCache{
+public:
+    SqlStmtCache():threadId_(0),epoch_(0){}
+    ~SqlStmtCache(){Clear();}
+
+    //返回conn上sql对应的语句，prepare失败返回nullptr
+    MYSQL_STMT* Get(MYSQL* conn, const std::string& sql);
+    void Clear();//关闭所有语句，连接关闭前调用
+    //每次Clear加一，之前Get到的语句句柄在epoch变化后都已经释放
+    uint64_t Epoch() const {return epoch_;}
+
+private:
+    unsigned long threadId_;//prepare时连接的线程id，变化说明发生过重连
+    uint64_t epoch_;
+    std::unordered_map<std::string, MYSQL_STMT*> stmts_;
+};
+
+class SqlStmt{
+public:
+    //conn必须由调用者独占(来自SqlConnPool)，sql中用?表示参数
+    SqlStmt(MYSQL* conn, const char* sql);
+    ~SqlStmt();
+
+    bool IsValid() const {return stmt_ != nullptr;}
+
+    //按顺序绑定参数并执行，支持std::string、const char*和整数
+    template<typename... Args>
+    bool Exec(const Args&... args){
+        ResetParams_(sizeof...(Args));
+        BindAll_(args...);
+        return Execute_();
+    }
+
+    //参数个数运行时才知道时使用(如多行INSERT、IN列表)，全部按字符串绑定
+    bool ExecList(const std::vector<std::string>& args);
+
+    bool Next();//取下一行结果，没有了返回false
+    bool IsNull(int col) const;
+    std::string GetString(int col) const;
+    long long GetInt(int col) const;
+
+    unsigned long long AffectedRows() const;
+    unsigned int Errno() const;
+
+private:
+    void ResetParams_(size_t n);
+    void BindAll_(){}
+    template<typename T, typename... Rest>
+    void BindAll_(const T& arg, const Rest&... rest){
+        Bind_(arg);
+        BindAll_(rest...);
+    }
+    void Bind_(const std::string& v);
+    void Bind_(const char* v);
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value>::type Bind_(const T& v){
+        BindInt_(static_cast<long long>(v), std::is_unsigned<T>::value);
+    }
+    void BindInt_(long long v, bool isUnsigned);
+
+    bool Execute_();
+    bool ExecuteOnce_();
+    bool BindResult_();
+    void FreeResult_();
+
+    MYSQL* conn_;
+    std::string sql_;
+    SqlStmtCache* cache_;
+    //同一连接上的其他SqlStmt可能触发重连后的Clear，句柄每次Exec都从缓存重新取，
+    //epoch_记下取的时候缓存的Epoch，变了就说明stmt_已经被释放
+    MYSQL_STMT* stmt_;
+    uint64_t epoch_;
+
+    //参数：缓冲区在Exec开始时按参数个数预留，绑定期间地址不变
+    std::vector<MYSQL_BIND> params_;
+    std::vector<unsigned long> paramLens_;
+    std::vector<long long> paramInts_;
+
+    //结果：每列按字符串取出
+    bool hasResult_;
+    std::vector<MYSQL_BIND> results_;
+    std::vector<std::string> resultBufs_;
+    std::vector<unsigned long> resultLens_;
+    std::vector<SqlBool> resultNulls_;
+};
+
+#endif
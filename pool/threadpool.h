@@ -8,6 +8,11 @@
 #include<functional>
 #include<thread>
 #include<assert.h>
+#include<chrono>
+#include<atomic>
+#include<memory>
+#include"../metrics/metrics.h"
+#include"../trace/probes.h"
 
 class ThreadPool{
 public:
@@ -22,30 +27,40 @@ public:
         // make_shared:传递右值
         //功能是在动态内存中分配一个对象并初始化它，返回指向此对象的shared_ptr
         assert(threadCount > 0);
+        pool_->running = threadCount;
         for(int i =0;i<threadCount;i++){
-            //创建一个新线程，并执行lambda表达式的代码块，使用[this]捕获当前对象的引用
-            std::thread([this](){
-                std::unique_lock<std::mutex> locker(pool_->mtx_);
+            //创建一个新线程，并执行lambda表达式的代码块，捕获pool_的副本，线程不依赖ThreadPool对象本身
+            std::thread([pool = pool_](){
+                std::unique_lock<std::mutex> locker(pool->mtx_);
                 while(true){
                     //判断线程池中的任务队列是否为空，非空则表示有任务
-                    if(!pool_->tasks.empty()){
+                    if(!pool->tasks.empty()){
                         //取出任务队列中的第一个任务，并使用move变为右值
                         //目的是为了将当前任务转移给当前线程，防止多线程争夺同一个任务
-                        auto task = std::move(pool_->tasks.front());
-                        pool_->tasks.pop();//弹出刚刚取出的任务
+                        auto task = std::move(pool->tasks.front());
+                        pool->tasks.pop();//弹出刚刚取出的任务
+                        pool->pending.fetch_sub(1, std::memory_order_relaxed);
                         locker.unlock();//已经取出任务，解锁，方便task的执行
-                        task();//执行刚刚队列中的任务
+                        TWS_PROBE1(pool_dequeue, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            task.queued.time_since_epoch()).count());
+                        uint64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - task.queued).count();
+                        Metrics::Instance()->poolWait.Record(waitUs);//排队时间
+                        pool->lastWaitUs.store(waitUs, std::memory_order_relaxed);
+                        task.fn();//执行刚刚队列中的任务
                         locker.lock();//上锁，循环等待下一个任务
                     }
                     //判断线程池是否关闭
-                    else if(pool_->isClosed){
+                    else if(pool->isClosed){
+                        pool->running--;
+                        pool->exited.notify_all();
                         break;//若关闭则跳出循环
                     }
                     else{
                         //调用条件变量的wait方法，将当前线程置于等待状态
                         //直到有新任务被添加到队列中或者线程池关闭
                         //在此期间互斥锁被释放，方便其他线程上锁添加新任务
-                        pool_->cond_.wait(locker);
+                        pool->cond_.wait(locker);
                     }
                 }
             }).detach();
@@ -57,24 +72,55 @@ public:
         if(pool_){
             std::unique_lock<std::mutex> locker(pool_->mtx_);
             pool_->isClosed = true;
+            pool_->cond_.notify_all();//唤醒所有线程
         }
-        pool_->cond_.notify_all();//唤醒所有线程
+    }
+
+    //关闭线程池并等待所有线程执行完队列中剩下的任务后退出，
+    //之后任务用到的对象才可以安全地销毁；不能在池内的线程中调用
+    void Close(){
+        if(!pool_){
+            return;
+        }
+        std::unique_lock<std::mutex> locker(pool_->mtx_);
+        pool_->isClosed = true;
+        pool_->cond_.notify_all();
+        pool_->exited.wait(locker, [this]{ return pool_->running == 0; });
     }
 
     template<typename T>
     void AddTask(T&& task){
         std::unique_lock<std::mutex> locker(pool_->mtx_);
-        pool_->tasks.emplace(std::forward<T>(task));
+        pool_->tasks.push(Task{std::chrono::steady_clock::now(), std::forward<T>(task)});
+        size_t pending = pool_->pending.fetch_add(1, std::memory_order_relaxed) + 1;
         pool_->cond_.notify_one();
+        TWS_PROBE1(pool_enqueue, pending);
+    }
+
+    //排队中还没开始执行的任务数，不加锁读取
+    size_t TaskCount() const{
+        return pool_->pending.load(std::memory_order_relaxed);
+    }
+    //最近开始执行的任务的排队时间(微秒)，准入控制用它判断队列是否过载
+    uint64_t QueueWaitUs() const{
+        return pool_->lastWaitUs.load(std::memory_order_relaxed);
     }
 
 private:
+    struct Task{
+        std::chrono::steady_clock::time_point queued;//入队时间
+        std::function<void()> fn;
+    };
     //使用结构体封装
     struct Pool{
         std::mutex mtx_;
         std::condition_variable cond_;
         bool isClosed;
-        std::queue<std::function<void()>> tasks;//任务队列
+        std::queue<Task> tasks;//任务队列
+        std::atomic<size_t> pending{0};
+        std::atomic<uint64_t> lastWaitUs{0};
+        int running = 0;//还没退出的线程数
+        std::condition_variable exited;//线程退出时通知Close
     };
     //智能指针
     std::shared_ptr<Pool> pool_;
@@ -0,0 +1,17 @@
+#include"admission.h"
+
+using namespace std;
+
+void Admission::Init(int maxConns, size_t maxQueue, int maxQueueWaitMS, int retryAfterSec){
+    maxConns_ = maxConns > 0 ? maxConns : 1;
+    highWater_ = maxConns_ - maxConns_ / 10;
+    lowWater_ = maxConns_ - maxConns_ / 5;
+    maxQueue_ = maxQueue;
+    maxQueueWaitUs_ = maxQueueWaitMS > 0 ? (uint64_t)maxQueueWaitMS * 1000 : 0;
+    static const char body[] = "503 Service Unavailable\n";
+    busy_ = "HTTP/1.1 503 Service Unavailable\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: " + to_string(sizeof(body) - 1) + "\r\n"
+            "Retry-After: " + to_string(retryAfterSec > 0 ? retryAfterSec : 1) + "\r\n"
+            "Connection: close\r\n\r\n" + body;
+}
@@ -0,0 +1,56 @@
+//准入控制：过载时尽早拒绝，保证已接受的请求的延迟
+//连接数达到上限时拒绝新连接；线程池排队的任务过多、或者最近开始执行的任务排队太久时，
+//新请求不再进线程池，直接在事件循环里回复预先生成的503(带Retry-After)并关闭连接
+//连接数接近上限时先关闭空闲最久的长连接，给新连接腾位置
+//只做判断和保存预生成的响应，关闭连接、发送等动作由WebServer完成
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include<string>
+#include<stdint.h>
+#include<stddef.h>
+#include"../metrics/metrics.h"
+
+class Admission{
+public:
+    //判断结果：ADMIT或者Metrics::REJECT_REASON
+    static const int ADMIT = -1;
+
+    //maxConns：最大连接数；maxQueue：线程池最多排队的任务数，0不限；
+    //maxQueueWaitMS：任务排队时间超过它就拒绝新请求，0不限；retryAfterSec：503的Retry-After
+    void Init(int maxConns, size_t maxQueue, int maxQueueWaitMS, int retryAfterSec);
+
+    int CheckConn(int userCount) const{
+        return userCount >= maxConns_ ? Metrics::REJECT_CONNS : ADMIT;
+    }
+    //queued为线程池排队的任务数，queueWaitUs为最近开始执行的任务的排队时间
+    int CheckRequest(size_t queued, uint64_t queueWaitUs) const{
+        if(maxQueue_ > 0 && queued >= maxQueue_){
+            return Metrics::REJECT_QUEUE_DEPTH;
+        }
+        //队列已经排空时上一个任务的排队时间不再代表当前状况
+        if(maxQueueWaitUs_ > 0 && queued > 0 && queueWaitUs >= maxQueueWaitUs_){
+            return Metrics::REJECT_QUEUE_WAIT;
+        }
+        return ADMIT;
+    }
+
+    //连接数超过高水位时返回需要关闭的空闲连接数(降到低水位)，否则返回0
+    int IdleToShed(int userCount) const{
+        return userCount >= highWater_ ? userCount - lowWater_ : 0;
+    }
+
+    int MaxConns() const {return maxConns_;}
+    //预生成的503响应，Connection: close
+    const std::string& BusyResponse() const {return busy_;}
+
+private:
+    int maxConns_;
+    int highWater_;//连接数的9/10
+    int lowWater_;//连接数的8/10
+    size_t maxQueue_;
+    uint64_t maxQueueWaitUs_;
+    std::string busy_;
+};
+
+#endif
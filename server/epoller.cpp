@@ -11,7 +11,7 @@ Epoller::~Epoller(){
 }
 
 bool Epoller::AddFd(int fd, uint32_t events){
-    if(fd < 0) return fasle;
+    if(fd < 0) return false;
     epoll_event ev = {0};
     ev.data.fd = fd;
     ev.events = events;
@@ -19,15 +19,15 @@ bool Epoller::AddFd(int fd, uint32_t events){
 }
 
 bool Epoller::ModFd(int fd,uint32_t events){
-    if(fd < 0) return fasle;
+    if(fd < 0) return false;
     epoll_event ev = {0};
     ev.data.fd = fd;
     ev.events = events;
     return 0 == epoll_ctl(epollFd_,EPOLL_CTL_MOD,fd,&ev);
 }
 
-bool Epoller::DelFd(int fd,uint32_t events){
-    if(fd < 0) return fasle;
+bool Epoller::DelFd(int fd){
+    if(fd < 0) return false;
     return 0 == epoll_ctl(epollFd_,EPOLL_CTL_DEL,fd,0);
 }
 
@@ -44,6 +44,6 @@ int Epoller::GetEventFd(size_t i) const{
 
 //获取事件属性
 uint32_t Epoller::GetEvents(size_t i) const{
-    assert(a<events_.size()&&i>=0);
+    assert(i<events_.size()&&i>=0);
     return events_[i].events;
 }
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include"ratelimit.h"
+#include<chrono>
+#include<algorithm>
+
+using namespace std;
+
+RateLimiter::RateLimiter():slotsPerShard_(0), maxConns_(0), reqPerSec_(0), burst_(0),
+    authPerSec_(0), authBurst_(0), ttlSec_(1), lastTick_(0), startMS_(0){
+    entries_ = 0;
+    overflows_ = 0;
+}
+
+void RateLimiter::Init(size_t capacity, int maxConns, int reqPerSec, int burst,
+                       int authPerSec, int authBurst, int ttlSec){
+    slotsPerShard_ = max(capacity / SHARD_CNT, (size_t)MAX_PROBE) + 1;
+    table_.reset(new Entry[slotsPerShard_ * SHARD_CNT]());
+    for(auto& slot : wheel_){
+        slot.clear();
+    }
+    maxConns_ = maxConns;
+    reqPerSec_ = reqPerSec;
+    burst_ = max(burst, 1);
+    authPerSec_ = authPerSec;
+    authBurst_ = max(authBurst, 1);
+    ttlSec_ = min(max(ttlSec, 1), WHEEL_SLOTS - 1);
+    startMS_ = chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+    lastTick_ = 0;
+    entries_ = 0;
+    overflows_ = 0;
+    static const char body[] = "429 Too Many Requests\n";
+    tooMany_ = "HTTP/1.1 429 Too Many Requests\r\n"
+               "Content-Type: text/plain\r\n"
+               "Content-Length: " + to_string(sizeof(body) - 1) + "\r\n"
+               "Retry-After: 1\r\n"
+               "Connection: close\r\n\r\n" + body;
+}
+
+uint64_t RateLimiter::ElapsedMS_() const{
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count() - startMS_;
+}
+
+void RateLimiter::Reset_(Entry& e, uint32_t ip, uint64_t elapsedMS){
+    uint32_t nowMS = (uint32_t)elapsedMS;
+    e.conns.store(0, memory_order_relaxed);
+    e.lastSeen.store(elapsedMS / 1000, memory_order_relaxed);
+    e.reqBucket.store(((uint64_t)burst_ * 1000 << 32) | nowMS, memory_order_relaxed);
+    e.authBucket.store(((uint64_t)authBurst_ * 1000 << 32) | nowMS, memory_order_relaxed);
+    e.ip.store(ip, memory_order_release);
+}
+
+int RateLimiter::Acquire(uint32_t ip){
+    uint64_t elapsed = ElapsedMS_();
+    uint32_t sec = elapsed / 1000;
+    uint32_t hash = ip * 2654435761u;
+    size_t base = (hash >> 28) * slotsPerShard_;
+    size_t normal = slotsPerShard_ - 1;
+    size_t start = hash % normal;
+    int slot = -1;
+    int freeSlot = -1;
+    //回收会留下空洞，所以探测范围内的每一项都要看
+    for(size_t i = 0; i < MAX_PROBE; i++){
+        size_t idx = base + (start + i) % normal;
+        uint32_t cur = table_[idx].ip.load(memory_order_acquire);
+        if(cur == ip){
+            slot = idx;
+            break;
+        }
+        if(cur == EMPTY && freeSlot < 0){
+            freeSlot = idx;
+        }
+    }
+    if(slot < 0){
+        if(freeSlot >= 0){
+            slot = freeSlot;
+            Reset_(table_[slot], ip, elapsed);
+            entries_.fetch_add(1, memory_order_relaxed);
+            Schedule_(slot, sec + ttlSec_);
+        }else{
+            slot = base + normal;//溢出项
+            overflows_.fetch_add(1, memory_order_relaxed);
+        }
+    }
+    Entry& e = table_[slot];
+    e.lastSeen.store(sec, memory_order_relaxed);
+    int conns = e.conns.fetch_add(1, memory_order_relaxed) + 1;
+    if(maxConns_ > 0 && conns > maxConns_){
+        e.conns.fetch_sub(1, memory_order_relaxed);
+        return -1;
+    }
+    return slot;
+}
+
+void RateLimiter::Release(int slot){
+    if(slot < 0){
+        return;
+    }
+    Entry& e = table_[slot];
+    //同一个连接重复关闭时不会减成负数
+    int32_t conns = e.conns.load(memory_order_relaxed);
+    while(conns > 0 && !e.conns.compare_exchange_weak(conns, conns - 1, memory_order_relaxed)){
+    }
+    e.lastSeen.store(NowSec_(), memory_order_relaxed);
+}
+
+bool RateLimiter::Take_(atomic<uint64_t>& bucket, int perSec, int burst, uint32_t nowMS){
+    uint64_t old = bucket.load(memory_order_relaxed);
+    uint64_t updated;
+    do{
+        uint64_t tokens = old >> 32;
+        uint32_t elapsed = nowMS - (uint32_t)old;
+        //每毫秒补充perSec个千分之一令牌
+        tokens = min(tokens + (uint64_t)elapsed * perSec, (uint64_t)burst * 1000);
+        if(tokens < 1000){
+            return false;
+        }
+        updated = ((tokens - 1000) << 32) | nowMS;
+    }while(!bucket.compare_exchange_weak(old, updated, memory_order_relaxed));
+    return true;
+}
+
+//退还Take_取走的一个令牌，时间戳不变，不超过突发上限
+void RateLimiter::Refund_(atomic<uint64_t>& bucket, int burst){
+    uint64_t old = bucket.load(memory_order_relaxed);
+    uint64_t updated;
+    do{
+        uint64_t tokens = min((old >> 32) + 1000, (uint64_t)burst * 1000);
+        updated = (tokens << 32) | (uint32_t)old;
+    }while(!bucket.compare_exchange_weak(old, updated, memory_order_relaxed));
+}
+
+bool RateLimiter::AllowRequest(int slot, bool auth){
+    if(slot < 0){
+        return true;
+    }
+    Entry& e = table_[slot];
+    uint64_t elapsed = ElapsedMS_();
+    uint32_t now = (uint32_t)elapsed;//令牌桶只用毫秒差值，回绕不影响
+    e.lastSeen.store(elapsed / 1000, memory_order_relaxed);
+    bool authTaken = auth && authPerSec_ > 0;
+    if(authTaken && !Take_(e.authBucket, authPerSec_, authBurst_, now)){
+        return false;
+    }
+    if(reqPerSec_ > 0 && !Take_(e.reqBucket, reqPerSec_, burst_, now)){
+        //被总请求速率拒绝的登录/注册没有放行，退还登录令牌
+        if(authTaken){
+            Refund_(e.authBucket, authBurst_);
+        }
+        return false;
+    }
+    return true;
+}
+
+void RateLimiter::Schedule_(int slot, uint32_t sec){
+    wheel_[sec % WHEEL_SLOTS].push_back(slot);
+}
+
+//依次处理上次Tick之后到期的各格：仍有连接或者期间被使用过的表项按新的到期时刻重新挂到轮上，其余回收
+void RateLimiter::Tick(){
+    if(!Enabled()){
+        return;
+    }
+    uint32_t now = NowSec_();
+    if(now - lastTick_ > (uint32_t)WHEEL_SLOTS){
+        lastTick_ = now - WHEEL_SLOTS;//停顿太久时每格处理一遍就够了
+    }
+    vector<int> due;
+    while(lastTick_ < now){
+        lastTick_++;
+        due.clear();
+        due.swap(wheel_[lastTick_ % WHEEL_SLOTS]);
+        for(int slot : due){
+            Entry& e = table_[slot];
+            uint32_t expires = e.lastSeen.load(memory_order_relaxed) + ttlSec_;
+            if(e.conns.load(memory_order_relaxed) == 0 && expires <= lastTick_){
+                e.ip.store(EMPTY, memory_order_release);
+                entries_.fetch_sub(1, memory_order_relaxed);
+            }else{
+                Schedule_(slot, max(expires, lastTick_ + 1));
+            }
+        }
+    }
+}
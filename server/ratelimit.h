@@ -0,0 +1,77 @@
+//按客户端IP的限流：每个IP的连接数上限，请求速率和登录/注册请求速率两个令牌桶
+//表按IP哈希分成16个分片，每个分片是固定大小的开放寻址表，容量在Init时确定，不随攻击者的源地址数增长；
+//表项的字段都是原子变量，令牌桶的令牌数和上次补充时刻打包在一个64位整数里，用CAS更新，不加锁
+//分片的探测范围内没有空位时，该IP记到分片的溢出项上，与其他放不下的IP共用一组限额
+//没有连接的表项在最后一次使用ttlSec秒后回收：表项挂在按秒转动的时间轮上，每秒只检查到期的那一格
+//线程约定：Acquire/AllowRequest/Tick只在事件循环线程调用(插入和回收只有这一个线程)，Release可以在任何线程调用
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include<string>
+#include<vector>
+#include<atomic>
+#include<memory>
+#include<stdint.h>
+
+class RateLimiter{
+public:
+    RateLimiter();
+
+    //capacity：最多跟踪的IP数；maxConns：每个IP的连接数上限，0不限；
+    //reqPerSec/burst：每个IP的请求速率和突发量，0不限；authPerSec/authBurst：登录/注册请求单独的限额；
+    //ttlSec：没有连接的IP表项保留的秒数(1~63)
+    void Init(size_t capacity, int maxConns, int reqPerSec, int burst,
+              int authPerSec, int authBurst, int ttlSec);
+    bool Enabled() const {return slotsPerShard_ > 0;}
+    bool LimitsAuth() const {return Enabled() && authPerSec_ > 0;}
+
+    //新连接到达，返回表项编号，连接关闭时交给Release；超过连接数上限返回-1
+    int Acquire(uint32_t ip);
+    void Release(int slot);
+    //连接上开始一个新请求，auth表示登录/注册请求，超过速率返回false
+    bool AllowRequest(int slot, bool auth);
+    //事件循环每轮调用，回收到期的空闲表项
+    void Tick();
+
+    size_t Entries() const {return entries_.load(std::memory_order_relaxed);}
+    uint64_t Overflows() const {return overflows_.load(std::memory_order_relaxed);}
+    //预生成的429响应，Connection: close
+    const std::string& TooManyResponse() const {return tooMany_;}
+
+private:
+    static const int SHARD_CNT = 16;
+    static const int MAX_PROBE = 8;
+    static const int WHEEL_SLOTS = 64;//时间轮每格1秒
+    static const uint32_t EMPTY = 0;//0.0.0.0不会是TCP连接的对端地址
+
+    struct Entry{
+        std::atomic<uint32_t> ip;
+        std::atomic<int32_t> conns;
+        std::atomic<uint32_t> lastSeen;//最后一次使用的时刻，秒
+        std::atomic<uint64_t> reqBucket;//高32位为千分之一令牌数，低32位为上次补充的时刻(毫秒，49.7天回绕，只用差值)
+        std::atomic<uint64_t> authBucket;
+    };
+
+    //相对startMS_的64位毫秒数；秒数由它直接换算，不从回绕的32位毫秒数换算
+    uint64_t ElapsedMS_() const;
+    uint32_t NowSec_() const {return ElapsedMS_() / 1000;}
+    void Reset_(Entry& e, uint32_t ip, uint64_t elapsedMS);
+    bool Take_(std::atomic<uint64_t>& bucket, int perSec, int burst, uint32_t nowMS);
+    void Refund_(std::atomic<uint64_t>& bucket, int burst);
+    void Schedule_(int slot, uint32_t sec);
+
+    size_t slotsPerShard_;//每个分片最后一项是溢出项
+    int maxConns_;
+    int reqPerSec_, burst_;
+    int authPerSec_, authBurst_;
+    uint32_t ttlSec_;
+    std::unique_ptr<Entry[]> table_;
+    std::vector<int> wheel_[WHEEL_SLOTS];//每格是在该秒到期的表项编号
+    uint32_t lastTick_;//上次Tick处理到的秒
+    int64_t startMS_;//单调时钟的起点，表项里的时刻都相对它
+    std::atomic<size_t> entries_;
+    std::atomic<uint64_t> overflows_;
+    std::string tooMany_;
+};
+
+#endif
@@ -15,7 +15,7 @@ WebServer::WebServer(
     int sqlPort, const char* sqlUser, const char* sqlPwd,
     const char* dbName, int connPoolNum, int threadNum,
     bool openLog, int logLevel, int logQueSize):
-    port_(port), timeoutMS_(timeoutMS), isClose_(isClose),
+    port_(port), timeoutMS_(timeoutMS), headerTimeoutMS_(0), bodyTimeoutMS_(0), writeStallMS_(0), isClose_(false),
     timer_(new HeapTimer()), threadpool_(new ThreadPool(threadNum)),epoller_(new Epoller()){
 
     //是否打开日志标志
@@ -38,23 +38,248 @@ WebServer::WebServer(
     strcat(srcDir_, "/resources/");
     HttpConn::userCount = 0;
     HttpConn::srcDir = srcDir_;
+    admission_.Init(MAX_FD, 0, 0, 1);
 
     //初始化操作
-    SqlConnPool::Instance()->Init("localhost",sqlPort,sqlUser,sqlPwd,dbName,connPoolNum);//连接池单例初始化
+    if(connPoolNum > 0){
+        SqlConnPool::Instance()->Init("localhost",sqlPort,sqlUser,sqlPwd,dbName,connPoolNum);//连接池单例初始化
+    }
     //初始化事件和初始化socket(监听)
     InitEvenMode_(trigMode);
     if(!InitSocket_()){ isClose_ = true;}
+    handBackFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(handBackFd_ < 0 || !epoller_->AddFd(handBackFd_, EPOLLIN)){
+        LOG_ERROR("Create hand back eventfd error!");
+        isClose_ = true;
+    }
 }
 
 WebServer::~WebServer(){
     close(listenFd_);
+    for(auto& item : refused_){
+        close(item.first);
+    }
+    close(handBackFd_);
     isClose_ = true;
+    //等工作线程把手上的任务做完再退出，之后才能清掉它们用到的认证后端、资源包等
+    threadpool_->Close();
+    HttpResponse::bundle = nullptr;
+    HttpRequest::authBackend = nullptr;
+    //先停掉指标的读取方，再清除引用本对象的回调
+    AdminServer::Instance()->Stop();
+    HttpConn::metricsPath = nullptr;
+    Metrics::Instance()->ClearCallbacks();
+    if(PhaseTrace::enabled){
+        PhaseTracer* tracer = PhaseTracer::Instance();
+        tracer->Close();
+        LOG_INFO("PhaseTracer slow:%llu, sampled:%llu",
+                 (unsigned long long)tracer->Slow(), (unsigned long long)tracer->Sampled());
+    }
+    if(RegBatch::Instance()->Enabled()){
+        //队列中剩下的注册先提交完，再关闭事件循环的数据库连接和连接池
+        RegBatch* batch = RegBatch::Instance();
+        batch->Close();
+        LOG_INFO("RegBatch batches:%llu, rows:%llu, duplicates:%llu, failures:%llu",
+                 (unsigned long long)batch->Batches(), (unsigned long long)batch->Rows(),
+                 (unsigned long long)batch->Duplicates(), (unsigned long long)batch->Failures());
+    }
+    AsyncSql::Instance()->Close();
+    if(HttpConn::zeroCopyThreshold > 0){
+        LOG_INFO("ZeroCopy send:%llu, done:%llu, copied:%llu, nobufs:%llu",
+                 (unsigned long long)HttpConn::zcSendCnt, (unsigned long long)HttpConn::zcDoneCnt,
+                 (unsigned long long)HttpConn::zcCopiedCnt, (unsigned long long)HttpConn::zcNoBufsCnt);
+    }
+    LOG_INFO("ResponseCache hit:%llu, miss:%llu",
+             (unsigned long long)ResponseCache::Instance()->Hits(),
+             (unsigned long long)ResponseCache::Instance()->Misses());
+    if(CredCache::Instance()->Enabled()){
+        CredCache* cred = CredCache::Instance();
+        LOG_INFO("CredCache hit:%llu, negative hit:%llu, miss:%llu, stale:%llu",
+                 (unsigned long long)cred->Hits(), (unsigned long long)cred->NegativeHits(),
+                 (unsigned long long)cred->Misses(), (unsigned long long)cred->Stale());
+    }
+    if(TrafficCapture::Instance()->IsOpen()){
+        TrafficCapture* capture = TrafficCapture::Instance();
+        capture->Close();
+        LOG_INFO("TrafficCapture records:%llu, dropped:%llu",
+                 (unsigned long long)capture->Records(), (unsigned long long)capture->Dropped());
+    }
+    if(AccessLog::Instance()->IsOpen()){
+        LOG_INFO("AccessLog dropped:%llu", (unsigned long long)AccessLog::Instance()->Dropped());
+        AccessLog::Instance()->Close();
+    }
+    SqlConnPool::Stats pool = SqlConnPool::Instance()->GetStats();
+    LOG_INFO("SqlConnPool acquired:%llu, waited:%llu, avg wait:%lluus, max wait:%lluus, "
+             "timeouts:%llu, connect failures:%llu, ping failures:%llu",
+             (unsigned long long)pool.acquired, (unsigned long long)pool.waited,
+             (unsigned long long)(pool.acquired ? pool.waitUsTotal / pool.acquired : 0),
+             (unsigned long long)pool.waitUsMax, (unsigned long long)pool.timeouts,
+             (unsigned long long)pool.connectFailures, (unsigned long long)pool.pingFailures);
     free(srcDir_);
     SqlConnPool::Instance()->ClosePool();
 }
 
+bool WebServer::OpenBundle(const char* path, bool populate, bool hugePage){
+    std::unique_ptr<AssetBundle> bundle(new AssetBundle());
+    if(!bundle->Open(path, populate, hugePage)){
+        return false;
+    }
+    bundle_ = move(bundle);
+    HttpResponse::bundle = bundle_.get();
+    LOG_INFO("Bundle mode: %s", path);
+    return true;
+}
+
+bool WebServer::OpenLocalAuth(const char* path, size_t maxUsers, bool syncWrites){
+    std::unique_ptr<LocalAuth> auth(new LocalAuth());
+    if(!auth->Open(path, maxUsers, syncWrites)){
+        return false;
+    }
+    localAuth_ = move(auth);
+    HttpRequest::authBackend = localAuth_.get();
+    LOG_INFO("LocalAuth mode: %s, max users:%d, sync:%d", path, (int)maxUsers, (int)syncWrites);
+    return true;
+}
+
+void WebServer::SetWriteQuantum(size_t bytes){
+    HttpConn::writeQuantum = bytes;
+    LOG_INFO("Write quantum: %d", (int)bytes);
+}
+
+void WebServer::SetZeroCopyThreshold(size_t bytes){
+    HttpConn::zeroCopyThreshold = bytes;
+    LOG_INFO("ZeroCopy threshold: %d", (int)bytes);
+}
+
+void WebServer::SetResponseCacheTtl(int ttlMS){
+    ResponseCache::Instance()->SetTtl(ttlMS);
+    LOG_INFO("ResponseCache ttl: %dms", ttlMS);
+}
+
+bool WebServer::EnableAsyncSql(int sqlPort, const char* sqlUser, const char* sqlPwd,
+                               const char* dbName, int connNum){
+    if(!AsyncSql::Instance()->Init(epoller_.get(), "localhost", sqlPort, sqlUser, sqlPwd, dbName, connNum)){
+        LOG_WARN("AsyncSql unavailable, login/register use SqlConnPool");
+        return false;
+    }
+    return true;
+}
+
+void WebServer::SetSqlPoolPolicy(int minConn, int acquireTimeoutMS, int validateIdleMS, int idleTimeoutMS){
+    SqlConnPool::Instance()->SetPolicy(minConn, acquireTimeoutMS, validateIdleMS, idleTimeoutMS);
+    LOG_INFO("SqlConnPool min:%d, acquire timeout:%dms, validate idle:%dms, idle timeout:%dms",
+             minConn, acquireTimeoutMS, validateIdleMS, idleTimeoutMS);
+}
+
+void WebServer::EnableRegBatch(int windowMS, int maxRows){
+    RegBatch::Instance()->Init(windowMS, maxRows);
+    LOG_INFO("RegBatch window:%dms, max rows:%d", windowMS, maxRows);
+}
+
+void WebServer::EnableCredCache(size_t capacity, int ttlMS, int negativeTtlMS){
+    CredCache::Instance()->Init(capacity, ttlMS, negativeTtlMS);
+    LOG_INFO("CredCache capacity:%d, ttl:%dms, negative ttl:%dms", (int)capacity, ttlMS, negativeTtlMS);
+}
+
+void WebServer::SetLogPolicy(int perSec, int burst, double sampleKeep, int saturation){
+    Log* log = Log::Instance();
+    log->SetRateLimit(perSec, burst);
+    log->SetSampling(sampleKeep);
+    log->SetSaturationPolicy(saturation);
+    LOG_INFO("Log rate limit: %d/s burst:%d, sample:%.3f, saturation:%d", perSec, burst, sampleKeep, saturation);
+}
+
+bool WebServer::OpenAccessLog(const char* path, int format, size_t maxBytes, int rotateSec, bool gzip){
+    if(!AccessLog::Instance()->init(path, format, maxBytes, rotateSec, gzip)){
+        LOG_ERROR("AccessLog open %s failed", path);
+        return false;
+    }
+    LOG_INFO("AccessLog: %s, format:%d, maxBytes:%d, rotateSec:%d, gzip:%d",
+             path, format, (int)maxBytes, rotateSec, (int)gzip);
+    return true;
+}
+
+bool WebServer::EnableMetrics(const char* path, int adminPort, const char* bindAddr){
+    Metrics* metrics = Metrics::Instance();
+    metrics->ClearCallbacks();
+    metrics->AddGauge("tws_active_connections", "Open client connections.",
+                      []{ return (double)HttpConn::userCount; });
+    ThreadPool* pool = threadpool_.get();
+    metrics->AddGauge("tws_threadpool_queue_depth", "Tasks waiting in the thread pool.",
+                      [pool]{ return (double)pool->TaskCount(); });
+    metrics->AddGauge("tws_sqlpool_connections", "Connections owned by SqlConnPool.",
+                      []{ return (double)SqlConnPool::Instance()->GetStats().total; });
+    metrics->AddGauge("tws_sqlpool_in_use", "Connections borrowed from SqlConnPool.",
+                      []{ return (double)SqlConnPool::Instance()->GetStats().inUse; });
+    metrics->AddGauge("tws_log_buffered_bytes", "Log bytes waiting for the writer thread.",
+                      []{ return (double)Log::Instance()->BufferedBytes(); });
+    RateLimiter* limiter = &rateLimiter_;
+    metrics->AddGauge("tws_ratelimit_entries", "Client IPs tracked by the rate limiter.",
+                      [limiter]{ return (double)limiter->Entries(); });
+    metrics->AddCounter("tws_ratelimit_overflows_total", "Connections counted on a shared overflow entry.",
+                        [limiter]{ return (double)limiter->Overflows(); });
+    metrics->AddCounter("tws_log_dropped_total", "Log messages dropped because the buffer was full.",
+                        []{ return (double)Log::Instance()->DroppedCount(); });
+    HttpConn::metricsPath = path && *path ? path : nullptr;
+    if(adminPort > 0){
+        AdminServer* admin = AdminServer::Instance();
+        admin->Handle("/metrics", "text/plain; version=0.0.4",
+                      [](const std::string&){ return Metrics::Instance()->Render(); });
+        if(!admin->Start(adminPort, bindAddr)){
+            return false;
+        }
+    }
+    LOG_INFO("Metrics path:%s, admin port:%d", HttpConn::metricsPath ? HttpConn::metricsPath : "off", adminPort);
+    return true;
+}
+
+void WebServer::EnableTracing(int slowMS, int sampleEvery, size_t capacity){
+    PhaseTracer::Instance()->Init(slowMS, sampleEvery, capacity);
+    AdminServer::Instance()->Handle("/trace", "text/plain",
+                                    [](const std::string& query){ return PhaseTracer::Instance()->HandleQuery(query); });
+    LOG_INFO("PhaseTracer slow:%dms, sample:1/%d, capacity:%d", slowMS, sampleEvery, (int)capacity);
+}
+
+bool WebServer::EnableCapture(const char* path, size_t maxBytes, int sampleConns){
+    if(!TrafficCapture::Instance()->Open(path, maxBytes, sampleConns)){
+        LOG_ERROR("TrafficCapture open %s failed", path);
+        return false;
+    }
+    LOG_INFO("TrafficCapture: %s, max bytes:%d, sample:1/%d", path, (int)maxBytes, sampleConns);
+    return true;
+}
+
+void WebServer::EnableAdmission(int maxConns, size_t maxQueue, int maxQueueWaitMS, int retryAfterSec){
+    if(maxConns <= 0 || maxConns > MAX_FD){
+        maxConns = MAX_FD;
+    }
+    admission_.Init(maxConns, maxQueue, maxQueueWaitMS, retryAfterSec);
+    LOG_INFO("Admission max conns:%d, max queue:%d, max queue wait:%dms, retry after:%ds",
+             maxConns, (int)maxQueue, maxQueueWaitMS, retryAfterSec);
+}
+
+void WebServer::EnableRateLimit(size_t capacity, int maxConns, int reqPerSec, int burst,
+                                int authPerSec, int authBurst, int ttlSec){
+    rateLimiter_.Init(capacity, maxConns, reqPerSec, burst, authPerSec, authBurst, ttlSec);
+    LOG_INFO("RateLimit capacity:%d, conns/ip:%d, req/s:%d burst:%d, auth/s:%d burst:%d, ttl:%ds",
+             (int)capacity, maxConns, reqPerSec, burst, authPerSec, authBurst, ttlSec);
+}
+
+void WebServer::SetClientDeadlines(int headerMS, int bodyMS, int writeStallMS){
+    headerTimeoutMS_ = headerMS;
+    bodyTimeoutMS_ = bodyMS;
+    writeStallMS_ = writeStallMS;
+    LOG_INFO("Client deadlines header:%dms, body:%dms, write stall:%dms", headerMS, bodyMS, writeStallMS);
+}
+
+void WebServer::SetRequestLimits(size_t maxHeaderBytes, size_t maxRequestBytes){
+    HttpRequest::maxHeaderBytes = maxHeaderBytes;
+    HttpRequest::maxRequestBytes = maxRequestBytes;
+    LOG_INFO("Request limits header:%d bytes, request:%d bytes", (int)maxHeaderBytes, (int)maxRequestBytes);
+}
+
 void WebServer::InitEvenMode_(int trigMode){
-    listenEvent_ = EPOOLRDHUP;//检测socket关闭
+    listenEvent_ = EPOLLRDHUP;//检测socket关闭
     connEvent_ = EPOLLONESHOT|EPOLLRDHUP; //EPOLLONESHOT由一个线程处理
     switch(trigMode){
     case 0:
@@ -81,21 +306,63 @@ void WebServer::Start(){
     int timeMS = -1;//epoll wait timeout == -1 无事件将阻塞
     if(!isClose_){ LOG_INFO("====== Server start ======");}
     while(!isClose_){
-        if(timeoutMS_ > 0){
+        ApplyHandBacks_();//空闲状态要在定时器检查之前更新
+        if(TimersOn_()){
             //获取下一次的超时等待时间
             //至少这个事件才会有用户过期，每次关闭超时连接则需要有新的请求
             timeMS = timer_->GetNextTick();
         }
+        //Date响应头每秒刷新一次，epoll最多等待1秒
+        if(timeMS < 0 || timeMS > 1000){
+            timeMS = 1000;
+        }
+        HttpDate::Update();
+        rateLimiter_.Tick();
+        ExpireRefused_();
+        HttpConn::ReapLingering();
         int eventCnt = epoller_->Wait(timeMS);
         for(int i = 0;i<eventCnt;i++){
             /*处理事件*/
             int fd = epoller_ -> GetEventFd(i);
             uint32_t events = epoller_ ->GetEvents(i);
+            if(AsyncSql::Instance()->HandleEvent(fd, events)){
+                continue;//数据库连接或查询提交的eventfd
+            }
+            if(fd == handBackFd_){
+                uint64_t cnt;
+                while(read(handBackFd_, &cnt, sizeof(cnt)) > 0){
+                }
+                ApplyHandBacks_();
+                continue;
+            }
+            if(refused_.count(fd)){
+                DrainRefused_(fd, events);
+                continue;
+            }
+            auto user = fd != listenFd_ && (events & EPOLLERR) ? users_.find(fd) : users_.end();
+            if(user != users_.end() && user->second.HasZeroCopyPending()){
+                //零拷贝的完成通知放在错误队列里，也会触发EPOLLERR
+                //读完通知后不是真正的错误就按其余事件正常处理
+                if(user->second.ReapZeroCopy()){
+                    events &= ~EPOLLERR;
+                    if(!(events & (EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLHUP))){
+                        //EPOLLONESHOT已经把fd摘掉，按原来的事件重新注册
+                        uint32_t ev = user->second.ToWriteBytes() > 0 ? EPOLLOUT : EPOLLIN;
+                        epoller_->ModFd(fd, connEvent_ | ev);
+                        continue;
+                    }
+                }
+            }
             if(fd == listenFd_){
                 DealListen_();
             }
-            else if(events & (EPOLLRDHUP|EPOLLHUB|EPOLLERR)){
+            else if(events & (EPOLLRDHUP|EPOLLHUP|EPOLLERR)){
                 assert(users_.count(fd) > 0);
+                if(users_[fd].IsDraining() && !(events & (EPOLLHUP|EPOLLERR))){
+                    DrainConn_(&users_[fd]);//客户端发完了，读空接收缓冲再关闭，不发RST
+                    continue;
+                }
+                Unidle_(&users_[fd]);
                 CloseConn_(&users_[fd]);
             }
             else if(events & EPOLLIN){
@@ -112,6 +379,10 @@ void WebServer::Start(){
     }
 }
 
+static int64_t NowMS(){
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 void WebServer::SendError_(int fd, const char*info){
     assert(fd>0);
     int ret = send(fd, info, strlen(info), 0);
@@ -121,19 +392,203 @@ void WebServer::SendError_(int fd, const char*info){
     close(fd);
 }
 
+void WebServer::Refuse_(int fd, const std::string& response){
+    assert(fd > 0);
+    if(refused_.size() >= MAX_REFUSED){
+        SendError_(fd, response.c_str());
+        return;
+    }
+    SetFdNonblock(fd);
+    send(fd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    int64_t deadline = NowMS() + DRAIN_TIMEOUT_MS;
+    refused_[fd] = deadline;
+    if(refusedQueue_.size() >= 2 * MAX_REFUSED){
+        //提前关闭的连接在队列里留下的旧记录太多时清理一遍，队列长度跟着refused_走
+        std::deque<RefusedFd> live;
+        for(auto& item : refusedQueue_){
+            auto it = refused_.find(item.fd);
+            if(it != refused_.end() && it->second == item.deadline){
+                live.push_back(item);
+            }
+        }
+        refusedQueue_.swap(live);
+    }
+    refusedQueue_.push_back({fd, deadline});
+    epoller_->AddFd(fd, EPOLLIN | EPOLLRDHUP);
+}
+
+void WebServer::DrainRefused_(int fd, uint32_t events){
+    char buf[4096];
+    ssize_t len = -1;
+    for(int i = 0; i < 16; i++){
+        len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if(len <= 0){
+            break;
+        }
+    }
+    if(len == 0 || (len < 0 && errno != EAGAIN) || (events & (EPOLLHUP | EPOLLERR))){
+        CloseRefused_(fd);
+    }
+}
+
+void WebServer::ExpireRefused_(){
+    if(refusedQueue_.empty()){
+        return;
+    }
+    int64_t now = NowMS();
+    while(!refusedQueue_.empty() && refusedQueue_.front().deadline <= now){
+        RefusedFd item = refusedQueue_.front();
+        refusedQueue_.pop_front();
+        auto it = refused_.find(item.fd);
+        if(it != refused_.end() && it->second == item.deadline){
+            CloseRefused_(item.fd);
+        }
+    }
+}
+
+void WebServer::CloseRefused_(int fd){
+    epoller_->DelFd(fd);
+    close(fd);
+    refused_.erase(fd);
+}
+
 void WebServer::CloseConn_(HttpConn* client) {
     assert(client);
     LOG_INFO("Client[%d] quit!", client->GetFd());
     epoller_->DelFd(client->GetFd());
+    rateLimiter_.Release(client->LimitSlot());
+    client->SetLimitSlot(-1);
     client->Close();
 }
 
+void WebServer::Reject_(HttpConn* client, int reason, int code, const std::string& response){
+    assert(client);
+    Metrics* metrics = Metrics::Instance();
+    metrics->rejected[reason].Add();
+    metrics->CountStatus(code);
+    //先读掉已经到达的请求，关闭时接收缓冲里还有数据内核会发RST，客户端可能收不到503
+    char buf[4096];
+    for(int i = 0; i < 16 && recv(client->GetFd(), buf, sizeof(buf), MSG_DONTWAIT) > 0; i++){
+    }
+    send(client->GetFd(), response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    LOG_WARN("Client[%d] rejected with %d, reason:%d", client->GetFd(), code, reason);
+    CloseConn_(client);
+}
+
+//偷看请求行(MSG_PEEK不从接收缓冲取走数据)，判断是不是登录/注册的POST
+bool WebServer::PeekAuthRoute_(int fd){
+    char buf[16];
+    ssize_t n = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+    if(n < 6 || memcmp(buf, "POST /", 6) != 0){
+        return false;
+    }
+    std::string path(buf + 5, n - 5);
+    return path.compare(0, 6, "/login") == 0 || path.compare(0, 9, "/register") == 0;
+}
+
+//从空闲列表头部(空闲最久的)开始关闭count个，列表里的连接都已经交回事件循环
+void WebServer::ShedIdle_(int count){
+    ApplyHandBacks_();
+    int shed = 0;
+    while(shed < count && !idleFds_.empty()){
+        HttpConn* client = &users_[idleFds_.front()];
+        Unidle_(client);
+        CloseConn_(client);
+        shed++;
+    }
+    if(shed > 0){
+        Metrics::Instance()->idleShed.Add(shed);
+        LOG_WARN("Connections near limit, closed %d idle keep-alive connections", shed);
+    }
+}
+
+//读出工作线程留下的交回记录；交回之后又交出去了、关闭了或者换了客户端的记录跳过
+void WebServer::ApplyHandBacks_(){
+    vector<HandBackNote> notes;
+    {
+        lock_guard<mutex> locker(handBackMtx_);
+        if(handBacks_.empty()){
+            return;
+        }
+        notes.swap(handBacks_);
+    }
+    for(auto& note : notes){
+        HttpConn* client = note.client;
+        if(client->DispatchSeq() != note.seq || client->Generation() != note.gen || client->IsClosed()){
+            continue;
+        }
+        if(note.state == CONN_IDLE){
+            MarkIdle_(client, note.ms);
+            //空闲记录不唤醒事件循环，处理时可能已经过了一会儿，空闲超时从交回时刻算
+            if(timeoutMS_ > 0){
+                int64_t left = note.ms + timeoutMS_ - NowMS();
+                ExtentTime_(client, left > 0 ? (int)left : 1);
+            }
+        }else if(note.state == CONN_PARTIAL){
+            ExtentTime_(client, ReadTimeout_(client));
+        }else if(note.state == CONN_DRAINING){
+            ExtentTime_(client, DRAIN_TIMEOUT_MS);
+        }
+    }
+}
+
+void WebServer::MarkIdle_(HttpConn* client, int64_t since){
+    Unidle_(client);
+    client->SetIdle(since);
+    idlePos_[client->GetFd()] = idleFds_.insert(idleFds_.end(), client->GetFd());
+}
+
+void WebServer::Unidle_(HttpConn* client){
+    auto pos = idlePos_.find(client->GetFd());
+    if(pos != idlePos_.end()){
+        idleFds_.erase(pos->second);
+        idlePos_.erase(pos);
+    }
+    client->SetIdle(0);
+}
+
+void WebServer::DrainConn_(HttpConn* client){
+    char buf[4096];
+    ssize_t len = -1;
+    for(int i = 0; i < 16; i++){
+        len = recv(client->GetFd(), buf, sizeof(buf), MSG_DONTWAIT);
+        if(len <= 0){
+            break;
+        }
+    }
+    if(len == 0 || (len < 0 && errno != EAGAIN)){
+        CloseConn_(client);
+        return;
+    }
+    //还有数据或者暂时读空，继续等；总时长由CONN_DRAINING设置的定时器限制
+    epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLIN);
+}
+
+//在工作线程中调用。epoll重新注册之后事件循环随时可能再次交出或者关闭连接，
+//所以序号和Generation先读好，注册之后只写交回记录和MarkReturned
+void WebServer::HandBack_(HttpConn* client, uint32_t events, int state){
+    uint64_t seq = client->DispatchSeq();
+    uint64_t gen = client->Generation();
+    epoller_->ModFd(client->GetFd(), connEvent_ | events);
+    if(state != CONN_ACTIVE){
+        lock_guard<mutex> locker(handBackMtx_);
+        handBacks_.push_back({client, gen, seq, state, NowMS()});
+    }
+    client->MarkReturned(seq);
+    if(state == CONN_PARTIAL){
+        uint64_t one = 1;
+        ::write(handBackFd_, &one, sizeof(one));
+    }
+}
+
 void WebServer::AddClient_(int fd, sockaddr_in addr) {
     assert(fd > 0);
     users_[fd].init(fd, addr);
-    if(timeoutMS_ > 0) {
-        timer_->add(fd, timeoutMS_, std::bind(&WebServer::CloseConn_, this, &users_[fd]));
-    }
+    TWS_PROBE2(accept, fd, addr.sin_addr.s_addr);
+    //新连接也要在请求头时限内发来完整的请求头，和空闲超时取小的
+    bool header = headerTimeoutMS_ > 0 && (timeoutMS_ <= 0 || headerTimeoutMS_ < timeoutMS_);
+    ExtentTime_(&users_[fd], header ? headerTimeoutMS_ : timeoutMS_);
     epoller_->AddFd(fd, EPOLLIN | connEvent_);
     SetFdNonblock(fd);
     LOG_INFO("Client[%d] in!", users_[fd].GetFd());
@@ -146,32 +601,135 @@ void WebServer::DealListen_(){
     do{
         int fd = accept(listenFd_, (struct  sockaddr*)&addr,&len);
         if(fd<=0) {return;}
-        else if(HttpConn::userCount >= MAX_FD){
-            SendError_(fd,"server busy!");
+        Metrics::Instance()->accepts.Add();
+        int shed = admission_.IdleToShed(HttpConn::userCount);
+        if(shed > 0){
+            ShedIdle_(shed);
+        }
+        if(admission_.CheckConn(HttpConn::userCount) != Admission::ADMIT){
+            Metrics::Instance()->rejected[Metrics::REJECT_CONNS].Add();
+            Metrics::Instance()->CountStatus(503);
+            Refuse_(fd, admission_.BusyResponse());
             LOG_WARN("Clients is full!");
-            return;
+            continue;//后面排队的连接同样回复503
+        }
+        int slot = -1;
+        if(rateLimiter_.Enabled()){
+            slot = rateLimiter_.Acquire(addr.sin_addr.s_addr);
+            if(slot < 0){
+                Metrics::Instance()->rejected[Metrics::REJECT_IP_CONNS].Add();
+                Metrics::Instance()->CountStatus(429);
+                Refuse_(fd, rateLimiter_.TooManyResponse());
+                continue;
+            }
         }
         AddClient_(fd,addr);
+        users_[fd].SetLimitSlot(slot);
     }while(listenEvent_& EPOLLET);
 }
 
 //处理读事件，主要逻辑是将OnRead加入线程池的任务队列中
 void WebServer::DealRead_(HttpConn* client){
     assert(client);
-    ExtentTime_(client);
+    if(client->IsDraining()){
+        DrainConn_(client);
+        return;
+    }
+    Unidle_(client);
+    //只在新请求开始时拒绝，已经读了一部分的请求继续处理
+    if(!client->HasPendingInput()){
+        int reason = admission_.CheckRequest(threadpool_->TaskCount(), threadpool_->QueueWaitUs());
+        if(reason != Admission::ADMIT){
+            Reject_(client, reason, 503, admission_.BusyResponse());
+            return;
+        }
+        //超过速率的请求不进线程池；登录/注册要查库，只有配置了单独限额时才偷看请求行
+        bool auth = rateLimiter_.LimitsAuth() && PeekAuthRoute_(client->GetFd());
+        if(!rateLimiter_.AllowRequest(client->LimitSlot(), auth)){
+            Reject_(client, auth ? Metrics::REJECT_IP_AUTH : Metrics::REJECT_IP_RATE,
+                    429, rateLimiter_.TooManyResponse());
+            return;
+        }
+    }
+    ExtentTime_(client, ReadTimeout_(client));
+    client->MarkDispatch();
     threadpool_->AddTask(std::bind(&WebServer::OnRead_,this,client));//bind将参数和函数绑定
 }
 
 // 处理写事件，主要逻辑是将OnWrite加入线程池的任务队列中
 void WebServer::DealWrite_(HttpConn* client) {
     assert(client);
-    ExtentTime_(client);
+    //每次可写都说明客户端在收，写停顿的计时从这里重新开始
+    ExtentTime_(client, writeStallMS_ > 0 ? writeStallMS_ : timeoutMS_);
+    client->MarkDispatch();
     threadpool_->AddTask(std::bind(&WebServer::OnWrite_, this, client));
 }
 
-void WebServer::ExtentTime_(HttpConn* client) {
+//截止时间可能比原来的早，用add重新排序，定时器不存在时也会新建
+void WebServer::ExtentTime_(HttpConn* client, int timeoutMS) {
     assert(client);
-    if(timeoutMS_ > 0) { timer_->adjust(client->GetFd(), timeoutMS_); }
+    if(timeoutMS > 0) {
+        timer_->add(client->GetFd(), timeoutMS, std::bind(&WebServer::OnTimeout_, this, client));
+    }
+}
+
+//请求收了一部分时返回请求头/消息体截止时刻的剩余时间，读到数据不会延长；
+//否则这次读可能就收齐了整个请求，按空闲/处理超时定时，收了一半时工作线程交回后再改
+int WebServer::ReadTimeout_(HttpConn* client) const{
+    int phase = client->ReadPhase();
+    int limit = phase == HttpConn::PHASE_BODY ? bodyTimeoutMS_ : headerTimeoutMS_;
+    if(phase == HttpConn::PHASE_NONE || limit <= 0){
+        return timeoutMS_;
+    }
+    int64_t left = client->PhaseStartMS() + limit - NowMS();
+    return left > 0 ? (int)left : 1;
+}
+
+void WebServer::OnTimeout_(HttpConn* client){
+    assert(client);
+    if(client->IsClosed()){
+        return;
+    }
+    //工作线程(或者等待中的数据库查询)还拿着连接，不能关闭，按空闲/处理超时再检查
+    if(client->IsBusy()){
+        ExtentTime_(client, timeoutMS_);
+        return;
+    }
+    int fd = client->GetFd();
+    int64_t now = NowMS();
+    //请求收了一半：截止时刻到了回复408，还没到(阶段变了)就按剩余时间重新定时
+    int phase = client->ReadPhase();
+    int limit = phase == HttpConn::PHASE_BODY ? bodyTimeoutMS_ : headerTimeoutMS_;
+    if(phase != HttpConn::PHASE_NONE && limit > 0){
+        int64_t left = client->PhaseStartMS() + limit - now;
+        if(left > 0){
+            ExtentTime_(client, (int)left);
+            return;
+        }
+        static const std::string TIMEOUT_RESPONSE = HttpResponse::CloseResponse(408);
+        send(fd, TIMEOUT_RESPONSE.data(), TIMEOUT_RESPONSE.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        Metrics::Instance()->CountStatus(408);
+        LOG_WARN("Client[%d] %s timeout", fd, phase == HttpConn::PHASE_BODY ? "body" : "header");
+    }else if(client->ToWriteBytes() > 0){
+        //writeStallMS_(没有设置时为timeoutMS_)内没有等到可写
+        if(writeStallMS_ <= 0 && timeoutMS_ <= 0){
+            return;
+        }
+        LOG_WARN("Client[%d] write stalled, %d bytes left", fd, (int)client->ToWriteBytes());
+    }else if(client->IdleSince() > 0){
+        //长连接空闲，只受空闲超时限制
+        if(timeoutMS_ <= 0){
+            return;
+        }
+        int64_t left = client->IdleSince() + timeoutMS_ - now;
+        if(left > 0){
+            ExtentTime_(client, (int)left);
+            return;
+        }
+    }
+    Metrics::Instance()->timerExpirations.Add();
+    Unidle_(client);
+    CloseConn_(client);
 }
 
 void WebServer::OnRead_(HttpConn* client) {
@@ -179,12 +737,13 @@ void WebServer::OnRead_(HttpConn* client) {
     int ret = -1;
     int readErrno = 0;
     ret = client->read(&readErrno);         // 读取客户端套接字的数据，读到httpconn的读缓存区
-    if(ret <= 0 && readErrno != EAGAIN) {   // 读异常就关闭客户端
+    //ENOBUFS是读缓冲到了上限，交给process回复413/431
+    if(ret <= 0 && readErrno != EAGAIN && readErrno != ENOBUFS) {   // 读异常就关闭客户端
         CloseConn_(client);
         return;
     }
     // 业务逻辑的处理（先读后处理）
-    OnProcess(client);
+    OnProcess_(client);
 }
 
 /*处理读（请求）数据的函数*/
@@ -193,13 +752,33 @@ void WebServer::OnProcess_(HttpConn* client){
     if(client->process()){
         //根据返回的信息将fd置为EPOLLOUT（写）或EPOLLIN（读）
         //读完事件就跟内核说可以写
-        epoller_->ModFd(client->GetFd(),connEvent_|EPOLLOUT);//响应成功，修改监听事件为写，等待OnWrite_()发送
+        HandBack_(client, EPOLLOUT);//响应成功，修改监听事件为写，等待OnWrite_()发送
+    }else if(client->IsWaitingDb()){
+        //查询期间不重新注册事件，回调在事件循环线程中执行；
+        //连接可能已经超时关闭并被新客户端复用，用Generation判断
+        uint64_t gen = client->Generation();
+        client->VerifyAsync([this, client, gen](bool ok){
+            if(client->IsClosed() || client->Generation() != gen){
+                return;
+            }
+            threadpool_->AddTask(std::bind(&WebServer::OnVerified_, this, client, gen, ok));
+        });
     }else{
-        //写完事件跟内核说可以读
-        epoller_->ModFd(client->GetFd(),connEvent_|EPOLLIN);
+        //写完事件跟内核说可以读；请求收了一半时让事件循环改按截止时刻定时
+        HandBack_(client, EPOLLIN, client->ReadPhase() != HttpConn::PHASE_NONE ? CONN_PARTIAL : CONN_ACTIVE);
     }
 }
 
+void WebServer::OnVerified_(HttpConn* client, uint64_t gen, bool ok){
+    assert(client);
+    //任务排队期间连接可能已经关闭，fd也可能已经给了新客户端
+    if(client->IsClosed() || client->Generation() != gen){
+        return;
+    }
+    client->Resume(ok);
+    HandBack_(client, EPOLLOUT);
+}
+
 void WebServer::OnWrite_(HttpConn* client) {
     assert(client);
     int ret = -1;
@@ -209,14 +788,23 @@ void WebServer::OnWrite_(HttpConn* client) {
         /* 传输完成 */
         if(client->IsKeepAlive()) {
             // OnProcess(client);
-            epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLIN); // 回归换成监测读事件
+            HandBack_(client, EPOLLIN, CONN_IDLE); // 回归换成监测读事件
+            return;
+        }
+        if(client->Drain()){
+            HandBack_(client, EPOLLIN, CONN_DRAINING);
             return;
         }
     }
+    else if(ret > 0) {
+        /* 配额用完或LT模式剩余不多，让出线程，等EPOLLOUT重新排队继续写 */
+        HandBack_(client, EPOLLOUT);
+        return;
+    }
     else if(ret < 0) {
         if(writeErrno == EAGAIN) {  // 缓冲区满了 
             /* 继续传输 */
-            epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT);
+            HandBack_(client, EPOLLOUT);
             return;
         }
     }
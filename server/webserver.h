@@ -2,20 +2,37 @@
 #define WEBSERVER_H
 
 #include<unordered_map>
+#include<list>
+#include<deque>
+#include<mutex>
+#include<vector>
 #include<fcntl.h>//fcntl()
 #include<unistd.h> //close()
 #include<assert.h>
 #include<errno.h>
 #include<sys/socket.h>
+#include<sys/eventfd.h>
 #include<netinet/in.h>
 #include<arpa/inet.h>
 
 #include"epoller.h"
+#include"admission.h"
+#include"ratelimit.h"
 #include"../timer/heaptimer.h"
 #include"../log/log.h"
 #include"../pool/sqlconnpool.h"
+#include"../pool/asyncsql.h"
+#include"../pool/credcache.h"
+#include"../pool/regbatch.h"
 #include"../pool/threadpool.h"
 #include"../http/httpconn.h"
+#include"../bundle/assetbundle.h"
+#include"../auth/localauth.h"
+#include"../metrics/metrics.h"
+#include"../metrics/adminserver.h"
+#include"../trace/phasetrace.h"
+#include"../trace/capture.h"
+#include"../trace/probes.h"
 
 class WebServer{
 public:
@@ -27,30 +44,113 @@ public:
     );
     ~WebServer();
     void Start();
+    //资源包模式：启动时映射打包好的资源文件，之后的请求不再访问resources/目录
+    bool OpenBundle(const char* path, bool populate = false, bool hugePage = false);
+    //每次写事件最多写出的字节数，0表示一直写到完成或缓冲区满
+    void SetWriteQuantum(size_t bytes);
+    //消息体不小于bytes时用MSG_ZEROCOPY发送，0表示关闭
+    void SetZeroCopyThreshold(size_t bytes);
+    //welcome/error页面和错误页面的响应缓存时间，0表示关闭
+    void SetResponseCacheTtl(int ttlMS);
+    //登录/注册改用非阻塞数据库查询，套接字由事件循环驱动，不占用工作线程
+    bool EnableAsyncSql(int sqlPort, const char* sqlUser, const char* sqlPwd,
+                        const char* dbName, int connNum);
+    //数据库连接池的伸缩与校验策略，参数含义见SqlConnPool::SetPolicy
+    void SetSqlPoolPolicy(int minConn, int acquireTimeoutMS, int validateIdleMS, int idleTimeoutMS);
+    //注册写入的组提交：第一行到达后最多等windowMS毫秒或凑够maxRows行，一个事务提交
+    void EnableRegBatch(int windowMS, int maxRows);
+    //登录/注册改用本地认证存储，不再访问MySQL；构造时connPoolNum传0可以完全不连接数据库
+    bool OpenLocalAuth(const char* path, size_t maxUsers, bool syncWrites);
+    //登录/注册前的凭据缓存，capacity为0关闭；ttlMS为用户记录有效期，negativeTtlMS为"用户不存在"的有效期
+    void EnableCredCache(size_t capacity, int ttlMS, int negativeTtlMS);
+    //运行日志的过载保护：每个调用处每秒最多perSec条(0不限)，DEBUG/INFO按sampleKeep比例采样，
+    //saturation为Log::SATURATION，决定线程缓冲区满时丢弃、采样还是等待
+    void SetLogPolicy(int perSec, int burst, double sampleKeep, int saturation);
+    //访问日志，format取AccessLog::FORMAT，maxBytes/rotateSec为0时不按大小/时间切换
+    bool OpenAccessLog(const char* path, int format = AccessLog::COMBINED,
+                       size_t maxBytes = 0, int rotateSec = 0, bool gzip = false);
+    //Prometheus指标：path不为空时业务端口上的该路径返回指标；adminPort>0时另开管理端口提供/metrics，
+    //bindAddr为空只监听127.0.0.1
+    bool EnableMetrics(const char* path, int adminPort = 0, const char* bindAddr = nullptr);
+    //请求分阶段计时：总耗时不小于slowMS的请求和每sampleEvery个请求中的一个，保留最近capacity条，
+    //通过管理端口的/trace读取(需要EnableMetrics开启管理端口)，慢请求同时写运行日志
+    void EnableTracing(int slowMS, int sampleEvery, size_t capacity = 1024);
+    //抓取请求流量到path，供bench/replay回放；maxBytes为文件大小上限(0不限)，每sampleConns个连接抓一个
+    bool EnableCapture(const char* path, size_t maxBytes, int sampleConns = 1);
+    //准入控制：最多maxConns个连接(<=0为MAX_FD)；线程池排队任务数达到maxQueue(0不限)或者
+    //排队时间超过maxQueueWaitMS(0不限)时，新请求直接回复503，Retry-After为retryAfterSec
+    void EnableAdmission(int maxConns, size_t maxQueue, int maxQueueWaitMS, int retryAfterSec);
+    //按客户端IP限流：最多跟踪capacity个IP，每个IP最多maxConns个连接，请求速率reqPerSec(突发burst)，
+    //登录/注册另外限制为authPerSec(突发authBurst)；超限回复429。各项为0表示不限
+    void EnableRateLimit(size_t capacity, int maxConns, int reqPerSec, int burst,
+                         int authPerSec, int authBurst, int ttlSec = 60);
+    //慢速客户端的截止时间(毫秒，0不限)：请求头从第一个字节(新连接从建立)起headerMS内收完，
+    //消息体从请求头收完起bodyMS内收完，超时回复408并关闭；响应写不出去超过writeStallMS时关闭
+    //这些截止时间不因为收到数据而延长，与只在空闲时起作用的timeoutMS分开计算
+    void SetClientDeadlines(int headerMS, int bodyMS, int writeStallMS);
+    //请求行加请求头最多maxHeaderBytes字节，超过回复431；整个请求最多maxRequestBytes字节，超过回复413，
+    //同时也是读缓冲的上限。0不限
+    void SetRequestLimits(size_t maxHeaderBytes, size_t maxRequestBytes);
 
 private:
     bool InitSocket_();
     void InitEvenMode_(int trigMode);
-    void AddClient_();
+    void AddClient_(int fd, sockaddr_in addr);
 
     void DealListen_();
     void DealWrite_(HttpConn* client);
     void DealRead_(HttpConn* client);
 
     void SendError_(int fd,const char* info);
-    void ExtentTime_(HttpConn* client);
+    //accept时就拒绝的连接(503/429)：回复后只关闭写方向，读到客户端的EOF再关闭，
+    //直接close时接收缓冲里的请求会让内核发RST，客户端可能收不到响应
+    void Refuse_(int fd, const std::string& response);
+    void DrainRefused_(int fd, uint32_t events);
+    void ExpireRefused_();//关闭等待超过DRAIN_TIMEOUT_MS的被拒连接
+    void CloseRefused_(int fd);
+    void ExtentTime_(HttpConn* client, int timeoutMS);
+    int ReadTimeout_(HttpConn* client) const;//读事件到达或请求收了一部分交回时的超时时间
+    void OnTimeout_(HttpConn* client);//定时器到期，按连接的状态关闭或者重新定时
+    bool TimersOn_() const{
+        return timeoutMS_ > 0 || headerTimeoutMS_ > 0 || bodyTimeoutMS_ > 0 || writeStallMS_ > 0;
+    }
     void CloseConn_(HttpConn* client);
+    //在事件循环中回复预生成的响应(503/429)并关闭，reason为Metrics::REJECT_REASON
+    void Reject_(HttpConn* client, int reason, int code, const std::string& response);
+    static bool PeekAuthRoute_(int fd);
+    void ShedIdle_(int count);//关闭空闲最久的count个长连接
+
+    //工作线程交回连接时连接所处的状态
+    enum CONN_STATE{
+        CONN_ACTIVE,//请求或响应还没处理完
+        CONN_IDLE,//响应写完，长连接等待下一个请求
+        CONN_PARTIAL,//请求收了一部分，按请求头/消息体的截止时刻重新定时
+        CONN_DRAINING,//错误响应写完、写方向已关闭，丢弃客户端剩下的数据后关闭
+    };
+    //工作线程重新注册events、把连接交回事件循环，除CONN_ACTIVE外留一条记录给事件循环，
+    //CONN_PARTIAL还会通过handBackFd_唤醒事件循环
+    void HandBack_(HttpConn* client, uint32_t events, int state = CONN_ACTIVE);
+    void ApplyHandBacks_();//事件循环每轮开始时处理交回记录
+    void MarkIdle_(HttpConn* client, int64_t since);
+    void Unidle_(HttpConn* client);
+    void DrainConn_(HttpConn* client);//在事件循环中读掉Drain之后到达的数据，读到EOF或出错时关闭
 
     void OnRead_(HttpConn* client);
     void OnWrite_(HttpConn* client);
     void OnProcess_(HttpConn* client);
+    void OnVerified_(HttpConn* client, uint64_t gen, bool ok);//数据库结果到达，在工作线程中生成响应
 
     static const int MAX_FD = 65536;
+    static const int DRAIN_TIMEOUT_MS = 5000;//Drain之后最多等客户端关闭这么久
+    static const size_t MAX_REFUSED = 1024;//同时等待关闭的被拒连接数，超过时退回直接关闭
     static int SetFdNonblock(int fd);
 
     int port_;
     bool openLinger_;
     int timeoutMS_;//毫秒
+    int headerTimeoutMS_;
+    int bodyTimeoutMS_;
+    int writeStallMS_;
     bool isClose_;
     int listenFd_;
     char* srcDir_;//文件路径
@@ -62,9 +162,32 @@ private:
     std::unique_ptr<HeapTimer> timer_;
     std::unique_ptr<ThreadPool> threadpool_;
     std::unique_ptr<Epoller> epoller_;
-    std::unordered_map<int,HttpConn> user_;
+    std::unique_ptr<AssetBundle> bundle_;
+    std::unique_ptr<LocalAuth> localAuth_;
+    Admission admission_;
+    RateLimiter rateLimiter_;
+    //空闲状态只在事件循环中修改：工作线程交回连接时记一条，事件循环读出后再改
+    struct HandBackNote{
+        HttpConn* client;
+        uint64_t gen;
+        uint64_t seq;//交回时的DispatchSeq，之后又交出过的记录作废
+        int state;
+        int64_t ms;//交回时刻，单调时钟毫秒
+    };
+    int handBackFd_;//eventfd
+    std::mutex handBackMtx_;
+    std::vector<HandBackNote> handBacks_;
+    std::list<int> idleFds_;//空闲的长连接，开始空闲早的在前
+    std::unordered_map<int, std::list<int>::iterator> idlePos_;
+    std::unordered_map<int,HttpConn> users_;
+    //被拒连接只在事件循环中处理，不占HttpConn；到期时刻都是拒绝时刻加同样的时长，队列按到期先后排列
+    struct RefusedFd{
+        int fd;
+        int64_t deadline;
+    };
+    std::unordered_map<int, int64_t> refused_;//fd -> 到期时刻，提前关闭的fd不在这里，队列里的旧记录跳过
+    std::deque<RefusedFd> refusedQueue_;
 };
 
 #endif
 
-#endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include"heaptimer.h"
+#include"../trace/probes.h"
 
 void HeapTimer::SwapNode_(size_t i,size_t j){
     assert(i >= 0 && i < heap_.size());
@@ -10,12 +11,12 @@ void HeapTimer::SwapNode_(size_t i,size_t j){
 
 void HeapTimer::siftup_(size_t i){
     assert(i >=0 && i < heap_.size());
-    size_t parent = (i-1)/2;
-    while(parent >= 0){
+    //size_t没有负数，到根节点就停
+    while(i > 0){
+        size_t parent = (i-1)/2;
         if(heap_[parent] > heap_[i]){
             SwapNode_(i,parent);
             i = parent;
-            parent = (i-1)/2;
         }
         else{
             break;
@@ -38,7 +39,9 @@ bool HeapTimer::siftdown_(size_t i,size_t n){
             index = child;
             child = 2*child + 1;
         }
-        break;
+        else{
+            break;
+        }
     } 
     return index > i;
 }
@@ -65,7 +68,10 @@ void HeapTimer::del_(size_t index){
 void HeapTimer::adjust(int id,int newExpires){
     assert(!heap_.empty()&&ref_.count(id));
     heap_[ref_[id]].expires = Clock::now() + MS(newExpires);
-    siftdown_(ref_[id],heap_.size());
+    //新的到期时刻可能更早，下滑不动时要上浮
+    if(!siftdown_(ref_[id],heap_.size())){
+        siftup_(ref_[id]);
+    }
 }
 
 void HeapTimer::add(int id,int timeOut,const TimeoutCallBack& cb){
@@ -94,8 +100,8 @@ void HeapTimer::dowork(int id){
     }
     size_t i =ref_[id];
     auto node = heap_[i];
+    del_(i);//先删除，回调中可以重新添加同一个id
     node.cb();//触发回调函数
-    del_(i);//删除指定id
 }
 
 void HeapTimer::tick(){
@@ -108,8 +114,9 @@ void HeapTimer::tick(){
         if(std::chrono::duration_cast<MS>(node.expires - Clock::now()).count() > 0) { 
             break; 
         }
+        TWS_PROBE1(timer_fire, node.id);
+        pop();//先弹出，回调中可以用add重新定时
         node.cb();
-        pop();//弹出
     }
 }
 
@@ -13,6 +13,7 @@
 #include<assert.h>
 #include<chrono>
 #include"../log/log.h"
+#include"../metrics/metrics.h"
 
 typedef std::function<void()> TimeoutCallBack;
 typedef std::chrono::high_resolution_clock Clock;
@@ -25,13 +26,13 @@ struct TimeNode{
     TimeoutCallBack cb;//回调函数
     //重载操作符 >
     bool operator > (const TimeNode& t){
-        //若t的超时时间大于超时时间，则返回true
-        return expires < t.expires;
+        //超时时间比t晚则返回true，堆顶是最早到期的节点
+        return expires > t.expires;
     }
     //重载操作符 <
     bool operator < (const TimeNode& t){
-        //若t的超时时间小于超时时间，则返回true
-        return expires > t.expires;
+        //超时时间比t早则返回true
+        return expires < t.expires;
     }
 };
 
@@ -57,7 +58,7 @@ private:
     std::vector<TimeNode> heap_;//使用vector实现最小堆
     // key:id value:vector的下标；id对应的在heap_中的下标，方便用heap_的时候查找
     std::unordered_map<int,size_t>ref_;//使用哈希表实现对事件的查找
-}
+};
 
 
 
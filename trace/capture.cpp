@@ -0,0 +1,166 @@
+#include"capture.h"
+#include<fcntl.h>
+#include<unistd.h>
+#include<errno.h>
+#include<string.h>
+#include<time.h>
+#include<sys/time.h>
+#include<assert.h>
+#include<vector>
+#include"../log/log.h"
+
+using namespace std;
+
+static int64_t MonoUs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+TrafficCapture::TrafficCapture():fd_(-1), maxBytes_(0), sampleConns_(1), startMono_(0){
+    queuedBytes_ = 0;
+    isOpen_ = false;
+    isRunning_ = false;
+    records_ = 0;
+    dropped_ = 0;
+}
+
+TrafficCapture::~TrafficCapture(){
+    Close();
+}
+
+TrafficCapture* TrafficCapture::Instance(){
+    static TrafficCapture capture;
+    return &capture;
+}
+
+bool TrafficCapture::Open(const char* path, size_t maxBytes, int sampleConns, int maxQueueCapacity){
+    assert(path && maxQueueCapacity > 0);
+    Close();
+    fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if(fd_ < 0){
+        return false;
+    }
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    CaptureFileHeader header;
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.startUs = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+    batch_.assign((const char*)&header, sizeof(header));
+    startMono_ = MonoUs();
+    maxBytes_ = maxBytes;
+    sampleConns_ = sampleConns > 0 ? sampleConns : 1;
+    queuedBytes_ = sizeof(header);
+    queue_.reset(new LockFreeQueue<string>(maxQueueCapacity));
+    isRunning_ = true;
+    writeThread_.reset(new thread(&TrafficCapture::AsyncWrite_, this));
+    isOpen_ = true;
+    return true;
+}
+
+void TrafficCapture::Close(){
+    if(!isOpen_){
+        return;
+    }
+    isOpen_ = false;
+    isRunning_ = false;
+    if(writeThread_ && writeThread_->joinable()){
+        queue_->flush();
+        writeThread_->join();
+    }
+    close(fd_);
+    fd_ = -1;
+}
+
+bool TrafficCapture::Record(uint32_t conn, int type, const void* data, size_t len){
+    if(!IsOpen() || len > CaptureRecordHeader::LEN_MASK){
+        return false;
+    }
+    size_t size = sizeof(CaptureRecordHeader) + len;
+    //超过文件大小上限后不再抓取，已经在途的记录仍然写完
+    if(maxBytes_ > 0 && queuedBytes_.fetch_add(size, memory_order_relaxed) + size > maxBytes_){
+        dropped_.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    CaptureRecordHeader header;
+    header.offsetUs = MonoUs() - startMono_;
+    header.conn = conn;
+    header.typeLen = ((uint32_t)type << 28) | (uint32_t)len;
+    string rec;
+    rec.reserve(size);
+    rec.append((const char*)&header, sizeof(header));
+    rec.append((const char*)data, len);
+    if(!queue_->try_push(move(rec))){
+        dropped_.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    records_.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+//每个连接最多一条，走加锁的小数组而不是队列，队列满时也不会丢
+void TrafficCapture::Truncate(uint32_t conn){
+    if(!IsOpen()){
+        return;
+    }
+    CaptureRecordHeader header;
+    header.offsetUs = MonoUs() - startMono_;
+    header.conn = conn;
+    header.typeLen = (uint32_t)CAPTURE_TRUNCATED << 28;
+    lock_guard<mutex> locker(truncMtx_);
+    truncated_.push_back(header);
+    records_.fetch_add(1, memory_order_relaxed);
+}
+
+void TrafficCapture::AppendTruncated_(){
+    vector<CaptureRecordHeader> truncated;
+    {
+        lock_guard<mutex> locker(truncMtx_);
+        truncated.swap(truncated_);
+    }
+    for(auto& header : truncated){
+        batch_.append((const char*)&header, sizeof(header));
+    }
+}
+
+//与访问日志的写线程相同：攒够FLUSH_BYTES或者队列空闲1秒就写一次
+void TrafficCapture::AsyncWrite_(){
+    string rec;
+    vector<string> recs;
+    recs.reserve(POP_BATCH);
+    while(isRunning_ || !queue_->empty()){
+        if(queue_->pop(rec, 1)){
+            batch_ += rec;
+            recs.clear();
+            queue_->pop_bulk(recs, POP_BATCH);
+            for(auto& r : recs){
+                batch_ += r;
+            }
+            if(batch_.size() < FLUSH_BYTES){
+                continue;
+            }
+        }
+        AppendTruncated_();
+        Flush_();
+    }
+    AppendTruncated_();
+    Flush_();
+}
+
+void TrafficCapture::Flush_(){
+    const char* p = batch_.data();
+    size_t left = batch_.size();
+    while(left > 0){
+        ssize_t len = ::write(fd_, p, left);
+        if(len < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            LOG_ERROR("TrafficCapture write error: %d", errno);
+            break;
+        }
+        p += len;
+        left -= len;
+    }
+    batch_.clear();
+}
@@ -0,0 +1,96 @@
+//流量抓取：把连接上收到的原始请求字节连同时间和连接编号写入一个二进制文件，交给bench/replay在本机回放
+//请求线程只拼一条记录放入无锁队列，写线程批量写文件；队列满或达到文件大小上限时丢弃并计数
+//文件格式(小端)：
+//  文件头 CaptureFileHeader：magic "TWSCAP01"，开始抓取时的unix时间(微秒)
+//  之后每条记录 CaptureRecordHeader + len字节数据
+//    OPEN：新连接，数据为客户端IPv4地址(4字节，网络序)
+//    DATA：一次read读到的请求字节
+//    CLOSE：连接关闭，没有数据
+//    TRUNCATED：这个连接有记录被丢弃，之后不再抓取，回放时整个连接跳过，没有数据
+#ifndef TRAFFIC_CAPTURE_H
+#define TRAFFIC_CAPTURE_H
+
+#include<string>
+#include<thread>
+#include<memory>
+#include<atomic>
+#include<mutex>
+#include<vector>
+#include<stdint.h>
+#include"../log/lockfreequeue.h"
+
+static const char CAPTURE_MAGIC[8] = {'T', 'W', 'S', 'C', 'A', 'P', '0', '1'};
+
+struct CaptureFileHeader{
+    char magic[8];
+    uint64_t startUs;
+};
+
+enum CAPTURE_TYPE{
+    CAPTURE_OPEN = 1,
+    CAPTURE_DATA = 2,
+    CAPTURE_CLOSE = 3,
+    CAPTURE_TRUNCATED = 4,
+};
+
+//16字节：相对开始抓取的微秒数、连接编号、类型(高4位)和数据长度(低28位)
+struct CaptureRecordHeader{
+    uint64_t offsetUs;
+    uint32_t conn;
+    uint32_t typeLen;
+
+    static const uint32_t LEN_MASK = (1u << 28) - 1;
+    int Type() const {return typeLen >> 28;}
+    uint32_t Len() const {return typeLen & LEN_MASK;}
+};
+
+class TrafficCapture{
+public:
+    static TrafficCapture* Instance();
+
+    //maxBytes：文件达到这么大后停止抓取，0不限制；sampleConns：每N个连接抓一个
+    bool Open(const char* path, size_t maxBytes, int sampleConns = 1, int maxQueueCapacity = 8192);
+    void Close();
+    bool IsOpen() const {return isOpen_.load(std::memory_order_relaxed);}
+
+    //是否抓取这个连接，连接建立时判断一次
+    bool Sampled(uint32_t conn) const{
+        return IsOpen() && conn % sampleConns_ == 0;
+    }
+    //记录被丢弃时返回false
+    bool Record(uint32_t conn, int type, const void* data, size_t len);
+    //连接的记录丢了一部分，写一条TRUNCATED记录；不经过队列、不受大小上限限制，不会再被丢弃
+    void Truncate(uint32_t conn);
+
+    uint64_t Records() const {return records_.load(std::memory_order_relaxed);}
+    uint64_t Dropped() const {return dropped_.load(std::memory_order_relaxed);}
+
+private:
+    TrafficCapture();
+    ~TrafficCapture();
+
+    void AsyncWrite_();
+    void Flush_();
+    void AppendTruncated_();//把Truncate登记的记录放进batch_
+
+    static const size_t FLUSH_BYTES = 256 * 1024;
+    static const size_t POP_BATCH = 256;
+
+    int fd_;
+    size_t maxBytes_;
+    uint32_t sampleConns_;
+    int64_t startMono_;//开始抓取时的单调时钟(微秒)，记录里的时间相对它
+    std::atomic<size_t> queuedBytes_;//已接受的字节数，用于文件大小上限
+    std::string batch_;
+
+    std::atomic<bool> isOpen_;
+    std::atomic<bool> isRunning_;
+    std::atomic<uint64_t> records_;
+    std::atomic<uint64_t> dropped_;
+    std::unique_ptr<LockFreeQueue<std::string>> queue_;
+    std::mutex truncMtx_;
+    std::vector<CaptureRecordHeader> truncated_;
+    std::unique_ptr<std::thread> writeThread_;
+};
+
+#endif
@@ -0,0 +1,248 @@
+#include"phasetrace.h"
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<chrono>
+#include<thread>
+#include"../log/log.h"
+
+using namespace std;
+
+const char* const PhaseTrace::PHASE_NAME[PhaseTrace::PHASE_CNT] = {
+    "queue", "read", "parse", "verify", "build", "write",
+};
+
+std::atomic<bool> PhaseTrace::enabled(false);
+
+PhaseTrace::PhaseTrace(){
+    accept_ = lastDispatch_ = dispatch_ = 0;
+    begin_ = parseStart_ = parseEnd_ = verify_ = resume_ = built_ = done_ = 0;
+    connect_ = 0;
+}
+
+void PhaseTrace::Accept(){
+    begin_ = done_ = lastDispatch_ = 0;
+    accept_ = enabled.load(std::memory_order_relaxed) ? Now() : 0;
+}
+
+void PhaseTrace::Dispatch(){
+    if(!enabled.load(std::memory_order_relaxed)){
+        return;
+    }
+    lastDispatch_ = Now();
+}
+
+void PhaseTrace::Begin(){
+    if(!enabled.load(std::memory_order_relaxed)){
+        begin_ = 0;
+        return;
+    }
+    begin_ = Now();
+    //没有对应的分发时间(例如刚开启跟踪)就不计排队时间
+    dispatch_ = lastDispatch_ && lastDispatch_ <= begin_ ? lastDispatch_ : begin_;
+    lastDispatch_ = 0;
+    connect_ = accept_ && accept_ <= dispatch_ ? dispatch_ - accept_ : 0;
+    accept_ = 0;
+    parseStart_ = parseEnd_ = verify_ = resume_ = built_ = done_ = 0;
+}
+
+void PhaseTrace::ParseStart(){
+    if(begin_){
+        parseStart_ = Now();
+    }
+}
+
+void PhaseTrace::ParseEnd(uint64_t verifyTicks){
+    if(begin_){
+        parseEnd_ = Now();
+        verify_ = verifyTicks;
+    }
+}
+
+void PhaseTrace::Resume(){
+    if(begin_){
+        resume_ = Now();
+    }
+}
+
+void PhaseTrace::Built(){
+    if(begin_){
+        built_ = Now();
+    }
+}
+
+void PhaseTrace::Done(){
+    if(begin_ && built_){
+        done_ = Now();
+    }
+}
+
+void PhaseTrace::Phases(uint64_t* ticks) const{
+    uint64_t buildStart = resume_ ? resume_ : parseEnd_;
+    uint64_t parse = parseEnd_ - parseStart_;
+    ticks[QUEUE] = begin_ - dispatch_;
+    ticks[READ] = parseStart_ - begin_;
+    ticks[PARSE] = parse > verify_ ? parse - verify_ : 0;
+    ticks[VERIFY] = verify_ + (resume_ ? resume_ - parseEnd_ : 0);
+    ticks[BUILD] = built_ - buildStart;
+    ticks[WRITE] = done_ - built_;
+}
+
+PhaseTracer::PhaseTracer():ticksPerUs_(1000), slowTicks_(0), sampleEvery_(0), next_(0), count_(0){
+    slowCnt_ = 0;
+    sampledCnt_ = 0;
+}
+
+PhaseTracer* PhaseTracer::Instance(){
+    static PhaseTracer tracer;
+    return &tracer;
+}
+
+void PhaseTracer::Init(int slowMS, int sampleEvery, size_t capacity){
+    Calibrate_();
+    {
+        lock_guard<mutex> locker(mtx_);
+        ring_.assign(capacity > 0 ? capacity : 1, PhaseRecord());
+        next_ = count_ = 0;
+    }
+    slowTicks_ = slowMS > 0 ? (uint64_t)(slowMS * 1000 * ticksPerUs_) : 0;
+    sampleEvery_ = sampleEvery > 0 ? sampleEvery : 0;
+    PhaseTrace::enabled.store(slowTicks_ > 0 || sampleEvery_ > 0, std::memory_order_relaxed);
+}
+
+void PhaseTracer::Close(){
+    PhaseTrace::enabled.store(false, std::memory_order_relaxed);
+}
+
+//启动时测一次，20ms内的TSC增量除以单调时钟的微秒数
+void PhaseTracer::Calibrate_(){
+#if defined(__x86_64__) || defined(__i386__)
+    auto t0 = chrono::steady_clock::now();
+    uint64_t c0 = PhaseTrace::Now();
+    this_thread::sleep_for(chrono::milliseconds(20));
+    uint64_t c1 = PhaseTrace::Now();
+    double us = chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count();
+    ticksPerUs_ = us > 0 && c1 > c0 ? (c1 - c0) / us : 1000;
+#else
+    ticksPerUs_ = 1000;//纳秒
+#endif
+    LOG_INFO("PhaseTracer: %.1f ticks/us", ticksPerUs_);
+}
+
+uint32_t PhaseTracer::ToUs_(uint64_t ticks) const{
+    double us = ticks / ticksPerUs_;
+    return us >= UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static void CopyField(char* dst, size_t size, const char* src){
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = '\0';
+}
+
+void PhaseTracer::Submit(const PhaseTrace& trace, const char* peer, const string& method,
+                         const string& path, int status, size_t bytes){
+    if(!PhaseTrace::enabled.load(std::memory_order_relaxed) || !trace.Active() || trace.Total() == 0){
+        return;
+    }
+    bool slow = slowTicks_ > 0 && trace.Total() >= slowTicks_;
+    if(!slow){
+        //线程局部计数，抽样不需要共享的原子变量
+        thread_local uint32_t seen = 0;
+        if(sampleEvery_ <= 0 || ++seen % sampleEvery_ != 0){
+            return;
+        }
+    }
+    PhaseRecord r;
+    r.time = time(nullptr);
+    r.slow = slow;
+    CopyField(r.peer, sizeof(r.peer), peer);
+    CopyField(r.method, sizeof(r.method), method.c_str());
+    CopyField(r.path, sizeof(r.path), path.c_str());
+    r.status = status;
+    r.bytes = bytes;
+    r.connectUs = ToUs_(trace.Connect());
+    r.totalUs = ToUs_(trace.Total());
+    uint64_t ticks[PhaseTrace::PHASE_CNT];
+    trace.Phases(ticks);
+    for(int i = 0; i < PhaseTrace::PHASE_CNT; i++){
+        r.phaseUs[i] = ToUs_(ticks[i]);
+    }
+    if(slow){
+        slowCnt_.fetch_add(1, std::memory_order_relaxed);
+        string line;
+        Format_(r, &line);
+        line.pop_back();
+        LOG_WARN("slow request: %s", line.c_str());
+    }else{
+        sampledCnt_.fetch_add(1, std::memory_order_relaxed);
+    }
+    lock_guard<mutex> locker(mtx_);
+    if(ring_.empty()){
+        return;
+    }
+    ring_[next_] = r;
+    next_ = (next_ + 1) % ring_.size();
+    if(count_ < ring_.size()){
+        count_++;
+    }
+}
+
+//一行一条：时间 类型 客户端 方法 路径 状态码 字节数 总耗时 各阶段耗时
+void PhaseTracer::Format_(const PhaseRecord& r, string* out){
+    char line[512];
+    struct tm t;
+    localtime_r(&r.time, &t);
+    int n = snprintf(line, sizeof(line), "%04d-%02d-%02d %02d:%02d:%02d %s %s %s %s %d %zuB total=%uus connect=%uus",
+                     t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
+                     r.slow ? "slow" : "sample", r.peer, r.method, r.path, r.status, r.bytes,
+                     r.totalUs, r.connectUs);
+    for(int i = 0; i < PhaseTrace::PHASE_CNT && n < (int)sizeof(line); i++){
+        n += snprintf(line + n, sizeof(line) - n, " %s=%uus", PhaseTrace::PHASE_NAME[i], r.phaseUs[i]);
+    }
+    *out += line;
+    *out += '\n';
+}
+
+string PhaseTracer::Dump(size_t limit, bool slowOnly){
+    vector<PhaseRecord> records;
+    {
+        lock_guard<mutex> locker(mtx_);
+        records.reserve(count_);
+        for(size_t i = 0; i < count_; i++){
+            records.push_back(ring_[(next_ + ring_.size() - 1 - i) % ring_.size()]);
+        }
+    }
+    string out;
+    size_t n = 0;
+    for(auto& r : records){
+        if(n >= limit){
+            break;
+        }
+        if(slowOnly && !r.slow){
+            continue;
+        }
+        Format_(r, &out);
+        n++;
+    }
+    return out;
+}
+
+string PhaseTracer::HandleQuery(const string& query){
+    size_t limit = DEFAULT_DUMP;
+    bool slowOnly = false;
+    size_t pos = 0;
+    while(pos < query.size()){
+        size_t end = query.find('&', pos);
+        if(end == string::npos){
+            end = query.size();
+        }
+        string kv = query.substr(pos, end - pos);
+        if(kv.compare(0, 2, "n=") == 0){
+            limit = strtoul(kv.c_str() + 2, nullptr, 10);
+        }else if(kv == "slow=1"){
+            slowOnly = true;
+        }
+        pos = end + 1;
+    }
+    return Dump(limit, slowOnly);
+}
@@ -0,0 +1,143 @@
+//请求分阶段计时
+//每个连接带一个PhaseTrace，在各阶段的边界用TSC打时间戳，一次打点只是一条rdtsc；
+//响应写完时交给PhaseTracer：超过慢请求阈值的，以及每N个请求抽一个，整理成分阶段的耗时记录，
+//放入固定大小的环形缓冲区，通过管理端口的/trace读取，慢请求同时写一行运行日志
+//各阶段首尾相接，加起来等于总耗时：
+//  queue  事件循环发现可读到工作线程开始读
+//  read   开始读到开始解析
+//  parse  解析请求，不含同步的登录/注册
+//  verify 登录/注册：同步方式为UserVerify本身，异步方式为挂起到结果到达后重新进入工作线程
+//  build  生成响应(stat/mmap/缓存)
+//  write  响应生成完到最后一个字节写出，包括等EPOLLOUT、写任务排队和套接字背压
+//工作线程之间比较TSC要求各核的TSC同步(constant_tsc/nonstop_tsc)，现在的x86服务器都满足
+#ifndef PHASE_TRACE_H
+#define PHASE_TRACE_H
+
+#include<string>
+#include<vector>
+#include<mutex>
+#include<atomic>
+#include<stdint.h>
+#include<time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include<x86intrin.h>
+#endif
+
+class PhaseTrace{
+public:
+    enum PHASE{
+        QUEUE,
+        READ,
+        PARSE,
+        VERIFY,
+        BUILD,
+        WRITE,
+        PHASE_CNT,
+    };
+    static const char* const PHASE_NAME[PHASE_CNT];
+
+    //x86上读TSC，其他平台退回单调时钟的纳秒
+    static uint64_t Now(){
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+    static std::atomic<bool> enabled;//未开启时各打点函数直接返回
+
+    PhaseTrace();
+
+    void Accept();//新连接
+    void Dispatch();//事件循环把这个连接的读/写任务交给线程池
+    void Begin();//读到新请求的第一批数据
+    void ParseStart();
+    void ParseEnd(uint64_t verifyTicks);//verifyTicks为解析中同步登录/注册用掉的时间
+    void Resume();//异步登录/注册的结果到达，重新进入工作线程
+    void Built();
+    void Done();//最后一个字节写出
+
+    bool Active() const {return begin_ != 0;}
+    //各阶段耗时，单位为TSC周期
+    void Phases(uint64_t* ticks) const;
+    uint64_t Total() const {return done_ - dispatch_;}
+    uint64_t Connect() const {return connect_;}//第一个请求从accept到可读，之后的请求为0
+
+private:
+    uint64_t accept_;
+    uint64_t lastDispatch_;
+    uint64_t dispatch_;//开始这个请求的那次分发
+    uint64_t begin_;
+    uint64_t parseStart_;
+    uint64_t parseEnd_;
+    uint64_t verify_;
+    uint64_t resume_;
+    uint64_t built_;
+    uint64_t done_;
+    uint64_t connect_;
+};
+
+//一条分阶段记录
+struct PhaseRecord{
+    time_t time;
+    bool slow;//超过阈值，否则是抽样
+    char peer[16];
+    char method[8];
+    char path[64];
+    int status;
+    size_t bytes;
+    uint32_t connectUs;
+    uint32_t totalUs;
+    uint32_t phaseUs[PhaseTrace::PHASE_CNT];
+};
+
+class PhaseTracer{
+public:
+    static PhaseTracer* Instance();
+
+    //slowMS：总耗时不小于它的请求都记录，0表示不按阈值记录；sampleEvery：每N个请求抽一个，0表示不抽样
+    //capacity：环形缓冲区保留的记录数
+    void Init(int slowMS, int sampleEvery, size_t capacity);
+    void Close();
+
+    //请求写完时调用，大部分请求只做一次比较和一次线程局部计数
+    void Submit(const PhaseTrace& trace, const char* peer, const std::string& method,
+                const std::string& path, int status, size_t bytes);
+
+    //最近的limit条记录，新的在前；slowOnly只看慢请求
+    std::string Dump(size_t limit, bool slowOnly);
+    //管理端口的处理函数，query支持n=条数和slow=1
+    std::string HandleQuery(const std::string& query);
+
+    uint64_t Slow() const {return slowCnt_.load(std::memory_order_relaxed);}
+    uint64_t Sampled() const {return sampledCnt_.load(std::memory_order_relaxed);}
+
+    double TicksPerUs() const {return ticksPerUs_;}
+
+private:
+    PhaseTracer();
+    ~PhaseTracer() = default;
+
+    void Calibrate_();//用单调时钟测出TSC频率
+    uint32_t ToUs_(uint64_t ticks) const;
+    static void Format_(const PhaseRecord& r, std::string* out);
+
+    static const size_t DEFAULT_DUMP = 100;
+
+    double ticksPerUs_;
+    uint64_t slowTicks_;
+    int sampleEvery_;
+
+    std::mutex mtx_;//保护ring_，只有被记录的请求才会进入
+    std::vector<PhaseRecord> ring_;
+    size_t next_;//下一条写入的位置
+    size_t count_;
+
+    std::atomic<uint64_t> slowCnt_;
+    std::atomic<uint64_t> sampledCnt_;
+};
+
+#endif
@@ -0,0 +1,42 @@
+//USDT静态探针：在请求生命周期的固定位置留下探针，供perf/bpftrace挂载，不受内联和优化影响
+//编译时定义ENABLE_USDT=1(需要systemtap-sdt-dev提供的sys/sdt.h)才生成探针，
+//探针只是一条nop，加上ELF note里的参数位置描述，没有挂载时开销可以忽略；
+//未定义时宏不生成任何代码，参数也不求值
+//provider为webserver，各探针及参数：
+//  accept(fd, ip)                   新连接，ip为网络序IPv4地址
+//  read_done(fd, bytes)             一次读事件处理完，bytes为读缓冲中的字节数
+//  parse_done(fd, ok, path)         请求解析完，path为C字符串
+//  response_built(fd, code, bytes)  响应报文组装完，bytes为要写的字节数
+//  write_done(fd, code, bytes)      响应写完
+//  timer_fire(id)                   定时器到期，id为连接fd
+//  pool_enqueue(pending)            线程池任务入队，pending为入队后排队的任务数
+//  pool_dequeue(queued_ns)          线程池任务开始执行，queued_ns为入队时的单调时钟(纳秒，与bpftrace的nsecs同源)
+//  sql_acquire(conn, wait_us, waited) 从连接池借到连接
+//  sql_release(conn, broken)        归还连接，broken表示连接已断开
+//  log_enqueue(level, len)          异步日志放入缓冲
+//例子见trace/bpf/*.bt
+#ifndef PROBES_H
+#define PROBES_H
+
+#if defined(ENABLE_USDT) && ENABLE_USDT
+
+#include<sys/sdt.h>
+
+#define TWS_PROBE0(name) DTRACE_PROBE(webserver, name)
+#define TWS_PROBE1(name, a) DTRACE_PROBE1(webserver, name, a)
+#define TWS_PROBE2(name, a, b) DTRACE_PROBE2(webserver, name, a, b)
+#define TWS_PROBE3(name, a, b, c) DTRACE_PROBE3(webserver, name, a, b, c)
+#define TWS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(webserver, name, a, b, c, d)
+
+#else
+
+//sizeof不对参数求值，只是让专为探针准备的变量不产生未使用警告
+#define TWS_PROBE0(name) do{}while(0)
+#define TWS_PROBE1(name, a) do{(void)sizeof(a);}while(0)
+#define TWS_PROBE2(name, a, b) do{(void)sizeof(a); (void)sizeof(b);}while(0)
+#define TWS_PROBE3(name, a, b, c) do{(void)sizeof(a); (void)sizeof(b); (void)sizeof(c);}while(0)
+#define TWS_PROBE4(name, a, b, c, d) do{(void)sizeof(a); (void)sizeof(b); (void)sizeof(c); (void)sizeof(d);}while(0)
+
+#endif
+
+#endif